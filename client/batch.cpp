@@ -0,0 +1,625 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* icecc --batch: compiles the commands read from the standard input with
+   one request for servers for all of them, so the scheduler can place
+   them together instead of one after the other as they come.  */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <deque>
+#include <list>
+#include <map>
+
+#include "client.h"
+
+using namespace std;
+
+struct BatchCommand {
+    vector<string> args; // the compiler and its arguments
+    CompileJob job;
+    int status;
+};
+
+/* One GetCSMsg for up to MAX_GET_CS_BATCH commands of the same kind, over
+   a connection to the daemon of its own.  */
+struct BatchRequest {
+    MsgChannel *daemon; // 0 once it's gone
+    Environments envs;
+    vector<size_t> commands;
+    vector<bool> answered;
+    unsigned int waiting; // answers still to come
+};
+
+/* A child compiling a command, as a job of a request or as a plain
+   icecc.  The write end of PIPE is open as long as the child runs.  */
+struct BatchChild {
+    pid_t pid;
+    size_t command;
+    BatchRequest *request;
+    uint32_t job_id;
+    bool local;
+    bool retry; // the remote compile failed, the child asked for a plain one
+    struct timeval start;
+    int pipe;
+};
+
+/* Splits LINE into words like a shell does, with quotes and backslashes
+   but nothing else.  Returns false for an unterminated quote.  */
+static bool split_command(const string &line, vector<string> &words)
+{
+    string word;
+    bool in_word = false;
+    char quote = 0;
+
+    for (size_t i = 0; i < line.size(); ++i) {
+        char c = line[i];
+
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            } else if (c == '\\' && quote == '"' && i + 1 < line.size()
+                       && strchr("\"\\$`", line[i + 1])) {
+                word += line[++i];
+            } else {
+                word += c;
+            }
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+            in_word = true;
+        } else if (c == '\\' && i + 1 < line.size()) {
+            word += line[++i];
+            in_word = true;
+        } else if (isspace((unsigned char) c)) {
+            if (in_word) {
+                words.push_back(word);
+                word.clear();
+                in_word = false;
+            }
+        } else {
+            word += c;
+            in_word = true;
+        }
+    }
+
+    if (in_word) {
+        words.push_back(word);
+    }
+
+    return !quote;
+}
+
+/* Reads the commands, empty lines and ones starting with # are skipped.  */
+static bool read_commands(FILE *in, vector<BatchCommand> &commands)
+{
+    char *line = 0;
+    size_t size = 0;
+    unsigned int number = 0;
+    bool ok = true;
+
+    while (getline(&line, &size, in) >= 0) {
+        BatchCommand command;
+        command.status = 0;
+        ++number;
+
+        if (!split_command(line, command.args)) {
+            log_error() << "unterminated quote in line " << number << endl;
+            ok = false;
+            break;
+        }
+
+        if (!command.args.empty() && command.args[0][0] != '#') {
+            commands.push_back(command);
+        }
+    }
+
+    free(line);
+    return ok;
+}
+
+/* Fills JOB like icecc would for ARGS in CWD, returns true if it can
+   only be compiled locally.  */
+static bool analyse_command(const vector<string> &args, const string &cwd, CompileJob &job)
+{
+    vector<const char *> argv;
+    argv.push_back("icecc");
+
+    for (vector<string>::const_iterator it = args.begin(); it != args.end(); ++it) {
+        argv.push_back(it->c_str());
+    }
+
+    argv.push_back(0);
+    job = CompileJob();
+    job.setWorkingDirectory(cwd);
+    job.setCompilerName(args[0]);
+    job.setCompilerPathname(args[0]);
+
+    list<string> extrafiles;
+    bool local = analyse_argv(&argv[0], job, false, &extrafiles);
+    // plugins need the native environment made for them
+    return local || !extrafiles.empty();
+}
+
+// the commands that can go into one GetCSMsg
+static string batch_kind(const CompileJob &job)
+{
+    return job.compilerName() + '\n' + job.targetPlatform() + '\n'
+           + toString(int(job.language())) + '\n' + toString(job.argumentFlags());
+}
+
+static MsgChannel *open_daemon()
+{
+    if (const char *socket = getenv("ICECC_TEST_SOCKET")) {
+        return Service::createChannel(socket);
+    }
+
+    return connect_to_daemon();
+}
+
+/* The environments for the jobs of REQUEST, false if there are none.  */
+static bool batch_environments(BatchRequest &request, const CompileJob &job)
+{
+    if (getenv("ICECC_VERSION")) {
+        try {
+            request.envs = parse_icecc_version(job.targetPlatform(), find_prefix(job.compilerName()));
+        } catch (std::exception &) {
+            return false;
+        }
+    } else {
+        if (!request.daemon->send_msg(GetNativeEnvMsg(compiler_is_clang(job) ? "clang" : "gcc",
+                                                      list<string>()))) {
+            return false;
+        }
+
+        // the timeout is high because it creates the native version
+        Msg *msg = request.daemon->get_msg(4 * 60);
+
+        if (msg && msg->type == M_NATIVE_ENV
+                && !static_cast<UseNativeEnvMsg *>(msg)->nativeVersion.empty()) {
+            request.envs.push_back(make_pair(job.targetPlatform(),
+                                             static_cast<UseNativeEnvMsg *>(msg)->nativeVersion));
+        }
+
+        delete msg;
+    }
+
+    for (Environments::const_iterator it = request.envs.begin(); it != request.envs.end(); ++it) {
+        if (::access(it->second.c_str(), R_OK)) {
+            log_error() << "can't read environment " << it->second << endl;
+            return false;
+        }
+    }
+
+    return !request.envs.empty();
+}
+
+/* Connects REQUEST to the daemon and asks for servers for its commands.
+   If that fails they have to be compiled as plain ones.  */
+static bool send_request(BatchRequest &request, const vector<BatchCommand> &commands)
+{
+    request.daemon = open_daemon();
+
+    if (!request.daemon || !IS_PROTOCOL_42(request.daemon)) {
+        return false;
+    }
+
+    const CompileJob &first = commands[request.commands.front()].job;
+
+    if (!batch_environments(request, first)) {
+        return false;
+    }
+
+    vector<const CompileJob *> jobs;
+
+    for (vector<size_t>::const_iterator it = request.commands.begin(); it != request.commands.end(); ++it) {
+        jobs.push_back(&commands[*it].job);
+    }
+
+    request.answered.assign(request.commands.size(), false);
+    request.waiting = request.commands.size();
+    return ask_for_batch(request.daemon, jobs, request.envs);
+}
+
+/* The commands of REQUEST that didn't get a server go to PLAIN.  */
+static void drop_request(BatchRequest &request, deque<size_t> &plain)
+{
+    for (size_t i = 0; i < request.commands.size(); ++i) {
+        if (request.answered.size() <= i || !request.answered[i]) {
+            plain.push_back(request.commands[i]);
+        }
+    }
+
+    request.waiting = 0;
+    delete request.daemon;
+    request.daemon = 0;
+}
+
+static bool fork_child(BatchChild &child, size_t command)
+{
+    int fds[2];
+
+    if (pipe(fds)) {
+        log_perror("pipe");
+        return false;
+    }
+
+    flush_debug();
+    child.pid = fork();
+
+    if (child.pid < 0) {
+        log_perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (child.pid == 0) {
+        close(fds[0]);
+        child.pipe = fds[1];
+        return true;
+    }
+
+    close(fds[1]);
+    child.pipe = fds[0];
+    child.command = command;
+    child.request = 0;
+    child.job_id = 0;
+    child.local = false;
+    child.retry = false;
+    gettimeofday(&child.start, 0);
+    return true;
+}
+
+/* Runs COMMAND through ICECC_PROGRAM like any single compile.  */
+static bool start_plain(const char *icecc_program, const BatchCommand &command, size_t index,
+                        list<BatchChild> &children)
+{
+    BatchChild child;
+
+    if (!fork_child(child, index)) {
+        return false;
+    }
+
+    if (child.pid == 0) {
+        vector<char *> argv;
+        argv.push_back(const_cast<char *>(icecc_program));
+
+        for (vector<string>::const_iterator it = command.args.begin(); it != command.args.end(); ++it) {
+            argv.push_back(const_cast<char *>(it->c_str()));
+        }
+
+        argv.push_back(0);
+        execvp(icecc_program, &argv[0]);
+        log_perror("execvp");
+        _exit(EXIT_DISTCC_FAILED);
+    }
+
+    children.push_back(child);
+    return true;
+}
+
+/* Whether USECS is for the daemon itself, which leaves out the port.  A
+   server on this host is 127.0.0.1 too.  */
+static bool for_us(const UseCSMsg *usecs)
+{
+    return usecs->hostname == "127.0.0.1" && !usecs->port;
+}
+
+/* Compiles COMMAND where USECS says.  The scheduler counted a job for
+   ourselves against our slots already, so it doesn't wait for the daemon
+   like a plain local compile.  */
+static bool start_job(BatchRequest &request, UseCSMsg *usecs, const BatchCommand &command,
+                      size_t index, list<BatchChild> &children)
+{
+    BatchChild child;
+
+    if (!fork_child(child, index)) {
+        return false;
+    }
+
+    bool local = for_us(usecs);
+
+    if (child.pid == 0) {
+        // analysed again for the flags it leaves behind in arg.cpp
+        CompileJob job;
+        analyse_command(command.args, command.job.workingDirectory(), job);
+        int ret = EXIT_DISTCC_FAILED;
+
+        if (local) {
+            job.setJobID(usecs->job_id);
+            // with a daemon it doesn't lock the host
+            ret = build_local(job, request.daemon);
+        } else {
+            try {
+                ret = build_batch_job(job, usecs, request.envs);
+            } catch (std::exception &error) {
+                log_info() << "compiling on " << usecs->hostname << " failed: " << error.what()
+                           << endl;
+
+                if (write(child.pipe, "r", 1) != 1) {
+                    log_perror("write");
+                }
+            }
+        }
+
+        _exit(ret);
+    }
+
+    child.request = &request;
+    child.job_id = usecs->job_id;
+    child.local = local;
+    children.push_back(child);
+    return true;
+}
+
+/* Handles the answers the daemon has for REQUEST, READABLE if there's
+   more to read.  Local ones without a job id came without a scheduler,
+   those go to PLAIN to wait for the daemon like single compiles.  Returns
+   false if the daemon is gone.  */
+static bool read_answers(BatchRequest &request, bool readable, vector<BatchCommand> &commands,
+                         list<BatchChild> &children, deque<size_t> &plain)
+{
+    if (readable && !request.daemon->read_a_bit()) {
+        return false;
+    }
+
+    while (request.waiting && request.daemon->has_msg()) {
+        Msg *msg = request.daemon->get_msg(0);
+
+        if (!msg) {
+            return false;
+        }
+
+        UseCSMsg *usecs = dynamic_cast<UseCSMsg *>(msg);
+
+        if (!usecs || usecs->batch_index >= request.commands.size()
+                || request.answered[usecs->batch_index]) {
+            log_error() << "unexpected answer for a batch" << endl;
+            delete msg;
+            return false;
+        }
+
+        size_t index = request.commands[usecs->batch_index];
+        request.answered[usecs->batch_index] = true;
+        --request.waiting;
+
+        if (for_us(usecs) && !usecs->job_id) {
+            plain.push_back(index);
+        } else if (!start_job(request, usecs, commands[index], index, children)) {
+            plain.push_back(index);
+        }
+
+        delete msg;
+    }
+
+    return true;
+}
+
+/* Reaps CHILD, which closed its pipe, and tells the daemon how its job
+   went.  Whatever failed remotely gets another try as a plain compile.  */
+static void finish_child(BatchChild &child, vector<BatchCommand> &commands, deque<size_t> &plain)
+{
+    int status = 0;
+    struct rusage ru;
+
+    while (wait4(child.pid, &status, 0, &ru) < 0 && errno == EINTR) {}
+
+    close(child.pipe);
+    int ret = shell_exit_status(status);
+    BatchCommand &command = commands[child.command];
+
+    if (child.request && child.request->daemon && child.job_id) {
+        JobDoneMsg msg(child.job_id, ret, JobDoneMsg::FROM_SUBMITTER);
+
+        if (child.local) {
+            struct timeval end;
+            gettimeofday(&end, 0);
+            local_job_stats(msg, command.job, ru, (end.tv_sec - child.start.tv_sec) * 1000
+                            + (end.tv_usec - child.start.tv_usec) / 1000);
+        }
+
+        child.request->daemon->send_msg(msg);
+    }
+
+    if (child.retry) {
+        plain.push_back(child.command);
+    } else {
+        command.status = ret;
+    }
+}
+
+int build_batch(const char *icecc_program)
+{
+    vector<BatchCommand> commands;
+
+    if (!read_commands(stdin, commands)) {
+        return EXIT_BAD_ARGUMENTS;
+    }
+
+    char cwd[PATH_MAX];
+
+    if (!getcwd(cwd, sizeof(cwd))) {
+        log_perror("getcwd");
+        return EXIT_DISTCC_FAILED;
+    }
+
+    const char *icecc = getenv("ICECC");
+    bool all_plain = icecc && (!strcasecmp(icecc, "no") || !strcasecmp(icecc, "disable"));
+    deque<size_t> plain;
+    map<string, vector<size_t> > kinds;
+
+    for (size_t i = 0; i < commands.size(); ++i) {
+        if (analyse_command(commands[i].args, cwd, commands[i].job) || all_plain) {
+            plain.push_back(i);
+        } else {
+            kinds[batch_kind(commands[i].job)].push_back(i);
+        }
+    }
+
+    list<BatchRequest> requests;
+
+    for (map<string, vector<size_t> >::const_iterator kind = kinds.begin(); kind != kinds.end(); ++kind) {
+        for (size_t i = 0; i < kind->second.size(); i += MAX_GET_CS_BATCH) {
+            requests.push_back(BatchRequest());
+            BatchRequest &request = requests.back();
+            request.daemon = 0;
+            request.waiting = 0;
+            request.commands.assign(kind->second.begin() + i,
+                                    kind->second.begin() + min(i + MAX_GET_CS_BATCH, kind->second.size()));
+
+            if (!send_request(request, commands)) {
+                drop_request(request, plain);
+            }
+        }
+    }
+
+    trace() << "batch of " << commands.size() << " commands, " << requests.size() << " requests, "
+            << plain.size() << " plain" << endl;
+
+    // the plain ones wait for the daemon each, don't start all of them at once
+    long max_plain = max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+    list<BatchChild> children;
+
+    for (;;) {
+        long running_plain = 0;
+
+        for (list<BatchChild>::const_iterator it = children.begin(); it != children.end(); ++it) {
+            running_plain += !it->request;
+        }
+
+        while (!plain.empty() && running_plain < max_plain) {
+            size_t index = plain.front();
+            plain.pop_front();
+
+            if (start_plain(icecc_program, commands[index], index, children)) {
+                ++running_plain;
+            } else {
+                commands[index].status = EXIT_DISTCC_FAILED;
+            }
+        }
+
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        int max_fd = -1;
+        struct timeval zero = { 0, 0 };
+        struct timeval *timeout = 0;
+
+        for (list<BatchRequest>::iterator it = requests.begin(); it != requests.end(); ++it) {
+            if (it->daemon && it->waiting) {
+                FD_SET(it->daemon->fd, &read_set);
+                max_fd = max(max_fd, it->daemon->fd);
+
+                // what was read with the environment already
+                if (it->daemon->has_msg()) {
+                    timeout = &zero;
+                }
+            }
+        }
+
+        for (list<BatchChild>::const_iterator it = children.begin(); it != children.end(); ++it) {
+            FD_SET(it->pipe, &read_set);
+            max_fd = max(max_fd, it->pipe);
+        }
+
+        if (max_fd < 0) {
+            break;
+        }
+
+        int ret = select(max_fd + 1, &read_set, NULL, NULL, timeout);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            log_perror("select");
+            break;
+        }
+
+        for (list<BatchRequest>::iterator it = requests.begin(); it != requests.end(); ++it) {
+            if (!it->daemon || !it->waiting) {
+                continue;
+            }
+
+            bool readable = FD_ISSET(it->daemon->fd, &read_set);
+
+            if ((readable || it->daemon->has_msg())
+                    && !read_answers(*it, readable, commands, children, plain)) {
+                log_warning() << "lost the daemon, compiling the rest of a batch one by one" << endl;
+                drop_request(*it, plain);
+            }
+        }
+
+        for (list<BatchChild>::iterator it = children.begin(); it != children.end();) {
+            if (!FD_ISSET(it->pipe, &read_set)) {
+                ++it;
+                continue;
+            }
+
+            char c;
+            ssize_t len = read(it->pipe, &c, 1);
+
+            if (len > 0) {
+                it->retry = true;
+                ++it;
+            } else if (len < 0 && errno == EINTR) {
+                ++it;
+            } else {
+                finish_child(*it, commands, plain);
+                it = children.erase(it);
+            }
+        }
+    }
+
+    // nothing of ours is left with the daemons
+    for (list<BatchRequest>::iterator it = requests.begin(); it != requests.end(); ++it) {
+        if (it->daemon) {
+            it->daemon->send_msg(EndMsg());
+            delete it->daemon;
+        }
+    }
+
+    int ret = 0;
+
+    for (size_t i = 0; i < commands.size(); ++i) {
+        if (commands[i].status) {
+            log_error() << "command " << i + 1 << " (" << commands[i].job.inputFile()
+                        << ") failed with exit code " << commands[i].status << endl;
+
+            if (!ret) {
+                ret = commands[i].status;
+            }
+        }
+    }
+
+    return ret;
+}
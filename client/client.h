@@ -30,7 +30,9 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 
+#include <set>
 #include <stdexcept>
+#include <vector>
 
 #include "exitcode.h"
 #include "logging.h"
@@ -59,6 +61,41 @@ extern std::string compiler_path_lookup(const std::string &compiler);
 
 /* In remote.cpp - permill is the probability it will be compiled three times */
 extern int build_remote(CompileJob &job, MsgChannel *scheduler, const Environments &envs, int permill);
+extern unsigned int input_size(const CompileJob &job);
+extern void local_job_stats(JobDoneMsg &msg, const CompileJob &job, const struct rusage &ru,
+                            unsigned int real_msec);
+extern bool ask_for_batch(MsgChannel *local_daemon, const std::vector<const CompileJob *> &jobs,
+                          const Environments &envs);
+extern int build_batch_job(CompileJob &job, UseCSMsg *usecs, const Environments &envs);
+
+/* In batch.cpp - icecc --batch, with ICECC_PROGRAM to run the commands
+   that aren't batched with.  */
+extern int build_batch(const char *icecc_program);
+
+/* In envcache.cpp - a hash of the contents of an environment tarball */
+extern std::string env_identity(const std::string &tarball);
+
+/* In envmanifest.cpp - the regular files of an environment tarball, and a
+   tarball of only those of them with a blob in MISSING (and everything
+   else), written by a child to READ_FD.  */
+struct EnvManifestFile {
+    std::string path;
+    std::string blob; // SHA-256 of the content and mode, how the daemon stores it
+    uint64_t size;
+};
+extern bool env_manifest(const std::string &tarball, std::list<EnvManifestFile> &files);
+extern pid_t write_env_delta(const std::string &tarball, const std::list<EnvManifestFile> &files,
+                             const std::set<std::string> &missing, int &read_fd);
+
+/* In createenv.cpp - icecc --build-native without icecc-create-env, for
+   gcc and g++ or for clang and the compilerwrapper.  */
+#if defined(HAVE_ZLIB) && defined(__linux__)
+#define HAVE_NATIVE_CREATE_ENV 1
+extern int create_env(const std::string &gcc, const std::string &gxx, const std::string &clang,
+                      const std::string &compilerwrapper, const std::list<std::string> &extrafiles);
+// what ldd would list for BINARY, false if it's no ELF file
+extern bool elf_dependencies(const std::string &binary, std::list<std::string> &libs);
+#endif
 
 /* safeguard.cpp */
 extern void dcc_increment_safeguard(void);
@@ -0,0 +1,1343 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Creates the environment tarball for icecc --build-native, doing what
+   icecc-create-env does without running ldd, md5sum and tar for it: the
+   libraries are found by reading the dynamic sections of the binaries, the
+   files are hashed in parallel and the tar stream is compressed as gzip
+   members of fixed size by several threads, which gunzip and tar -xz read
+   like any other .tar.gz.  The result only depends on the files added, so
+   the same compiler always gives the same name.  */
+
+#include "config.h"
+
+#include "client.h"
+
+#ifdef HAVE_NATIVE_CREATE_ENV
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <glob.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include "hash.h"
+
+using namespace std;
+
+// uncompressed size of each gzip member
+#define GZIP_CHUNK_SIZE (4 * 1024 * 1024)
+#define MAX_THREADS 16
+
+/* A file of the environment. Either copied from SOURCE or, for the files
+   made up here, CONTENTS.  */
+struct EnvFile {
+    EnvFile() : mode(0644), mtime(0), size(0) {}
+
+    string source;
+    string contents;
+    mode_t mode;
+    time_t mtime;
+    off_t size;
+    string hash;
+};
+
+// by the path in the environment, which also sorts them for hashing
+typedef map<string, EnvFile> EnvFiles;
+
+static EnvFiles env_files;
+static set<string> env_sources;
+static bool env_failed = false;
+
+struct ElfInfo {
+    ElfInfo() : elf(false), dynamic(false), elfclass(0), machine(0), runpath(false) {}
+
+    bool elf;
+    bool dynamic;
+    int elfclass;
+    int machine;
+    string interp;
+    list<string> needed;
+    // DT_RUNPATH if set, else DT_RPATH, with $ORIGIN expanded
+    list<string> rpath;
+    bool runpath;
+};
+
+static string dir_of(const string &path)
+{
+    string::size_type slash = path.rfind('/');
+
+    if (slash == string::npos) {
+        return ".";
+    }
+
+    return slash ? path.substr(0, slash) : "/";
+}
+
+/* Like pwd -P: resolves the symlinks in the directories but not in the last
+   part of the path of a file.  */
+static string abs_path(const string &path)
+{
+    struct stat st;
+    char buffer[PATH_MAX];
+
+    if (stat(path.c_str(), &st)) {
+        return path;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        return realpath(path.c_str(), buffer) ? buffer : path;
+    }
+
+    if (!realpath(dir_of(path).c_str(), buffer)) {
+        return path;
+    }
+
+    string dir = buffer;
+    return (dir == "/" ? "" : dir) + "/" + find_basename(path);
+}
+
+static void split_paths(const string &s, const char *separators, list<string> &paths)
+{
+    string::size_type start = 0;
+
+    while (start < s.size()) {
+        string::size_type end = s.find_first_of(separators, start);
+
+        if (end == string::npos) {
+            end = s.size();
+        }
+
+        if (end > start) {
+            paths.push_back(s.substr(start, end - start));
+        }
+
+        start = end + 1;
+    }
+}
+
+static string elf_string(const unsigned char *data, size_t size, size_t offset)
+{
+    if (offset >= size) {
+        return string();
+    }
+
+    const char *s = (const char *) data + offset;
+    return string(s, strnlen(s, size - offset));
+}
+
+template<typename Ehdr, typename Phdr, typename Dyn>
+static void parse_elf(const unsigned char *data, size_t size, const string &path, ElfInfo &info)
+{
+    Ehdr ehdr;
+
+    if (size < sizeof(ehdr)) {
+        return;
+    }
+
+    memcpy(&ehdr, data, sizeof(ehdr));
+    info.elf = true;
+    info.machine = ehdr.e_machine;
+
+    if (ehdr.e_phoff > size || (size - ehdr.e_phoff) / sizeof(Phdr) < ehdr.e_phnum) {
+        return;
+    }
+
+    vector<Phdr> phdrs(ehdr.e_phnum);
+
+    if (ehdr.e_phnum) {
+        memcpy(&phdrs[0], data + ehdr.e_phoff, ehdr.e_phnum * sizeof(Phdr));
+    }
+
+    const Phdr *dynamic = 0;
+
+    for (size_t i = 0; i < phdrs.size(); ++i) {
+        if (phdrs[i].p_type == PT_INTERP) {
+            info.interp = elf_string(data, size, phdrs[i].p_offset);
+        } else if (phdrs[i].p_type == PT_DYNAMIC) {
+            dynamic = &phdrs[i];
+        }
+    }
+
+    if (!dynamic || dynamic->p_offset > size) {
+        return;
+    }
+
+    info.dynamic = true;
+
+    // the dynamic section refers to the string table by its address
+    uint64_t strtab_addr = 0;
+    bool has_strtab = false;
+    list<uint64_t> needed, rpath, runpath;
+    size_t count = min<uint64_t>(dynamic->p_filesz, size - dynamic->p_offset) / sizeof(Dyn);
+
+    for (size_t i = 0; i < count; ++i) {
+        Dyn dyn;
+        memcpy(&dyn, data + dynamic->p_offset + i * sizeof(Dyn), sizeof(dyn));
+
+        if (dyn.d_tag == DT_NULL) {
+            break;
+        }
+
+        switch (dyn.d_tag) {
+        case DT_STRTAB:
+            strtab_addr = dyn.d_un.d_ptr;
+            has_strtab = true;
+            break;
+        case DT_NEEDED:
+            needed.push_back(dyn.d_un.d_val);
+            break;
+        case DT_RPATH:
+            rpath.push_back(dyn.d_un.d_val);
+            break;
+        case DT_RUNPATH:
+            runpath.push_back(dyn.d_un.d_val);
+            break;
+        }
+    }
+
+    if (!has_strtab) {
+        return;
+    }
+
+    uint64_t strtab = 0;
+    bool mapped = false;
+
+    for (size_t i = 0; i < phdrs.size() && !mapped; ++i) {
+        if (phdrs[i].p_type == PT_LOAD && strtab_addr >= phdrs[i].p_vaddr
+                && strtab_addr < phdrs[i].p_vaddr + phdrs[i].p_filesz) {
+            strtab = strtab_addr - phdrs[i].p_vaddr + phdrs[i].p_offset;
+            mapped = true;
+        }
+    }
+
+    if (!mapped) {
+        return;
+    }
+
+    for (list<uint64_t>::const_iterator it = needed.begin(); it != needed.end(); ++it) {
+        info.needed.push_back(elf_string(data, size, strtab + *it));
+    }
+
+    info.runpath = !runpath.empty();
+    list<uint64_t> &paths = info.runpath ? runpath : rpath;
+    string origin = dir_of(abs_path(path));
+
+    for (list<uint64_t>::const_iterator it = paths.begin(); it != paths.end(); ++it) {
+        list<string> dirs;
+        split_paths(elf_string(data, size, strtab + *it), ":", dirs);
+
+        for (list<string>::iterator dir = dirs.begin(); dir != dirs.end(); ++dir) {
+            string::size_type pos;
+
+            while ((pos = dir->find("${ORIGIN}")) != string::npos) {
+                dir->replace(pos, 9, origin);
+            }
+
+            while ((pos = dir->find("$ORIGIN")) != string::npos) {
+                dir->replace(pos, 7, origin);
+            }
+
+            // $LIB and $PLATFORM depend on the loader, skip them
+            if (dir->find('$') == string::npos) {
+                info.rpath.push_back(*dir);
+            }
+        }
+    }
+}
+
+static bool read_elf(const string &path, ElfInfo &info)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > EI_NIDENT) {
+        map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    const unsigned char *data = (const unsigned char *) map;
+
+    if (!memcmp(data, ELFMAG, SELFMAG)) {
+        info.elfclass = data[EI_CLASS];
+
+        if (info.elfclass == ELFCLASS64) {
+            parse_elf<Elf64_Ehdr, Elf64_Phdr, Elf64_Dyn>(data, st.st_size, path, info);
+        } else if (info.elfclass == ELFCLASS32) {
+            parse_elf<Elf32_Ehdr, Elf32_Phdr, Elf32_Dyn>(data, st.st_size, path, info);
+        }
+    }
+
+    munmap(map, st.st_size);
+    return info.elf;
+}
+
+static void read_ld_so_conf(const string &file, list<string> &dirs, int depth = 0)
+{
+    FILE *f = fopen(file.c_str(), "r");
+
+    if (!f) {
+        return;
+    }
+
+    char line[PATH_MAX];
+
+    while (fgets(line, sizeof(line), f)) {
+        string s = line;
+        s = s.substr(0, s.find('#'));
+        list<string> words;
+        split_paths(s, " \t\r\n:,", words);
+
+        if (words.empty() || words.front() == "hwcap") {
+            continue;
+        }
+
+        if (words.front() != "include") {
+            for (list<string>::const_iterator it = words.begin(); it != words.end(); ++it) {
+                // the old dir=type syntax
+                dirs.push_back(it->substr(0, it->find('=')));
+            }
+
+            continue;
+        }
+
+        if (depth > 10) {
+            continue;
+        }
+
+        for (list<string>::const_iterator it = ++words.begin(); it != words.end(); ++it) {
+            string pattern = (*it)[0] == '/' ? *it : dir_of(file) + "/" + *it;
+            glob_t g;
+
+            if (glob(pattern.c_str(), 0, 0, &g) == 0) {
+                for (size_t i = 0; i < g.gl_pathc; ++i) {
+                    read_ld_so_conf(g.gl_pathv[i], dirs, depth + 1);
+                }
+            }
+
+            globfree(&g);
+        }
+    }
+
+    fclose(f);
+}
+
+// where the dynamic linker looks after the paths in the binaries
+static const list<string> &system_lib_dirs(int elfclass)
+{
+    static list<string> dirs[2];
+    static bool done[2];
+    int i = elfclass == ELFCLASS64;
+
+    if (!done[i]) {
+        read_ld_so_conf("/etc/ld.so.conf", dirs[i]);
+
+        if (i) {
+            dirs[i].push_back("/lib64");
+            dirs[i].push_back("/usr/lib64");
+        }
+
+        dirs[i].push_back("/lib");
+        dirs[i].push_back("/usr/lib");
+        done[i] = true;
+    }
+
+    return dirs[i];
+}
+
+static bool find_library(const string &name, const ElfInfo &loader, const list<string> &rpath_chain,
+                         string &found, ElfInfo &info)
+{
+    list<string> dirs;
+
+    if (name.find('/') != string::npos) {
+        dirs.push_back(string());
+    } else {
+        if (!loader.runpath) {
+            dirs = rpath_chain;
+        }
+
+        if (const char *env = getenv("LD_LIBRARY_PATH")) {
+            split_paths(env, ":;", dirs);
+        }
+
+        if (loader.runpath) {
+            dirs.insert(dirs.end(), loader.rpath.begin(), loader.rpath.end());
+        }
+
+        const list<string> &system = system_lib_dirs(loader.elfclass);
+        dirs.insert(dirs.end(), system.begin(), system.end());
+    }
+
+    for (list<string>::const_iterator it = dirs.begin(); it != dirs.end(); ++it) {
+        string path = it->empty() ? name : *it + "/" + name;
+        ElfInfo candidate;
+
+        // a library of another architecture doesn't count
+        if (read_elf(path, candidate) && candidate.elfclass == loader.elfclass
+                && candidate.machine == loader.machine) {
+            found = path;
+            info = candidate;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* All the libraries BINARY is linked against, directly or not, and its
+   dynamic linker, as ldd would list them.  */
+static void dependencies(const string &binary, const ElfInfo &binary_info, list<string> &libs)
+{
+    struct Pending {
+        string path;
+        ElfInfo info;
+        // DT_RPATH of the loaders, which is searched for their libraries too
+        list<string> rpath_chain;
+    };
+
+    vector<Pending> todo(1);
+    todo[0].path = binary;
+    todo[0].info = binary_info;
+    set<string> seen;
+    // like the dynamic linker, load each name only once
+    set<string> names;
+
+    if (!binary_info.interp.empty()) {
+        seen.insert(binary_info.interp);
+        names.insert(find_basename(binary_info.interp));
+        libs.push_back(binary_info.interp);
+    }
+
+    for (size_t i = 0; i < todo.size(); ++i) {
+        list<string> chain;
+
+        if (!todo[i].info.runpath) {
+            chain = todo[i].info.rpath;
+            chain.insert(chain.end(), todo[i].rpath_chain.begin(), todo[i].rpath_chain.end());
+        }
+
+        const list<string> needed = todo[i].info.needed;
+
+        for (list<string>::const_iterator it = needed.begin(); it != needed.end(); ++it) {
+            Pending lib;
+
+            if (!names.insert(*it).second) {
+                continue;
+            }
+
+            if (!find_library(*it, todo[i].info, chain, lib.path, lib.info)) {
+                fprintf(stderr, "%s: %s not found\n", todo[i].path.c_str(), it->c_str());
+                continue;
+            }
+
+            if (!seen.insert(lib.path).second) {
+                continue;
+            }
+
+            libs.push_back(lib.path);
+            lib.rpath_chain = chain;
+            todo.push_back(lib);
+        }
+    }
+}
+
+bool elf_dependencies(const string &binary, list<string> &libs)
+{
+    ElfInfo info;
+
+    if (!read_elf(binary, info)) {
+        return false;
+    }
+
+    dependencies(binary, info, libs);
+    return true;
+}
+
+static void add_file(const string &path, const string &target = string())
+{
+    string name = target.empty() ? path : target;
+
+    if (name.empty() || env_files.count(name)) {
+        return;
+    }
+
+    // already added under another name
+    if (name == path && env_sources.count(path)) {
+        return;
+    }
+
+    if (name == path) {
+        printf("adding file %s\n", path.c_str());
+    } else {
+        printf("adding file %s=%s\n", name.c_str(), path.c_str());
+    }
+
+    struct stat st;
+
+    if (stat(path.c_str(), &st) || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: not a file\n", path.c_str());
+        env_failed = true;
+        return;
+    }
+
+    EnvFile &file = env_files[name];
+    file.source = path;
+    file.mode = st.st_mode & 07777;
+    file.mtime = st.st_mtime;
+    file.size = st.st_size;
+    env_sources.insert(path);
+
+    ElfInfo info;
+
+    if (!(st.st_mode & 0111) || !read_elf(path, info) || !info.dynamic) {
+        return;
+    }
+
+    list<string> libs;
+    dependencies(path, info, libs);
+
+    for (list<string>::const_iterator it = libs.begin(); it != libs.end(); ++it) {
+        string lib = *it;
+        /* Check whether the same library also exists in the top directory,
+           and prefer that on the assumption that it is a more generic one.  */
+        string::size_type slash = lib.find('/', 1);
+
+        if (lib[0] == '/' && slash != string::npos) {
+            string baselib = lib.substr(0, slash) + "/" + find_basename(lib);
+            struct stat base_st;
+
+            if (baselib != lib && !stat(baselib.c_str(), &base_st) && S_ISREG(base_st.st_mode)) {
+                lib = baselib;
+            }
+        }
+
+        add_file(lib);
+    }
+}
+
+static void add_contents(const string &name, const string &contents)
+{
+    printf("adding file %s\n", name.c_str());
+    EnvFile &file = env_files[name];
+    file.contents = contents;
+    file.size = contents.size();
+}
+
+// what COMPILER prints for ARG, without the newline
+static string compiler_output(const string &compiler, const string &arg)
+{
+    int fds[2];
+
+    if (pipe(fds)) {
+        return string();
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return string();
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        execl(compiler.c_str(), compiler.c_str(), arg.c_str(), (char *) NULL);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    string output;
+    char buffer[1024];
+    ssize_t bytes;
+
+    while ((bytes = read(fds[0], buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        output.append(buffer, bytes);
+    }
+
+    close(fds[0]);
+    int status;
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    while (!output.empty() && output[output.size() - 1] == '\n') {
+        output.resize(output.size() - 1);
+    }
+
+    return output;
+}
+
+static bool exists(const string &path)
+{
+    struct stat st;
+    return !path.empty() && !stat(path.c_str(), &st);
+}
+
+/* Adds the FILE the compiler uses, where the compiler found it or in
+   INSTALLDIR.  */
+static bool search_add_file(const string &compiler, const string &name, string installdir = string())
+{
+    string file = compiler_output(compiler, "-print-prog-name=" + name);
+
+    if (file.empty() || file == name || !exists(file)) {
+        file = compiler_output(compiler, "-print-file-name=" + name);
+    }
+
+    if (!exists(file)) {
+        return false;
+    }
+
+    if (installdir.empty()) {
+        installdir = dir_of(file);
+        string abs_installdir = abs_path(installdir);
+
+        if (installdir != abs_installdir) {
+            /* The path where the compiler found the file is relative to the
+               compiler, which is going to be in /usr/bin in the environment.  */
+            string compiler_basedir = abs_path(dir_of(dir_of(compiler)));
+            installdir = abs_installdir;
+            string::size_type pos = installdir.find(compiler_basedir);
+
+            if (pos != string::npos) {
+                installdir.replace(pos, compiler_basedir.size(), "/usr");
+            }
+        }
+    }
+
+    add_file(file, installdir + "/" + name);
+    return true;
+}
+
+static void add_directory(const string &dir, const string &prefix)
+{
+    DIR *d = opendir(dir.c_str());
+
+    if (!d) {
+        return;
+    }
+
+    while (struct dirent *ent = readdir(d)) {
+        string name = ent->d_name;
+
+        if (name == "." || name == "..") {
+            continue;
+        }
+
+        string path = dir + "/" + name;
+        struct stat st;
+
+        if (lstat(path.c_str(), &st)) {
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            add_directory(path, prefix);
+        } else if (S_ISREG(st.st_mode)) {
+            // without .. and from <prefix> to /usr
+            string target = abs_path(path);
+            string::size_type pos = target.find(prefix);
+
+            if (!prefix.empty() && pos != string::npos) {
+                target.replace(pos, prefix.size(), "/usr");
+            }
+
+            add_file(path, target);
+        }
+    }
+
+    closedir(d);
+}
+
+/* for ldconfig -r to work, ld.so.conf must not contain relative paths in
+   include directives. Make them absolute.  */
+static string absolute_ld_so_conf()
+{
+    FILE *f = fopen("/etc/ld.so.conf", "r");
+    string contents;
+
+    if (!f) {
+        return contents;
+    }
+
+    char line[PATH_MAX];
+
+    while (fgets(line, sizeof(line), f)) {
+        list<string> words;
+        split_paths(line, " \t\r\n", words);
+        string directive = words.empty() ? string() : words.front();
+        string path = words.size() > 1 ? *++words.begin() : string();
+
+        if (directive == "include" && !path.empty() && path[0] != '/') {
+            path = "/etc/" + path;
+        }
+
+        contents += directive + " " + path + "\n";
+    }
+
+    fclose(f);
+    return contents;
+}
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t bytes = write(fd, data, len);
+
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        data += bytes;
+        len -= bytes;
+    }
+
+    return true;
+}
+
+static bool mkdir_p(const string &dir)
+{
+    if (dir.empty() || dir == "/" || !mkdir(dir.c_str(), 0755) || errno == EEXIST) {
+        return true;
+    }
+
+    return errno == ENOENT && mkdir_p(dir_of(dir)) && (!mkdir(dir.c_str(), 0755) || errno == EEXIST);
+}
+
+static bool copy_file(const string &from, const string &to)
+{
+    if (!link(from.c_str(), to.c_str())) {
+        return true;
+    }
+
+    int in = open(from.c_str(), O_RDONLY);
+
+    if (in < 0) {
+        return false;
+    }
+
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = out >= 0;
+    char buffer[65536];
+    ssize_t bytes;
+
+    while (ok && (bytes = read(in, buffer, sizeof(buffer))) > 0) {
+        ok = write_all(out, buffer, bytes);
+    }
+
+    close(in);
+
+    if (out >= 0 && close(out)) {
+        ok = false;
+    }
+
+    return ok;
+}
+
+static int remove_entry(const char *path, const struct stat *, int, struct FTW *)
+{
+    remove(path);
+    return 0;
+}
+
+/* Lets ldconfig -r create the ld.so.cache for the libraries in the
+   environment. ldconfig only looks at the libraries, so only they are
+   copied.  */
+static bool create_ld_so_cache()
+{
+    char tempdir[] = "/tmp/iceccenvXXXXXX";
+
+    if (!mkdtemp(tempdir)) {
+        log_perror("mkdtemp");
+        return false;
+    }
+
+    string root = tempdir;
+    bool ok = mkdir_p(root + "/var/cache/ldconfig");
+
+    // special case for weird multilib setups
+    static const char *const multilib_dirs[] = { "/lib", "/lib64", "/usr/lib", "/usr/lib64", NULL };
+
+    for (int i = 0; ok && multilib_dirs[i]; ++i) {
+        char link[PATH_MAX];
+        ssize_t len = readlink(multilib_dirs[i], link, sizeof(link) - 1);
+
+        if (len > 0) {
+            link[len] = 0;
+            // so that the libraries can be copied through the link
+            string target = link[0] == '/' ? root + link : root + dir_of(multilib_dirs[i]) + "/" + link;
+            ok = mkdir_p(target) && !symlink(link, (root + multilib_dirs[i]).c_str());
+        }
+    }
+
+    for (EnvFiles::const_iterator it = env_files.begin(); ok && it != env_files.end(); ++it) {
+        string target = root + it->first;
+
+        if (it->second.source.empty()) {
+            ok = mkdir_p(dir_of(target));
+            int fd = ok ? open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+            ok = fd >= 0 && write_all(fd, it->second.contents.data(), it->second.contents.size());
+
+            if (fd >= 0) {
+                close(fd);
+            }
+        } else if (find_basename(it->first).find(".so") != string::npos) {
+            ok = mkdir_p(dir_of(target)) && copy_file(it->second.source, target);
+        }
+    }
+
+    if (ok) {
+        const char *argv[] = { "/sbin/ldconfig", "-r", tempdir, NULL };
+        fflush(stdout);
+        pid_t pid = fork();
+
+        if (pid == 0) {
+            execv(argv[0], const_cast<char *const *>(argv));
+            _exit(127);
+        }
+
+        int status = 0;
+
+        while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+        ok = pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+    string cache;
+
+    if (ok) {
+        FILE *f = fopen((root + "/etc/ld.so.cache").c_str(), "r");
+        ok = f != NULL;
+        char buffer[65536];
+        size_t bytes;
+
+        while (f && (bytes = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+            cache.append(buffer, bytes);
+        }
+
+        if (f) {
+            fclose(f);
+        }
+    }
+
+    nftw(tempdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    if (!ok) {
+        fprintf(stderr, "ldconfig -r %s failed\n", tempdir);
+        return false;
+    }
+
+    add_contents("/etc/ld.so.cache", cache);
+    return true;
+}
+
+static int thread_count()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : cpus > MAX_THREADS ? MAX_THREADS : cpus;
+}
+
+struct ParallelWork {
+    void (*func)(void *arg, size_t index);
+    void *arg;
+    size_t count;
+    size_t next;
+};
+
+static void *parallel_worker(void *data)
+{
+    ParallelWork *work = (ParallelWork *) data;
+    size_t i;
+
+    while ((i = __sync_fetch_and_add(&work->next, 1)) < work->count) {
+        work->func(work->arg, i);
+    }
+
+    return 0;
+}
+
+// calls FUNC(ARG, i) for all i < COUNT, from several threads
+static void run_parallel(void (*func)(void *, size_t), void *arg, size_t count)
+{
+    ParallelWork work = { func, arg, count, 0 };
+    vector<pthread_t> threads;
+
+    for (int i = 1; i < thread_count() && size_t(i) < count; ++i) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, 0, parallel_worker, &work) == 0) {
+            threads.push_back(thread);
+        }
+    }
+
+    parallel_worker(&work);
+
+    for (size_t i = 0; i < threads.size(); ++i) {
+        pthread_join(threads[i], 0);
+    }
+}
+
+static void hash_one(void *arg, size_t index)
+{
+    EnvFile *file = ((EnvFile **) arg)[index];
+
+    if (file->source.empty()) {
+        Hash hash;
+        hash.update(file->contents);
+        file->hash = hash.digest();
+    } else {
+        file->hash = hash_file(file->source);
+    }
+}
+
+// the name of the environment, from the names and contents of all files
+static string hash_environment()
+{
+    vector<EnvFile *> files;
+
+    for (EnvFiles::iterator it = env_files.begin(); it != env_files.end(); ++it) {
+        files.push_back(&it->second);
+    }
+
+    run_parallel(hash_one, files.empty() ? 0 : &files[0], files.size());
+    Hash hash;
+
+    for (EnvFiles::const_iterator it = env_files.begin(); it != env_files.end(); ++it) {
+        if (it->second.hash.empty()) {
+            fprintf(stderr, "can't read %s\n", it->second.source.c_str());
+            return string();
+        }
+
+        hash.update(it->first.c_str(), it->first.size() + 1);
+        hash.update(it->second.hash);
+    }
+
+    return hash.digest();
+}
+
+/* Writes a stream as gzip members of GZIP_CHUNK_SIZE bytes each, compressed
+   by as many threads as there are CPUs.  */
+class GzipWriter
+{
+public:
+    explicit GzipWriter(int fd)
+        : m_fd(fd)
+        , m_ok(true)
+        , m_batch(thread_count()) {}
+
+    bool write(const char *data, size_t len) {
+        while (len > 0 && m_ok) {
+            if (m_chunks.empty() || m_chunks.back().in.size() == GZIP_CHUNK_SIZE) {
+                if (m_chunks.size() == m_batch) {
+                    flush();
+                }
+
+                m_chunks.push_back(Chunk());
+                m_chunks.back().in.reserve(GZIP_CHUNK_SIZE);
+            }
+
+            string &chunk = m_chunks.back().in;
+            size_t bytes = min(len, GZIP_CHUNK_SIZE - chunk.size());
+            chunk.append(data, bytes);
+            data += bytes;
+            len -= bytes;
+        }
+
+        return m_ok;
+    }
+
+    bool finish() {
+        flush();
+        return m_ok;
+    }
+
+private:
+    struct Chunk {
+        string in;
+        string out;
+    };
+
+    static void compress(void *arg, size_t index) {
+        Chunk &chunk = ((Chunk *) arg)[index];
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+
+        // 15 + 16 for a gzip header, which has no time and name in it
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            return;
+        }
+
+        chunk.out.resize(deflateBound(&stream, chunk.in.size()));
+        stream.next_in = (Bytef *) chunk.in.data();
+        stream.avail_in = chunk.in.size();
+        stream.next_out = (Bytef *) &chunk.out[0];
+        stream.avail_out = chunk.out.size();
+
+        if (deflate(&stream, Z_FINISH) == Z_STREAM_END) {
+            chunk.out.resize(stream.total_out);
+        } else {
+            chunk.out.clear();
+        }
+
+        deflateEnd(&stream);
+    }
+
+    void flush() {
+        if (m_chunks.empty()) {
+            return;
+        }
+
+        vector<Chunk> chunks(m_chunks.begin(), m_chunks.end());
+        m_chunks.clear();
+        run_parallel(compress, &chunks[0], chunks.size());
+
+        for (size_t i = 0; i < chunks.size() && m_ok; ++i) {
+            m_ok = !chunks[i].out.empty() && write_all(m_fd, chunks[i].out.data(), chunks[i].out.size());
+        }
+    }
+
+    int m_fd;
+    bool m_ok;
+    size_t m_batch;
+    list<Chunk> m_chunks;
+};
+
+/* In octal with a trailing 0, or, for what doesn't fit like the size of a
+   file of 8 GB, in base-256 as GNU tar does.  */
+static void tar_field(char *field, size_t size, unsigned long long value)
+{
+    if (value >> (3 * (size - 1)) == 0) {
+        char octal[32];
+        snprintf(octal, sizeof(octal), "%0*llo", int(size - 1), value);
+        memcpy(field, octal, size);
+        return;
+    }
+
+    field[0] = (char) 0x80;
+
+    for (size_t i = size - 1; i > 0; --i, value >>= 8) {
+        field[i] = (char) (value & 0xff);
+    }
+}
+
+static bool write_tar_header(GzipWriter &out, const string &name, char type, off_t size,
+                             mode_t mode, time_t mtime)
+{
+    char header[512];
+    memset(header, 0, sizeof(header));
+    memcpy(header, name.data(), min<size_t>(name.size(), 100));
+    tar_field(header + 100, 8, mode);
+    tar_field(header + 108, 8, 0);
+    tar_field(header + 116, 8, 0);
+    tar_field(header + 124, 12, size);
+    tar_field(header + 136, 12, mtime < 0 ? 0 : mtime);
+    header[156] = type;
+    // the GNU format, as GNU tar writes it
+    memcpy(header + 257, "ustar  ", 8);
+    memset(header + 148, ' ', 8);
+    unsigned int sum = 0;
+
+    for (size_t i = 0; i < sizeof(header); ++i) {
+        sum += (unsigned char) header[i];
+    }
+
+    snprintf(header + 148, 8, "%06o", sum);
+    return out.write(header, sizeof(header));
+}
+
+static bool write_tar_padding(GzipWriter &out, off_t size)
+{
+    static const char zeros[512] = { 0 };
+    return size % 512 == 0 || out.write(zeros, 512 - size % 512);
+}
+
+static bool write_tar_entry(GzipWriter &out, const string &path, const EnvFile &file)
+{
+    // without the leading /
+    string name = path.substr(path.find_first_not_of('/'));
+
+    if (name.size() > 100) {
+        if (!write_tar_header(out, "././@LongLink", 'L', name.size() + 1, 0, 0)
+                || !out.write(name.c_str(), name.size() + 1)
+                || !write_tar_padding(out, name.size() + 1)) {
+            return false;
+        }
+    }
+
+    if (!write_tar_header(out, name, '0', file.size, file.mode, file.mtime)) {
+        return false;
+    }
+
+    if (file.source.empty()) {
+        return out.write(file.contents.data(), file.contents.size())
+               && write_tar_padding(out, file.size);
+    }
+
+    int fd = open(file.source.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    vector<char> buffer(1024 * 1024);
+    off_t total = 0;
+    ssize_t bytes;
+
+    while ((bytes = read(fd, &buffer[0], buffer.size())) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        total += bytes;
+
+        if (total > file.size || !out.write(&buffer[0], bytes)) {
+            break;
+        }
+    }
+
+    close(fd);
+
+    // changed since it was added, the hash would be wrong
+    if (total != file.size || bytes != 0) {
+        fprintf(stderr, "%s changed while creating the environment\n", file.source.c_str());
+        return false;
+    }
+
+    return write_tar_padding(out, file.size);
+}
+
+static bool write_archive(const string &filename)
+{
+    string tmpname = filename + ".tmp";
+    int fd = open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        log_perror("open");
+        return false;
+    }
+
+    GzipWriter out(fd);
+    bool ok = true;
+
+    for (EnvFiles::const_iterator it = env_files.begin(); ok && it != env_files.end(); ++it) {
+        ok = write_tar_entry(out, it->first, it->second);
+    }
+
+    static const char end_of_archive[1024] = { 0 };
+    ok = ok && out.write(end_of_archive, sizeof(end_of_archive)) && out.finish();
+
+    if (close(fd)) {
+        ok = false;
+    }
+
+    if (!ok || rename(tmpname.c_str(), filename.c_str())) {
+        unlink(tmpname.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static bool check_binary(const string &path)
+{
+    if (access(path.c_str(), X_OK)) {
+        printf("'%s' is no executable.\n", path.c_str());
+        return false;
+    }
+
+    ElfInfo info;
+
+    if (!read_elf(path, info)) {
+        printf("%s is not a binary file.\n", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+int create_env(const string &gcc, const string &gxx, const string &clang,
+               const string &compilerwrapper, const list<string> &extrafiles)
+{
+    // the daemon closes stdout, don't let the archive end up there
+    if (fcntl(STDOUT_FILENO, F_GETFD) < 0) {
+        int fd = open("/dev/null", O_WRONLY);
+
+        if (fd < 0) {
+            log_perror("open /dev/null");
+            return 1;
+        }
+
+        if (fd != STDOUT_FILENO) {
+            dup2(fd, STDOUT_FILENO);
+            close(fd);
+        }
+    }
+
+    if (!gcc.empty() && (!check_binary(gcc) || !check_binary(gxx))) {
+        return 1;
+    }
+
+    if (!clang.empty() && !check_binary(clang)) {
+        return 1;
+    }
+
+    if (!clang.empty() && access(compilerwrapper.c_str(), X_OK)) {
+        printf("'%s' is no executable.\n", compilerwrapper.c_str());
+        return 1;
+    }
+
+    // for testing the environment is usable at all
+    if (access("/bin/true", X_OK) == 0) {
+        add_file("/bin/true");
+    } else if (access("/usr/bin/true", X_OK) == 0) {
+        add_file("/usr/bin/true", "/bin/true");
+    }
+
+    if (!gcc.empty()) {
+        string abs_gcc = abs_path(gcc);
+        string abs_gxx = abs_path(gxx);
+
+        if (clang.empty()) {
+            add_file(abs_gcc, "/usr/bin/gcc");
+            add_file(abs_gxx, "/usr/bin/g++");
+        } else {
+            // the wrapper added in place of gcc calls the real one under this name
+            add_file(abs_gcc, "/usr/bin/gcc.bin");
+            add_file(abs_gxx, "/usr/bin/g++.bin");
+        }
+
+        add_file(compiler_output(abs_gcc, "-print-prog-name=cc1"), "/usr/bin/cc1");
+        add_file(compiler_output(abs_gxx, "-print-prog-name=cc1plus"), "/usr/bin/cc1plus");
+
+        string gcc_as = compiler_output(abs_gcc, "-print-prog-name=as");
+        add_file(gcc_as == "as" ? "/usr/bin/as" : gcc_as, "/usr/bin/as");
+
+        search_add_file(abs_gcc, "specs");
+        search_add_file(abs_gcc, "liblto_plugin.so");
+    }
+
+    if (!clang.empty()) {
+        add_file(clang, "/usr/bin/clang");
+        /* Older icecream remotes have /usr/bin/{gcc|g++} hardcoded and wouldn't
+           call /usr/bin/clang at all. So include a wrapper binary that will call
+           gcc or clang depending on an extra argument added by icecream.  */
+        add_file(compilerwrapper, "/usr/bin/gcc");
+        add_file(compilerwrapper, "/usr/bin/g++");
+        add_file(compiler_output(clang, "-print-prog-name=as"), "/usr/bin/as");
+
+        // clang always uses its internal .h files
+        string clangincludes = dir_of(compiler_output(clang, "-print-file-name=include/limits.h"));
+        add_directory(clangincludes, dir_of(dir_of(clang)));
+    }
+
+    for (list<string>::const_iterator it = extrafiles.begin(); it != extrafiles.end(); ++it) {
+        add_file(*it);
+    }
+
+    add_file("/usr/bin/objcopy");
+
+    if (exists("/etc/ld.so.conf")) {
+        add_contents("/etc/ld.so.conf", absolute_ld_so_conf());
+    }
+
+    if (env_failed) {
+        printf("Couldn't create archive\n");
+        return 3;
+    }
+
+    if (access("/sbin/ldconfig", X_OK) == 0 && !create_ld_so_cache()) {
+        return 3;
+    }
+
+    string hash = hash_environment();
+
+    if (hash.empty()) {
+        printf("Couldn't compute the hash.\n");
+        return 2;
+    }
+
+    string filename = hash + ".tar.gz";
+    printf("creating %s\n", filename.c_str());
+    fflush(stdout);
+
+    if (!write_archive(filename)) {
+        printf("Couldn't create archive\n");
+        return 3;
+    }
+
+    // tell whoever has invoked us, if it gave us a pipe for it
+    struct stat st;
+
+    if (fstat(5, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        string line = filename + "\n";
+        write_all(5, line.data(), line.size());
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,286 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "client.h"
+#include "hash.h"
+
+using namespace std;
+
+/* Hashing an environment tarball means reading all of it, which is too much
+   to do in every icecc process.  So the hashes are remembered in a small
+   table in a file of the user, keyed by the path and what stat says about
+   the file.  Readers map the file and don't lock it: each entry has a
+   sequence number that a writer (who holds the lock on the file) makes odd
+   while it changes the entry, a reader that sees an odd or changed number
+   treats the entry as a miss.  */
+
+#define ENV_CACHE_MAGIC 0x31766e4563636349ULL // "Iccc" "Env1"
+#define ENV_CACHE_SLOTS 1024
+// how many slots after the first one a path may end up in
+#define ENV_CACHE_PROBES 4
+
+struct EnvCacheEntry {
+    volatile uint32_t seq; // 0 for unused, odd while being written
+    uint32_t unused;
+    char path_hash[32];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+    int64_t ctime;
+    char hash[32];
+};
+
+struct EnvCacheHeader {
+    uint64_t magic;
+    uint32_t slots;
+    uint32_t entry_size;
+};
+
+static const size_t env_cache_size = sizeof(EnvCacheHeader) + ENV_CACHE_SLOTS * sizeof(EnvCacheEntry);
+
+static string env_cache_file()
+{
+    string dir = dcc_user_dir();
+
+    if (dir.empty()) {
+        return dir;
+    }
+
+    return dir + "/env_hashes";
+}
+
+static EnvCacheEntry *env_cache_slots(void *map)
+{
+    return (EnvCacheEntry *)((char *) map + sizeof(EnvCacheHeader));
+}
+
+static bool env_cache_valid(const void *map)
+{
+    const EnvCacheHeader *header = (const EnvCacheHeader *) map;
+    return header->magic == ENV_CACHE_MAGIC && header->slots == ENV_CACHE_SLOTS
+           && header->entry_size == sizeof(EnvCacheEntry);
+}
+
+static unsigned int first_slot(const string &path_hash)
+{
+    return strtoul(path_hash.substr(0, 8).c_str(), 0, 16) % ENV_CACHE_SLOTS;
+}
+
+static void fill_key(EnvCacheEntry &entry, const string &path_hash, const struct stat &st)
+{
+    memcpy(entry.path_hash, path_hash.data(), sizeof(entry.path_hash));
+    entry.dev = st.st_dev;
+    entry.ino = st.st_ino;
+    entry.size = st.st_size;
+    entry.mtime = st.st_mtime;
+    entry.ctime = st.st_ctime;
+}
+
+static bool same_key(const EnvCacheEntry &a, const EnvCacheEntry &b)
+{
+    return !memcmp(a.path_hash, b.path_hash, sizeof(a.path_hash)) && a.dev == b.dev
+           && a.ino == b.ino && a.size == b.size && a.mtime == b.mtime && a.ctime == b.ctime;
+}
+
+static string lookup(const string &file, const EnvCacheEntry &key)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return string();
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size == env_cache_size) {
+        map = mmap(0, env_cache_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return string();
+    }
+
+    string hash;
+
+    if (env_cache_valid(map)) {
+        const EnvCacheEntry *slots = env_cache_slots(map);
+        unsigned int slot = first_slot(string(key.path_hash, sizeof(key.path_hash)));
+
+        for (int i = 0; i < ENV_CACHE_PROBES && hash.empty(); ++i) {
+            const EnvCacheEntry &entry = slots[(slot + i) % ENV_CACHE_SLOTS];
+            uint32_t seq = entry.seq;
+
+            if (seq == 0 || (seq & 1)) {
+                continue;
+            }
+
+            __sync_synchronize();
+            EnvCacheEntry copy;
+            memcpy(&copy, (const void *) &entry, sizeof(copy));
+            __sync_synchronize();
+
+            if (entry.seq == seq && same_key(copy, key)) {
+                hash.assign(copy.hash, sizeof(copy.hash));
+            }
+        }
+    }
+
+    munmap(map, env_cache_size);
+    return hash;
+}
+
+static void store(const string &file, const EnvCacheEntry &key, const string &hash)
+{
+    int fd = open(file.c_str(), O_RDWR | O_CREAT, 0600);
+
+    if (fd < 0) {
+        trace() << "can't open " << file << ": " << strerror(errno) << endl;
+        return;
+    }
+
+    struct stat st;
+
+    if (sys_lock(fd, true) || fstat(fd, &st)) {
+        close(fd);
+        return;
+    }
+
+    if ((size_t) st.st_size != env_cache_size) {
+        // new or from some other version - start over
+        EnvCacheHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = ENV_CACHE_MAGIC;
+        header.slots = ENV_CACHE_SLOTS;
+        header.entry_size = sizeof(EnvCacheEntry);
+
+        if (ftruncate(fd, 0) || ftruncate(fd, env_cache_size)
+                || pwrite(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+            log_perror("ftruncate");
+            close(fd);
+            return;
+        }
+    }
+
+    void *map = mmap(0, env_cache_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+
+    if (env_cache_valid(map)) {
+        EnvCacheEntry *slots = env_cache_slots(map);
+        unsigned int slot = first_slot(string(key.path_hash, sizeof(key.path_hash)));
+        EnvCacheEntry *target = &slots[slot];
+
+        // the old entry of the same path or a free slot, else evict the first one
+        for (int i = 0; i < ENV_CACHE_PROBES; ++i) {
+            EnvCacheEntry *entry = &slots[(slot + i) % ENV_CACHE_SLOTS];
+
+            if (entry->seq == 0 || !memcmp(entry->path_hash, key.path_hash, sizeof(key.path_hash))) {
+                target = entry;
+                break;
+            }
+        }
+
+        EnvCacheEntry entry = key;
+        memcpy(entry.hash, hash.data(), sizeof(entry.hash));
+        const size_t start = offsetof(EnvCacheEntry, path_hash);
+
+        uint32_t seq = target->seq;
+        target->seq = seq | 1;
+        __sync_synchronize();
+        memcpy((char *) target + start, (const char *) &entry + start, sizeof(entry) - start);
+        __sync_synchronize();
+        target->seq = (seq | 1) + 1;
+    }
+
+    munmap(map, env_cache_size);
+    // also releases the lock
+    close(fd);
+}
+
+string env_identity(const string &tarball)
+{
+    struct stat st;
+
+    if (stat(tarball.c_str(), &st) || !S_ISREG(st.st_mode)) {
+        return string();
+    }
+
+    string path_hash;
+    {
+        Hash hash;
+        hash.update(get_absfilename(tarball));
+        path_hash = hash.digest();
+    }
+
+    EnvCacheEntry key;
+    memset(&key, 0, sizeof(key));
+    fill_key(key, path_hash, st);
+
+    string file = env_cache_file();
+
+    if (!file.empty()) {
+        string hash = lookup(file, key);
+
+        if (!hash.empty()) {
+            return hash;
+        }
+    }
+
+    string hash = hash_file(tarball);
+
+    if (hash.size() != sizeof(key.hash) || file.empty()) {
+        return hash;
+    }
+
+    // don't remember anything for a file that changed while it was read
+    struct stat after;
+
+    if (stat(tarball.c_str(), &after) == 0) {
+        EnvCacheEntry check;
+        memset(&check, 0, sizeof(check));
+        fill_key(check, path_hash, after);
+
+        if (same_key(check, key)) {
+            store(file, key, hash);
+        }
+    }
+
+    return hash;
+}
@@ -0,0 +1,541 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/* Daemons keep the files of their environments in a store by content and
+   mode, and different versions of a toolchain have most of their files in
+   common.  So before transferring an environment the client lists its
+   regular files with their hashes, and then sends a tarball of just the
+   ones the remote doesn't have, plus the directories and links.  Reading
+   through the whole tarball for the list is as expensive as sending it, so
+   the list is kept in a file of the user, named by the tarball's hash.  */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "hash.h"
+
+using namespace std;
+
+#ifdef HAVE_ZLIB
+
+#include <zlib.h>
+
+// manifests not written for this long are thrown away
+#define MANIFEST_MAX_AGE (30 * 24 * 3600)
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+    while (len) {
+        ssize_t bytes = write(fd, data, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            return false;
+        }
+
+        data += bytes;
+        len -= bytes;
+    }
+
+    return true;
+}
+
+static uint64_t tar_number(const char *field, size_t len)
+{
+    uint64_t res = 0;
+
+    // GNU tar's base-256 for what doesn't fit the octal digits
+    if (field[0] & 0x80) {
+        res = field[0] & 0x3f;
+
+        for (size_t i = 1; i < len; ++i) {
+            res = (res << 8) | (unsigned char) field[i];
+        }
+
+        return res;
+    }
+
+    for (size_t i = 0; i < len && field[i]; ++i) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            res = (res << 3) | (field[i] - '0');
+        } else if (field[i] != ' ') {
+            break;
+        }
+    }
+
+    return res;
+}
+
+static string tar_string(const char *field, size_t len)
+{
+    return string(field, strnlen(field, len));
+}
+
+/* Walks through the entries of a (maybe gzipped) tar.  The headers of an
+   entry include the ones of the GNU long names and pax extensions before
+   it, which is what has to be copied to reproduce it.  */
+class TarReader
+{
+public:
+    explicit TarReader(gzFile file)
+        : type(0)
+        , mode(0)
+        , size(0)
+        , m_file(file)
+        , m_end(false) {}
+
+    // false at the end and for anything this doesn't know about
+    bool next() {
+        headers.clear();
+        string long_name;
+        string pax_path;
+
+        for (;;) {
+            char block[512];
+
+            if (!read_block(block)) {
+                return false;
+            }
+
+            if (!block[0] && !memcmp(block, block + 1, sizeof(block) - 1)) {
+                m_end = true;
+                return false;
+            }
+
+            if (!valid_checksum(block)) {
+                trace() << "not a tar header, no manifest" << endl;
+                return false;
+            }
+
+            headers.append(block, sizeof(block));
+            type = block[156];
+            size = tar_number(block + 124, 12);
+
+            if (type == 'L' || type == 'x') {
+                string data;
+
+                if (!read_data(&data, 0, -1)) {
+                    return false;
+                }
+
+                if (type == 'L') {
+                    long_name = tar_string(data.data(), data.size());
+                } else if (!parse_pax(data, pax_path)) {
+                    return false;
+                }
+
+                continue;
+            }
+
+            if (type == 'K') {
+                if (!read_data(0, 0, -1)) {
+                    return false;
+                }
+
+                continue;
+            }
+
+            // old GNU sparse files have more headers, pax ones are caught above
+            if (type == 'S') {
+                return false;
+            }
+
+            mode = tar_number(block + 100, 8);
+
+            if (!pax_path.empty()) {
+                path = pax_path;
+            } else if (!long_name.empty()) {
+                path = long_name;
+            } else {
+                path = tar_string(block, 100);
+
+                // POSIX ustar splits long names, GNU uses the field for times
+                if (!memcmp(block + 257, "ustar\0", 6) && block[345]) {
+                    path = tar_string(block + 345, 155) + "/" + path;
+                }
+            }
+
+            while (path.compare(0, 2, "./") == 0) {
+                path.erase(0, 2);
+            }
+
+            while (!path.empty() && path[0] == '/') {
+                path.erase(0, 1);
+            }
+
+            return true;
+        }
+    }
+
+    // whether next() stopped at the end and not at some error
+    bool at_end() const {
+        return m_end;
+    }
+
+    bool is_file() const {
+        return type == '0' || type == '\0' || type == '7';
+    }
+
+    /* Reads the data of the entry, into DATA, adding it to HASH and/or
+       writing it with its padding to FD if given.  */
+    bool read_data(string *data, Sha256 *hash, int fd) {
+        uint64_t left = (size + 511) & ~(uint64_t) 511;
+        uint64_t content = size;
+        char buffer[65536];
+
+        while (left) {
+            size_t chunk = left < sizeof(buffer) ? left : sizeof(buffer);
+            int bytes = gzread(m_file, buffer, chunk);
+
+            if (bytes != (int) chunk) {
+                return false;
+            }
+
+            size_t used = content < chunk ? content : chunk;
+
+            if (data) {
+                data->append(buffer, used);
+            }
+
+            if (hash) {
+                hash->update(buffer, used);
+            }
+
+            if (fd >= 0 && !write_all(fd, buffer, chunk)) {
+                return false;
+            }
+
+            content -= used;
+            left -= chunk;
+        }
+
+        return true;
+    }
+
+    string headers;
+    string path;
+    char type;
+    unsigned int mode;
+    uint64_t size;
+
+private:
+    bool read_block(char *block) {
+        return gzread(m_file, block, 512) == 512;
+    }
+
+    static bool valid_checksum(const char *block) {
+        unsigned long sum = 0;
+        long signed_sum = 0;
+
+        for (int i = 0; i < 512; ++i) {
+            char c = (i >= 148 && i < 156) ? ' ' : block[i];
+            sum += (unsigned char) c;
+            signed_sum += (signed char) c;
+        }
+
+        uint64_t stored = tar_number(block + 148, 8);
+        return stored == sum || stored == (uint64_t) signed_sum;
+    }
+
+    static bool parse_pax(const string &data, string &path) {
+        string::size_type pos = 0;
+
+        while (pos < data.size()) {
+            char *end;
+            unsigned long len = strtoul(data.c_str() + pos, &end, 10);
+            string::size_type space = end - data.c_str();
+
+            if (!len || space >= data.size() || data[space] != ' ' || pos + len > data.size()) {
+                return false;
+            }
+
+            string record = data.substr(space + 1, pos + len - space - 2);
+
+            if (record.compare(0, 5, "path=") == 0) {
+                path = record.substr(5);
+            } else if (record.compare(0, 10, "GNU.sparse") == 0) {
+                return false;
+            }
+
+            pos += len;
+        }
+
+        return true;
+    }
+
+    gzFile m_file;
+    bool m_end;
+};
+
+static string manifest_dir()
+{
+    string dir = dcc_user_dir();
+
+    if (dir.empty()) {
+        return dir;
+    }
+
+    dir += "/env_manifests";
+
+    if (mkdir(dir.c_str(), 0700) && errno != EEXIST) {
+        return string();
+    }
+
+    return dir;
+}
+
+static bool read_cached_manifest(const string &file, list<EnvManifestFile> &files)
+{
+    FILE *f = fopen(file.c_str(), "r");
+
+    if (!f) {
+        return false;
+    }
+
+    char line[PATH_MAX + 128];
+    bool ok = fgets(line, sizeof(line), f) && !strcmp(line, "icecc-manifest 2\n");
+
+    while (ok && fgets(line, sizeof(line), f)) {
+        char *blob_end = strchr(line, ' ');
+        char *size_end = blob_end ? strchr(blob_end + 1, ' ') : 0;
+        size_t len = strlen(line);
+
+        if (!size_end || line[len - 1] != '\n') {
+            ok = false;
+            break;
+        }
+
+        EnvManifestFile entry;
+        entry.blob.assign(line, blob_end);
+        entry.size = strtoull(blob_end + 1, 0, 10);
+        entry.path.assign(size_end + 1, line + len - 1);
+        files.push_back(entry);
+    }
+
+    fclose(f);
+    return ok;
+}
+
+static void write_cached_manifest(const string &dir, const string &file,
+                                  const list<EnvManifestFile> &files)
+{
+    string tmp = file + ".tmp" + toString(getpid());
+    FILE *f = fopen(tmp.c_str(), "w");
+
+    if (!f) {
+        return;
+    }
+
+    fputs("icecc-manifest 2\n", f);
+
+    for (list<EnvManifestFile>::const_iterator it = files.begin(); it != files.end(); ++it) {
+        fprintf(f, "%s %llu %s\n", it->blob.c_str(), (unsigned long long) it->size,
+                it->path.c_str());
+    }
+
+    if (fclose(f) || rename(tmp.c_str(), file.c_str())) {
+        unlink(tmp.c_str());
+    }
+
+    DIR *d = opendir(dir.c_str());
+
+    if (!d) {
+        return;
+    }
+
+    time_t now = time(0);
+
+    for (struct dirent *ent = readdir(d); ent; ent = readdir(d)) {
+        string old = dir + "/" + ent->d_name;
+        struct stat st;
+
+        if (ent->d_name[0] != '.' && lstat(old.c_str(), &st) == 0
+                && st.st_mtime + MANIFEST_MAX_AGE < now) {
+            unlink(old.c_str());
+        }
+    }
+
+    closedir(d);
+}
+
+static bool read_manifest(const string &tarball, list<EnvManifestFile> &files)
+{
+    gzFile file = gzopen(tarball.c_str(), "rb");
+
+    if (!file) {
+        return false;
+    }
+
+    gzbuffer(file, 128 * 1024);
+    TarReader tar(file);
+    bool ok = true;
+
+    while (ok && tar.next()) {
+        if (!tar.is_file()) {
+            ok = tar.read_data(0, 0, -1);
+            continue;
+        }
+
+        // they are one per line in the cache
+        if (tar.path.find('\n') != string::npos) {
+            ok = false;
+            break;
+        }
+
+        Sha256 hash;
+        ok = tar.read_data(0, &hash, -1);
+
+        char mode[16];
+        // like the daemon names its blobs, see store_files()
+        snprintf(mode, sizeof(mode), "-%04o", tar.mode & 07555);
+
+        EnvManifestFile entry;
+        entry.path = tar.path;
+        entry.blob = hash.digest() + mode;
+        entry.size = tar.size;
+        files.push_back(entry);
+    }
+
+    gzclose(file);
+    return ok && tar.at_end() && !files.empty();
+}
+
+bool env_manifest(const string &tarball, list<EnvManifestFile> &files)
+{
+    files.clear();
+    string identity = env_identity(tarball);
+    string dir = identity.empty() ? string() : manifest_dir();
+    string file = dir.empty() ? string() : dir + "/" + identity;
+
+    if (!file.empty() && read_cached_manifest(file, files)) {
+        return true;
+    }
+
+    files.clear();
+
+    if (!read_manifest(tarball, files)) {
+        files.clear();
+        return false;
+    }
+
+    if (!file.empty()) {
+        write_cached_manifest(dir, file, files);
+    }
+
+    return true;
+}
+
+pid_t write_env_delta(const string &tarball, const list<EnvManifestFile> &files,
+                      const set<string> &missing, int &read_fd)
+{
+    int fds[2];
+
+    if (pipe(fds)) {
+        log_perror("pipe");
+        return -1;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        log_perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid) {
+        close(fds[1]);
+        read_fd = fds[0];
+        return pid;
+    }
+
+    close(fds[0]);
+    int fd = fds[1];
+    gzFile file = gzopen(tarball.c_str(), "rb");
+
+    if (!file) {
+        _exit(1);
+    }
+
+    TarReader tar(file);
+    list<EnvManifestFile>::const_iterator entry = files.begin();
+
+    while (tar.next()) {
+        bool wanted = true;
+
+        // the files come in the order of the manifest
+        if (tar.is_file()) {
+            if (entry == files.end() || entry->path != tar.path) {
+                _exit(1);
+            }
+
+            wanted = missing.count(entry->blob) > 0;
+            ++entry;
+        }
+
+        if (wanted && !write_all(fd, tar.headers.data(), tar.headers.size())) {
+            _exit(1);
+        }
+
+        if (!tar.read_data(0, 0, wanted ? fd : -1)) {
+            _exit(1);
+        }
+    }
+
+    if (!tar.at_end() || entry != files.end()) {
+        _exit(1);
+    }
+
+    char end[1024];
+    memset(end, 0, sizeof(end));
+    _exit(write_all(fd, end, sizeof(end)) ? 0 : 1);
+}
+
+#else
+
+bool env_manifest(const string &, list<EnvManifestFile> &)
+{
+    return false;
+}
+
+pid_t write_env_delta(const string &, const list<EnvManifestFile> &, const set<string> &, int &)
+{
+    return -1;
+}
+
+#endif
@@ -72,12 +72,16 @@ static void dcc_show_usage(void)
         "Usage:\n"
         "   icecc [compiler] [compile options] -o OBJECT -c SOURCE\n"
         "   icecc --build-native [compilertype] [file...]\n"
+        "   icecc --batch < COMMANDS\n"
         "   icecc --help\n"
         "\n"
         "Options:\n"
         "   --help                     explain usage and exit\n"
         "   --version                  show version and exit\n"
         "   --build-native             create icecc environment\n"
+        "   --batch                    compile the commands read from the standard input,\n"
+        "                              one per line, with the servers for all of them\n"
+        "                              asked for at once\n"
         "Environment Variables:\n"
         "   ICECC                      if set to \"no\", just exec the real compiler\n"
         "   ICECC_VERSION              use a specific icecc environment, see icecc-create-env\n"
@@ -88,6 +92,8 @@ static void dcc_show_usage(void)
         "                              compiled on multiple hosts to ensure that they're\n"
         "                              producing the same output.  The default is 0.\n"
         "   ICECC_PREFERRED_HOST       overrides scheduler decisions if set.\n"
+        "   ICECC_OBJECT_CACHE         if set, results are looked up in and stored to the\n"
+        "                              object caches of the daemons (see iceccd --object-cache).\n"
         "   ICECC_CC                   set C compiler name (default gcc).\n"
         "   ICECC_CXX                  set C++ compiler name (default g++).\n"
         "   ICECC_CLANG_REMOTE_CPP     set to 1 or 0 to override remote preprocessing with clang\n"
@@ -180,18 +186,11 @@ static int create_native(char **args)
         extrafiles++;
     }
 
-    vector<char*> argv;
     struct stat st;
-
-    if (lstat(BINDIR "/icecc-create-env", &st)) {
-        log_error() << BINDIR "/icecc-create-env does not exist" << endl;
-        return 1;
-    }
-
-    argv.push_back(strdup(BINDIR "/icecc-create-env"));
+    string gcc, gpp, clang, compilerwrapper;
 
     if (is_clang) {
-        string clang = compiler_path_lookup("clang");
+        clang = compiler_path_lookup("clang");
 
         if (clang.empty()) {
             log_error() << "clang compiler not found" << endl;
@@ -203,12 +202,8 @@ static int create_native(char **args)
             return 1;
         }
 
-        argv.push_back(strdup("--clang"));
-        argv.push_back(strdup(clang.c_str()));
-        argv.push_back(strdup(PLIBDIR "/compilerwrapper"));
+        compilerwrapper = PLIBDIR "/compilerwrapper";
     } else { // "gcc" (default)
-        string gcc, gpp;
-
         // perhaps we're on gentoo
         if (!lstat("/usr/bin/gcc-config", &st)) {
             string gccpath = read_output("/usr/bin/gcc-config -B") + "/";
@@ -224,7 +219,31 @@ static int create_native(char **args)
             log_error() << "gcc compiler not found" << endl;
             return 1;
         }
+    }
+
+#ifdef HAVE_NATIVE_CREATE_ENV
+    list<string> extras;
+
+    for (int extracount = 0; extrafiles[extracount]; extracount++) {
+        extras.push_back(extrafiles[extracount]);
+    }
 
+    return create_env(gcc, gpp, clang, compilerwrapper, extras);
+#else
+    vector<char*> argv;
+
+    if (lstat(BINDIR "/icecc-create-env", &st)) {
+        log_error() << BINDIR "/icecc-create-env does not exist" << endl;
+        return 1;
+    }
+
+    argv.push_back(strdup(BINDIR "/icecc-create-env"));
+
+    if (is_clang) {
+        argv.push_back(strdup("--clang"));
+        argv.push_back(strdup(clang.c_str()));
+        argv.push_back(strdup(compilerwrapper.c_str()));
+    } else {
         argv.push_back(strdup("--gcc"));
         argv.push_back(strdup(gcc.c_str()));
         argv.push_back(strdup(gpp.c_str()));
@@ -238,6 +257,7 @@ static int create_native(char **args)
     argv.push_back(NULL);
 
     return execv(argv[0], argv.data());
+#endif
 }
 
 int main(int argc, char **argv)
@@ -291,6 +311,11 @@ int main(int argc, char **argv)
                 return create_native(argv + 2);
             }
 
+            if (arg == "--batch") {
+                dcc_ignore_sigpipe(1);
+                return build_batch(argv[0]);
+            }
+
             if (arg.size() > 0) {
                 job.setCompilerName(arg);
                 job.setCompilerPathname(arg);
@@ -387,22 +412,7 @@ int main(int argc, char **argv)
 
     MsgChannel *local_daemon;
     if (getenv("ICECC_TEST_SOCKET") == NULL) {
-        /* try several options to reach the local daemon - 3 sockets, one TCP */
-        local_daemon = Service::createChannel("/var/run/icecc/iceccd.socket");
-
-        if (!local_daemon) {
-            local_daemon = Service::createChannel("/var/run/iceccd.socket");
-        }
-
-        if (!local_daemon && getenv("HOME")) {
-            string path = getenv("HOME");
-            path += "/.iceccd.socket";
-            local_daemon = Service::createChannel(path);
-        }
-
-        if (!local_daemon) {
-            local_daemon = Service::createChannel("127.0.0.1", 10245, 0/*timeout*/);
-        }
+        local_daemon = connect_to_daemon();
     } else {
         local_daemon = Service::createChannel(getenv("ICECC_TEST_SOCKET"));
         if (!local_daemon) {
@@ -50,7 +50,8 @@
 #include <comm.h>
 #include "client.h"
 #include "tempfile.h"
-#include "md5.h"
+#include "hash.h"
+#include "platform.h"
 #include "services/util.h"
 
 #ifndef O_LARGEFILE
@@ -68,6 +69,19 @@ struct CharBufferDeleter {
     }
 };
 
+// also removes the file the buffer names, if any
+struct TempFileDeleter {
+    char *file;
+    TempFileDeleter(char *f) : file(f) {}
+    ~TempFileDeleter() {
+        if (file) {
+            unlink(file);
+        }
+
+        free(file);
+    }
+};
+
 }
 
 using namespace std;
@@ -250,63 +264,117 @@ static void check_for_failure(Msg *msg, MsgChannel *cserver)
     }
 }
 
+static void write_to_server_failed(int cpp_fd, MsgChannel *cserver)
+{
+    Msg *m = cserver->get_msg(2);
+    check_for_failure(m, cserver);
+
+    log_error() << "write of source chunk to host "
+                << cserver->name.c_str() << endl;
+    log_perror("failed ");
+    close(cpp_fd);
+    throw client_error(15, "Error 15 - write to host failed");
+}
+
+/* Chunks are sent as soon as the previous one is out, but not smaller than this
+   (unless it's the last one), to keep the per-message overhead low.  */
+#define MIN_CPP_CHUNK 16384
+
+/* Reading from cpp_fd goes on while the previous chunk is still being sent, so cpp,
+   compression and the network overlap instead of running in lockstep. At most one
+   chunk is being read and one queued for sending at any time.  */
 static void write_server_cpp(int cpp_fd, MsgChannel *cserver)
 {
     unsigned char buffer[100000]; // some random but huge number
-    off_t offset = 0;
+    size_t offset = 0;
     size_t uncompressed = 0;
     size_t compressed = 0;
+    bool input_done = false;
 
-    do {
-        ssize_t bytes;
+    for (;;) {
+        if (!cserver->has_queued_output() && offset
+                && (input_done || offset >= MIN_CPP_CHUNK)) {
+            FileChunkMsg fcmsg(buffer, offset);
 
-        do {
-            bytes = read(cpp_fd, buffer + offset, sizeof(buffer) - offset);
-
-            if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
-                continue;
+            if (!cserver->send_msg(fcmsg, MsgChannel::SendQueued)) {
+                write_to_server_failed(cpp_fd, cserver);
             }
 
-            if (bytes < 0) {
-                log_perror("reading from cpp_fd");
-                close(cpp_fd);
-                throw client_error(16, "Error 16 - error reading local cpp file");
-            }
+            uncompressed += fcmsg.len;
+            compressed += fcmsg.compressed;
+            offset = 0;
+        }
 
+        if (input_done && !offset && !cserver->has_queued_output()) {
             break;
-        } while (1);
+        }
 
-        offset += bytes;
+        fd_set rfds;
+        fd_set wfds;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        int max_fd = -1;
 
-        if (!bytes || offset == sizeof(buffer)) {
-            if (offset) {
-                FileChunkMsg fcmsg(buffer, offset);
+        if (!input_done && offset < sizeof(buffer)) {
+            FD_SET(cpp_fd, &rfds);
+            max_fd = cpp_fd;
+        }
 
-                if (!cserver->send_msg(fcmsg)) {
-                    Msg *m = cserver->get_msg(2);
-                    check_for_failure(m, cserver);
+        if (cserver->has_queued_output()) {
+            FD_SET(cserver->fd, &wfds);
+            max_fd = max(max_fd, cserver->fd);
+        }
 
-                    log_error() << "write of source chunk to host "
-                                << cserver->name.c_str() << endl;
-                    log_perror("failed ");
-                    close(cpp_fd);
-                    throw client_error(15, "Error 15 - write to host failed");
-                }
+        // like a blocking send, give up if nothing can be sent for 20 seconds
+        struct timeval tv;
+        tv.tv_sec = 20;
+        tv.tv_usec = 0;
+        int ret = select(max_fd + 1, &rfds, &wfds, NULL,
+                         cserver->has_queued_output() ? &tv : NULL);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0) {
+            log_perror("select in write_server_cpp()");
+            close(cpp_fd);
+            throw client_error(16, "Error 16 - error reading local cpp file");
+        }
+
+        if (ret == 0) {
+            write_to_server_failed(cpp_fd, cserver);
+        }
+
+        if (FD_ISSET(cserver->fd, &wfds) && !cserver->flush_queued()) {
+            write_to_server_failed(cpp_fd, cserver);
+        }
+
+        if (FD_ISSET(cpp_fd, &rfds)) {
+            ssize_t bytes = read(cpp_fd, buffer + offset, sizeof(buffer) - offset);
 
-                uncompressed += fcmsg.len;
-                compressed += fcmsg.compressed;
-                offset = 0;
+            if (bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+
+            if (bytes < 0) {
+                log_perror("reading from cpp_fd");
+                close(cpp_fd);
+                throw client_error(16, "Error 16 - error reading local cpp file");
             }
 
             if (!bytes) {
-                break;
+                input_done = true;
             }
+
+            offset += bytes;
         }
-    } while (1);
+    }
 
     if (compressed)
         trace() << "sent " << compressed << " bytes (" << (compressed * 100 / uncompressed) <<
-                "%)" << endl;
+                "% " << compression_name(cserver->compression()) << ", "
+                << cserver->compress_usec / 1000 << " ms compressing)" << endl;
 
     close(cpp_fd);
 }
@@ -343,6 +411,20 @@ static void receive_file(const string& output_file, MsgChannel* cserver)
             break;
         }
 
+        if (msg->type == M_FILE_BULK) {
+            uint32_t len = static_cast<FileBulkMsg*>(msg)->len;
+
+            if (!cserver->read_raw(obj_fd, 40)) {
+                unlink(tmp_file.c_str());
+                delete msg;
+                throw client_error(19, "Error 19 - (network failure?)");
+            }
+
+            compressed += len;
+            uncompressed += len;
+            continue;
+        }
+
         if (msg->type != M_FILE_CHUNK) {
             unlink(tmp_file.c_str());
             delete msg;
@@ -362,7 +444,8 @@ static void receive_file(const string& output_file, MsgChannel* cserver)
 
     if (uncompressed)
         trace() << "got " << compressed << " bytes ("
-                << (compressed * 100 / uncompressed) << "%)" << endl;
+                << (compressed * 100 / uncompressed) << "%, "
+                << cserver->decompress_usec / 1000 << " ms decompressing)" << endl;
 
     delete msg;
 
@@ -372,15 +455,237 @@ static void receive_file(const string& output_file, MsgChannel* cserver)
     }
 }
 
+/* Takes over a connection the local daemon made in advance, if it has one,
+   or connects on our own.  LOCAL_DAEMON is 0 if it can't be asked, because
+   others use the channel concurrently.  BORROWED tells whether the local
+   daemon wants to hear back about it, see return_connection().  */
+static MsgChannel *connect_to_server(const string &hostname, unsigned int port,
+                                     MsgChannel *local_daemon, bool &borrowed)
+{
+    borrowed = false;
+
+    if (local_daemon && IS_PROTOCOL_39(local_daemon)
+            && local_daemon->send_msg(GetConnectionMsg(hostname, port))) {
+        if (MsgChannel *cserver = Service::receiveChannel(local_daemon, 10)) {
+            borrowed = IS_PROTOCOL_40(local_daemon);
+            return cserver;
+        }
+    }
+
+    return Service::createChannel(hostname, port, 10);
+}
+
+/* Since protocol 40 the local daemon keeps the connection for further jobs,
+   if we read everything the server sent for ours.  */
+static void return_connection(MsgChannel *local_daemon, bool reusable)
+{
+    if (!local_daemon->send_msg(ReturnConnectionMsg(reusable))) {
+        log_warning() << "returning connection failed" << endl;
+    }
+}
+
+/* Reads what the job on HOSTNAME came to from CSERVER, prints what the
+   compiler printed if OUTPUT and puts the output files in place.  */
+static int receive_result(CompileJob &job, MsgChannel *cserver, const string &hostname, bool output)
+{
+    Msg *msg;
+    {
+        log_block wait_cs("wait for cs");
+        msg = cserver->get_msg(12 * 60);
+
+        if (!msg) {
+            throw client_error(14, "Error 14 - error reading message from remote");
+        }
+    }
+
+    check_for_failure(msg, cserver);
+
+    if (msg->type != M_COMPILE_RESULT) {
+        log_warning() << "waited for compile result, but got " << (char)msg->type << endl;
+        delete msg;
+        throw client_error(13, "Error 13 - did not get compile response message");
+    }
+
+    CompileResultMsg *crmsg = dynamic_cast<CompileResultMsg*>(msg);
+    assert(crmsg);
+
+    int status = crmsg->status;
+
+    if (status && crmsg->was_out_of_memory) {
+        delete crmsg;
+        log_info() << "the server ran out of memory, recompiling locally" << endl;
+        throw remote_error(101, "Error 101 - the server ran out of memory, recompiling locally");
+    }
+
+    if (output) {
+        if ((!crmsg->out.empty() || !crmsg->err.empty()) && output_needs_workaround(job)) {
+            delete crmsg;
+            log_info() << "command needs stdout/stderr workaround, recompiling locally" << endl;
+            throw remote_error(102, "Error 102 - command needs stdout/stderr workaround, recompiling locally");
+        }
+
+        ignore_result(write(STDOUT_FILENO, crmsg->out.c_str(), crmsg->out.size()));
+
+        if (colorify_wanted(job)) {
+            colorify_output(crmsg->err);
+        } else {
+            ignore_result(write(STDERR_FILENO, crmsg->err.c_str(), crmsg->err.size()));
+        }
+
+        if (status && (crmsg->err.length() || crmsg->out.length())) {
+            log_error() << "Compiled on " << hostname << endl;
+        }
+    }
+
+    bool have_dwo_file = crmsg->have_dwo_file;
+    delete crmsg;
+
+    assert(!job.outputFile().empty());
+
+    if (status == 0) {
+        receive_file(job.outputFile(), cserver);
+        if (have_dwo_file) {
+            string dwo_output = job.outputFile().substr(0, job.outputFile().find_last_of('.')) + ".dwo";
+            receive_file(dwo_output, cserver);
+        }
+    }
+
+    return status;
+}
+
+static bool get_cache_result(MsgChannel *cserver)
+{
+    Msg *msg = cserver->get_msg(60);
+    check_for_failure(msg, cserver);
+
+    if (!msg || msg->type != M_CACHE_RESULT) {
+        delete msg;
+        throw client_error(32, "Error 32 - did not get cache result message");
+    }
+
+    bool hit = static_cast<CacheResultMsg *>(msg)->hit;
+    delete msg;
+    return hit;
+}
+
+/* With a cache key the server tells first whether it has the result, then
+   it doesn't need the source.  */
+static bool cached_on_server(const CompileJob &job, MsgChannel *cserver)
+{
+    if (job.cacheKey().empty() || !IS_PROTOCOL_43(cserver)) {
+        return false;
+    }
+
+    return get_cache_result(cserver);
+}
+
+// the local daemon may have it in its object cache as well
+static bool cached_locally(CompileJob &job, MsgChannel *local_daemon, int &ret)
+{
+    if (!local_daemon->send_msg(CacheLookupMsg(job.cacheKey()))) {
+        throw client_error(32, "Error 32 - asking for cached result failed");
+    }
+
+    if (!get_cache_result(local_daemon)) {
+        return false;
+    }
+
+    trace() << "result is in the object cache of the local daemon" << endl;
+    ret = receive_result(job, local_daemon, "localhost", true);
+    return true;
+}
+
+// how much of a manifest goes into one message, they are limited to 1 MB
+#define MANIFEST_CHUNK (256 * 1024)
+
+/* Lists the files of the environment for the remote, which links what it
+   has of them from its store.  MISSING gets what it still needs.  Returns
+   false if the remote wants the whole tarball.  */
+static bool send_env_manifest(const CompileJob &job, MsgChannel *cserver,
+                              const list<EnvManifestFile> &files, set<string> &missing)
+{
+    list<EnvManifestFile>::const_iterator it = files.begin();
+
+    while (it != files.end()) {
+        EnvManifestMsg msg(job.targetPlatform(), job.environmentVersion());
+        size_t bytes = 0;
+
+        for (; it != files.end() && bytes < MANIFEST_CHUNK; ++it) {
+            msg.paths.push_back(it->path);
+            msg.blobs.push_back(it->blob);
+            bytes += it->path.size() + it->blob.size() + 8;
+        }
+
+        if (!cserver->send_msg(msg)) {
+            throw client_error(6, "Error 6 - send environment to remove failed");
+        }
+
+        Msg *answer = cserver->get_msg(60);
+
+        if (!answer || answer->type != M_ENV_MISSING) {
+            delete answer;
+            throw client_error(33, "Error 33 - did not get answer to environment manifest");
+        }
+
+        EnvMissingMsg *missing_msg = static_cast<EnvMissingMsg *>(answer);
+        bool ok = missing_msg->ok;
+        missing.insert(missing_msg->blobs.begin(), missing_msg->blobs.end());
+        delete answer;
+
+        if (!ok) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Has the remote get the environment from daemons that have it already,
+   instead of sending it from here.  They are usually closer to it than
+   this host.  Returns whether it got it.  */
+static bool fetched_from_peers(const CompileJob &job, MsgChannel *cserver,
+                               const list<string> &peers)
+{
+    if (peers.empty() || !IS_PROTOCOL_45(cserver)) {
+        return false;
+    }
+
+    log_block b("Fetch Environment");
+
+    if (!cserver->send_msg(EnvFetchMsg(job.targetPlatform(), job.environmentVersion(), peers))) {
+        throw client_error(6, "Error 6 - send environment to remove failed");
+    }
+
+    Msg *msg = cserver->get_msg(120);
+
+    if (!msg || msg->type != M_VERIFY_ENV_RESULT) {
+        delete msg;
+        throw client_error(25, "Error 25 - other error verifying enviornment on remote");
+    }
+
+    bool ok = static_cast<VerifyEnvResultMsg *>(msg)->ok;
+    delete msg;
+    trace() << (ok ? "remote fetched the environment from " : "remote could not fetch it from ")
+            << peers.size() << " peers" << endl;
+    return ok;
+}
+
 static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_daemon,
                             const string &environment, const string &version_file,
-                            const char *preproc_file, bool output)
+                            const char *preproc_file, bool output, bool exclusive)
 {
     string hostname = usecs->hostname;
     unsigned int port = usecs->port;
     int job_id = usecs->job_id;
     bool got_env = usecs->got_env;
     job.setJobID(job_id);
+
+    if (!job.cacheKey().empty() && job.environmentVersion() != environment) {
+        string digest = preproc_file ? sha256_file(preproc_file) : string();
+        job.setEnvironmentVersion(environment);
+        job.setCacheKey(digest.empty() ? string() : object_cache_key(job, digest));
+    }
+
     job.setEnvironmentVersion(environment);   // hoping on the scheduler's wisdom
     trace() << "Have to use host " << hostname << ":" << port << " - Job ID: "
             << job.jobID() << " - env: " << usecs->host_platform
@@ -391,9 +696,10 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
     int status = 255;
 
     MsgChannel *cserver = 0;
+    bool borrowed = false;
 
     try {
-        cserver = Service::createChannel(hostname, port, 10);
+        cserver = connect_to_server(hostname, port, exclusive ? local_daemon : 0, borrowed);
 
         if (!cserver) {
             log_error() << "no server found behind given hostname " << hostname << ":"
@@ -401,6 +707,10 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             throw client_error(2, "Error 2 - no server found at " + hostname);
         }
 
+        if (!got_env && fetched_from_peers(job, cserver, usecs->env_peers)) {
+            got_env = true;
+        }
+
         if (!got_env) {
             log_block b("Transfer Environment");
             // transfer env
@@ -411,13 +721,41 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
                 throw client_error(4, "Error 4 - unable to stat version file");
             }
 
+            list<EnvManifestFile> files;
+            set<string> missing;
+            bool delta = IS_PROTOCOL_44(cserver) && env_manifest(version_file, files)
+                         && send_env_manifest(job, cserver, files, missing);
+
+            if (delta) {
+                uint64_t missing_size = 0;
+
+                for (list<EnvManifestFile>::const_iterator it = files.begin(); it != files.end(); ++it) {
+                    if (missing.count(it->blob)) {
+                        missing_size += it->size;
+                    }
+                }
+
+                /* What is missing goes uncompressed into the tarball, so the
+                   compressed whole one can be smaller.  */
+                delta = missing_size < (uint64_t) buf.st_size;
+                trace() << "remote misses " << missing.size() << " of " << files.size()
+                        << " files, " << missing_size << " bytes" << endl;
+            }
+
             EnvTransferMsg msg(job.targetPlatform(), job.environmentVersion());
 
             if (!cserver->send_msg(msg)) {
                 throw client_error(6, "Error 6 - send environment to remove failed");
             }
 
-            int env_fd = open(version_file.c_str(), O_RDONLY);
+            int env_fd = -1;
+            pid_t delta_pid = -1;
+
+            if (delta) {
+                delta_pid = write_env_delta(version_file, files, missing, env_fd);
+            } else {
+                env_fd = open(version_file.c_str(), O_RDONLY);
+            }
 
             if (env_fd < 0) {
                 throw client_error(5, "Error 5 - unable to open version file:\n\t" + version_file);
@@ -425,6 +763,18 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
 
             write_server_cpp(env_fd, cserver);
 
+            if (delta_pid > 0) {
+                int status = 1;
+
+                while (waitpid(delta_pid, &status, 0) < 0 && errno == EINTR) {}
+
+                // without the end the remote throws away what it got
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    log_error() << "writing environment delta failed" << endl;
+                    throw client_error(8, "Error 8 - write enviornment to remote failed");
+                }
+            }
+
             if (!cserver->send_msg(EndMsg())) {
                 log_error() << "write of environment failed" << endl;
                 throw client_error(8, "Error 8 - write enviornment to remote failed");
@@ -448,7 +798,12 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
                                    << endl;
                         BlacklistHostEnvMsg blacklist(job.targetPlatform(),
                                                       job.environmentVersion(), hostname);
-                        local_daemon->send_msg(blacklist);
+
+                        // jobs of a batch don't talk to the daemon
+                        if (local_daemon) {
+                            local_daemon->send_msg(blacklist);
+                        }
+
                         throw client_error(24, "Error 24 - remote " + hostname + " unable to handle environment");
                     } else
                         trace() << "Verified host " << hostname << " for environment "
@@ -475,7 +830,11 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             }
         }
 
-        if (!preproc_file) {
+        bool cached = cached_on_server(job, cserver);
+
+        if (cached) {
+            trace() << "result is in the object cache of " << hostname << endl;
+        } else if (!preproc_file) {
             int sockets[2];
 
             if (pipe(sockets)) {
@@ -507,6 +866,11 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             if (shell_exit_status(status) != 0) {   // failure
                 delete cserver;
                 cserver = 0;
+
+                if (borrowed) {
+                    return_connection(local_daemon, false);
+                }
+
                 return shell_exit_status(status);
             }
         } else {
@@ -520,72 +884,12 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             write_server_cpp(cpp_fd, cserver);
         }
 
-        if (!cserver->send_msg(EndMsg())) {
+        if (!cached && !cserver->send_msg(EndMsg())) {
             log_info() << "write of end failed" << endl;
             throw client_error(12, "Error 12 - failed to send file to remote");
         }
 
-        Msg *msg;
-        {
-            log_block wait_cs("wait for cs");
-            msg = cserver->get_msg(12 * 60);
-
-            if (!msg) {
-                throw client_error(14, "Error 14 - error reading message from remote");
-            }
-        }
-
-        check_for_failure(msg, cserver);
-
-        if (msg->type != M_COMPILE_RESULT) {
-            log_warning() << "waited for compile result, but got " << (char)msg->type << endl;
-            delete msg;
-            throw client_error(13, "Error 13 - did not get compile response message");
-        }
-
-        CompileResultMsg *crmsg = dynamic_cast<CompileResultMsg*>(msg);
-        assert(crmsg);
-
-        status = crmsg->status;
-
-        if (status && crmsg->was_out_of_memory) {
-            delete crmsg;
-            log_info() << "the server ran out of memory, recompiling locally" << endl;
-            throw remote_error(101, "Error 101 - the server ran out of memory, recompiling locally");
-        }
-
-        if (output) {
-            if ((!crmsg->out.empty() || !crmsg->err.empty()) && output_needs_workaround(job)) {
-                delete crmsg;
-                log_info() << "command needs stdout/stderr workaround, recompiling locally" << endl;
-                throw remote_error(102, "Error 102 - command needs stdout/stderr workaround, recompiling locally");
-            }
-
-            ignore_result(write(STDOUT_FILENO, crmsg->out.c_str(), crmsg->out.size()));
-
-            if (colorify_wanted(job)) {
-                colorify_output(crmsg->err);
-            } else {
-                ignore_result(write(STDERR_FILENO, crmsg->err.c_str(), crmsg->err.size()));
-            }
-
-            if (status && (crmsg->err.length() || crmsg->out.length())) {
-                log_error() << "Compiled on " << hostname << endl;
-            }
-        }
-
-        bool have_dwo_file = crmsg->have_dwo_file;
-        delete crmsg;
-
-        assert(!job.outputFile().empty());
-
-        if (status == 0) {
-            receive_file(job.outputFile(), cserver);
-            if (have_dwo_file) {
-                string dwo_output = job.outputFile().substr(0, job.outputFile().find_last_of('.')) + ".dwo";
-                receive_file(dwo_output, cserver);
-            }
-        }
+        status = receive_result(job, cserver, hostname, output);
 
     } catch (...) {
         // Handle pending status messages, if any.
@@ -600,52 +904,45 @@ static int build_remote_int(CompileJob &job, UseCSMsg *usecs, MsgChannel *local_
             cserver = 0;
         }
 
+        if (borrowed) {
+            return_connection(local_daemon, false);
+        }
+
         throw;
     }
 
+    if (borrowed) {
+        return_connection(local_daemon, cserver->is_idle());
+    }
+
     delete cserver;
     return status;
 }
 
-static string
-md5_for_file(const string & file)
+/* Fills MSG with what the local compile of JOB took, RU of the compiler
+   and REAL_MSEC in all.  */
+void local_job_stats(JobDoneMsg &msg, const CompileJob &job, const struct rusage &ru,
+                     unsigned int real_msec)
 {
-    md5_state_t state;
-    string result;
+    msg.real_msec = real_msec;
 
-    md5_init(&state);
-    FILE *f = fopen(file.c_str(), "rb");
+    struct stat st;
 
-    if (!f) {
-        return result;
+    msg.out_uncompressed = 0;
+    if (!stat(job.outputFile().c_str(), &st)) {
+        msg.out_uncompressed += st.st_size;
     }
-
-    md5_byte_t buffer[40000];
-
-    while (true) {
-        size_t size = fread(buffer, 1, 40000, f);
-
-        if (!size) {
-            break;
-        }
-
-        md5_append(&state, buffer, size);
+    if (!stat((job.outputFile().substr(0, job.outputFile().find_last_of('.')) + ".dwo").c_str(), &st)) {
+        msg.out_uncompressed += st.st_size;
     }
 
-    fclose(f);
+    msg.user_msec = ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000;
+    msg.sys_msec = ru.ru_stime.tv_sec * 1000 + ru.ru_stime.tv_usec / 1000;
+    msg.pfaults = ru.ru_majflt + ru.ru_minflt + ru.ru_nswap;
 
-    md5_byte_t digest[16];
-    md5_finish(&state, digest);
-
-    char digest_cache[33];
-
-    for (int di = 0; di < 16; ++di) {
-        sprintf(digest_cache + di * 2, "%02x", digest[di]);
+    if (msg.user_msec > 50 && msg.out_uncompressed > 1024) {
+        trace() << "speed=" << float(msg.out_uncompressed / msg.user_msec) << endl;
     }
-
-    digest_cache[32] = 0;
-    result = digest_cache;
-    return result;
 }
 
 static bool
@@ -682,28 +979,8 @@ maybe_build_local(MsgChannel *local_daemon, UseCSMsg *usecs, CompileJob &job,
 
         // filling the stats, so the daemon can play proxy for us
         JobDoneMsg msg(job_id, ret, JobDoneMsg::FROM_SUBMITTER);
-
-        msg.real_msec = (endtv.tv_sec - begintv.tv_sec) * 1000 + (endtv.tv_usec - begintv.tv_usec) / 1000;
-
-        struct stat st;
-
-        msg.out_uncompressed = 0;
-        if (!stat(job.outputFile().c_str(), &st)) {
-            msg.out_uncompressed += st.st_size;
-        }
-        if (!stat((job.outputFile().substr(0, job.outputFile().find_last_of('.')) + ".dwo").c_str(), &st)) {
-            msg.out_uncompressed += st.st_size;
-        }
-
-        msg.user_msec = ru.ru_utime.tv_sec * 1000 + ru.ru_utime.tv_usec / 1000;
-        msg.sys_msec = ru.ru_stime.tv_sec * 1000 + ru.ru_stime.tv_usec / 1000;
-        msg.pfaults = ru.ru_majflt + ru.ru_minflt + ru.ru_nswap;
-        msg.exitcode = ret;
-
-        if (msg.user_msec > 50 && msg.out_uncompressed > 1024) {
-            trace() << "speed=" << float(msg.out_uncompressed / msg.user_msec) << endl;
-        }
-
+        local_job_stats(msg, job, ru,
+                        (endtv.tv_sec - begintv.tv_sec) * 1000 + (endtv.tv_usec - begintv.tv_usec) / 1000);
         return local_daemon->send_msg(msg);
     }
 
@@ -719,6 +996,73 @@ static int minimalRemoteVersion( const CompileJob& )
     return version;
 }
 
+/* A cheap hint for the scheduler how big the job is, the preprocessed
+   source isn't there yet when asking for a server.  */
+unsigned int input_size(const CompileJob &job)
+{
+    struct stat st;
+
+    if (stat(job.inputFile().c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+
+    return st.st_size;
+}
+
+/* Runs the preprocessor for JOB into a new temporary file, PREPROC is set to
+   its name.  Returns the exit status of the preprocessor.  */
+static int preprocess_to_file(CompileJob &job, char **preproc)
+{
+    dcc_make_tmpnam("icecc", ".ix", preproc, 0);
+    int cpp_fd = open(*preproc, O_WRONLY);
+    /* When call_cpp returns normally (for the parent) it will have closed
+       the write fd, i.e. cpp_fd.  */
+    pid_t cpp_pid = call_cpp(job, cpp_fd);
+
+    if (cpp_pid == -1) {
+        ::unlink(*preproc);
+        throw client_error(10, "Error 10 - (unable to fork process?)");
+    }
+
+    int status = 255;
+    waitpid(cpp_pid, &status, 0);
+    return shell_exit_status(status);
+}
+
+/* Asks LOCAL_DAEMON for servers for all of JOBS at once, which have the
+   compiler, target, language and flags of the first in common.  The
+   answers come in any order, for build_batch_job().  */
+bool ask_for_batch(MsgChannel *local_daemon, const vector<const CompileJob *> &jobs,
+                   const Environments &_envs)
+{
+    map<string, string> versionfile_map, version_map;
+    Environments envs = rip_out_paths(_envs, version_map, versionfile_map);
+    const CompileJob &first = *jobs.front();
+    const char *preferred_host = getenv("ICECC_PREFERRED_HOST");
+
+    GetCSMsg getcs(envs, string(), first.language(), 1, first.targetPlatform(),
+                   first.argumentFlags(), preferred_host ? preferred_host : string(),
+                   minimalRemoteVersion(first));
+
+    for (vector<const CompileJob *>::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        getcs.batch.push_back(make_pair(get_absfilename((*it)->inputFile()), input_size(**it)));
+    }
+
+    return local_daemon->send_msg(getcs);
+}
+
+/* Compiles JOB of a batch on the server the daemon told in USECS, in a
+   child of the batch that leaves talking to the daemon to its parent.  */
+int build_batch_job(CompileJob &job, UseCSMsg *usecs, const Environments &_envs)
+{
+    map<string, string> versionfile_map, version_map;
+    rip_out_paths(_envs, version_map, versionfile_map);
+
+    remote_daemon = usecs->hostname;
+    return build_remote_int(job, usecs, 0, version_map[usecs->host_platform],
+                            versionfile_map[usecs->host_platform], 0, true, false);
+}
+
 int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &_envs, int permill)
 {
     srand(time(0) + getpid());
@@ -766,10 +1110,45 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
 
         fake_filename += get_absfilename(job.inputFile());
 
+        /* For the object cache the source has to be preprocessed before
+           asking anybody, instead of while sending it.  */
+        char *preproc = 0;
+
+        if (getenv("ICECC_OBJECT_CACHE") && IS_PROTOCOL_43(local_daemon)) {
+            int cpp_status = preprocess_to_file(job, &preproc);
+
+            if (cpp_status) {
+                ::unlink(preproc);
+                free(preproc);
+                return cpp_status;
+            }
+        }
+
+        const TempFileDeleter preproc_holder(preproc);
+
+        if (preproc) {
+            int ret;
+            string digest = sha256_file(preproc);
+
+            /* The key is for the environment of this host, the one it most
+               likely gets compiled in, build_remote_int() redoes it for
+               another one.  */
+            map<string, string>::const_iterator env = version_map.find(determine_platform());
+            job.setEnvironmentVersion(env != version_map.end() ? env->second
+                                      : version_map[envs.front().first]);
+            job.setCacheKey(digest.empty() ? string() : object_cache_key(job, digest));
+
+            if (!job.cacheKey().empty() && cached_locally(job, local_daemon, ret)) {
+                return ret;
+            }
+        }
+
         GetCSMsg getcs(envs, fake_filename, job.language(), torepeat,
                        job.targetPlatform(), job.argumentFlags(),
                        preferred_host ? preferred_host : string(),
                        minimalRemoteVersion(job));
+        getcs.input_size = input_size(job);
+        getcs.cache_key = job.cacheKey();
 
         if (!local_daemon->send_msg(getcs)) {
             log_warning() << "asked for CS" << endl;
@@ -783,30 +1162,18 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
             ret = build_remote_int(job, usecs, local_daemon,
                                    version_map[usecs->host_platform],
                                    versionfile_map[usecs->host_platform],
-                                   0, true);
+                                   preproc, true, true);
 
         delete usecs;
         return ret;
     } else {
         char *preproc = 0;
-        dcc_make_tmpnam("icecc", ".ix", &preproc, 0);
+        int status = preprocess_to_file(job, &preproc);
         const CharBufferDeleter preproc_holder(preproc);
-        int cpp_fd = open(preproc, O_WRONLY);
-        /* When call_cpp returns normally (for the parent) it will have closed
-           the write fd, i.e. cpp_fd.  */
-        pid_t cpp_pid = call_cpp(job, cpp_fd);
-
-        if (cpp_pid == -1) {
-            ::unlink(preproc);
-            throw client_error(10, "Error 10 - (unable to fork process?)");
-        }
 
-        int status = 255;
-        waitpid(cpp_pid, &status, 0);
-
-        if (shell_exit_status(status)) {   // failure
+        if (status) {   // failure
             ::unlink(preproc);
-            return shell_exit_status(status);
+            return status;
         }
 
         char rand_seed[400]; // "designed to be oversized" (Levi's)
@@ -817,7 +1184,7 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
                        job.targetPlatform(), job.argumentFlags(),
                        preferred_host ? preferred_host : string(),
                        minimalRemoteVersion(job));
-
+        getcs.input_size = input_size(job);
 
         if (!local_daemon->send_msg(getcs)) {
             log_warning() << "asked for CS" << endl;
@@ -868,7 +1235,7 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
                                   jobs[i], umsgs[i], local_daemon,
                                   version_map[umsgs[i]->host_platform],
                                   versionfile_map[umsgs[i]->host_platform],
-                                  preproc, i == 0);
+                                  preproc, i == 0, false);
                 } catch (std::exception& error) {
                     log_info() << "build_remote_int failed and has thrown " << error.what() << endl;
                     kill(getpid(), SIGTERM);
@@ -900,7 +1267,7 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
         }
 
         if (!misc_error) {
-            string first_md5 = md5_for_file(jobs[0].outputFile());
+            string first_hash = hash_file(jobs[0].outputFile());
 
             for (int i = 1; i < torepeat; i++) {
                 if (!exit_codes[0]) {   // if the first failed, we fail anyway
@@ -921,14 +1288,14 @@ int build_remote(CompileJob &job, MsgChannel *local_daemon, const Environments &
                         break;
                     }
 
-                    string other_md5 = md5_for_file(jobs[i].outputFile());
+                    string other_hash = hash_file(jobs[i].outputFile());
 
-                    if (other_md5 != first_md5) {
+                    if (other_hash != first_hash) {
                         log_error() << umsgs[i]->hostname << " compiled "
-                                    << jobs[0].outputFile() << " with md5 sum " << other_md5
+                                    << jobs[0].outputFile() << " with hash " << other_hash
                                     << "(" << jobs[i].outputFile() << ")" << " and "
-                                    << umsgs[0]->hostname << " compiled with md5 sum "
-                                    << first_md5 << " - aborting!\n";
+                                    << umsgs[0]->hostname << " compiled with hash "
+                                    << first_hash << " - aborting!\n";
                         rename(jobs[0].outputFile().c_str(),
                                (jobs[0].outputFile() + ".caught").c_str());
                         rename(preproc, (string(preproc) + ".caught").c_str());
@@ -49,6 +49,28 @@ using namespace std;
 extern bool explicit_color_diagnostics;
 extern bool explicit_no_show_caret;
 
+/* Tries the places the local daemon may listen on: three sockets, then TCP.  */
+MsgChannel *connect_to_daemon()
+{
+    MsgChannel *local_daemon = Service::createChannel("/var/run/icecc/iceccd.socket");
+
+    if (!local_daemon) {
+        local_daemon = Service::createChannel("/var/run/iceccd.socket");
+    }
+
+    if (!local_daemon && getenv("HOME")) {
+        string path = getenv("HOME");
+        path += "/.iceccd.socket";
+        local_daemon = Service::createChannel(path);
+    }
+
+    if (!local_daemon) {
+        local_daemon = Service::createChannel("127.0.0.1", 10245, 0/*timeout*/);
+    }
+
+    return local_daemon;
+}
+
 /**
  * Set the `FD_CLOEXEC' flag of DESC if VALUE is nonzero,
  * or clear the flag if VALUE is 0.
@@ -130,7 +152,7 @@ string find_prefix(const string &basename)
  * @retval 0 if we got the lock
  * @retval -1 with errno set if the file is already locked.
  **/
-static int sys_lock(int fd, bool block)
+int sys_lock(int fd, bool block)
 {
 #if defined(F_SETLK)
     struct flock lockparam;
@@ -184,21 +206,38 @@ static bool dcc_open_lockfile(const string &fname, int &plockfd)
     return true;
 }
 
-bool dcc_lock_host(int &lock_fd)
+/**
+ * The directory for the state shared by the icecc processes of the user,
+ * created if needed.
+ *
+ * @return an empty string if it can't be created
+ **/
+string dcc_user_dir()
 {
-    string fname = "/tmp/.icecream-";
+    string dir = "/tmp/.icecream-";
     struct passwd *pwd = getpwuid(getuid());
 
     if (pwd) {
-        fname += pwd->pw_name;
+        dir += pwd->pw_name;
     } else {
         char buffer[10];
         sprintf(buffer, "%ld", (long)getuid());
-        fname += buffer;
+        dir += buffer;
     }
 
-    if (mkdir(fname.c_str(), 0700) && errno != EEXIST) {
+    if (mkdir(dir.c_str(), 0700) && errno != EEXIST) {
         log_perror("mkdir");
+        return string();
+    }
+
+    return dir;
+}
+
+bool dcc_lock_host(int &lock_fd)
+{
+    string fname = dcc_user_dir();
+
+    if (fname.empty()) {
         return false;
     }
 
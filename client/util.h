@@ -23,8 +23,10 @@
 #include <string>
 
 class CompileJob;
+class MsgChannel;
 
 /* util.c */
+extern MsgChannel *connect_to_daemon();
 extern int set_cloexec_flag(int desc, int value);
 extern int dcc_ignore_sigpipe(int val);
 
@@ -37,5 +39,7 @@ extern bool output_needs_workaround(const CompileJob &job);
 extern bool ignore_unverified();
 extern int resolve_link(const std::string &file, std::string &resolved);
 
+extern int sys_lock(int fd, bool block);
+extern std::string dcc_user_dir();
 extern bool dcc_unlock(int lock_fd);
 extern bool dcc_lock_host(int &lock_fd);
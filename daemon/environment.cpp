@@ -32,12 +32,14 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <set>
 #ifdef HAVE_SIGNAL_H
 #include <signal.h>
 #endif
 
 #include "comm.h"
 #include "exitcode.h"
+#include "hash.h"
 #include "util.h"
 
 using namespace std;
@@ -86,7 +88,9 @@ static bool extract_version(string &version)
 }
 #endif
 
-size_t sumup_dir(const string &dir)
+/* The size of the files in DIR, with UNSHARED_ONLY only of the ones not
+   hardlinked elsewhere, which is what removing it frees.  */
+size_t sumup_dir(const string &dir, bool unshared_only = false)
 {
     size_t res = 0;
     DIR *envdir = opendir(dir.c_str());
@@ -110,8 +114,8 @@ size_t sumup_dir(const string &dir)
         }
 
         if (S_ISDIR(st.st_mode)) {
-            res += sumup_dir(tdir + ent->d_name);
-        } else if (S_ISREG(st.st_mode)) {
+            res += sumup_dir(tdir + ent->d_name, unshared_only);
+        } else if (S_ISREG(st.st_mode) && (!unshared_only || st.st_nlink == 1)) {
             res += st.st_size;
         }
 
@@ -122,6 +126,191 @@ size_t sumup_dir(const string &dir)
     return res;
 }
 
+/* All environments keep their files in one store under the base dir, by
+   content and mode, and have hardlinks to them in their tree.  So what
+   different environments share, like the assembler, the libc and often
+   the compiler itself, is only once on the disk and in the page cache.  */
+string store_dir(const string &basedir)
+{
+    return basedir + "/store";
+}
+
+// the name of the blob of each file in STORE
+void store_blobs(const string &store, StoreBlobs &blobs)
+{
+    DIR *dir = opendir(store.c_str());
+
+    if (!dir) {
+        return;
+    }
+
+    for (struct dirent *sub = readdir(dir); sub; sub = readdir(dir)) {
+        if (sub->d_name[0] == '.') {
+            continue;
+        }
+
+        string subdir = store + "/" + sub->d_name;
+        DIR *entries = opendir(subdir.c_str());
+
+        if (!entries) {
+            continue;
+        }
+
+        for (struct dirent *ent = readdir(entries); ent; ent = readdir(entries)) {
+            struct stat st;
+
+            if (ent->d_name[0] != '.' && lstat((subdir + "/" + ent->d_name).c_str(), &st) == 0) {
+                blobs[make_pair(st.st_dev, st.st_ino)] = ent->d_name;
+            }
+        }
+
+        closedir(entries);
+    }
+
+    closedir(dir);
+}
+
+/* Replaces the regular files in DIR by hardlinks to the ones with the same
+   content in STORE, adding those that aren't there yet.  The files lose
+   their write permissions and become ours, they are not just this
+   environment's anymore.
+   Files that are STORED already (linked in from a manifest) are left alone.
+   Returns the size of what wasn't on the disk before.  */
+static size_t store_files(const string &store, const string &dir, const StoreBlobs &stored)
+{
+    size_t res = 0;
+    DIR *envdir = opendir(dir.c_str());
+
+    if (!envdir) {
+        return res;
+    }
+
+    string tdir = dir + "/";
+
+    for (struct dirent *ent = readdir(envdir); ent; ent = readdir(envdir)) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+
+        string file = tdir + ent->d_name;
+        struct stat st;
+
+        if (lstat(file.c_str(), &st)) {
+            log_perror("stat");
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            res += store_files(store, file, stored);
+            continue;
+        }
+
+        if (!S_ISREG(st.st_mode)
+                || (st.st_nlink > 1 && stored.count(make_pair(st.st_dev, st.st_ino)))) {
+            continue;
+        }
+
+        /* tar ran as the compile user, who must not be able to change what
+           other environments use, so it's ours before it gets hashed.  No
+           setuid bits on what is ours.  */
+        mode_t mode = st.st_mode & 0555;
+
+        if (lchown(file.c_str(), geteuid(), getegid()) != 0 || chmod(file.c_str(), mode) != 0) {
+            log_perror("protect store file");
+            res += st.st_size;
+            continue;
+        }
+
+        /* Other environments get linked to the blob by its name, so the
+           name must not be one another file can be made to have.  */
+        string hash = sha256_file(file);
+
+        if (hash.empty()) {
+            res += st.st_size;
+            continue;
+        }
+
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), "-%04o", (unsigned int) mode);
+        string blobdir = store + "/" + hash.substr(0, 2);
+        string blob = blobdir + "/" + hash + suffix;
+        struct stat bst;
+
+        if (lstat(blob.c_str(), &bst) == 0) {
+            // one the tarball had as hardlink to another
+            if (bst.st_ino == st.st_ino && bst.st_dev == st.st_dev) {
+                continue;
+            }
+
+            string tmp = file + ".icecc-link";
+
+            if (bst.st_size == st.st_size && link(blob.c_str(), tmp.c_str()) == 0) {
+                if (rename(tmp.c_str(), file.c_str()) == 0) {
+                    continue;
+                }
+
+                unlink(tmp.c_str());
+            }
+
+            res += st.st_size;
+            continue;
+        }
+
+        res += st.st_size;
+
+        if (mkdir(blobdir.c_str(), 0700) && errno != EEXIST) {
+            log_perror("mkdir store");
+            continue;
+        }
+
+        if (link(file.c_str(), blob.c_str()) != 0) {
+            trace() << "can't store " << file << ": " << strerror(errno) << endl;
+        }
+    }
+
+    closedir(envdir);
+    return res;
+}
+
+// removes what no environment links to anymore, returns its size
+static size_t sweep_store(const string &store)
+{
+    size_t res = 0;
+    DIR *dir = opendir(store.c_str());
+
+    if (!dir) {
+        return res;
+    }
+
+    for (struct dirent *sub = readdir(dir); sub; sub = readdir(dir)) {
+        if (sub->d_name[0] == '.') {
+            continue;
+        }
+
+        string subdir = store + "/" + sub->d_name;
+        DIR *entries = opendir(subdir.c_str());
+
+        if (!entries) {
+            continue;
+        }
+
+        for (struct dirent *ent = readdir(entries); ent; ent = readdir(entries)) {
+            string blob = subdir + "/" + ent->d_name;
+            struct stat st;
+
+            if (ent->d_name[0] != '.' && lstat(blob.c_str(), &st) == 0
+                    && S_ISREG(st.st_mode) && st.st_nlink == 1 && unlink(blob.c_str()) == 0) {
+                res += st.st_size;
+            }
+        }
+
+        closedir(entries);
+    }
+
+    closedir(dir);
+    return res;
+}
+
 static void list_target_dirs(const string &current_target, const string &targetdir, Environments &envs)
 {
     DIR *envdir = opendir(targetdir.c_str());
@@ -225,6 +414,12 @@ bool cleanup_cache(const string &basedir, uid_t user_uid, gid_t user_gid)
         return false;
     }
 
+    // only we need to get at it, the environments have their own links
+    if (mkdir(store_dir(basedir).c_str(), 0700) && errno != EEXIST) {
+        log_perror("mkdir of the environment store failed");
+        return false;
+    }
+
     return true;
 }
 
@@ -441,14 +636,11 @@ size_t finish_create_env(int pipe, const string &basedir, string &native_environ
 }
 
 
-pid_t start_install_environment(const std::string &basename, const std::string &target,
-                                const std::string &name, MsgChannel *c,
-                                int &pipe_to_stdin, FileChunkMsg *&fmsg,
-                                uid_t user_uid, gid_t user_gid)
+bool valid_env_name(const string &name)
 {
     if (!name.size()) {
         log_error() << "illegal name for environment " << name << endl;
-        return 0;
+        return false;
     }
 
     for (string::size_type i = 0; i < name.size(); ++i) {
@@ -457,6 +649,162 @@ pid_t start_install_environment(const std::string &basename, const std::string &
         }
 
         log_error() << "illegal char '" << name[i] << "' - rejecting environment " << name << endl;
+        return false;
+    }
+
+    return true;
+}
+
+// creates DIRNAME/NAME for the user, fails if it exists
+bool create_env_dir(const string &dirname, const string &name, uid_t user_uid, gid_t user_gid)
+{
+    if (mkdir(dirname.c_str(), 0770) && errno != EEXIST) {
+        log_perror("mkdir target");
+        return false;
+    }
+
+    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
+        log_perror("chown,chmod target");
+        return false;
+    }
+
+    string envdir = dirname + "/" + name;
+
+    if (mkdir(envdir.c_str(), 0770)) {
+        log_perror("mkdir name");
+        return false;
+    }
+
+    if (chown(envdir.c_str(), user_uid, user_gid) || chmod(envdir.c_str(), 0770)) {
+        log_perror("chown,chmod name");
+        return false;
+    }
+
+    return true;
+}
+
+// relative, without any . or .. in it
+bool valid_manifest_path(const string &path)
+{
+    if (path.empty() || path[0] == '/') {
+        return false;
+    }
+
+    string::size_type start = 0;
+
+    while (start <= path.size()) {
+        string::size_type end = path.find('/', start);
+
+        if (end == string::npos) {
+            end = path.size();
+        }
+
+        string part = path.substr(start, end - start);
+
+        if (part.empty() || part == "." || part == "..") {
+            return false;
+        }
+
+        start = end + 1;
+    }
+
+    return true;
+}
+
+bool make_parent_dirs(const string &envdir, const string &path, uid_t user_uid, gid_t user_gid)
+{
+    // the directories get their real permissions from the tarball later, if any
+    for (string::size_type slash = path.find('/'); slash != string::npos;
+            slash = path.find('/', slash + 1)) {
+        string dir = envdir + "/" + path.substr(0, slash);
+
+        if (mkdir(dir.c_str(), 0755) == 0) {
+            ignore_result(chown(dir.c_str(), user_uid, user_gid));
+        } else if (errno != EEXIST) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+string store_blob(const string &store, const string &blob)
+{
+    if (blob.size() < 3 || blob.find_first_not_of("0123456789abcdef-") != string::npos) {
+        return string();
+    }
+
+    return store + "/" + blob.substr(0, 2) + "/" + blob;
+}
+
+bool link_from_store(const string &store, const string &blob, const string &envdir,
+                     const string &path, uid_t user_uid, gid_t user_gid)
+{
+    string source = store_blob(store, blob);
+    struct stat st;
+
+    if (source.empty() || !valid_manifest_path(path)
+            || lstat(source.c_str(), &st) || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+
+    // only what store_files() made ours and read-only, see there
+    if (st.st_uid != geteuid() || (st.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH | S_ISUID | S_ISGID))) {
+        return false;
+    }
+
+    if (!make_parent_dirs(envdir, path, user_uid, user_gid)) {
+        return false;
+    }
+
+    return link(source.c_str(), (envdir + "/" + path).c_str()) == 0;
+}
+
+bool prepare_install_environment(const std::string &basename, const std::string &target,
+                                 const std::string &name, bool first,
+                                 const std::list<std::string> &paths,
+                                 const std::list<std::string> &blobs,
+                                 std::list<std::string> &missing,
+                                 uid_t user_uid, gid_t user_gid)
+{
+    if (!valid_env_name(name)) {
+        return false;
+    }
+
+    string dirname = basename + "/target=" + target;
+
+    if (first && !create_env_dir(dirname, name, user_uid, user_gid)) {
+        return false;
+    }
+
+    dirname += "/" + name;
+    string store = store_dir(basename);
+    set<string> reported;
+    list<string>::const_iterator path = paths.begin();
+    list<string>::const_iterator blob = blobs.begin();
+
+    for (; path != paths.end() && blob != blobs.end(); ++path, ++blob) {
+        /* Environments count as installed once they have an assembler,
+           so that one has to come with the tarball.  */
+        if (*path != "usr/bin/as"
+                && link_from_store(store, *blob, dirname, *path, user_uid, user_gid)) {
+            continue;
+        }
+
+        if (reported.insert(*blob).second) {
+            missing.push_back(*blob);
+        }
+    }
+
+    return true;
+}
+
+pid_t start_install_environment(const std::string &basename, const std::string &target,
+                                const std::string &name, bool prepared, MsgChannel *c,
+                                int &pipe_to_stdin, FileChunkMsg *&fmsg,
+                                uid_t user_uid, gid_t user_gid)
+{
+    if (!valid_env_name(name)) {
         return 0;
     }
 
@@ -479,28 +827,13 @@ pid_t start_install_environment(const std::string &basename, const std::string &
         }
     }
 
-    if (mkdir(dirname.c_str(), 0770) && errno != EEXIST) {
-        log_perror("mkdir target");
-        return 0;
-    }
-
-    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
-        log_perror("chown,chmod target");
+    // a prepared one has the files from the store already, the rest is added
+    if (!prepared && !create_env_dir(dirname, name, user_uid, user_gid)) {
         return 0;
     }
 
     dirname = dirname + "/" + name;
 
-    if (mkdir(dirname.c_str(), 0770)) {
-        log_perror("mkdir name");
-        return 0;
-    }
-
-    if (chown(dirname.c_str(), user_uid, user_gid) || chmod(dirname.c_str(), 0770)) {
-        log_perror("chown,chmod name");
-        return 0;
-    }
-
     int fds[2];
 
     if (pipe(fds)) {
@@ -567,21 +900,25 @@ pid_t start_install_environment(const std::string &basename, const std::string &
 }
 
 
-size_t finalize_install_environment(const std::string &basename, const std::string &target,
-                                    pid_t pid, uid_t user_uid, gid_t user_gid)
+bool finalize_install_environment(const std::string &basename, const std::string &target,
+                                  int status, uid_t user_uid, gid_t user_gid, size_t &added)
 {
-    int status = 1;
-
-    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    added = 0;
 
     if (shell_exit_status(status) != 0) {
         log_error() << "exit code: " << shell_exit_status(status) << endl;
         remove_environment(basename, target);
-        return 0;
+        return false;
     }
 
     string dirname = basename + "/target=" + target;
 
+    /* Blocks us for reading through what tar just wrote, but that's in the
+       page cache still, and new environments are rare.  */
+    StoreBlobs stored;
+    store_blobs(store_dir(basename), stored);
+    added = store_files(store_dir(basename), dirname, stored);
+
     errno = 0;
     mkdir((dirname + "/tmp").c_str(), 01775);
     ignore_result(chown((dirname + "/tmp").c_str(), user_uid, user_gid));
@@ -591,14 +928,15 @@ size_t finalize_install_environment(const std::string &basename, const std::stri
                     << strerror(errno) << endl;
     }
 
-    return sumup_dir(dirname);
+    return true;
 }
 
 size_t remove_environment(const string &basename, const string &env)
 {
     string dirname = basename + "/target=" + env;
 
-    size_t res = sumup_dir(dirname);
+    // the files in the store are accounted for when the last link goes
+    size_t res = sumup_dir(dirname, true);
 
     flush_debug();
     pid_t pid = fork();
@@ -609,7 +947,7 @@ size_t remove_environment(const string &basename, const string &env)
         while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
 
         if (WIFEXITED(status)) {
-            return res;
+            return res + sweep_store(store_dir(basename));
         }
 
         // something went wrong. assume no disk space was free'd.
@@ -648,7 +986,8 @@ size_t remove_native_environment(const string &env)
 static void
 error_client(MsgChannel *client, string error)
 {
-    if (IS_PROTOCOL_23(client)) {
+    // the workers set up their environment before there is a client
+    if (client && IS_PROTOCOL_23(client)) {
         client->send_msg(StatusTextMsg(error));
     }
 }
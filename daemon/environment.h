@@ -25,6 +25,7 @@
 
 #include <comm.h>
 #include <list>
+#include <map>
 #include <string>
 #include <unistd.h>
 
@@ -37,18 +38,43 @@ extern size_t finish_create_env(int pipe, const std::string &basedir, std::strin
 Environments available_environmnents(const std::string &basename);
 extern void save_compiler_timestamps(time_t &gcc_bin_timestamp, time_t &gpp_bin_timestamp, time_t &clang_bin_timestamp);
 bool compilers_uptodate(time_t gcc_bin_timestamp, time_t gpp_bin_timestamp, time_t clang_bin_timestamp);
+extern bool prepare_install_environment(const std::string &basename,
+                                        const std::string &target,
+                                        const std::string &name, bool first,
+                                        const std::list<std::string> &paths,
+                                        const std::list<std::string> &blobs,
+                                        std::list<std::string> &missing,
+                                        uid_t user_uid, gid_t user_gid);
 extern pid_t start_install_environment(const std::string &basename,
                                        const std::string &target,
-                                       const std::string &name,
+                                       const std::string &name, bool prepared,
                                        MsgChannel *c, int& pipe_to_child,
                                        FileChunkMsg*& fmsg,
                                        uid_t user_uid, gid_t user_gid);
-extern size_t finalize_install_environment(const std::string &basename, const std::string &target,
-        pid_t pid, uid_t user_uid, gid_t user_gid);
+// STATUS is the exit status of the child start_install_environment() gave
+extern bool finalize_install_environment(const std::string &basename, const std::string &target,
+        int status, uid_t user_uid, gid_t user_gid, size_t &added);
 extern size_t remove_environment(const std::string &basedir, const std::string &env);
 extern size_t remove_native_environment(const std::string &env);
 extern void chdir_to_environment(MsgChannel *c, const std::string &dirname, uid_t user_uid, gid_t user_gid);
 extern bool verify_env(MsgChannel *c, const std::string &basedir, const std::string &target,
                        const std::string &env, uid_t user_uid, gid_t user_gid);
 
+/* The store of installed files and what goes with it, for the
+   environments coming from other daemons (envpeers.cpp).  */
+typedef std::map<std::pair<dev_t, ino_t>, std::string> StoreBlobs;
+extern std::string store_dir(const std::string &basedir);
+extern void store_blobs(const std::string &store, StoreBlobs &blobs);
+// the path of BLOB in STORE, empty if it's no valid blob name
+extern std::string store_blob(const std::string &store, const std::string &blob);
+extern bool link_from_store(const std::string &store, const std::string &blob,
+                            const std::string &envdir, const std::string &path,
+                            uid_t user_uid, gid_t user_gid);
+extern bool make_parent_dirs(const std::string &envdir, const std::string &path,
+                             uid_t user_uid, gid_t user_gid);
+extern bool valid_manifest_path(const std::string &path);
+extern bool valid_env_name(const std::string &name);
+extern bool create_env_dir(const std::string &dirname, const std::string &name,
+                           uid_t user_uid, gid_t user_gid);
+
 #endif
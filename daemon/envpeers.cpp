@@ -0,0 +1,672 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include <comm.h>
+#include "environment.h"
+#include "envpeers.h"
+#include "exitcode.h"
+#include "hash.h"
+#include "logging.h"
+#include "util.h"
+#include "workit.h"
+
+using namespace std;
+
+// a file of the environment to fetch, with all the paths it has in there
+struct FetchBlob {
+    string name;
+    uint32_t size;
+    list<string> paths;
+};
+
+static bool collect_files(const string &store, const StoreBlobs &stored, const string &dir,
+                          const string &prefix, EnvManifestMsg &manifest)
+{
+    DIR *envdir = opendir(dir.c_str());
+
+    if (!envdir) {
+        return false;
+    }
+
+    bool ok = true;
+
+    for (struct dirent *ent = readdir(envdir); ok && ent; ent = readdir(envdir)) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+
+        // the one the jobs write to, see finalize_install_environment()
+        if (prefix.empty() && !strcmp(ent->d_name, "tmp")) {
+            continue;
+        }
+
+        string file = dir + "/" + ent->d_name;
+        string path = prefix + ent->d_name;
+        struct stat st;
+
+        if (lstat(file.c_str(), &st)) {
+            ok = false;
+        } else if (S_ISDIR(st.st_mode)) {
+            ok = collect_files(store, stored, file, path + "/", manifest);
+        } else if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(file.c_str(), target, sizeof(target) - 1);
+
+            if (len < 0) {
+                ok = false;
+            } else {
+                manifest.links.push_back(path);
+                manifest.links.push_back(string(target, len));
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            // everything of an installed environment is in the store
+            StoreBlobs::const_iterator blob = stored.find(make_pair(st.st_dev, st.st_ino));
+
+            if (blob == stored.end() || st.st_size > (off_t) 0xffffffffU) {
+                trace() << "can't offer " << file << endl;
+                ok = false;
+            } else {
+                manifest.paths.push_back(path);
+                manifest.blobs.push_back(blob->second);
+                manifest.sizes.push_back(st.st_size);
+            }
+        }
+    }
+
+    closedir(envdir);
+    return ok;
+}
+
+bool list_environment(const string &basedir, const string &target, const string &name,
+                      EnvManifestMsg &manifest)
+{
+    if (!valid_env_name(name) || target.find('/') != string::npos) {
+        return false;
+    }
+
+    string dirname = basedir + "/target=" + target + "/" + name;
+
+    // not (yet) installed completely
+    if (access((dirname + "/usr/bin/as").c_str(), X_OK)) {
+        return false;
+    }
+
+    StoreBlobs stored;
+    store_blobs(store_dir(basedir), stored);
+
+    manifest.target = target;
+    manifest.name = name;
+
+    if (!collect_files(store_dir(basedir), stored, dirname, "", manifest)) {
+        manifest.paths.clear();
+        manifest.blobs.clear();
+        manifest.sizes.clear();
+        manifest.links.clear();
+        return false;
+    }
+
+    return !manifest.paths.empty();
+}
+
+static bool send_env_blobs(MsgChannel *c, const string &basedir, const list<string> &blobs)
+{
+    string store = store_dir(basedir);
+    unsigned char buffer[100000];
+
+    for (list<string>::const_iterator it = blobs.begin(); it != blobs.end(); ++it) {
+        string file = store_blob(store, *it);
+        int fd = file.empty() ? -1 : open(file.c_str(), O_RDONLY);
+
+        if (fd < 0) {
+            log_error() << "no blob " << *it << " to send" << endl;
+            return false;
+        }
+
+        ssize_t bytes;
+
+        while ((bytes = read(fd, buffer, sizeof(buffer))) != 0) {
+            if (bytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                log_perror("read blob");
+                close(fd);
+                return false;
+            }
+
+            if (!c->send_msg(FileChunkMsg(buffer, bytes))) {
+                close(fd);
+                return false;
+            }
+        }
+
+        close(fd);
+
+        if (!c->send_msg(EndMsg())) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Makes a forked child of the daemon let go of everything of it but FD,
+   which ends up as the one after stderr.  Killing it has to work, and the
+   daemon's pipes and connections must not stay open longer than they do
+   there.  */
+static int detach_from_daemon(int fd)
+{
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGALRM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    close_debug();
+
+    if (fd != STDERR_FILENO + 1) {
+        dup2(fd, STDERR_FILENO + 1);
+        close(fd);
+        fd = STDERR_FILENO + 1;
+    }
+
+    close_fds_from(fd + 1, getdtablesize());
+    reset_debug(0);
+    return fd;
+}
+
+/* Answers a GetEnvManifestMsg for TARGET/NAME over C, and sends what of
+   that manifest the other end asks for then.  It asks once it has the
+   manifests of all the peers it fetches from, or closes the connection if
+   it needs nothing of this one.  */
+static bool send_environment(MsgChannel *c, const string &basedir, const string &target,
+                             const string &name)
+{
+    EnvManifestMsg manifest;
+    bool listed = list_environment(basedir, target, name, manifest);
+
+    if (!c->send_msg(manifest) || !listed) {
+        return false;
+    }
+
+    Msg *msg = c->get_msg(120);
+
+    if (!msg) {
+        return true;
+    }
+
+    GetEnvBlobsMsg *request = dynamic_cast<GetEnvBlobsMsg *>(msg);
+    bool ok = request != NULL;
+
+    if (ok) {
+        // the store has the blobs of other environments as well
+        set<string> offered(manifest.blobs.begin(), manifest.blobs.end());
+
+        for (list<string>::const_iterator it = request->blobs.begin();
+                ok && it != request->blobs.end(); ++it) {
+            if (!offered.count(*it)) {
+                log_error() << "blob " << *it << " isn't in " << target << "/" << name << endl;
+                ok = false;
+            }
+        }
+
+        ok = ok && send_env_blobs(c, basedir, request->blobs);
+    }
+
+    delete msg;
+    return ok;
+}
+
+pid_t start_send_environment(MsgChannel *c, const string &basedir, const string &target,
+                             const string &name)
+{
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid) {
+        if (pid < 0) {
+            log_perror("fork");
+        }
+
+        return pid;
+    }
+
+    c->fd = detach_from_daemon(c->fd);
+    bool ok = send_environment(c, basedir, target, name);
+    flush_debug();
+    _exit(ok ? 0 : 1);
+}
+
+static bool write_all(int fd, const unsigned char *buffer, size_t len)
+{
+    while (len) {
+        ssize_t bytes = write(fd, buffer, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            return false;
+        }
+
+        buffer += bytes;
+        len -= bytes;
+    }
+
+    return true;
+}
+
+// receives one blob into the first of its paths and links the others to it
+static bool receive_blob(MsgChannel *c, const string &envdir, const FetchBlob &blob,
+                         uid_t user_uid, gid_t user_gid)
+{
+    // the SHA-256 of the content, a dash and the mode, see store_files()
+    if (blob.name.size() != 69 || blob.name[64] != '-') {
+        return false;
+    }
+
+    mode_t mode = strtoul(blob.name.c_str() + 65, NULL, 8) & 0555;
+    string file = envdir + "/" + blob.paths.front();
+
+    if (!make_parent_dirs(envdir, blob.paths.front(), user_uid, user_gid)) {
+        return false;
+    }
+
+    int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+    if (fd < 0) {
+        log_perror("open fetched file");
+        return false;
+    }
+
+    Sha256 hash;
+    size_t received = 0;
+    bool ok = true;
+
+    for (;;) {
+        Msg *msg = c->get_msg(30);
+
+        if (!msg || (msg->type != M_FILE_CHUNK && msg->type != M_END)) {
+            delete msg;
+            ok = false;
+            break;
+        }
+
+        if (msg->type == M_END) {
+            delete msg;
+            break;
+        }
+
+        FileChunkMsg *fcmsg = static_cast<FileChunkMsg *>(msg);
+        hash.update(fcmsg->buffer, fcmsg->len);
+        received += fcmsg->len;
+        ok = received <= blob.size && write_all(fd, fcmsg->buffer, fcmsg->len);
+        delete msg;
+
+        if (!ok) {
+            break;
+        }
+    }
+
+    if (ok && (received != blob.size || hash.digest() != blob.name.substr(0, 64))) {
+        log_error() << "got a broken " << blob.name << endl;
+        ok = false;
+    }
+
+    // it goes to the store as it is, see store_files()
+    if (ok && (fchown(fd, geteuid(), getegid()) || fchmod(fd, mode))) {
+        ok = false;
+    }
+
+    if (close(fd)) {
+        ok = false;
+    }
+
+    list<string>::const_iterator path = blob.paths.begin();
+
+    for (++path; ok && path != blob.paths.end(); ++path) {
+        ok = make_parent_dirs(envdir, *path, user_uid, user_gid)
+             && link(file.c_str(), (envdir + "/" + *path).c_str()) == 0;
+    }
+
+    return ok;
+}
+
+static bool receive_blobs(MsgChannel *c, const string &envdir, const vector<FetchBlob *> &blobs,
+                          uid_t user_uid, gid_t user_gid)
+{
+    if (blobs.empty()) {
+        return true;
+    }
+
+    GetEnvBlobsMsg request;
+
+    for (vector<FetchBlob *>::const_iterator it = blobs.begin(); it != blobs.end(); ++it) {
+        request.blobs.push_back((*it)->name);
+    }
+
+    if (!c->send_msg(request)) {
+        return false;
+    }
+
+    for (vector<FetchBlob *>::const_iterator it = blobs.begin(); it != blobs.end(); ++it) {
+        if (!receive_blob(c, envdir, **it, user_uid, user_gid)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static MsgChannel *connect_peer(const string &peer, const string &target, const string &name,
+                                EnvManifestMsg *&manifest)
+{
+    string::size_type colon = peer.rfind(':');
+
+    if (colon == string::npos) {
+        return NULL;
+    }
+
+    unsigned short port = atoi(peer.c_str() + colon + 1);
+    MsgChannel *c = Service::createChannel(peer.substr(0, colon), port, 10);
+
+    if (!c) {
+        trace() << "can't reach " << peer << endl;
+        return NULL;
+    }
+
+    if (!IS_PROTOCOL_45(c) || !c->send_msg(GetEnvManifestMsg(target, name))) {
+        delete c;
+        return NULL;
+    }
+
+    Msg *msg = c->get_msg(60);
+    manifest = dynamic_cast<EnvManifestMsg *>(msg);
+
+    if (!manifest || manifest->paths.empty()
+            || manifest->paths.size() != manifest->blobs.size()
+            || manifest->paths.size() != manifest->sizes.size()) {
+        trace() << peer << " doesn't have " << target << "/" << name << endl;
+        delete msg;
+        delete c;
+        manifest = NULL;
+        return NULL;
+    }
+
+    return c;
+}
+
+static bool fetch_environment(const string &basedir, const string &target, const string &name,
+                              const list<string> &peers, unsigned int max_peers,
+                              uid_t user_uid, gid_t user_gid)
+{
+    vector<MsgChannel *> channels;
+    EnvManifestMsg *manifest = NULL;
+    set<string> blob_names;
+
+    for (list<string>::const_iterator it = peers.begin();
+            it != peers.end() && channels.size() < max_peers; ++it) {
+        EnvManifestMsg *other = NULL;
+        MsgChannel *c = connect_peer(*it, target, name, other);
+
+        if (!c) {
+            continue;
+        }
+
+        // they all have to have the same, it's their blobs we take
+        set<string> other_names(other->blobs.begin(), other->blobs.end());
+
+        if (!manifest) {
+            manifest = other;
+            blob_names.swap(other_names);
+        } else {
+            bool same = other_names == blob_names;
+            delete other;
+
+            if (!same) {
+                log_error() << *it << " has another " << target << "/" << name << endl;
+                delete c;
+                continue;
+            }
+        }
+
+        channels.push_back(c);
+    }
+
+    if (channels.empty()) {
+        return false;
+    }
+
+    char pid[32];
+    snprintf(pid, sizeof(pid), "%d", (int) getpid());
+
+    if (!create_env_dir(basedir + "/fetch", pid, user_uid, user_gid)) {
+        return false;
+    }
+
+    string envdir = basedir + "/fetch/" + pid;
+    string store = store_dir(basedir);
+    map<string, FetchBlob> missing;
+    list<string>::const_iterator path = manifest->paths.begin();
+    list<string>::const_iterator blob = manifest->blobs.begin();
+    list<uint32_t>::const_iterator size = manifest->sizes.begin();
+
+    for (; path != manifest->paths.end(); ++path, ++blob, ++size) {
+        if (!valid_manifest_path(*path)) {
+            return false;
+        }
+
+        if (link_from_store(store, *blob, envdir, *path, user_uid, user_gid)) {
+            continue;
+        }
+
+        FetchBlob &fetch = missing[*blob];
+        fetch.name = *blob;
+        fetch.size = *size;
+        fetch.paths.push_back(*path);
+    }
+
+    /* Deal out the largest ones first, each to the peer that has the least
+       to send yet, so they all finish at about the same time.  */
+    multimap<uint32_t, FetchBlob *> by_size;
+
+    for (map<string, FetchBlob>::iterator it = missing.begin(); it != missing.end(); ++it) {
+        by_size.insert(make_pair(it->second.size, &it->second));
+    }
+
+    vector<vector<FetchBlob *> > shares(channels.size());
+    vector<size_t> share_sizes(channels.size(), 0);
+
+    for (multimap<uint32_t, FetchBlob *>::reverse_iterator it = by_size.rbegin();
+            it != by_size.rend(); ++it) {
+        size_t least = 0;
+
+        for (size_t i = 1; i < channels.size(); ++i) {
+            if (share_sizes[i] < share_sizes[least]) {
+                least = i;
+            }
+        }
+
+        shares[least].push_back(it->second);
+        share_sizes[least] += it->first;
+    }
+
+    // the peers there's nothing to get from can let go of the environment
+    for (size_t i = 0; i < channels.size(); ++i) {
+        if (shares[i].empty()) {
+            delete channels[i];
+            channels[i] = NULL;
+        }
+    }
+
+    trace() << "fetching " << missing.size() << " of " << manifest->paths.size()
+            << " files for " << target << "/" << name << " from "
+            << channels.size() << " peers" << endl;
+
+    // one process per connection besides the first one, which is ours
+    vector<pid_t> helpers;
+    bool ok = true;
+
+    for (size_t i = 1; i < channels.size(); ++i) {
+        if (shares[i].empty()) {
+            continue;
+        }
+
+        pid_t helper = fork();
+
+        if (helper == 0) {
+            _exit(receive_blobs(channels[i], envdir, shares[i], user_uid, user_gid) ? 0 : 1);
+        }
+
+        if (helper < 0) {
+            log_perror("fork");
+            ok = false;
+            break;
+        }
+
+        helpers.push_back(helper);
+    }
+
+    if (ok) {
+        ok = receive_blobs(channels[0], envdir, shares[0], user_uid, user_gid);
+    }
+
+    for (vector<pid_t>::iterator it = helpers.begin(); it != helpers.end(); ++it) {
+        int status = 1;
+
+        while (waitpid(*it, &status, 0) < 0 && errno == EINTR) {}
+
+        if (shell_exit_status(status) != 0) {
+            ok = false;
+        }
+    }
+
+    for (list<string>::const_iterator it = manifest->links.begin();
+            ok && it != manifest->links.end(); ++it) {
+        string link_path = *it;
+
+        if (++it == manifest->links.end()) {
+            ok = false;
+            break;
+        }
+
+        string file = envdir + "/" + link_path;
+        ok = valid_manifest_path(link_path)
+             && make_parent_dirs(envdir, link_path, user_uid, user_gid)
+             && symlink(it->c_str(), file.c_str()) == 0
+             && lchown(file.c_str(), user_uid, user_gid) == 0;
+    }
+
+    // replaces the empty directory the daemon made for it
+    string dirname = basedir + "/target=" + target + "/" + name;
+
+    if (ok && rename(envdir.c_str(), dirname.c_str())) {
+        log_perror("rename fetched environment");
+        ok = false;
+    }
+
+    return ok;
+}
+
+pid_t start_fetch_environment(const string &basedir, const string &target, const string &name,
+                              const list<string> &peers, unsigned int max_peers,
+                              uid_t user_uid, gid_t user_gid, int &pipe_from_child)
+{
+    int fds[2];
+
+    if (pipe(fds)) {
+        log_perror("pipe");
+        return 0;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        log_perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+
+    if (pid) {
+        trace() << "pid " << pid << endl;
+        close(fds[1]);
+        pipe_from_child = fds[0];
+        return pid;
+    }
+
+    /* Stays root, linking from the store needs that just like in
+       prepare_install_environment(), but gives everything to the user.
+       The pipe stays open as long as this runs.  */
+    close(fds[0]);
+    detach_from_daemon(fds[1]);
+
+    bool ok = fetch_environment(basedir, target, name, peers, max_peers, user_uid, user_gid);
+    flush_debug();
+    _exit(ok ? 0 : 1);
+}
+
+bool finish_fetch_environment(const string &basedir, const string &env, pid_t pid, int status,
+                              uid_t user_uid, gid_t user_gid, size_t &added)
+{
+    if (finalize_install_environment(basedir, env, status, user_uid, user_gid, added)) {
+        return true;
+    }
+
+    // what the child got until it failed or was killed
+    char staging[32];
+    snprintf(staging, sizeof(staging), "/fetch/%d", (int) pid);
+    string dirname = basedir + staging;
+
+    flush_debug();
+    pid_t rm = fork();
+
+    if (rm == 0) {
+        execl("/bin/rm", "/bin/rm", "-rf", "--", dirname.c_str(), (char *) NULL);
+        _exit(1);
+    }
+
+    if (rm > 0) {
+        int status;
+
+        while (waitpid(rm, &status, 0) < 0 && errno == EINTR) {}
+    }
+
+    return false;
+}
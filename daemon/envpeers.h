@@ -0,0 +1,57 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_ENVPEERS_H
+#define ICECREAM_ENVPEERS_H
+
+#include <list>
+#include <string>
+#include <sys/types.h>
+
+class EnvManifestMsg;
+class MsgChannel;
+
+/* Daemons getting environments from each other instead of from the client
+   that needs them, see EnvFetchMsg.  */
+
+// fills MANIFEST with the files of the installed environment TARGET/NAME
+extern bool list_environment(const std::string &basedir, const std::string &target,
+                             const std::string &name, EnvManifestMsg &manifest);
+
+/* Starts a child that answers a GetEnvManifestMsg for TARGET/NAME over C
+   and sends the blobs asked for after it, the daemon is done with C then.  */
+extern pid_t start_send_environment(MsgChannel *c, const std::string &basedir,
+                                    const std::string &target, const std::string &name);
+
+/* Starts a child that fetches TARGET/NAME, whose empty directory has to
+   exist, from up to MAX_PEERS of PEERS at once.  PIPE_FROM_CHILD gets
+   closed when it's done, finish_fetch_environment() then tells how it went.  */
+extern pid_t start_fetch_environment(const std::string &basedir, const std::string &target,
+                                     const std::string &name,
+                                     const std::list<std::string> &peers,
+                                     unsigned int max_peers, uid_t user_uid, gid_t user_gid,
+                                     int &pipe_from_child);
+
+// like finalize_install_environment(), also cleaning up after a failed child PID
+extern bool finish_fetch_environment(const std::string &basedir, const std::string &env,
+                                     pid_t pid, int status, uid_t user_uid, gid_t user_gid,
+                                     size_t &added);
+
+#endif
@@ -90,6 +90,7 @@
 #include <set>
 #include <fstream>
 #include <string>
+#include <vector>
 
 #include "ncpus.h"
 #include "exitcode.h"
@@ -99,8 +100,13 @@
 #include <comm.h>
 #include "load.h"
 #include "environment.h"
+#include "envpeers.h"
 #include "platform.h"
 #include "util.h"
+#include "poller.h"
+#include "objcache.h"
+#include "workers.h"
+#include "mux.h"
 
 static std::string pidFilePath;
 static volatile sig_atomic_t exit_main_loop = 0;
@@ -128,10 +134,11 @@ public:
      * CLIENTWORK: Client is busy working and we reserve the spot (job_id is set if it's a scheduler job)
      * WAITFORCHILD: Client is waiting for the compile job to finish.
      * WAITCREATEENV: We're waiting for icecc-create-env to finish.
+     * FETCHENV: We're getting the environment the client wants from other daemons.
      */
     enum Status { UNKNOWN, GOTNATIVE, PENDING_USE_CS, JOBDONE, LINKJOB, TOINSTALL, TOCOMPILE,
-                  WAITFORCS, WAITCOMPILE, CLIENTWORK, WAITFORCHILD, WAITCREATEENV,
-                  LASTSTATE = WAITCREATEENV
+                  WAITFORCS, WAITCOMPILE, CLIENTWORK, WAITFORCHILD, WAITCREATEENV, FETCHENV,
+                  LASTSTATE = FETCHENV
                 } status;
     Client() {
         job_id = 0;
@@ -142,6 +149,8 @@ public:
         status = UNKNOWN;
         pipe_to_child = -1;
         child_pid = -1;
+        polled_pipe = -1;
+        batch_waiting = 0;
     }
 
     static string status_str(Status status) {
@@ -170,6 +179,8 @@ public:
             return "waitforchild";
         case WAITCREATEENV:
             return "waitcreateenv";
+        case FETCHENV:
+            return "fetchenv";
         }
 
         assert(false);
@@ -191,14 +202,19 @@ public:
 
     }
     uint32_t job_id;
-    string outfile; // only useful for LINKJOB or TOINSTALL
+    string outfile; // only useful for LINKJOB, TOINSTALL or FETCHENV
     MsgChannel *channel;
     UseCSMsg *usecsmsg;
     CompileJob *job;
     int client_id;
-    int pipe_to_child; // pipe to child process, only valid if WAITFORCHILD or TOINSTALL
+    int pipe_to_child; // pipe to child process, only valid if WAITFORCHILD, TOINSTALL or FETCHENV
     pid_t child_pid;
+    int polled_pipe; // pipe_to_child as registered in the poller, maintained by Clients
     string pending_create_env; // only for WAITCREATEENV
+    string prepared_env; // target/name of an environment started from a manifest
+    unsigned int batch_waiting; // answers to a batched GetCSMsg still to come
+    // jobs of the batch the client didn't report done yet, whether they are compiled here
+    map<uint32_t, bool> batch_jobs;
 
     string dump() const {
         string ret = status_str(status) + " " + channel->dump();
@@ -207,6 +223,7 @@ public:
         case LINKJOB:
             return ret + " CID: " + toString(client_id) + " " + outfile;
         case TOINSTALL:
+        case FETCHENV:
             return ret + " " + toString(client_id) + " " + outfile;
         case WAITFORCHILD:
             return ret + " CID: " + toString(client_id) + " PID: " + toString(child_pid) + " PFD: " + toString(pipe_to_child);
@@ -214,6 +231,11 @@ public:
             return ret + " " + toString(client_id) + " " + pending_create_env;
         default:
 
+            if (!batch_jobs.empty() || batch_waiting) {
+                return ret + " CID: " + toString(client_id) + " batch: " + toString(batch_jobs.size())
+                       + "/" + toString(batch_waiting);
+            }
+
             if (job_id) {
                 string jobs;
 
@@ -231,21 +253,95 @@ public:
     }
 };
 
+/* All clients, by channel, with indexes by client id, child pid, the pipe to
+   the child and status, so that lookups and picking the next client of a
+   status don't need to walk all of them. Use add(), remove(), set_status()
+   and set_child_pid() instead of changing the map or the fields directly,
+   they keep the indexes (and the poller) up to date. */
 class Clients : public map<MsgChannel*, Client*>
 {
 public:
     Clients() {
         active_processes = 0;
+        poller = 0;
     }
     unsigned int active_processes;
+    // if set, follows the channels of the clients and the pipes to their children
+    Poller *poller;
 
-    Client *find_by_client_id(int id) const {
-        for (const_iterator it = begin(); it != end(); ++it)
-            if (it->second->client_id == id) {
-                return it->second;
+    /* We don't handle anything from the client while the job is compiled
+       locally, so don't wake up on its events either. */
+    static bool ignores_channel(Client::Status status) {
+        return status == Client::TOCOMPILE || status == Client::WAITFORCHILD
+               || status == Client::FETCHENV;
+    }
+
+    void add(Client *client) {
+        (*this)[client->channel] = client;
+        by_id[client->client_id] = client;
+        by_status[client->status][client->client_id] = client;
+
+        if (client->child_pid > 0) {
+            by_pid[client->child_pid] = client;
+        }
+
+        update_poller(client);
+    }
+
+    bool remove(Client *client) {
+        if (!erase(client->channel)) {
+            return false;
+        }
+
+        by_id.erase(client->client_id);
+        by_status[client->status].erase(client->client_id);
+        forget_pid(client);
+
+        if (client->polled_pipe >= 0) {
+            by_pipe.erase(client->polled_pipe);
+
+            if (poller) {
+                poller->remove(client->polled_pipe);
             }
 
-        return 0;
+            client->polled_pipe = -1;
+        }
+
+        if (poller) {
+            poller->remove(client->channel->fd);
+        }
+
+        return true;
+    }
+
+    void set_status(Client *client, Client::Status status) {
+        if (client->status == status) {
+            return;
+        }
+
+        by_status[client->status].erase(client->client_id);
+        client->status = status;
+        by_status[status][client->client_id] = client;
+        update_poller(client);
+    }
+
+    void set_child_pid(Client *client, pid_t pid) {
+        forget_pid(client);
+        client->child_pid = pid;
+
+        if (pid > 0) {
+            by_pid[pid] = client;
+        }
+    }
+
+    Client *find_by_client_id(int id) const {
+        map<int, Client *>::const_iterator it = by_id.find(id);
+
+        if (it == by_id.end()) {
+            return 0;
+        }
+
+        return it->second;
     }
 
     Client *find_by_channel(MsgChannel *c) const {
@@ -258,13 +354,35 @@ public:
         return it->second;
     }
 
+    /* The pid may be another client's by now, a worker that ran the job of
+       this one has taken the next.  */
+    void forget_pid(Client *client) {
+        map<pid_t, Client *>::iterator it = by_pid.find(client->child_pid);
+
+        if (client->child_pid > 0 && it != by_pid.end() && it->second == client) {
+            by_pid.erase(it);
+        }
+    }
+
     Client *find_by_pid(pid_t pid) const {
-        for (const_iterator it = begin(); it != end(); ++it)
-            if (it->second->child_pid == pid) {
-                return it->second;
-            }
+        map<pid_t, Client *>::const_iterator it = by_pid.find(pid);
 
-        return 0;
+        if (it == by_pid.end()) {
+            return 0;
+        }
+
+        return it->second;
+    }
+
+    // only finds pipes of clients in WAITFORCHILD or FETCHENV, which are the ones we wait on
+    Client *find_by_pipe(int fd) const {
+        map<int, Client *>::const_iterator it = by_pipe.find(fd);
+
+        if (it == by_pipe.end()) {
+            return 0;
+        }
+
+        return it->second;
     }
 
     Client *first() {
@@ -279,13 +397,7 @@ public:
     }
 
     string dump_status(Client::Status s) const {
-        int count = 0;
-
-        for (const_iterator it = begin(); it != end(); ++it) {
-            if (it->second->status == s) {
-                count++;
-            }
-        }
+        size_t count = by_status[s].size();
 
         if (count) {
             return toString(count) + " " + Client::status_str(s) + ", ";
@@ -304,20 +416,59 @@ public:
 
         return s;
     }
+
     Client *get_earliest_client(Client::Status s) const {
-        // TODO: possibly speed this up in adding some sorted lists
-        Client *client = 0;
-        int min_client_id = 0;
-
-        for (const_iterator it = begin(); it != end(); ++it) {
-            if (it->second->status == s && (!min_client_id || min_client_id > it->second->client_id)) {
-                client = it->second;
-                min_client_id = client->client_id;
+        if (by_status[s].empty()) {
+            return 0;
+        }
+
+        // client ids are handed out in increasing order
+        return by_status[s].begin()->second;
+    }
+
+private:
+    void update_poller(Client *client) {
+        int pipe = client->status == Client::WAITFORCHILD || client->status == Client::FETCHENV
+                   ? client->pipe_to_child : -1;
+
+        if (pipe != client->polled_pipe) {
+            if (client->polled_pipe >= 0) {
+                by_pipe.erase(client->polled_pipe);
+
+                if (poller) {
+                    poller->remove(client->polled_pipe);
+                }
+            }
+
+            if (pipe >= 0) {
+                by_pipe[pipe] = client;
+
+                if (poller) {
+                    poller->add(pipe);
+                }
             }
+
+            client->polled_pipe = pipe;
         }
 
-        return client;
+        if (!poller) {
+            return;
+        }
+
+        /* Not just no events: epoll reports hangups and errors anyway, and
+           we'd wake up for them over and over without reading.  */
+        if (ignores_channel(client->status)) {
+            poller->remove(client->channel->fd);
+        } else {
+            poller->modify(client->channel->fd, Poller::Read);
+        }
     }
+
+    map<int, Client *> by_id;
+    map<pid_t, Client *> by_pid;
+    map<int, Client *> by_pipe;
+    // client id -> client, for each status
+    map<int, Client *> by_status[Client::LASTSTATE + 1];
 };
 
 static int set_new_pgrp(void)
@@ -403,7 +554,8 @@ void usage(const char *reason = 0)
     }
 
     cerr << "usage: iceccd [-n <netname>] [-m <max_processes>] [--no-remote] [-w] [-d|--daemonize] [-l logfile] [-s <schedulerhost[:port]>]"
-        " [-v[v[v]]] [-u|--user-uid <user_uid>] [-b <env-basedir>] [--cache-limit <MB>] [-N <node_name>]" << endl;
+        " [-v[v[v]]] [-u|--user-uid <user_uid>] [-b <env-basedir>] [--cache-limit <MB>] [--object-cache <MB>]"
+        " [--tmpfs-outputs] [--env-peers <n>] [--multiplex] [-N <node_name>]" << endl;
     exit(1);
 }
 
@@ -413,6 +565,13 @@ unsigned int max_kids = 0;
 
 size_t cache_size_limit = 100 * 1024 * 1024;
 
+// how often the object cache is brought back to its size, in seconds
+#define OBJCACHE_TRIM_INTERVAL 300
+// children sending results from it at once, more get told it's not there
+#define MAX_CACHE_SENDERS 8
+// children sending environments to other daemons at once, likewise
+#define MAX_ENV_SENDERS 4
+
 struct NativeEnvironment {
     string name; // the hash
     map<string, time_t> extrafilestimes;
@@ -424,9 +583,65 @@ struct NativeEnvironment {
     int create_env_pipe; // if in progress of creating the environment
 };
 
+/* A connection to a remote daemon made ahead of time, to be handed to a
+   local client for its job, so that connecting and exchanging the protocol
+   versions is not on the path of the job.  Before protocol 40 the remote
+   daemon serves one job per connection, so it's used only once, otherwise
+   we keep our end while the client has it and take it back after the job,
+   which keeps the connection (and its TCP window) for the next one.  */
+struct WarmConnection {
+    string host;
+    unsigned short port;
+    MsgChannel *channel; // 0 while connecting
+    time_t since;
+    int lent_to; // the client id using it, 0 if none
+    int reserved_for; // the client id waiting for it to get set up, 0 if none
+    int mux; // the MuxLink it's a stream of, -1 for a connection of its own
+};
+
+/* A relay carrying the connections of jobs between us and another daemon
+   over a single one, see mux.h.  */
+struct MuxLink {
+    pid_t pid;
+    string host;
+    unsigned short port; // 0 if the other daemon connected to us
+    time_t idle_since; // 0 while a warm connection is a stream of it
+};
+
+/* A job id on a compile server the scheduler leased to us, for answering
+   a GetCSMsg for the same environments, target and minimal host version
+   without asking the scheduler, see LeaseMsg.  */
+struct LeasedJob {
+    uint32_t job_id;
+    time_t deadline;
+    string hostname;
+    uint32_t port;
+    string host_platform;
+    Environments versions;
+    string target;
+    int minimal_host_version;
+};
+
+/* Kept per remote daemon at most, beyond those handed out.  How many are
+   wanted follows the slots the scheduler leased us there, the ones the
+   remote has free for our jobs, and the jobs about to go there.  */
+#define WARM_CONNECTIONS_PER_HOST 2
+// unused ones a lease accounts for are closed after this many seconds
+#define WARM_CONNECTION_TIMEOUT 60
+// and the others after this many
+#define WARM_CONNECTION_IDLE 5
+// for connecting and exchanging the protocol versions
+#define WARM_CONNECT_TIMEOUT 10
+// the same if a client waits for it, which gives up after 10 seconds
+#define WARM_RESERVED_TIMEOUT 5
+// how long a remote daemon whose relay failed gets plain connections
+#define MUX_RETRY_INTERVAL 300
+
 struct Daemon {
     Clients clients;
     map<string, time_t> envs_last_use;
+    // of the children installing environments the reaper got, see wait_install()
+    map<pid_t, int> install_status;
     // Map of native environments, the basic one(s) containing just the compiler
     // and possibly more containing additional files (such as compiler plugins).
     // The key is the compiler name and a concatenated list of the additional files
@@ -443,7 +658,35 @@ struct Daemon {
     bool noremote;
     bool custom_nodename;
     size_t cache_size;
+    // empty if there's no object cache
+    string objcachedir;
+    size_t objcache_limit;
+    time_t next_objcache_trim;
+    pid_t objcache_trimmer;
+    set<pid_t> cache_senders;
+    // let compilers write their outputs to a tmpfs
+    bool tmpfs_outputs;
+    // other daemons to get a missing environment from at once, 0 for none
+    unsigned int env_peers;
+    // children sending an environment to another daemon, and which one
+    map<pid_t, string> env_senders;
+    // processes waiting in the environments for remote jobs
+    WorkerPool workers;
     map<int, MsgChannel *> fd2chan;
+    Poller poller;
+    // fds other than the client ones currently registered in the poller
+    set<int> service_fds;
+    // clients that have messages buffered in their channel, which won't wake up the poller
+    set<int> buffered_clients;
+    // by fd
+    map<int, WarmConnection> warm_connections;
+    // warm connections are streams of a MuxLink, where the remote daemon can do that
+    bool multiplex;
+    // by the fd of the socket to the relay
+    map<int, MuxLink> mux_links;
+    // remote daemons whose relay failed, and when
+    map<pair<string, unsigned short>, time_t> mux_failed;
+    list<LeasedJob> leased_jobs;
     int new_client_id;
     string remote_name;
     time_t next_scheduler_connect;
@@ -486,6 +729,12 @@ struct Daemon {
         new_client_id = 0;
         next_scheduler_connect = 0;
         cache_size = 0;
+        objcache_limit = 0;
+        next_objcache_trim = 0;
+        objcache_trimmer = 0;
+        tmpfs_outputs = false;
+        env_peers = 1;
+        multiplex = false;
         noremote = false;
         custom_nodename = false;
         icecream_load = 0;
@@ -499,12 +748,23 @@ struct Daemon {
         max_scheduler_pong = MAX_SCHEDULER_PONG;
         max_scheduler_ping = MAX_SCHEDULER_PING;
         current_kids = 0;
+        clients.poller = &poller;
+        workers.poller = &poller;
     }
 
     bool reannounce_environments() __attribute_warn_unused_result__;
     int answer_client_requests();
+    void update_service_fds();
+    void handle_client_input(Client *client);
     bool handle_transfer_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_transfer_env_done(Client *client);
+    int wait_install(pid_t pid);
+    bool environment_installed(const string &current, bool installed, size_t installed_size);
+    bool handle_env_fetch(Client *client, EnvFetchMsg *msg) __attribute_warn_unused_result__;
+    bool handle_fetch_env_done(Client *client, bool answer = true);
+    bool handle_get_env_manifest(Client *client, GetEnvManifestMsg *msg) __attribute_warn_unused_result__;
+    void env_sender_exited(pid_t pid);
+    bool handle_env_manifest(Client *client, EnvManifestMsg *msg) __attribute_warn_unused_result__;
     bool handle_get_native_env(Client *client, GetNativeEnvMsg *msg) __attribute_warn_unused_result__;
     bool finish_get_native_env(Client *client, string env_key);
     void handle_old_request();
@@ -515,12 +775,35 @@ struct Daemon {
     int scheduler_get_internals() __attribute_warn_unused_result__;
     void clear_children();
     int scheduler_use_cs(UseCSMsg *msg) __attribute_warn_unused_result__;
+    int use_cs_batch(Client *c, UseCSMsg *msg) __attribute_warn_unused_result__;
+    int scheduler_lease(LeaseMsg *msg);
+    bool take_leased_job(const GetCSMsg *msg, LeasedJob &leased);
     bool handle_get_cs(Client *client, Msg *msg) __attribute_warn_unused_result__;
+    bool handle_get_cs_batch(Client *client, GetCSMsg *msg) __attribute_warn_unused_result__;
     bool handle_local_job(Client *client, Msg *msg) __attribute_warn_unused_result__;
     bool handle_job_done(Client *cl, JobDoneMsg *m) __attribute_warn_unused_result__;
     bool handle_compile_done(Client *client) __attribute_warn_unused_result__;
     bool handle_verify_env(Client *client, VerifyEnvMsg *msg) __attribute_warn_unused_result__;
     bool handle_blacklist_host_env(Client *client, Msg *msg) __attribute_warn_unused_result__;
+    bool handle_get_connection(Client *client, GetConnectionMsg *msg) __attribute_warn_unused_result__;
+    bool handle_return_connection(Client *client, ReturnConnectionMsg *msg) __attribute_warn_unused_result__;
+    int find_lent_connection(int client_id) const;
+    unsigned int leased_slots(const string &host, unsigned short port) const;
+    void warm_up(const string &host, unsigned short port, unsigned int wanted);
+    int start_warm_connection(const string &host, unsigned short port);
+    bool lend_warm_connection(Client *client, int fd) __attribute_warn_unused_result__;
+    void handle_warm_connection(int fd);
+    void close_warm_connection(int fd);
+    void expire_warm_connections();
+    int find_mux_link(const string &host, unsigned short port);
+    bool handle_mux(Client *client) __attribute_warn_unused_result__;
+    void handle_mux_stream(int fd);
+    void close_mux_link(int fd);
+    void mux_relay_exited(pid_t pid);
+    void add_client(MsgChannel *c);
+    void trim_object_cache();
+    void objcache_child_exited(pid_t pid);
+    bool handle_cache_lookup(Client *client, CacheLookupMsg *msg) __attribute_warn_unused_result__;
     int handle_cs_conf(ConfCSMsg *msg);
     string dump_internals() const;
     string determine_nodename();
@@ -711,8 +994,18 @@ void Daemon::close_scheduler()
         return;
     }
 
+    /* Forked compile jobs still hold copies of the fds, so the kernel
+       wouldn't drop them from the poller on close.  */
+    poller.remove(scheduler->fd);
     delete scheduler;
     scheduler = 0;
+    // the job ids are the scheduler's
+    leased_jobs.clear();
+
+    if (discover) {
+        poller.remove(discover->listen_fd());
+    }
+
     delete discover;
     discover = 0;
     next_scheduler_connect = time(0) + 20 + (rand() & 31);
@@ -825,6 +1118,10 @@ string Daemon::dump_internals() const
         result += "  Cache Size: " + toString(cache_size) + "\n";
     }
 
+    if (!objcachedir.empty()) {
+        result += "  Object Cache: " + objcachedir + " limit " + toString(objcache_limit) + "\n";
+    }
+
     result += "  Architecture: " + machine_name + "\n";
 
     for (map<string, NativeEnvironment>::const_iterator it = native_environments.begin();
@@ -844,6 +1141,17 @@ string Daemon::dump_internals() const
 
     result += "  Current kids: " + toString(current_kids) + " (max: " + toString(max_kids) + ")\n";
 
+    if (!warm_connections.empty()) {
+        result += "  Warm connections: " + toString(warm_connections.size()) + "\n";
+    }
+
+    for (map<int, MuxLink>::const_iterator it = mux_links.begin(); it != mux_links.end(); ++it) {
+        result += "  Multiplexing " + string(it->second.port ? "to " : "from ") + it->second.host
+                  + " (pid " + toString(it->second.pid) + ")\n";
+    }
+
+    result += "  Workers: " + workers.dump() + "\n";
+
     if (scheduler) {
         result += "  Scheduler protocol: " + toString(scheduler->protocol) + "\n";
     }
@@ -885,10 +1193,14 @@ int Daemon::scheduler_use_cs(UseCSMsg *msg)
         return 1;
     }
 
+    if (c->batch_waiting) {
+        return use_cs_batch(c, msg);
+    }
+
     if (msg->hostname == remote_name && int(msg->port) == daemon_port) {
         c->usecsmsg = new UseCSMsg(msg->host_platform, "127.0.0.1", daemon_port, msg->job_id, true, 1,
                                    msg->matched_job_id);
-        c->status = Client::PENDING_USE_CS;
+        clients.set_status(c, Client::PENDING_USE_CS);
     } else {
         c->usecsmsg = new UseCSMsg(msg->host_platform, msg->hostname, msg->port,
                                    msg->job_id, true, 1, msg->matched_job_id);
@@ -898,7 +1210,12 @@ int Daemon::scheduler_use_cs(UseCSMsg *msg)
             return 0;
         }
 
-        c->status = Client::WAITCOMPILE;
+        clients.set_status(c, Client::WAITCOMPILE);
+
+        // the client will ask for a connection to it right away
+        if (IS_PROTOCOL_39(c->channel)) {
+            warm_up(msg->hostname, msg->port, 1 + leased_slots(msg->hostname, msg->port));
+        }
     }
 
     c->job_id = msg->job_id;
@@ -906,6 +1223,116 @@ int Daemon::scheduler_use_cs(UseCSMsg *msg)
     return 0;
 }
 
+/* Passes the server for one source of a batched request on to the client
+   right away, it connects to each server itself, so there's nothing to
+   warm up.  The ones for us it compiles itself, the scheduler counted
+   them against our slots already.  Those get no port, servers on this
+   host like in the tests are 127.0.0.1 as well.  */
+int Daemon::use_cs_batch(Client *c, UseCSMsg *msg)
+{
+    bool local = msg->hostname == remote_name && int(msg->port) == daemon_port;
+
+    if (local) {
+        msg->hostname = "127.0.0.1";
+        msg->port = 0;
+    }
+
+    if (!c->channel->send_msg(*msg)) {
+        handle_end(c, 143);
+        return 0;
+    }
+
+    if (msg->job_id) {
+        c->batch_jobs[msg->job_id] = local;
+    }
+
+    if (!--c->batch_waiting) {
+        clients.set_status(c, Client::WAITCOMPILE);
+    }
+
+    return 0;
+}
+
+int Daemon::scheduler_lease(LeaseMsg *msg)
+{
+    trace() << "handle_lease " << msg->job_ids.size() << " " << msg->hostname
+            << " ttl " << msg->ttl << endl;
+
+    if (!msg->ttl) {
+        for (list<LeasedJob>::iterator it = leased_jobs.begin(); it != leased_jobs.end();) {
+            if (find(msg->job_ids.begin(), msg->job_ids.end(), it->job_id) != msg->job_ids.end()) {
+                it = leased_jobs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        return 0;
+    }
+
+    LeasedJob leased;
+    // ours starts later than the scheduler's, keep some more distance
+    leased.deadline = time(0) + msg->ttl - 1;
+    leased.hostname = msg->hostname;
+    leased.port = msg->port;
+    leased.host_platform = msg->host_platform;
+    leased.versions = msg->versions;
+    leased.target = msg->target;
+    leased.minimal_host_version = msg->minimal_host_version;
+
+    for (list<uint32_t>::const_iterator it = msg->job_ids.begin(); it != msg->job_ids.end(); ++it) {
+        leased.job_id = *it;
+        leased_jobs.push_back(leased);
+    }
+
+    // before the jobs for them come
+    warm_up(msg->hostname, msg->port, leased_slots(msg->hostname, msg->port));
+    return 0;
+}
+
+// the unexpired leased jobs on the remote daemon
+unsigned int Daemon::leased_slots(const string &host, unsigned short port) const
+{
+    time_t now = time(0);
+    unsigned int count = 0;
+
+    for (list<LeasedJob>::const_iterator it = leased_jobs.begin(); it != leased_jobs.end(); ++it) {
+        if (it->hostname == host && it->port == port && it->deadline > now) {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+/* Takes a leased job for the request out of the unexpired ones.  */
+bool Daemon::take_leased_job(const GetCSMsg *msg, LeasedJob &leased)
+{
+    if (msg->count != 1 || !msg->preferred_host.empty()) {
+        return false;
+    }
+
+    time_t now = time(0);
+
+    for (list<LeasedJob>::iterator it = leased_jobs.begin(); it != leased_jobs.end();) {
+        if (it->deadline <= now) {
+            it = leased_jobs.erase(it);
+            continue;
+        }
+
+        if (it->versions == msg->versions && it->target == msg->target
+                && it->minimal_host_version == msg->minimal_host_version) {
+            leased = *it;
+            leased_jobs.erase(it);
+            return true;
+        }
+
+        ++it;
+    }
+
+    return false;
+}
+
 bool Daemon::handle_transfer_env(Client *client, Msg *_msg)
 {
     log_error() << "handle_transfer_env" << endl;
@@ -924,18 +1351,21 @@ bool Daemon::handle_transfer_env(Client *client, Msg *_msg)
 
     int sock_to_stdin = -1;
     FileChunkMsg *fmsg = 0;
+    bool prepared = client->prepared_env == target + "/" + emsg->name;
+    client->prepared_env.clear();
 
-    pid_t pid = start_install_environment(envbasedir, target, emsg->name, client->channel,
-                                          sock_to_stdin, fmsg, user_uid, user_gid);
+    pid_t pid = start_install_environment(envbasedir, target, emsg->name, prepared,
+                                          client->channel, sock_to_stdin, fmsg,
+                                          user_uid, user_gid);
 
-    client->status = Client::TOINSTALL;
+    clients.set_status(client, Client::TOINSTALL);
     client->outfile = emsg->target + "/" + emsg->name;
     current_kids++;
 
     if (pid > 0) {
         log_error() << "got pid " << pid << endl;
         client->pipe_to_child = sock_to_stdin;
-        client->child_pid = pid;
+        clients.set_child_pid(client, pid);
 
         if (!handle_file_chunk_env(client, fmsg)) {
             pid = 0;
@@ -950,6 +1380,160 @@ bool Daemon::handle_transfer_env(Client *client, Msg *_msg)
     return pid > 0;
 }
 
+/* Links what the daemon has of an environment into place before its
+   transfer, which then only needs to bring the rest.  */
+bool Daemon::handle_env_manifest(Client *client, EnvManifestMsg *msg)
+{
+    string target = msg->target;
+
+    if (target.empty()) {
+        target = machine_name;
+    }
+
+    string env = target + "/" + msg->name;
+    bool first = client->prepared_env != env;
+    EnvMissingMsg answer;
+
+    if (first && !client->prepared_env.empty()) {
+        remove_environment(envbasedir, client->prepared_env);
+        client->prepared_env.clear();
+    }
+
+    // one that is installed already stays as it is
+    if (!first || envs_last_use.find(env) == envs_last_use.end()) {
+        answer.ok = prepare_install_environment(envbasedir, target, msg->name, first,
+                                                msg->paths, msg->blobs, answer.blobs,
+                                                user_uid, user_gid);
+    }
+
+    if (answer.ok) {
+        client->prepared_env = env;
+    }
+
+    trace() << "manifest of " << env << " with " << msg->paths.size() << " files, "
+            << answer.blobs.size() << " missing" << endl;
+    return client->channel->send_msg(answer);
+}
+
+/* Gets the environment from the daemons the scheduler named as having it,
+   the client waits for the verification as after a transfer.  */
+bool Daemon::handle_env_fetch(Client *client, EnvFetchMsg *msg)
+{
+    string target = msg->target;
+
+    if (target.empty()) {
+        target = machine_name;
+    }
+
+    string env = target + "/" + msg->name;
+
+    // someone else's transfer or fetch can have been quicker
+    if (envs_last_use.find(env) != envs_last_use.end()) {
+        VerifyEnvMsg verify(target, msg->name);
+        return handle_verify_env(client, &verify);
+    }
+
+    int pipe_from_child = -1;
+    pid_t pid = 0;
+
+    if (env_peers && !msg->peers.empty() && valid_env_name(msg->name)
+            && create_env_dir(envbasedir + "/target=" + target, msg->name, user_uid, user_gid)) {
+        pid = start_fetch_environment(envbasedir, target, msg->name, msg->peers, env_peers,
+                                      user_uid, user_gid, pipe_from_child);
+
+        if (pid <= 0) {
+            remove_environment(envbasedir, env);
+        }
+    }
+
+    if (pid <= 0) {
+        return client->channel->send_msg(VerifyEnvResultMsg(false));
+    }
+
+    trace() << "fetching " << env << " from " << msg->peers.size() << " peers" << endl;
+    client->outfile = env;
+    client->pipe_to_child = pipe_from_child;
+    clients.set_child_pid(client, pid);
+    current_kids++;
+    clients.set_status(client, Client::FETCHENV);
+    return true;
+}
+
+bool Daemon::handle_fetch_env_done(Client *client, bool answer)
+{
+    assert(client->status == Client::FETCHENV);
+
+    close(client->pipe_to_child);
+    client->pipe_to_child = -1;
+
+    size_t installed_size = 0;
+    bool installed = finish_fetch_environment(envbasedir, client->outfile, client->child_pid,
+                     wait_install(client->child_pid), user_uid, user_gid,
+                     installed_size);
+
+    clients.set_status(client, Client::UNKNOWN);
+    string current = client->outfile;
+    client->outfile.clear();
+    clients.set_child_pid(client, -1);
+    assert(current_kids > 0);
+    current_kids--;
+
+    bool r = environment_installed(current, installed, installed_size);
+
+    if (!answer) {
+        return r;
+    }
+
+    bool sent;
+
+    if (installed) {
+        string::size_type slash = current.find('/');
+        VerifyEnvMsg verify(current.substr(0, slash), current.substr(slash + 1));
+        sent = handle_verify_env(client, &verify);
+    } else {
+        sent = client->channel->send_msg(VerifyEnvResultMsg(false));
+    }
+
+    if (!sent) {
+        handle_end(client, 121);
+    }
+
+    return r;
+}
+
+/* For another daemon fetching it, see handle_env_fetch().  A child sends
+   the manifest and the blobs, the connection is its then.  */
+bool Daemon::handle_get_env_manifest(Client *client, GetEnvManifestMsg *msg)
+{
+    string env = msg->target + "/" + msg->name;
+    trace() << "manifest of " << env << " asked for" << endl;
+
+    if (envs_last_use.find(env) == envs_last_use.end() || env_senders.size() >= MAX_ENV_SENDERS) {
+        return client->channel->send_msg(EnvManifestMsg());
+    }
+
+    pid_t pid = start_send_environment(client->channel, envbasedir, msg->target, msg->name);
+
+    if (pid < 0) {
+        return client->channel->send_msg(EnvManifestMsg());
+    }
+
+    // check_cache_size() keeps it while the child runs
+    env_senders[pid] = env;
+    envs_last_use[env] = time(NULL);
+    current_kids++;
+    handle_end(client, 119);
+    return false;
+}
+
+void Daemon::env_sender_exited(pid_t pid)
+{
+    if (env_senders.erase(pid)) {
+        assert(current_kids > 0);
+        current_kids--;
+    }
+}
+
 bool Daemon::handle_transfer_env_done(Client *client)
 {
     log_error() << "handle_transfer_env_done" << endl;
@@ -957,25 +1541,55 @@ bool Daemon::handle_transfer_env_done(Client *client)
     assert(client->outfile.size());
     assert(client->status == Client::TOINSTALL);
 
-    size_t installed_size = finalize_install_environment(envbasedir, client->outfile,
-                            client->child_pid, user_uid, user_gid);
+    size_t installed_size = 0;
+    bool installed = finalize_install_environment(envbasedir, client->outfile,
+                     wait_install(client->child_pid), user_uid, user_gid,
+                     installed_size);
 
     if (client->pipe_to_child >= 0) {
-        installed_size = 0;
+        // what tar saw of an unfinished transfer may look complete to it
+        if (installed) {
+            remove_environment(envbasedir, client->outfile);
+        }
+
+        installed = false;
         close(client->pipe_to_child);
         client->pipe_to_child = -1;
     }
 
-    client->status = Client::UNKNOWN;
+    clients.set_status(client, Client::UNKNOWN);
     string current = client->outfile;
     client->outfile.clear();
-    client->child_pid = -1;
+    clients.set_child_pid(client, -1);
     assert(current_kids > 0);
     current_kids--;
 
+    return environment_installed(current, installed, installed_size);
+}
+
+// the exit status of the child installing an environment, when it's done
+int Daemon::wait_install(pid_t pid)
+{
+    int status = 1;
+    map<pid_t, int>::iterator reaped = install_status.find(pid);
+
+    if (reaped != install_status.end()) {
+        status = reaped->second;
+        install_status.erase(reaped);
+        return status;
+    }
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    return status;
+}
+
+bool Daemon::environment_installed(const string &current, bool installed, size_t installed_size)
+{
     log_error() << "installed_size: " << installed_size << endl;
 
-    if (installed_size) {
+    // all of it can have been in the store already
+    if (installed) {
         cache_size += installed_size;
         envs_last_use[current] = time(NULL);
         log_error() << "installed " << current << " size: " << installed_size
@@ -1047,6 +1661,13 @@ void Daemon::check_cache_size(const string &new_env)
                     }
                 }
 
+                for (map<pid_t, string>::const_iterator it2 = env_senders.begin();
+                        it2 != env_senders.end(); ++it2) {
+                    if (it2->second == it->first) {
+                        env_currently_in_use = true;
+                    }
+                }
+
                 if (!env_currently_in_use) {
                     oldest_time = it->second;
                     oldest = it->first;
@@ -1066,6 +1687,7 @@ void Daemon::check_cache_size(const string &new_env)
             native_environments.erase(oldest_native_env_key);
             trace() << "removing " << oldest << " " << oldest_time << " " << removed << endl;
         } else {
+            workers.stop(oldest);
             removed = remove_environment(envbasedir, oldest);
             trace() << "removing " << envbasedir << "/" << oldest << " " << oldest_time
                     << " " << removed << endl;
@@ -1108,6 +1730,7 @@ bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
             cache_size -= remove_native_environment(env.name);
             envs_last_use.erase(env.name);
             if (env.create_env_pipe) {
+                poller.remove(env.create_env_pipe);
                 close(env.create_env_pipe);
                 // TODO kill the still running icecc-create-env process?
             }
@@ -1118,7 +1741,7 @@ bool Daemon::handle_get_native_env(Client *client, GetNativeEnvMsg *msg)
     trace() << "get_native_env " << native_environments[env_key].name
             << " (" << env_key << ")" << endl;
 
-    client->status = Client::WAITCREATEENV;
+    clients.set_status(client, Client::WAITCREATEENV);
     client->pending_create_env = env_key;
 
     if (native_environments[env_key].name.length()) { // already available
@@ -1148,7 +1771,7 @@ bool Daemon::finish_get_native_env(Client *client, string env_key)
     }
 
     envs_last_use[native_environments[env_key].name] = time(NULL);
-    client->status = Client::GOTNATIVE;
+    clients.set_status(client, Client::GOTNATIVE);
     client->pending_create_env.clear();
     return true;
 }
@@ -1160,6 +1783,7 @@ bool Daemon::create_env_finished(string env_key)
 
     trace() << "create_env_finished " << env_key << endl;
     assert(env.create_env_pipe);
+    poller.remove(env.create_env_pipe);
     size_t installed_size = finish_create_env(env.create_env_pipe, envbasedir, env.name);
     env.create_env_pipe = 0;
 
@@ -1190,11 +1814,27 @@ bool Daemon::create_env_finished(string env_key)
 
 bool Daemon::handle_job_done(Client *cl, JobDoneMsg *m)
 {
+    map<uint32_t, bool>::iterator batch = cl->batch_jobs.find(m->job_id);
+
+    if (batch != cl->batch_jobs.end()) {
+        bool local = batch->second;
+        cl->batch_jobs.erase(batch);
+        trace() << "handle_job_done " << m->job_id << " of batch " << cl->client_id << endl;
+
+        /* Like for a single job, the server tells about a remote one,
+           unless it failed, maybe before the server even got it.  */
+        if (!local && !m->exitcode) {
+            return true;
+        }
+
+        return send_scheduler(*m);
+    }
+
     if (cl->status == Client::CLIENTWORK) {
         clients.active_processes--;
     }
 
-    cl->status = Client::JOBDONE;
+    clients.set_status(cl, Client::JOBDONE);
     JobDoneMsg *msg = static_cast<JobDoneMsg *>(m);
     trace() << "handle_job_done " << msg->job_id << " " << msg->exitcode << endl;
 
@@ -1221,7 +1861,7 @@ void Daemon::handle_old_request()
                 log_warning() << "can't send start message to client" << endl;
                 handle_end(client, 112);
             } else {
-                client->status = Client::CLIENTWORK;
+                clients.set_status(client, Client::CLIENTWORK);
                 clients.active_processes++;
                 trace() << "pushed local job " << client->client_id << endl;
 
@@ -1239,7 +1879,7 @@ void Daemon::handle_old_request()
             trace() << "pending " << client->dump() << endl;
 
             if (client->channel->send_msg(*client->usecsmsg)) {
-                client->status = Client::CLIENTWORK;
+                clients.set_status(client, Client::CLIENTWORK);
                 /* we make sure we reserve a spot and the rest is done if the
                  * client contacts as back with a Compile request */
                 clients.active_processes++;
@@ -1268,14 +1908,20 @@ void Daemon::handle_old_request()
 
             string envforjob = job->targetPlatform() + "/" + job->environmentVersion();
             envs_last_use[envforjob] = time(NULL);
-            pid = handle_connection(envbasedir, job, client->channel, sock, mem_limit, user_uid, user_gid);
-            trace() << "handle connection returned " << pid << endl;
+            string dirname = envbasedir + "/target=" + envforjob;
+
+            if (!workers.start_job(envforjob, dirname, job, client->channel, mem_limit, sock, pid)) {
+                pid = handle_connection(envbasedir, job, client->channel, sock, mem_limit, user_uid, user_gid,
+                                        objcachedir, tmpfs_outputs);
+                trace() << "handle connection returned " << pid << endl;
+            }
 
             if (pid > 0) {
                 current_kids++;
-                client->status = Client::WAITFORCHILD;
                 client->pipe_to_child = sock;
-                client->child_pid = pid;
+                clients.set_child_pid(client, pid);
+                // after setting the pipe, so that it gets watched
+                clients.set_status(client, Client::WAITFORCHILD);
 
                 if (!send_scheduler(JobBeginMsg(job->jobID()))) {
                     log_info() << "failed sending scheduler about " << job->jobID() << endl;
@@ -1302,10 +1948,13 @@ bool Daemon::handle_compile_done(Client *client)
     assert(current_kids > 0);
     current_kids--;
 
-    unsigned int job_stat[8];
+    unsigned int job_stat[JobStatistics::num_fields];
     int end_status = 151;
+    // the child sends the statistics only after it sent the result
+    bool got_result = false;
 
     if (read(client->pipe_to_child, job_stat, sizeof(job_stat)) == sizeof(job_stat)) {
+        got_result = true;
         msg->in_uncompressed = job_stat[JobStatistics::in_uncompressed];
         msg->in_compressed = job_stat[JobStatistics::in_compressed];
         msg->out_compressed = msg->out_uncompressed = job_stat[JobStatistics::out_uncompressed];
@@ -1314,17 +1963,34 @@ bool Daemon::handle_compile_done(Client *client)
         msg->user_msec = job_stat[JobStatistics::user_msec];
         msg->sys_msec = job_stat[JobStatistics::sys_msec];
         msg->pfaults = job_stat[JobStatistics::sys_pfaults];
+        msg->in_compression = job_stat[JobStatistics::in_compression];
+        msg->in_decompress_usec = job_stat[JobStatistics::in_decompress_usec];
         end_status = job_stat[JobStatistics::exit_code];
     }
 
+    poller.remove(client->pipe_to_child);
     close(client->pipe_to_child);
     client->pipe_to_child = -1;
     string envforjob = client->job->targetPlatform() + "/" + client->job->environmentVersion();
     envs_last_use[envforjob] = time(NULL);
 
     bool r = send_scheduler(*msg);
-    handle_end(client, end_status);
     delete msg;
+
+    /* Since protocol 40 the submitter can send another job over the same
+       connection once it got the output, which the child sends on its own.
+       What we had buffered from the connection was the child's.  */
+    if (got_result && IS_PROTOCOL_40(client->channel)) {
+        trace() << "keeping connection " << client->channel->fd << " for the next job" << endl;
+        delete client->job;
+        client->job = 0;
+        clients.set_child_pid(client, -1);
+        client->channel->drop_input();
+        clients.set_status(client, Client::UNKNOWN);
+        return r;
+    }
+
+    handle_end(client, end_status);
     return r;
 }
 
@@ -1346,7 +2012,7 @@ bool Daemon::handle_compile_file(Client *client, Msg *msg)
 
         // no scheduler is not an error case!
     } else {
-        client->status = Client::TOCOMPILE;
+        clients.set_status(client, Client::TOCOMPILE);
     }
 
     return true;
@@ -1381,7 +2047,461 @@ bool Daemon::handle_blacklist_host_env(Client *client, Msg *msg)
     return send_scheduler(*msg);
 }
 
-void Daemon::handle_end(Client *client, int exitcode)
+bool Daemon::handle_get_connection(Client *client, GetConnectionMsg *msg)
+{
+    assert(msg);
+    int fd = -1;
+    // one still being set up, if there's none ready
+    int pending = -1;
+
+    for (map<int, WarmConnection>::const_iterator it = warm_connections.begin();
+            it != warm_connections.end(); ++it) {
+        if (it->second.host != msg->hostname || it->second.port != msg->port
+                || it->second.lent_to || it->second.reserved_for) {
+            continue;
+        }
+
+        if (it->second.channel && it->second.channel->is_set_up()) {
+            fd = it->first;
+            break;
+        }
+
+        pending = it->first;
+    }
+
+    trace() << "handle_get_connection " << msg->hostname << ":" << msg->port
+            << (fd >= 0 ? " from pool" : " none ready") << endl;
+
+    /* A stream is there without connecting, the versions are exchanged
+       after one round trip over the multiplexed connection, so the client
+       rather waits for it than connects itself.  */
+    if (fd < 0 && multiplex) {
+        if (pending < 0) {
+            pending = start_warm_connection(msg->hostname, msg->port);
+        }
+
+        if (pending >= 0) {
+            warm_connections[pending].reserved_for = client->client_id;
+            warm_up(msg->hostname, msg->port, leased_slots(msg->hostname, msg->port));
+            return true;
+        }
+    }
+
+    bool ok = lend_warm_connection(client, fd);
+
+    // the next one is only needed for what's leased there
+    warm_up(msg->hostname, msg->port, leased_slots(msg->hostname, msg->port));
+
+    if (!ok) {
+        log_error() << "passing connection to client failed.." << endl;
+        handle_end(client, 121);
+    }
+
+    return ok;
+}
+
+/* Passes the set up warm connection FD (none if -1) to CLIENT.  Since
+   protocol 40 we keep our end while the client has it, else it's the
+   client's.  */
+bool Daemon::lend_warm_connection(Client *client, int fd)
+{
+    MsgChannel *c = fd >= 0 ? warm_connections[fd].channel : 0;
+    bool ok = client->channel->send_channel(c);
+
+    if (c && ok && IS_PROTOCOL_40(c) && IS_PROTOCOL_40(client->channel)) {
+        // stay out of the client's way until it's done with it
+        poller.remove(fd);
+        warm_connections[fd].lent_to = client->client_id;
+        warm_connections[fd].reserved_for = 0;
+    } else if (c) {
+        warm_connections[fd].reserved_for = 0;
+        close_warm_connection(fd);
+    }
+
+    return ok;
+}
+
+bool Daemon::handle_return_connection(Client *client, ReturnConnectionMsg *msg)
+{
+    assert(msg);
+    int fd = find_lent_connection(client->client_id);
+
+    if (fd < 0) {
+        return true;
+    }
+
+    WarmConnection &conn = warm_connections[fd];
+    trace() << "handle_return_connection " << conn.host << ":" << conn.port
+            << (msg->reusable ? "" : " (not reusable)") << endl;
+
+    if (!msg->reusable) {
+        close_warm_connection(fd);
+        return true;
+    }
+
+    conn.lent_to = 0;
+    conn.since = time(0);
+    poller.add(fd);
+    return true;
+}
+
+int Daemon::find_lent_connection(int client_id) const
+{
+    for (map<int, WarmConnection>::const_iterator it = warm_connections.begin();
+            it != warm_connections.end(); ++it) {
+        if (it->second.lent_to == client_id) {
+            return it->first;
+        }
+    }
+
+    return -1;
+}
+
+/* Tops up the unused connections to the given remote daemon to WANTED.  */
+void Daemon::warm_up(const string &host, unsigned short port, unsigned int wanted)
+{
+    unsigned int count = 0;
+
+    for (map<int, WarmConnection>::const_iterator it = warm_connections.begin();
+            it != warm_connections.end(); ++it) {
+        if (it->second.host == host && it->second.port == port && !it->second.lent_to
+                && !it->second.reserved_for) {
+            ++count;
+        }
+    }
+
+    for (; count < min(wanted, (unsigned int) WARM_CONNECTIONS_PER_HOST); ++count) {
+        if (start_warm_connection(host, port) < 0) {
+            return;
+        }
+    }
+}
+
+/* Starts a warm connection to the given remote daemon, a stream of the
+   relay to it if we multiplex.  Its fd or -1.  */
+int Daemon::start_warm_connection(const string &host, unsigned short port)
+{
+    // connecting to ourselves would block in Service::createChannel() on accepting
+    if (port == daemon_port && (host == remote_name || host == "127.0.0.1")) {
+        return -1;
+    }
+
+    int mux = multiplex ? find_mux_link(host, port) : -1;
+    int fd = mux >= 0 ? open_mux_stream(mux) : -1;
+
+    if (mux >= 0 && fd < 0) {
+        close_mux_link(mux);
+        mux = -1;
+    }
+
+    if (fd < 0) {
+        fd = Service::startConnect(host, port);
+    }
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    // a stream is writable right away, like a connected socket
+    WarmConnection &conn = warm_connections[fd];
+    conn.host = host;
+    conn.port = port;
+    conn.channel = 0;
+    conn.since = time(0);
+    conn.lent_to = 0;
+    conn.reserved_for = 0;
+    conn.mux = mux;
+    poller.add(fd, Poller::Write);
+    return fd;
+}
+
+/* Carries on with connecting or exchanging the protocol versions.  Once
+   that's done, the remote daemon doesn't send anything until we ask for
+   something, so input means the connection is gone.  */
+void Daemon::handle_warm_connection(int fd)
+{
+    WarmConnection &conn = warm_connections[fd];
+
+    if (conn.lent_to) {
+        return;
+    }
+
+    if (!conn.channel) {
+        poller.remove(fd);
+        conn.channel = Service::finishConnect(fd);
+
+        if (!conn.channel) {
+            // the fd is closed already
+            warm_connections.erase(fd);
+            return;
+        }
+
+        if (conn.mux >= 0) {
+            conn.channel->name = conn.host;
+        }
+
+        poller.add(fd);
+        return;
+    }
+
+    if (conn.channel->is_set_up() || !conn.channel->read_a_bit() || conn.channel->at_eof()) {
+        close_warm_connection(fd);
+        return;
+    }
+
+    Client *client = conn.reserved_for ? clients.find_by_client_id(conn.reserved_for) : 0;
+
+    if (client && conn.channel->is_set_up() && !lend_warm_connection(client, fd)) {
+        log_error() << "passing connection to client failed.." << endl;
+        handle_end(client, 121);
+    }
+}
+
+void Daemon::close_warm_connection(int fd)
+{
+    map<int, WarmConnection>::iterator it = warm_connections.find(fd);
+
+    if (it == warm_connections.end()) {
+        return;
+    }
+
+    poller.remove(fd);
+
+    if (it->second.channel) {
+        delete it->second.channel;
+    } else {
+        close(fd);
+    }
+
+    Client *client = it->second.reserved_for ? clients.find_by_client_id(it->second.reserved_for) : 0;
+    warm_connections.erase(it);
+
+    // the client that waited for it connects on its own then
+    if (client && !lend_warm_connection(client, -1)) {
+        log_error() << "passing connection to client failed.." << endl;
+        handle_end(client, 121);
+    }
+}
+
+void Daemon::expire_warm_connections()
+{
+    time_t now = time(0);
+    vector<int> expired;
+    // the unused ones per remote daemon its leases account for yet
+    map<pair<string, unsigned short>, unsigned int> leased;
+
+    for (map<int, WarmConnection>::const_iterator it = warm_connections.begin();
+            it != warm_connections.end(); ++it) {
+        bool ready = it->second.channel && it->second.channel->is_set_up();
+
+        if (it->second.lent_to) {
+            continue;
+        }
+
+        time_t timeout = it->second.reserved_for ? WARM_RESERVED_TIMEOUT : WARM_CONNECT_TIMEOUT;
+
+        if (ready) {
+            pair<string, unsigned short> key(it->second.host, it->second.port);
+
+            if (!leased.count(key)) {
+                leased[key] = leased_slots(key.first, key.second);
+            }
+
+            timeout = WARM_CONNECTION_IDLE;
+
+            if (leased[key]) {
+                --leased[key];
+                timeout = WARM_CONNECTION_TIMEOUT;
+            }
+        }
+
+        if (now - it->second.since > timeout) {
+            expired.push_back(it->first);
+        }
+    }
+
+    for (vector<int>::const_iterator it = expired.begin(); it != expired.end(); ++it) {
+        close_warm_connection(*it);
+    }
+
+    // the relays no warm connection went over for as long as those are kept
+    set<int> used;
+
+    for (map<int, WarmConnection>::const_iterator it = warm_connections.begin();
+            it != warm_connections.end(); ++it) {
+        used.insert(it->second.mux);
+    }
+
+    expired.clear();
+
+    for (map<int, MuxLink>::iterator it = mux_links.begin(); it != mux_links.end(); ++it) {
+        if (!it->second.port) {
+            continue;
+        }
+
+        if (used.count(it->first)) {
+            it->second.idle_since = 0;
+        } else if (!it->second.idle_since) {
+            it->second.idle_since = now;
+        } else if (now - it->second.idle_since > WARM_CONNECTION_TIMEOUT) {
+            expired.push_back(it->first);
+        }
+    }
+
+    for (vector<int>::const_iterator it = expired.begin(); it != expired.end(); ++it) {
+        close_mux_link(*it);
+    }
+}
+
+/* The relay for streams to the given remote daemon, started if there's
+   none, -1 if its last one failed not long ago.  */
+int Daemon::find_mux_link(const string &host, unsigned short port)
+{
+    for (map<int, MuxLink>::const_iterator it = mux_links.begin(); it != mux_links.end(); ++it) {
+        if (it->second.host == host && it->second.port == port) {
+            return it->first;
+        }
+    }
+
+    pair<string, unsigned short> key(host, port);
+    map<pair<string, unsigned short>, time_t>::iterator failed = mux_failed.find(key);
+
+    if (failed != mux_failed.end()) {
+        if (time(0) - failed->second < MUX_RETRY_INTERVAL) {
+            return -1;
+        }
+
+        mux_failed.erase(failed);
+    }
+
+    int fd;
+    pid_t pid = start_mux_client(host, port, user_uid, user_gid, fd);
+
+    if (pid <= 0) {
+        return -1;
+    }
+
+    MuxLink &link = mux_links[fd];
+    link.pid = pid;
+    link.host = host;
+    link.port = port;
+    link.idle_since = 0;
+    return fd;
+}
+
+/* The submitting daemon wants to send the jobs of several of its clients
+   over this connection at once.  A relay takes it over and passes us each
+   job's connection like one we accepted, see handle_mux_stream().  */
+bool Daemon::handle_mux(Client *client)
+{
+    if (client->status != Client::UNKNOWN || !IS_PROTOCOL_46(client->channel)) {
+        log_error() << "unexpected multiplexing from " << client->dump() << endl;
+        handle_end(client, 120);
+        return false;
+    }
+
+    int fd;
+    pid_t pid = start_mux_server(client->channel, user_uid, user_gid, fd);
+
+    if (pid > 0) {
+        trace() << "multiplexing jobs from " << client->channel->name << endl;
+        MuxLink &link = mux_links[fd];
+        link.pid = pid;
+        link.host = client->channel->name;
+        link.port = 0;
+        link.idle_since = 0;
+    }
+
+    // the relay has it now
+    handle_end(client, 0);
+    return false;
+}
+
+void Daemon::handle_mux_stream(int fd)
+{
+    int stream = receive_mux_stream(fd);
+
+    if (stream < 0) {
+        close_mux_link(fd);
+        return;
+    }
+
+    MsgChannel *c = Service::createChannel(stream, 0, 0);
+
+    if (c) {
+        c->name = mux_links[fd].host;
+        add_client(c);
+    }
+}
+
+/* Lets go of the relay, which exits once it's done with what it has, or
+   right away if the other daemon connected to us.  */
+void Daemon::close_mux_link(int fd)
+{
+    poller.remove(fd);
+    close(fd);
+    mux_links.erase(fd);
+}
+
+void Daemon::mux_relay_exited(pid_t pid)
+{
+    for (map<int, MuxLink>::iterator it = mux_links.begin(); it != mux_links.end(); ++it) {
+        if (it->second.pid != pid) {
+            continue;
+        }
+
+        // else we'd have let go of it
+        if (it->second.port) {
+            log_warning() << "relay to " << it->second.host << ":" << it->second.port
+                          << " failed, using plain connections for a while" << endl;
+            mux_failed[make_pair(it->second.host, it->second.port)] = time(0);
+        }
+
+        close_mux_link(it->first);
+        return;
+    }
+}
+
+void Daemon::trim_object_cache()
+{
+    time_t now = time(0);
+
+    if (objcachedir.empty() || now < next_objcache_trim || objcache_trimmer > 0) {
+        return;
+    }
+
+    next_objcache_trim = now + OBJCACHE_TRIM_INTERVAL;
+    objcache_trimmer = start_trim_object_cache(objcachedir, objcache_limit);
+}
+
+void Daemon::objcache_child_exited(pid_t pid)
+{
+    if (pid == objcache_trimmer) {
+        objcache_trimmer = 0;
+    }
+
+    cache_senders.erase(pid);
+}
+
+bool Daemon::handle_cache_lookup(Client *client, CacheLookupMsg *msg)
+{
+    trace() << "handle_cache_lookup " << msg->key << endl;
+
+    if (objcachedir.empty() || cache_senders.size() >= MAX_CACHE_SENDERS) {
+        return client->channel->send_msg(CacheResultMsg(false));
+    }
+
+    pid_t pid = start_send_cached_result(client->channel, objcachedir, msg->key);
+
+    if (pid < 0) {
+        return client->channel->send_msg(CacheResultMsg(false));
+    }
+
+    cache_senders.insert(pid);
+    return true;
+}
+
+void Daemon::handle_end(Client *client, int exitcode)
 {
 #ifdef ICECC_DEBUG
     trace() << "handle_end " << client->dump() << endl;
@@ -1389,12 +2509,43 @@ void Daemon::handle_end(Client *client, int exitcode)
 #endif
     fd2chan.erase(client->channel->fd);
 
+    // the client didn't say how its job went, so the connection is in an unknown state
+    int lent = find_lent_connection(client->client_id);
+
+    if (lent >= 0) {
+        close_warm_connection(lent);
+    }
+
+    for (map<int, WarmConnection>::iterator it = warm_connections.begin();
+            it != warm_connections.end(); ++it) {
+        if (it->second.reserved_for == client->client_id) {
+            it->second.reserved_for = 0;
+        }
+    }
+
     if (client->status == Client::TOINSTALL && client->pipe_to_child >= 0) {
+        /* The transfer didn't end, and a plain tar that stops between two
+           files looks complete to tar, so make it fail.  */
+        if (client->child_pid > 0) {
+            kill(client->child_pid, SIGTERM);
+        }
+
         close(client->pipe_to_child);
         client->pipe_to_child = -1;
         handle_transfer_env_done(client);
     }
 
+    if (client->status == Client::FETCHENV) {
+        kill(client->child_pid, SIGTERM);
+        handle_fetch_env_done(client, false);
+    }
+
+    // the manifest came, but no transfer after it
+    if (!client->prepared_env.empty()) {
+        remove_environment(envbasedir, client->prepared_env);
+        client->prepared_env.clear();
+    }
+
     if (client->status == Client::CLIENTWORK) {
         clients.active_processes--;
     }
@@ -1406,7 +2557,7 @@ void Daemon::handle_end(Client *client, int exitcode)
 
     /* Delete from the clients map before send_scheduler, which causes a
        double deletion. */
-    if (!clients.erase(client->channel)) {
+    if (!clients.remove(client)) {
         log_error() << "client can't be erased: " << client->channel << endl;
         flush_debug();
         log_error() << dump_internals() << endl;
@@ -1414,6 +2565,26 @@ void Daemon::handle_end(Client *client, int exitcode)
         assert(false);
     }
 
+    if (scheduler) {
+        /* The answers to come get cancelled one by one, the last one with
+           WAITFORCS below like a single request.  */
+        for (; client->batch_waiting > 1; --client->batch_waiting) {
+            if (!send_scheduler(JobDoneMsg(client->client_id, CLIENT_WAS_WAITING_FOR_CS,
+                                           JobDoneMsg::FROM_SUBMITTER))) {
+                break;
+            }
+        }
+
+        for (map<uint32_t, bool>::const_iterator it = client->batch_jobs.begin();
+                it != client->batch_jobs.end(); ++it) {
+            if (!send_scheduler(JobDoneMsg(it->first, exitcode, JobDoneMsg::FROM_SUBMITTER))) {
+                break;
+            }
+        }
+
+        client->batch_jobs.clear();
+    }
+
     if (scheduler && client->status != Client::WAITFORCHILD) {
         int job_id = client->job_id;
 
@@ -1440,6 +2611,7 @@ void Daemon::handle_end(Client *client, int exitcode)
             case Client::LINKJOB:
             case Client::TOINSTALL:
             case Client::WAITCREATEENV:
+            case Client::FETCHENV:
                 assert(false);   // should not have a job_id
                 break;
             case Client::WAITCOMPILE:
@@ -1470,24 +2642,39 @@ void Daemon::handle_end(Client *client, int exitcode)
 
 void Daemon::clear_children()
 {
+    // else the busy ones would not exit for the waiting below
+    workers.stop();
+
+    /* Only the jobs and the env_senders, which the reaper gets, are left in
+       current_kids once the clients are gone.  Wait for just the jobs,
+       other children may exit meanwhile.  */
+    set<pid_t> jobs;
+
+    for (Clients::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        if (it->second->status == Client::WAITFORCHILD && it->second->child_pid > 0) {
+            jobs.insert(it->second->child_pid);
+        }
+    }
+
     while (!clients.empty()) {
         Client *cl = clients.first();
         handle_end(cl, 116);
     }
 
-    while (current_kids > 0) {
+    for (set<pid_t>::const_iterator it = jobs.begin(); it != jobs.end(); ++it) {
         int status;
-        pid_t child;
 
-        while ((child = waitpid(-1, &status, 0)) < 0 && errno == EINTR) {}
+        // gone already if the reaper got it before its pipe was read
+        while (waitpid(*it, &status, 0) < 0 && errno == EINTR) {}
 
-        current_kids--;
+        current_kids -= min(current_kids, 1u);
     }
 
     // they should be all in clients too
     assert(fd2chan.empty());
 
     fd2chan.clear();
+    buffered_clients.clear();
     new_client_id = 0;
     trace() << "cleared children\n";
 }
@@ -1496,24 +2683,86 @@ bool Daemon::handle_get_cs(Client *client, Msg *msg)
 {
     GetCSMsg *umsg = dynamic_cast<GetCSMsg *>(msg);
     assert(client);
-    client->status = Client::WAITFORCS;
+
+    // count is 0 for a batch that was too big, and one batch is answered at a time
+    if (!umsg->count || (!umsg->batch.empty() && client->batch_waiting)) {
+        log_error() << "invalid request for servers from client " << client->dump() << endl;
+        client->channel->send_msg(EndMsg());
+        handle_end(client, 120);
+        return false;
+    }
+
+    clients.set_status(client, Client::WAITFORCS);
     umsg->client_id = client->client_id;
     trace() << "handle_get_cs " << umsg->client_id << endl;
 
+    if (!umsg->batch.empty()) {
+        return handle_get_cs_batch(client, umsg);
+    }
+
     if (!scheduler) {
         /* now the thing is this: if there is no scheduler
            there is no point in trying to ask him. So we just
            redefine this as local job */
         client->usecsmsg = new UseCSMsg(umsg->target, "127.0.0.1", daemon_port,
                                         umsg->client_id, true, 1, 0);
-        client->status = Client::PENDING_USE_CS;
+        clients.set_status(client, Client::PENDING_USE_CS);
         client->job_id = umsg->client_id;
         return true;
     }
 
+    LeasedJob leased;
+
+    if (IS_PROTOCOL_41(scheduler) && take_leased_job(umsg, leased)) {
+        trace() << "using leased job " << leased.job_id << " on " << leased.hostname << endl;
+        umsg->lease_job_id = leased.job_id;
+
+        if (!send_scheduler(*umsg)) {
+            return false;
+        }
+
+        // as if the scheduler had answered
+        int client_id = client->client_id;
+        UseCSMsg usecs(leased.host_platform, leased.hostname, leased.port, leased.job_id, true,
+                       client_id, 0);
+
+        if (scheduler_use_cs(&usecs)) {
+            return false;
+        }
+
+        // it's gone if it couldn't be told
+        return clients.find_by_client_id(client_id) != 0;
+    }
+
     return send_scheduler(*umsg);
 }
 
+/* Schedulers that don't know about batches get none, the jobs are all
+   compiled here then, like without a scheduler.  */
+bool Daemon::handle_get_cs_batch(Client *client, GetCSMsg *msg)
+{
+    client->batch_waiting = msg->batch.size();
+
+    if (scheduler && IS_PROTOCOL_42(scheduler)) {
+        return send_scheduler(*msg);
+    }
+
+    for (uint32_t i = 0; i < msg->batch.size(); ++i) {
+        UseCSMsg usecs(msg->target, remote_name, daemon_port, 0, true, client->client_id, 0);
+        usecs.batch_index = i;
+
+        if (use_cs_batch(client, &usecs)) {
+            return false;
+        }
+
+        if (!clients.find_by_client_id(client->client_id)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 int Daemon::handle_cs_conf(ConfCSMsg *msg)
 {
     max_scheduler_pong = msg->max_scheduler_pong;
@@ -1523,7 +2772,7 @@ int Daemon::handle_cs_conf(ConfCSMsg *msg)
 
 bool Daemon::handle_local_job(Client *client, Msg *msg)
 {
-    client->status = Client::LINKJOB;
+    clients.set_status(client, Client::LINKJOB);
     client->outfile = dynamic_cast<JobLocalBeginMsg *>(msg)->outfile;
     return true;
 }
@@ -1630,6 +2879,27 @@ bool Daemon::handle_activity(Client *client)
     case M_BLACKLIST_HOST_ENV:
         ret = handle_blacklist_host_env(client, msg);
         break;
+    case M_GET_CONNECTION:
+        ret = handle_get_connection(client, dynamic_cast<GetConnectionMsg *>(msg));
+        break;
+    case M_RETURN_CONNECTION:
+        ret = handle_return_connection(client, dynamic_cast<ReturnConnectionMsg *>(msg));
+        break;
+    case M_CACHE_LOOKUP:
+        ret = handle_cache_lookup(client, dynamic_cast<CacheLookupMsg *>(msg));
+        break;
+    case M_ENV_MANIFEST:
+        ret = handle_env_manifest(client, dynamic_cast<EnvManifestMsg *>(msg));
+        break;
+    case M_ENV_FETCH:
+        ret = handle_env_fetch(client, dynamic_cast<EnvFetchMsg *>(msg));
+        break;
+    case M_GET_ENV_MANIFEST:
+        ret = handle_get_env_manifest(client, dynamic_cast<GetEnvManifestMsg *>(msg));
+        break;
+    case M_MUX:
+        ret = handle_mux(client);
+        break;
     default:
         log_error() << "not compile: " << (char)msg->type << "protocol error on client "
                     << client->dump() << endl;
@@ -1642,119 +2912,195 @@ bool Daemon::handle_activity(Client *client)
     return ret;
 }
 
-int Daemon::answer_client_requests()
+/* Registers the fds we wait on besides the clients with the poller, only
+   the ones that came or went since the last round.  Forked children hold
+   copies of them, so the kernel doesn't drop them from the poller when we
+   close them, whoever does has to remove them first.  */
+void Daemon::update_service_fds()
 {
-#ifdef ICECC_DEBUG
+    set<int> fds;
 
-    if (clients.size() + current_kids) {
-        log_info() << dump_internals() << endl;
+    if (tcp_listen_fd != -1) {
+        fds.insert(tcp_listen_fd);
     }
 
-    log_info() << "clients " << clients.dump_per_status() << " " << current_kids
-               << " (" << max_kids << ")" << endl;
+    fds.insert(unix_listen_fd);
 
-#endif
+    if (scheduler) {
+        fds.insert(scheduler->fd);
+    } else if (discover && discover->listen_fd() >= 0) {
+        /* We don't explicitely check for discover->get_fd() being among
+        the ready fds below.  If it is, we simply will return
+        and our call will make sure we try to get the scheduler.  */
+        fds.insert(discover->listen_fd());
+    }
 
-    /* reap zombis */
-    int status;
+    for (map<string, NativeEnvironment>::const_iterator it = native_environments.begin();
+            it != native_environments.end(); ++it) {
+        if (it->second.create_env_pipe) {
+            fds.insert(it->second.create_env_pipe);
+        }
+    }
 
-    while (waitpid(-1, &status, WNOHANG) < 0 && errno == EINTR) {}
+    workers.get_fds(fds);
 
-    handle_old_request();
+    // only the relays of other daemons have something for us
+    for (map<int, MuxLink>::const_iterator it = mux_links.begin(); it != mux_links.end(); ++it) {
+        if (!it->second.port) {
+            fds.insert(it->first);
+        }
+    }
 
-    /* collect the stats after the children exited icecream_load */
-    if (scheduler) {
-        maybe_stats();
+    for (set<int>::const_iterator it = service_fds.begin(); it != service_fds.end(); ++it) {
+        // the number may belong to a client by now
+        if (!fds.count(*it) && !fd2chan.count(*it) && !clients.find_by_pipe(*it)
+                && !warm_connections.count(*it)) {
+            poller.remove(*it);
+        }
     }
 
-    fd_set listen_set;
-    struct timeval tv;
+    // whatever closes one of them removes it from the poller first
+    for (set<int>::const_iterator it = fds.begin(); it != fds.end(); ++it) {
+        if (!poller.contains(*it)) {
+            poller.add(*it);
+        }
+    }
 
-    FD_ZERO(&listen_set);
-    int max_fd = 0;
+    /* Except for DiscoverSched, which replaces its socket while looking
+       for the scheduler, maybe under the same number.  */
+    if (!scheduler && discover && discover->listen_fd() >= 0) {
+        poller.add(discover->listen_fd());
+    }
 
-    if (tcp_listen_fd != -1) {
-        FD_SET(tcp_listen_fd, &listen_set);
-        max_fd = tcp_listen_fd;
+    service_fds.swap(fds);
+}
+
+void Daemon::add_client(MsgChannel *c)
+{
+    trace() << "accepted " << c->fd << " " << c->name << endl;
+
+    Client *client = new Client;
+    client->client_id = ++new_client_id;
+    client->channel = c;
+    clients.add(client);
+
+    fd2chan[c->fd] = c;
+
+    handle_client_input(client);
+}
+
+/* Handles what the client sent, until there's nothing more to read or
+   the client has to wait for its local compile job.  */
+void Daemon::handle_client_input(Client *client)
+{
+    MsgChannel *c = client->channel;
+    int client_id = client->client_id;
+
+    while (!c->read_a_bit() || c->has_msg()) {
+        if (!handle_activity(client)) {
+            break;
+        }
+
+        if (Clients::ignores_channel(client->status)) {
+            break;
+        }
     }
 
-    FD_SET(unix_listen_fd, &listen_set);
+    /* handle_activity() may have ended the client, but if it's still there
+       and has messages left, take care of them in the next round.  */
+    client = clients.find_by_client_id(client_id);
 
-    if (unix_listen_fd > max_fd) { // very likely
-        max_fd = unix_listen_fd;
+    if (client && !Clients::ignores_channel(client->status) && client->channel->has_msg()) {
+        buffered_clients.insert(client_id);
     }
+}
 
-    for (map<int, MsgChannel *>::const_iterator it = fd2chan.begin();
-            it != fd2chan.end();) {
-        int i = it->first;
-        MsgChannel *c = it->second;
-        ++it;
-        /* don't select on a fd that we're currently not interested in.
-           Avoids that we wake up on an event we're not handling anyway */
-        Client *client = clients.find_by_channel(c);
-        assert(client);
-        int current_status = client->status;
-        bool ignore_channel = current_status == Client::TOCOMPILE
-                              || current_status == Client::WAITFORCHILD;
-
-        if (!ignore_channel && (!c->has_msg() || handle_activity(client))) {
-            if (i > max_fd) {
-                max_fd = i;
-            }
+int Daemon::answer_client_requests()
+{
+#ifdef ICECC_DEBUG
+
+    if (clients.size() + current_kids) {
+        log_info() << dump_internals() << endl;
+    }
+
+    log_info() << "clients " << clients.dump_per_status() << " " << current_kids
+               << " (" << max_kids << ")" << endl;
+
+#endif
+
+    /* reap zombis.  The tar of an environment transfer or the child
+       fetching one can be done before the transfer is, a plain tar ends
+       with its end blocks, their exit status is kept for then.  */
+    for (;;) {
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+
+        if (pid < 0 && errno == EINTR) {
+            continue;
+        }
 
-            FD_SET(i, &listen_set);
+        if (pid <= 0) {
+            break;
         }
 
-        if (current_status == Client::WAITFORCHILD
-                && client->pipe_to_child != -1) {
-            if (client->pipe_to_child > max_fd) {
-                max_fd = client->pipe_to_child;
-            }
+        Client *installing = clients.find_by_pid(pid);
 
-            FD_SET(client->pipe_to_child, &listen_set);
+        if (installing && (installing->status == Client::TOINSTALL
+                           || installing->status == Client::FETCHENV)) {
+            install_status[pid] = status;
+        } else {
+            objcache_child_exited(pid);
+            env_sender_exited(pid);
+            mux_relay_exited(pid);
         }
     }
 
+    handle_old_request();
+
+    /* collect the stats after the children exited icecream_load */
     if (scheduler) {
-        FD_SET(scheduler->fd, &listen_set);
+        maybe_stats();
+    }
 
-        if (max_fd < scheduler->fd) {
-            max_fd = scheduler->fd;
-        }
-    } else if (discover && discover->listen_fd() >= 0) {
-        /* We don't explicitely check for discover->get_fd() being in
-        the selected set below.  If it's set, we simply will return
-        and our call will make sure we try to get the scheduler.  */
-        FD_SET(discover->listen_fd(), &listen_set);
+    set<int> buffered;
+    buffered.swap(buffered_clients);
 
-        if (max_fd < discover->listen_fd()) {
-            max_fd = discover->listen_fd();
+    for (set<int>::const_iterator it = buffered.begin(); it != buffered.end(); ++it) {
+        Client *client = clients.find_by_client_id(*it);
+
+        if (client && !Clients::ignores_channel(client->status)) {
+            handle_client_input(client);
         }
     }
 
-    for (map<string, NativeEnvironment>::const_iterator it = native_environments.begin();
-            it != native_environments.end(); ++it) {
-        if (it->second.create_env_pipe) {
-            FD_SET(it->second.create_env_pipe, &listen_set);
-            if (max_fd < it->second.create_env_pipe)
-                max_fd = it->second.create_env_pipe;
-        }
+    /* What this round had for the scheduler goes out in one go.  */
+    if (scheduler && !scheduler->uncork()) {
+        log_error() << "sending to scheduler failed.." << endl;
+        close_scheduler();
     }
 
-    tv.tv_sec = max_scheduler_pong;
-    tv.tv_usec = 0;
+    expire_warm_connections();
+    workers.expire();
+    trim_object_cache();
+    update_service_fds();
 
-    int ret = select(max_fd + 1, &listen_set, NULL, NULL, &tv);
+    int ready = poller.wait(buffered_clients.empty() ? max_scheduler_pong * 1000 : 0);
 
-    if (ret < 0 && errno != EINTR) {
-        log_perror("select");
+    if (ready < 0 && errno != EINTR) {
+        log_perror("poll");
         return 5;
     }
 
-    if (ret > 0) {
-        bool had_scheduler = scheduler;
+    if (scheduler) {
+        scheduler->cork();
+    }
+
+    bool had_scheduler = scheduler;
 
-        if (scheduler && FD_ISSET(scheduler->fd, &listen_set)) {
+    for (int r = 0; r < ready; ++r) {
+        int fd = poller.ready_fd(r);
+
+        if (scheduler && fd == scheduler->fd) {
             while (!scheduler->read_a_bit() || scheduler->has_msg()) {
                 Msg *msg = scheduler->get_msg();
 
@@ -1765,7 +3111,7 @@ int Daemon::answer_client_requests()
                     return 1;
                 }
 
-                ret = 0;
+                int ret = 0;
 
                 switch (msg->type) {
                 case M_PING:
@@ -1784,6 +3130,9 @@ int Daemon::answer_client_requests()
                 case M_CS_CONF:
                     ret = handle_cs_conf(static_cast<ConfCSMsg *>(msg));
                     break;
+                case M_LEASE:
+                    ret = scheduler_lease(static_cast<LeaseMsg *>(msg));
+                    break;
                 default:
                     log_error() << "unknown scheduler type " << (char)msg->type << endl;
                     ret = 1;
@@ -1795,22 +3144,14 @@ int Daemon::answer_client_requests()
                     return ret;
                 }
             }
-        }
 
-        int listen_fd = -1;
-
-        if (tcp_listen_fd != -1 && FD_ISSET(tcp_listen_fd, &listen_set)) {
-            listen_fd = tcp_listen_fd;
-        }
-
-        if (FD_ISSET(unix_listen_fd, &listen_set)) {
-            listen_fd = unix_listen_fd;
+            continue;
         }
 
-        if (listen_fd != -1) {
+        if (fd == tcp_listen_fd || fd == unix_listen_fd) {
             struct sockaddr cli_addr;
             socklen_t cli_len = sizeof cli_addr;
-            int acc_fd = accept(listen_fd, &cli_addr, &cli_len);
+            int acc_fd = accept(fd, &cli_addr, &cli_len);
 
             if (acc_fd < 0) {
                 log_perror("accept error");
@@ -1823,85 +3164,70 @@ int Daemon::answer_client_requests()
 
             MsgChannel *c = Service::createChannel(acc_fd, &cli_addr, cli_len);
 
-            if (!c) {
-                return 0;
+            if (c) {
+                add_client(c);
             }
 
-            trace() << "accepted " << c->fd << " " << c->name << endl;
-
-            Client *client = new Client;
-            client->client_id = ++new_client_id;
-            client->channel = c;
-            clients[c] = client;
-
-            fd2chan[c->fd] = c;
+            continue;
+        }
 
-            while (!c->read_a_bit() || c->has_msg()) {
-                if (!handle_activity(client)) {
-                    break;
-                }
+        if (mux_links.count(fd)) {
+            handle_mux_stream(fd);
+            continue;
+        }
 
-                if (client->status == Client::TOCOMPILE
-                        || client->status == Client::WAITFORCHILD) {
-                    break;
+        if (Client *client = clients.find_by_pipe(fd)) {
+            if (client->status == Client::FETCHENV) {
+                if (!handle_fetch_env_done(client)) {
+                    return 1;
                 }
+            } else if (!handle_compile_done(client)) {
+                return 1;
             }
-        } else {
-            for (map<int, MsgChannel *>::const_iterator it = fd2chan.begin();
-                    max_fd && it != fd2chan.end();)  {
-                int i = it->first;
-                MsgChannel *c = it->second;
-                Client *client = clients.find_by_channel(c);
-                assert(client);
-                ++it;
-
-                if (client->status == Client::WAITFORCHILD
-                        && client->pipe_to_child >= 0
-                        && FD_ISSET(client->pipe_to_child, &listen_set)) {
-                    max_fd--;
 
-                    if (!handle_compile_done(client)) {
-                        return 1;
-                    }
-                }
+            continue;
+        }
 
-                if (FD_ISSET(i, &listen_set)) {
-                    assert(client->status != Client::TOCOMPILE);
+        if (warm_connections.count(fd)) {
+            handle_warm_connection(fd);
+            continue;
+        }
 
-                    while (!c->read_a_bit() || c->has_msg()) {
-                        if (!handle_activity(client)) {
-                            break;
-                        }
+        if (workers.handles(fd)) {
+            workers.handle_input(fd);
+            continue;
+        }
 
-                        if (client->status == Client::TOCOMPILE
-                                || client->status == Client::WAITFORCHILD) {
-                            break;
-                        }
-                    }
+        map<int, MsgChannel *>::const_iterator chan = fd2chan.find(fd);
 
-                    max_fd--;
-                }
-            }
+        if (chan != fd2chan.end()) {
+            Client *client = clients.find_by_channel(chan->second);
+            assert(client);
 
-            for (map<string, NativeEnvironment>::iterator it = native_environments.begin();
-                 it != native_environments.end(); ) {
-                if (it->second.create_env_pipe && FD_ISSET(it->second.create_env_pipe, &listen_set)) {
-                    if(!create_env_finished(it->first))
-                    {
-                        native_environments.erase(it++);
-                        continue;
-                    }
-                }
-                ++it;
+            /* may be stale, if the client started its local job or the
+               fd got reused by a new client earlier in this round */
+            if (!Clients::ignores_channel(client->status)) {
+                handle_client_input(client);
             }
 
+            continue;
         }
 
-        if (had_scheduler && !scheduler) {
-            clear_children();
-            return 2;
+        for (map<string, NativeEnvironment>::iterator it = native_environments.begin();
+                it != native_environments.end(); ++it) {
+            if (it->second.create_env_pipe == fd) {
+                if (!create_env_finished(it->first)) {
+                    native_environments.erase(it);
+                }
+
+                break;
+            }
         }
+    }
 
+    if (had_scheduler && !scheduler) {
+        clear_children();
+        return 2;
     }
 
     return 0;
@@ -1923,6 +3249,10 @@ bool Daemon::reconnect()
 #endif
 
     if (!discover || (NULL == (scheduler = discover->try_get_scheduler()) && discover->timed_out())) {
+        if (discover) {
+            poller.remove(discover->listen_fd());
+        }
+
         delete discover;
         discover = new DiscoverSched(netname, max_scheduler_pong, schedname, scheduler_port);
     }
@@ -1932,6 +3262,7 @@ bool Daemon::reconnect()
         return false;
     }
 
+    poller.remove(discover->listen_fd());
     delete discover;
     discover = 0;
     sockaddr_in name;
@@ -2000,6 +3331,10 @@ int main(int argc, char **argv)
             { "env-basedir", 1, NULL, 'b' },
             { "user-uid", 1, NULL, 'u'},
             { "cache-limit", 1, NULL, 0},
+            { "object-cache", 1, NULL, 0},
+            { "tmpfs-outputs", 0, NULL, 0},
+            { "env-peers", 1, NULL, 0},
+            { "multiplex", 0, NULL, 0},
             { "no-remote", 0, NULL, 0},
             { "port", 1, NULL, 'p'},
             { 0, 0, 0, 0 }
@@ -2043,6 +3378,22 @@ int main(int argc, char **argv)
                 } else {
                     usage("Error: --cache-limit requires argument");
                 }
+            } else if (optname == "object-cache") {
+                if (optarg && *optarg) {
+                    d.objcache_limit = (size_t) atoi(optarg) * 1024 * 1024;
+                } else {
+                    usage("Error: --object-cache requires argument");
+                }
+            } else if (optname == "tmpfs-outputs") {
+                d.tmpfs_outputs = true;
+            } else if (optname == "env-peers") {
+                if (optarg && *optarg) {
+                    d.env_peers = atoi(optarg);
+                } else {
+                    usage("Error: --env-peers requires argument");
+                }
+            } else if (optname == "multiplex") {
+                d.multiplex = true;
             } else if (optname == "no-remote") {
                 d.noremote = true;
             }
@@ -2242,6 +3593,9 @@ int main(int argc, char **argv)
 
     log_info() << "allowing up to " << max_kids << " active jobs" << endl;
 
+    // room for switching between environments without waiting for idle ones to expire
+    d.workers.setup(2 * max_kids, d.user_uid, d.user_gid, d.tmpfs_outputs);
+
     int ret;
 
     /* Still create a new process group, even if not detached */
@@ -2280,6 +3634,16 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (d.objcache_limit) {
+        string dir = getuid() == 0 ? "/var/cache/icecc/objects" : "/tmp/icecc-objects";
+
+        if (setup_object_cache(dir, d.user_uid, d.user_gid)) {
+            d.objcachedir = dir;
+            log_info() << "object cache in " << dir << ", up to "
+                       << d.objcache_limit / 1024 / 1024 << " MB" << endl;
+        }
+    }
+
     list<string> nl = get_netnames(200, d.scheduler_port);
     trace() << "Netnames:" << endl;
 
@@ -0,0 +1,757 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <map>
+#include <vector>
+
+#include <comm.h>
+#include "logging.h"
+#include "poller.h"
+#include "workit.h"
+#include "mux.h"
+
+using namespace std;
+
+/* A frame is the stream id and the length of the data after the header,
+   both as network order uint32, with the type between them as a byte.  */
+#define MUX_HEADER_SIZE 9
+// the most data in one frame, so that the streams take turns
+#define MUX_MAX_FRAME (32 * 1024)
+/* How much a stream may send before the other end has handed any of it
+   on, which is as much as a relay buffers for a stream.  Over a link with
+   a long round trip it limits what a single stream gets through.  */
+#define MUX_WINDOW (512 * 1024)
+// the other end gets room back once this much of its data was handed on
+#define MUX_WINDOW_UPDATE (MUX_WINDOW / 4)
+// no reading from the streams while this much waits for the connection
+#define MUX_MAX_QUEUED (1024 * 1024)
+#define MUX_MAX_STREAMS 1024
+// exit code of the client relay if the other daemon can't multiplex
+#define MUX_UNSUPPORTED 2
+
+enum FrameType {
+    // a new stream, only the relay of the submitting daemon opens them
+    FRAME_OPEN = 1,
+    FRAME_DATA,
+    // the other end may send as much more as the uint32 in it says
+    FRAME_WINDOW,
+    // the sender doesn't send anything more on the stream
+    FRAME_CLOSE,
+    // the stream is gone in both directions for the sender
+    FRAME_RESET
+};
+
+struct Stream {
+    int fd;
+    // from the other end, to be written to fd
+    string out;
+    // how much we may send yet, and how much the other end may
+    uint32_t credit;
+    uint32_t window;
+    // written to fd since the other end got room back for it
+    uint32_t consumed;
+    // fd said EOF and the other end got FRAME_CLOSE
+    bool read_closed;
+    // got FRAME_CLOSE, fd gets shut down for writing once OUT is written
+    bool peer_closed;
+    bool shut_down;
+    // what fd is in the poller for
+    int events;
+};
+
+class Relay
+{
+public:
+    Relay(int _sock, int _control, bool _opens, const string &input);
+    ~Relay();
+
+    void run();
+
+private:
+    void queue_frame(uint32_t id, FrameType type, const char *data = 0, uint32_t len = 0);
+    bool handle_frames();
+    bool handle_frame(uint32_t id, int type, const char *data, uint32_t len);
+    bool read_sock();
+    bool write_sock();
+    void handle_control();
+    void add_stream(uint32_t id, int fd);
+    void read_stream(Stream &s, uint32_t id);
+    void write_stream(Stream &s, uint32_t id);
+    void reset_stream(Stream &s, uint32_t id);
+    void update_streams();
+
+    size_t queued() const
+    {
+        return sockout.size() - sockout_pos;
+    }
+
+    int sock;
+    int control;
+    // the submitting side, which opens the streams
+    bool opens;
+    bool control_closed;
+    string sockin;
+    string sockout;
+    size_t sockout_pos;
+    map<uint32_t, Stream> streams;
+    map<int, uint32_t> by_fd;
+    uint32_t next_id;
+    Poller poller;
+};
+
+static void put_uint32(char *buf, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i) {
+        buf[i] = char(v >> ((3 - i) * 8));
+    }
+}
+
+static uint32_t get_uint32(const char *buf)
+{
+    uint32_t v = 0;
+
+    for (int i = 0; i < 4; ++i) {
+        v = (v << 8) | (unsigned char) buf[i];
+    }
+
+    return v;
+}
+
+// passes FD over the unix socket SOCK, false <--> error
+static bool send_fd(int sock, int fd)
+{
+    char byte = 0;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    memset(&control, 0, sizeof(control));
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    for (;;) {
+        if (sendmsg(sock, &mh, 0) == 1) {
+            return true;
+        }
+
+        if (errno != EINTR) {
+            log_perror("sendmsg()");
+            return false;
+        }
+    }
+}
+
+// the fd passed over SOCK by send_fd(), -1 if there's none
+static int receive_fd(int sock)
+{
+    char byte;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    ssize_t len;
+
+    do {
+#ifdef MSG_CMSG_CLOEXEC
+        len = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+#else
+        len = recvmsg(sock, &mh, 0);
+#endif
+    } while (len < 0 && errno == EINTR);
+
+    int fd = -1;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); len > 0 && cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+                && cmsg->cmsg_len >= CMSG_LEN(sizeof(int)) && fd < 0) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_perror("recvmsg()");
+    }
+
+    return fd;
+}
+
+Relay::Relay(int _sock, int _control, bool _opens, const string &input)
+    : sock(_sock)
+    , control(_control)
+    , opens(_opens)
+    , control_closed(false)
+    , sockin(input)
+    , sockout_pos(0)
+    , next_id(1)
+{
+    // a round's frames go out together anyway
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on));
+    fcntl(sock, F_SETFL, O_NONBLOCK);
+    poller.add(sock);
+    poller.add(control);
+}
+
+Relay::~Relay()
+{
+    // tells the daemons' ends that the streams are gone
+    for (map<uint32_t, Stream>::const_iterator it = streams.begin(); it != streams.end(); ++it) {
+        close(it->second.fd);
+    }
+
+    close(sock);
+    close(control);
+}
+
+void Relay::queue_frame(uint32_t id, FrameType type, const char *data, uint32_t len)
+{
+    char header[MUX_HEADER_SIZE];
+    put_uint32(header, id);
+    header[4] = char(type);
+    put_uint32(header + 5, len);
+    sockout.append(header, sizeof(header));
+
+    if (len) {
+        sockout.append(data, len);
+    }
+}
+
+// takes the complete frames out of SOCKIN, false <--> protocol error
+bool Relay::handle_frames()
+{
+    size_t pos = 0;
+    bool ok = true;
+
+    while (ok && sockin.size() - pos >= MUX_HEADER_SIZE) {
+        const char *header = sockin.data() + pos;
+        uint32_t len = get_uint32(header + 5);
+
+        if (len > MUX_MAX_FRAME) {
+            log_error() << "multiplexed frame of " << len << " bytes" << endl;
+            return false;
+        }
+
+        if (sockin.size() - pos - MUX_HEADER_SIZE < len) {
+            break;
+        }
+
+        ok = handle_frame(get_uint32(header), (unsigned char) header[4],
+                          header + MUX_HEADER_SIZE, len);
+        pos += MUX_HEADER_SIZE + len;
+    }
+
+    sockin.erase(0, pos);
+    return ok;
+}
+
+bool Relay::handle_frame(uint32_t id, int type, const char *data, uint32_t len)
+{
+    map<uint32_t, Stream>::iterator it = streams.find(id);
+
+    if (type == FRAME_OPEN) {
+        int sv[2];
+
+        if (opens || it != streams.end() || streams.size() >= MUX_MAX_STREAMS) {
+            log_error() << "unexpected multiplexed stream " << id << endl;
+            return false;
+        }
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+            log_perror("socketpair()");
+            queue_frame(id, FRAME_RESET);
+            return true;
+        }
+
+        bool passed = send_fd(control, sv[1]);
+        close(sv[1]);
+
+        if (!passed) {
+            close(sv[0]);
+            return false;
+        }
+
+        add_stream(id, sv[0]);
+        return true;
+    }
+
+    // what was still on the way when we reset the stream
+    if (it == streams.end()) {
+        return true;
+    }
+
+    Stream &s = it->second;
+
+    switch (type) {
+    case FRAME_DATA:
+        if (s.peer_closed || len > s.window) {
+            log_error() << "multiplexed stream " << id << " sent too much" << endl;
+            return false;
+        }
+
+        s.window -= len;
+        s.out.append(data, len);
+        return true;
+    case FRAME_WINDOW:
+        if (len != 4 || get_uint32(data) > MUX_WINDOW - s.credit) {
+            log_error() << "bad window for multiplexed stream " << id << endl;
+            return false;
+        }
+
+        s.credit += get_uint32(data);
+        return true;
+    case FRAME_CLOSE:
+        s.peer_closed = true;
+        return true;
+    case FRAME_RESET:
+        poller.remove(s.fd);
+        by_fd.erase(s.fd);
+        close(s.fd);
+        streams.erase(it);
+        return true;
+    default:
+        log_error() << "unknown multiplexed frame " << type << endl;
+        return false;
+    }
+}
+
+// false once the connection is gone
+bool Relay::read_sock()
+{
+    char buf[65536];
+    ssize_t len = read(sock, buf, sizeof(buf));
+
+    if (len < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return true;
+    }
+
+    if (len <= 0) {
+        if (len < 0) {
+            log_perror("read() of multiplexed connection");
+        }
+
+        return false;
+    }
+
+    sockin.append(buf, len);
+    return handle_frames();
+}
+
+bool Relay::write_sock()
+{
+    while (queued()) {
+        ssize_t len = write(sock, sockout.data() + sockout_pos, queued());
+
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+
+        if (len <= 0) {
+            log_perror("write() of multiplexed connection");
+            return false;
+        }
+
+        sockout_pos += len;
+    }
+
+    if (!queued()) {
+        sockout.clear();
+        sockout_pos = 0;
+    } else if (sockout_pos >= MUX_MAX_QUEUED) {
+        sockout.erase(0, sockout_pos);
+        sockout_pos = 0;
+    }
+
+    return true;
+}
+
+// a new stream from the daemon, or it's done with us
+void Relay::handle_control()
+{
+    int fd = opens ? receive_fd(control) : -1;
+
+    if (fd < 0) {
+        control_closed = true;
+        poller.remove(control);
+        return;
+    }
+
+    add_stream(next_id, fd);
+    queue_frame(next_id++, FRAME_OPEN);
+}
+
+void Relay::add_stream(uint32_t id, int fd)
+{
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    Stream &s = streams[id];
+    s.fd = fd;
+    s.credit = s.window = MUX_WINDOW;
+    s.consumed = 0;
+    s.read_closed = s.peer_closed = s.shut_down = false;
+    s.events = 0;
+    by_fd[fd] = id;
+}
+
+void Relay::read_stream(Stream &s, uint32_t id)
+{
+    char buf[MUX_MAX_FRAME];
+    ssize_t len = read(s.fd, buf, min(s.credit, (uint32_t) sizeof(buf)));
+
+    if (len > 0) {
+        queue_frame(id, FRAME_DATA, buf, len);
+        s.credit -= len;
+    } else if (len == 0) {
+        queue_frame(id, FRAME_CLOSE);
+        s.read_closed = true;
+    } else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+        reset_stream(s, id);
+    }
+}
+
+void Relay::write_stream(Stream &s, uint32_t id)
+{
+    ssize_t len = write(s.fd, s.out.data(), s.out.size());
+
+    if (len < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+            reset_stream(s, id);
+        }
+
+        return;
+    }
+
+    s.out.erase(0, len);
+    s.consumed += len;
+
+    if (s.consumed >= MUX_WINDOW_UPDATE) {
+        char buf[4];
+        put_uint32(buf, s.consumed);
+        queue_frame(id, FRAME_WINDOW, buf, sizeof(buf));
+        s.window += s.consumed;
+        s.consumed = 0;
+    }
+}
+
+// the daemon's end is gone, update_streams() drops it
+void Relay::reset_stream(Stream &s, uint32_t id)
+{
+    queue_frame(id, FRAME_RESET);
+    s.out.clear();
+    s.read_closed = s.peer_closed = s.shut_down = true;
+}
+
+/* Shuts down, drops and polls the streams for what they are up to now.
+   Streams registered for nothing are not in the poller at all, as a
+   hangup would be reported for them still.  */
+void Relay::update_streams()
+{
+    for (map<uint32_t, Stream>::iterator it = streams.begin(); it != streams.end();) {
+        Stream &s = it->second;
+
+        if (s.peer_closed && s.out.empty() && !s.shut_down) {
+            shutdown(s.fd, SHUT_WR);
+            s.shut_down = true;
+        }
+
+        if (s.read_closed && s.shut_down) {
+            poller.remove(s.fd);
+            by_fd.erase(s.fd);
+            close(s.fd);
+            streams.erase(it++);
+            continue;
+        }
+
+        int events = 0;
+
+        if (!s.read_closed && s.credit && queued() < MUX_MAX_QUEUED) {
+            events |= Poller::Read;
+        }
+
+        if (!s.out.empty()) {
+            events |= Poller::Write;
+        }
+
+        if (events != s.events) {
+            if (events) {
+                poller.modify(s.fd, events);
+            } else {
+                poller.remove(s.fd);
+            }
+
+            s.events = events;
+        }
+
+        ++it;
+    }
+}
+
+void Relay::run()
+{
+    if (!handle_frames()) {
+        return;
+    }
+
+    for (;;) {
+        // first, what's read from the streams depends on what's queued
+        if (!write_sock()) {
+            return;
+        }
+
+        update_streams();
+
+        if (control_closed && (!opens || streams.empty())) {
+            return;
+        }
+
+        poller.modify(sock, queued() ? Poller::Read | Poller::Write : Poller::Read);
+        int count = poller.wait(-1);
+
+        if (count < 0 && errno != EINTR) {
+            log_perror("poll in relay");
+            return;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            int fd = poller.ready_fd(i);
+
+            if (fd == sock) {
+                if ((poller.ready_events(i) & Poller::Read) && !read_sock()) {
+                    return;
+                }
+
+                continue;
+            }
+
+            if (fd == control) {
+                handle_control();
+                continue;
+            }
+
+            // dropped earlier in this round
+            map<int, uint32_t>::const_iterator id = by_fd.find(fd);
+
+            if (id == by_fd.end()) {
+                continue;
+            }
+
+            Stream &s = streams[id->second];
+
+            if (s.events & Poller::Write) {
+                write_stream(s, id->second);
+            }
+
+            if ((s.events & Poller::Read) && !s.read_closed) {
+                read_stream(s, id->second);
+            }
+        }
+    }
+}
+
+/* Makes a forked child of the daemon keep only FIRST and SECOND (if not
+   -1), as the fds after stderr, and become the user for the jobs.  */
+static void detach_relay(int &first, int &second, uid_t user_uid, gid_t user_gid)
+{
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGALRM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    close_debug();
+
+    // out of the way of the numbers they get
+    int fds[2] = { fcntl(first, F_DUPFD, STDERR_FILENO + 3), -1 };
+
+    if (second >= 0) {
+        fds[1] = fcntl(second, F_DUPFD, STDERR_FILENO + 3);
+    }
+
+    first = STDERR_FILENO + 1;
+    dup2(fds[0], first);
+
+    if (second >= 0) {
+        second = STDERR_FILENO + 2;
+        dup2(fds[1], second);
+    }
+
+    close_fds_from((second >= 0 ? second : first) + 1, getdtablesize());
+    reset_debug(0);
+
+    if (!geteuid() && (setgroups(0, NULL) < 0 || setgid(user_gid) < 0 || setuid(user_uid) < 0)) {
+        log_perror("relay can't become the user for the jobs");
+        _exit(1);
+    }
+}
+
+static pid_t fork_relay(int &control_fd, int &child_fd)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        log_perror("socketpair()");
+        return 0;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        log_perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return 0;
+    }
+
+    if (pid) {
+        close(sv[1]);
+        fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+        fcntl(sv[0], F_SETFL, O_NONBLOCK);
+        control_fd = sv[0];
+        return pid;
+    }
+
+    close(sv[0]);
+    child_fd = sv[1];
+    return 0;
+}
+
+pid_t start_mux_client(const string &host, unsigned short port, uid_t user_uid, gid_t user_gid,
+                       int &control_fd)
+{
+    int control = -1;
+    pid_t pid = fork_relay(control_fd, control);
+
+    if (control < 0) {
+        return pid;
+    }
+
+    int none = -1;
+    detach_relay(control, none, user_uid, user_gid);
+    MsgChannel *c = Service::createChannel(host, port, 10);
+
+    if (!c) {
+        _exit(1);
+    }
+
+    if (!IS_PROTOCOL_46(c)) {
+        trace() << host << " can't multiplex, protocol " << c->protocol << endl;
+        flush_debug();
+        _exit(MUX_UNSUPPORTED);
+    }
+
+    if (!c->send_msg(MuxMsg())) {
+        _exit(1);
+    }
+
+    trace() << "multiplexing jobs to " << host << ":" << port << endl;
+    {
+        Relay relay(c->fd, control, true, string());
+        relay.run();
+    }
+    flush_debug();
+    _exit(0);
+}
+
+int open_mux_stream(int control_fd)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        log_perror("socketpair()");
+        return -1;
+    }
+
+    bool passed = send_fd(control_fd, sv[1]);
+    close(sv[1]);
+
+    if (!passed) {
+        close(sv[0]);
+        return -1;
+    }
+
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    return sv[0];
+}
+
+pid_t start_mux_server(MsgChannel *c, uid_t user_uid, gid_t user_gid, int &control_fd)
+{
+    int control = -1;
+    pid_t pid = fork_relay(control_fd, control);
+
+    if (control < 0) {
+        return pid;
+    }
+
+    // what came after the MuxMsg already
+    string input = c->buffered_input();
+    int sock = c->fd;
+    detach_relay(sock, control, user_uid, user_gid);
+    {
+        Relay relay(sock, control, false, input);
+        relay.run();
+    }
+    flush_debug();
+    _exit(0);
+}
+
+int receive_mux_stream(int control_fd)
+{
+    return receive_fd(control_fd);
+}
@@ -0,0 +1,58 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_MUX_H
+#define ICECREAM_MUX_H
+
+#include <string>
+#include <sys/types.h>
+
+class MsgChannel;
+
+/* Since protocol 46 the connections of concurrent jobs from one daemon to
+   another can go over a single TCP connection, which then neither has to
+   be made for each of them nor starts in TCP slow start each time.  A relay
+   process on either end takes over that connection after a MuxMsg and
+   passes on what the jobs send in frames tagged with the id of their
+   stream.  A stream sends only as much as the other end has room for, the
+   room comes back as the data gets handed on, so a job that doesn't read
+   doesn't hold up the others.  Towards the daemons the streams are
+   socketpairs, which they use like the connections they stand in for.  */
+
+/* Starts a relay that connects to the daemon at HOST:PORT and runs as the
+   given user.  Returns its pid, or 0, and the socket for
+   open_mux_stream() in CONTROL_FD.  It exits once that is closed and its
+   streams are, right away if the other daemon can't multiplex.  */
+extern pid_t start_mux_client(const std::string &host, unsigned short port,
+                              uid_t user_uid, gid_t user_gid, int &control_fd);
+
+// a new stream over the relay at CONTROL_FD, our end of it or -1
+extern int open_mux_stream(int control_fd);
+
+/* Starts a relay that takes over C, which sent a MuxMsg, and passes the
+   streams to us over CONTROL_FD.  Returns its pid or 0, C is the daemon's
+   to close still.  The relay exits with the connection or when CONTROL_FD
+   is closed.  */
+extern pid_t start_mux_server(MsgChannel *c, uid_t user_uid, gid_t user_gid, int &control_fd);
+
+// our end of the next stream from the relay at CONTROL_FD, -1 if it's gone
+extern int receive_mux_stream(int control_fd);
+
+#endif
@@ -0,0 +1,417 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <comm.h>
+#include "logging.h"
+#include "file_util.h"
+#include "objcache.h"
+
+using namespace std;
+
+// entries put together by jobs that died before finishing them
+#define STALE_TMP_AGE 3600
+
+/* The key comes from the client, it must not be able to name anything
+   outside of the cache.  */
+static bool valid_key(const string &key)
+{
+    if (key.size() < 16 || key.size() > 128) {
+        return false;
+    }
+
+    for (string::const_iterator it = key.begin(); it != key.end(); ++it) {
+        if (!isxdigit(*it)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// two levels, to keep the directories small
+static string entry_name(const string &key)
+{
+    return key.substr(0, 2) + "/" + key;
+}
+
+bool setup_object_cache(const string &dir, uid_t user_uid, gid_t user_gid)
+{
+    if (!mkpath(dir)) {
+        log_perror("mkdir in setup_object_cache() failed");
+        return false;
+    }
+
+    if (chown(dir.c_str(), user_uid, user_gid) || chmod(dir.c_str(), 0755)) {
+        log_perror("chown/chmod in setup_object_cache() failed");
+        return false;
+    }
+
+    return true;
+}
+
+static bool read_file(const string &file, string &contents)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    contents.clear();
+    char buffer[4096];
+    ssize_t bytes;
+
+    while ((bytes = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            close(fd);
+            return false;
+        }
+
+        contents.append(buffer, bytes);
+    }
+
+    close(fd);
+    return true;
+}
+
+static bool send_file(MsgChannel *c, int fd)
+{
+    unsigned char buffer[100000];
+    ssize_t bytes;
+
+    while ((bytes = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        if (!c->send_msg(FileChunkMsg(buffer, bytes))) {
+            return false;
+        }
+    }
+
+    return c->send_msg(EndMsg());
+}
+
+bool send_cached_result(MsgChannel *c, const string &dir, const string &key, bool *hit)
+{
+    if (hit) {
+        *hit = false;
+    }
+
+    if (dir.empty() || !valid_key(key)) {
+        return c->send_msg(CacheResultMsg(false));
+    }
+
+    string entry = dir + "/" + entry_name(key);
+    CompileResultMsg rmsg;
+
+    if (!read_file(entry + "/out", rmsg.out) || !read_file(entry + "/err", rmsg.err)) {
+        return c->send_msg(CacheResultMsg(false));
+    }
+
+    /* Open what is sent before saying it's a hit, the daemon may drop the
+       entry meanwhile.  */
+    int obj_fd = open((entry + "/o").c_str(), O_RDONLY);
+    int dwo_fd = open((entry + "/dwo").c_str(), O_RDONLY);
+
+    if (obj_fd < 0) {
+        if (dwo_fd >= 0) {
+            close(dwo_fd);
+        }
+
+        return c->send_msg(CacheResultMsg(false));
+    }
+
+    utimes(entry.c_str(), 0);
+    trace() << "object cache hit " << key << endl;
+
+    rmsg.have_dwo_file = dwo_fd >= 0;
+
+    if (hit) {
+        *hit = true;
+    }
+
+    bool ok = c->send_msg(CacheResultMsg(true)) && c->send_msg(rmsg) && send_file(c, obj_fd)
+              && (dwo_fd < 0 || send_file(c, dwo_fd));
+
+    close(obj_fd);
+
+    if (dwo_fd >= 0) {
+        close(dwo_fd);
+    }
+
+    return ok;
+}
+
+int open_object_cache(const string &dir)
+{
+    if (dir.empty()) {
+        return -1;
+    }
+
+    return open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+static bool write_at(int dir_fd, const string &name, const char *data, size_t len)
+{
+    int fd = openat(dir_fd, name.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    while (len) {
+        ssize_t bytes = write(fd, data, len);
+
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            close(fd);
+            return false;
+        }
+
+        data += bytes;
+        len -= bytes;
+    }
+
+    return close(fd) == 0;
+}
+
+static bool copy_at(const string &file, int dir_fd, const string &name)
+{
+    string contents;
+    return read_file(file, contents) && write_at(dir_fd, name, contents.data(), contents.size());
+}
+
+static void remove_at(int dir_fd, const string &entry)
+{
+    static const char *const files[] = { "o", "dwo", "out", "err" };
+
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i) {
+        unlinkat(dir_fd, (entry + "/" + files[i]).c_str(), 0);
+    }
+
+    unlinkat(dir_fd, entry.c_str(), AT_REMOVEDIR);
+}
+
+void store_cached_result(int dir_fd, const string &key, const string &obj_file,
+                         const string &dwo_file, const CompileResultMsg &rmsg)
+{
+    if (dir_fd < 0 || !valid_key(key) || rmsg.status != 0 || rmsg.was_out_of_memory) {
+        return;
+    }
+
+    char tmp[32];
+    sprintf(tmp, "tmp.%d", (int) getpid());
+    string t = tmp;
+    string name = entry_name(key);
+
+    // one left over from a job that died with the same pid is in the way
+    remove_at(dir_fd, t);
+
+    if (mkdirat(dir_fd, tmp, 0755) < 0) {
+        log_perror("mkdir in object cache");
+        return;
+    }
+
+    bool ok = copy_at(obj_file, dir_fd, t + "/o")
+              && (!rmsg.have_dwo_file || copy_at(dwo_file, dir_fd, t + "/dwo"))
+              && write_at(dir_fd, t + "/out", rmsg.out.data(), rmsg.out.size())
+              && write_at(dir_fd, t + "/err", rmsg.err.data(), rmsg.err.size());
+
+    if (ok && mkdirat(dir_fd, key.substr(0, 2).c_str(), 0755) < 0 && errno != EEXIST) {
+        ok = false;
+    }
+
+    // someone else may have been faster, which is fine
+    if (!ok || renameat(dir_fd, tmp, dir_fd, name.c_str()) < 0) {
+        remove_at(dir_fd, t);
+        return;
+    }
+
+    trace() << "stored " << key << " in object cache" << endl;
+}
+
+struct CacheEntry {
+    string path;
+    time_t used;
+    size_t size;
+    bool operator<(const CacheEntry &other) const {
+        return used < other.used;
+    }
+};
+
+static size_t entry_size(const string &path)
+{
+    static const char *const files[] = { "o", "dwo", "out", "err" };
+    size_t size = 0;
+
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i) {
+        struct stat st;
+
+        if (stat((path + "/" + files[i]).c_str(), &st) == 0) {
+            size += st.st_size;
+        }
+    }
+
+    return size;
+}
+
+size_t trim_object_cache(const string &dir, size_t limit)
+{
+    DIR *top = opendir(dir.c_str());
+
+    if (!top) {
+        return 0;
+    }
+
+    vector<CacheEntry> entries;
+    size_t total = 0;
+    time_t now = time(0);
+
+    for (struct dirent *sub = readdir(top); sub; sub = readdir(top)) {
+        string subname = sub->d_name;
+        string subdir = dir + "/" + subname;
+        struct stat st;
+
+        if (subname[0] == '.') {
+            continue;
+        }
+
+        if (subname.compare(0, 4, "tmp.") == 0) {
+            if (stat(subdir.c_str(), &st) == 0 && now - st.st_mtime > STALE_TMP_AGE) {
+                rmpath(subdir.c_str());
+            }
+
+            continue;
+        }
+
+        DIR *d = opendir(subdir.c_str());
+
+        if (!d) {
+            continue;
+        }
+
+        for (struct dirent *ent = readdir(d); ent; ent = readdir(d)) {
+            CacheEntry entry;
+            entry.path = subdir + "/" + ent->d_name;
+
+            if (ent->d_name[0] == '.' || stat(entry.path.c_str(), &st) != 0) {
+                continue;
+            }
+
+            entry.used = st.st_mtime;
+            entry.size = entry_size(entry.path);
+            total += entry.size;
+            entries.push_back(entry);
+        }
+
+        closedir(d);
+    }
+
+    closedir(top);
+
+    if (total <= limit) {
+        return total;
+    }
+
+    // leave some room, so that this doesn't happen after every job
+    size_t target = limit / 10 * 9;
+    sort(entries.begin(), entries.end());
+
+    for (vector<CacheEntry>::const_iterator it = entries.begin();
+            it != entries.end() && total > target; ++it) {
+        rmpath(it->path.c_str());
+        total -= it->size;
+    }
+
+    trace() << "object cache trimmed to " << total << " bytes" << endl;
+    return total;
+}
+
+// a child for something that would hold up the daemon, returns in both like fork()
+static pid_t fork_child()
+{
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        log_perror("fork");
+    } else if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        reset_debug(0);
+    }
+
+    return pid;
+}
+
+pid_t start_trim_object_cache(const string &dir, size_t limit)
+{
+    pid_t pid = fork_child();
+
+    if (pid) {
+        return pid;
+    }
+
+    trim_object_cache(dir, limit);
+    flush_debug();
+    _exit(0);
+}
+
+pid_t start_send_cached_result(MsgChannel *c, const string &dir, const string &key)
+{
+    pid_t pid = fork_child();
+
+    if (pid) {
+        return pid;
+    }
+
+    bool ok = send_cached_result(c, dir, key);
+    flush_debug();
+    _exit(ok ? 0 : 1);
+}
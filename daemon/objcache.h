@@ -0,0 +1,58 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_OBJCACHE_H
+#define ICECREAM_OBJCACHE_H
+
+#include <string>
+#include <sys/types.h>
+
+class CompileResultMsg;
+class MsgChannel;
+
+/* Results of compile jobs by object_cache_key().  Each one is a directory
+   named after the key, with the object file, the .dwo file if there is one
+   and what the compiler printed.  They are put together under another name
+   and renamed in place, so nobody sees half of one.  The compile children of
+   the daemon add them, another one keeps the size in bounds now and then by
+   dropping the ones used longest ago, using an entry touches its directory.  */
+
+bool setup_object_cache(const std::string &dir, uid_t user_uid, gid_t user_gid);
+
+/* Answers with a CacheResultMsg, on a hit followed by the result like after
+   a compile.  Returns false if the channel failed.  */
+bool send_cached_result(MsgChannel *c, const std::string &dir, const std::string &key,
+                        bool *hit = 0);
+
+// the directory stays reachable through the fd after a chroot
+int open_object_cache(const std::string &dir);
+void store_cached_result(int dir_fd, const std::string &key, const std::string &obj_file,
+                         const std::string &dwo_file, const CompileResultMsg &rmsg);
+
+// returns the size of what is left
+size_t trim_object_cache(const std::string &dir, size_t limit);
+
+/* The same in a child, they read and write whole objects and stat the whole
+   cache, which is too long to keep the daemon from its clients.  C stays
+   the daemon's, the client waits for the answer before it says more.  */
+pid_t start_trim_object_cache(const std::string &dir, size_t limit);
+pid_t start_send_cached_result(MsgChannel *c, const std::string &dir, const std::string &key);
+
+#endif
@@ -32,6 +32,7 @@
 #include <errno.h>
 #include <signal.h>
 #include <cassert>
+#include <algorithm>
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -41,6 +42,11 @@
 #endif /* HAVE_SYS_SIGNAL_H */
 #include <sys/param.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mount.h>
+#include <sys/vfs.h>
+#endif
 
 #include <job.h>
 #include <comm.h>
@@ -53,6 +59,8 @@
 #include "serve.h"
 #include "util.h"
 #include "file_util.h"
+#include "objcache.h"
+#include "hash.h"
 
 #include <sys/time.h>
 
@@ -93,6 +101,38 @@ static void write_output_file( const string& file, MsgChannel* client )
             throw myexception(EXIT_DISTCC_FAILED);
         }
 
+        /* Without compression the file can go to the socket as it is, which saves
+           copying it through our buffers.  */
+        if (IS_PROTOCOL_37(client) && client->compression() == COMPRESSION_NONE) {
+            struct stat st;
+
+            if (fstat(obj_fd, &st) < 0) {
+                log_perror("fstat failed");
+                throw myexception(EXIT_DISTCC_FAILED);
+            }
+
+            off_t left = st.st_size;
+
+            while (left > 0) {
+                uint32_t len = min(left, (off_t) 1 << 30);
+
+                if (!client->send_msg(FileBulkMsg(len)) || !client->write_raw(obj_fd, len)) {
+                    log_info() << "write of obj data failed " << len << endl;
+                    throw myexception(EXIT_DISTCC_FAILED);
+                }
+
+                left -= len;
+            }
+
+            if (!client->send_msg(EndMsg())) {
+                log_info() << "write of obj end failed " << endl;
+                throw myexception(EXIT_DISTCC_FAILED);
+            }
+
+            close(obj_fd);
+            return;
+        }
+
         unsigned char buffer[100000];
 
         do {
@@ -122,6 +162,8 @@ static void write_output_file( const string& file, MsgChannel* client )
             }
         } while (1);
 
+        close(obj_fd);
+
     } catch(...) {
         if( obj_fd != -1 )
             close( obj_fd );
@@ -129,66 +171,64 @@ static void write_output_file( const string& file, MsgChannel* client )
     }
 }
 
-/**
- * Read a request, run the compiler, and send a response.
- **/
-int handle_connection(const string &basedir, CompileJob *job,
-                      MsgChannel *client, int &out_fd,
-                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid)
+/* Puts a tmpfs of SIZE_MB over DIR, for the compiler to write its outputs
+   to memory instead of the disk.  Only this process and the compiler see
+   it, and it goes away with them.  */
+bool mount_output_tmpfs(const string &dir, unsigned int size_mb, uid_t user_uid, gid_t user_gid)
 {
-    int socket[2];
+#if defined(__linux__) && defined(CLONE_NEWNS)
+    if (unshare(CLONE_NEWNS) < 0) {
+        trace() << "no tmpfs for the outputs, unshare failed: " << strerror(errno) << endl;
+        return false;
+    }
 
-    if (pipe(socket) == -1) {
-        return -1;
+    // else the mount would show up for everybody
+    if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0) {
+        log_perror("mount --make-rprivate /");
+        return false;
     }
 
-    flush_debug();
-    pid_t pid = fork();
-    assert(pid >= 0);
+    char options[100];
+    snprintf(options, sizeof(options), "size=%um,mode=1775,uid=%d,gid=%d",
+             size_mb, (int) user_uid, (int) user_gid);
 
-    if (pid > 0) {  // parent
-        close(socket[1]);
-        out_fd = socket[0];
-        fcntl(out_fd, F_SETFD, FD_CLOEXEC);
-        return pid;
+    if (mount("icecc-tmp", dir.c_str(), "tmpfs", MS_NOSUID | MS_NODEV, options) < 0) {
+        trace() << "no tmpfs for the outputs, mount failed: " << strerror(errno) << endl;
+        return false;
     }
 
-    reset_debug(0);
-    close(socket[0]);
-    out_fd = socket[1];
-
-    /* internal communication channel, don't inherit to gcc */
-    fcntl(out_fd, F_SETFD, FD_CLOEXEC);
+    return true;
+#else
+    (void) dir;
+    (void) size_mb;
+    (void) user_uid;
+    (void) user_gid;
+    return false;
+#endif
+}
 
-    errno = 0;
-    int niceval = nice(nice_level);
-    (void) niceval;
-    if (errno != 0) {
-        log_warning() << "failed to set nice value: " << strerror(errno)
-                      << endl;
-    }
+// whether the tmpfs at /tmp is as good as full
+static bool output_tmpfs_full()
+{
+#ifdef __linux__
+    struct statfs buf;
+    return statfs(_PATH_TMP, &buf) == 0 && (uint64_t) buf.f_bavail * buf.f_bsize < 1024 * 1024;
+#else
+    return false;
+#endif
+}
 
-    Msg *msg = 0; // The current read message
+/* Compiles JOB in the current directory, which is its environment already,
+   sends the result to CLIENT and the statistics to OUT_FD, which gets
+   closed.  The temporary files are gone again afterwards.  */
+int compile_job(CompileJob *job, MsgChannel *client, int out_fd,
+                unsigned int mem_limit, bool on_tmpfs, int cache_fd)
+{
     unsigned int job_id = 0;
     string tmp_path, obj_file, dwo_file;
+    int exitcode;
 
     try {
-        if (job->environmentVersion().size()) {
-            string dirname = basedir + "/target=" + job->targetPlatform() + "/" + job->environmentVersion();
-
-            if (::access(string(dirname + "/usr/bin/as").c_str(), X_OK)) {
-                error_client(client, dirname + "/usr/bin/as is not executable");
-                log_error() << "I don't have environment " << job->environmentVersion() << "(" << job->targetPlatform() << ") " << job->jobID() << endl;
-                throw myexception(EXIT_DISTCC_FAILED);   // the scheduler didn't listen to us!
-            }
-
-            chdir_to_environment(client, dirname, user_uid, user_gid);
-        } else {
-            error_client(client, "empty environment");
-            log_error() << "Empty environment (" << job->targetPlatform() << ") " << job->jobID() << endl;
-            throw myexception(EXIT_DISTCC_FAILED);
-        }
-
         if (::access(_PATH_TMP + 1, W_OK)) {
             error_client(client, "can't write to " _PATH_TMP);
             log_error() << "can't write into " << _PATH_TMP << " " << strerror(errno) << endl;
@@ -196,11 +236,14 @@ int handle_connection(const string &basedir, CompileJob *job,
         }
 
         int ret;
-        unsigned int job_stat[8];
+        unsigned int job_stat[JobStatistics::num_fields];
         CompileResultMsg rmsg;
+        Sha256 source_hash;
+        Sha256 *input_hash = cache_fd >= 0 ? &source_hash : 0;
         job_id = job->jobID();
 
         memset(job_stat, 0, sizeof(job_stat));
+        uint64_t decompress_usec_start = client->decompress_usec;
 
         char *tmp_output = 0;
         char prefix_output[32]; // 20 for 2^64 + 6 for "icecc-" + 1 for trailing NULL
@@ -257,7 +300,7 @@ int handle_connection(const string &basedir, CompileJob *job,
             obj_file = output_dir + '/' + file_name;
             dwo_file = obj_file.substr(0, obj_file.find_last_of('.')) + ".dwo";
 
-            ret = work_it(*job, job_stat, client, rmsg, tmp_path, job_working_dir, relative_file_path, mem_limit, client->fd, -1);
+            ret = work_it(*job, job_stat, client, rmsg, tmp_path, job_working_dir, relative_file_path, mem_limit, client->fd, -1, input_hash);
         }
         else if ((ret = dcc_make_tmpnam(prefix_output, ".o", &tmp_output, 0)) == 0) {
             obj_file = tmp_output;
@@ -265,7 +308,19 @@ int handle_connection(const string &basedir, CompileJob *job,
             string build_path = obj_file.substr(0, obj_file.find_last_of('/'));
             string file_name = obj_file.substr(obj_file.find_last_of('/')+1);
 
-            ret = work_it(*job, job_stat, client, rmsg, build_path, "", file_name, mem_limit, client->fd, -1);
+            ret = work_it(*job, job_stat, client, rmsg, build_path, "", file_name, mem_limit, client->fd, -1, input_hash);
+        }
+
+        /* A compiler that failed for lack of space in the tmpfs may well work
+           elsewhere, so let the client compile it locally instead of showing
+           that error.  */
+        if (on_tmpfs && (ret || rmsg.status) && output_tmpfs_full()) {
+            log_warning() << "the tmpfs for the outputs of job " << job_id << " ran full" << endl;
+            ret = EXIT_OUT_OF_MEMORY;
+
+            if (!rmsg.status) {
+                rmsg.status = EXIT_OUT_OF_MEMORY;
+            }
         }
 
         if (ret) {
@@ -290,37 +345,150 @@ int handle_connection(const string &basedir, CompileJob *job,
             job_stat[JobStatistics::out_uncompressed] += st.st_size;
         }
 
+        job_stat[JobStatistics::in_decompress_usec] = client->decompress_usec - decompress_usec_start;
+
         /* wake up parent and tell him that compile finished */
         /* if the write failed, well, doesn't matter */
         ignore_result(write(out_fd, job_stat, sizeof(job_stat)));
         close(out_fd);
+        out_fd = -1;
 
         if (rmsg.status == 0) {
             write_output_file(obj_file, client);
             if (rmsg.have_dwo_file) {
                 write_output_file(dwo_file, client);
             }
+
+            /* Under the key of what was compiled here, not the one the client
+               says it is.  */
+            if (input_hash) {
+                string key = object_cache_key(*job, input_hash->digest());
+
+                if (key != job->cacheKey()) {
+                    log_warning() << "job " << job_id << " came with the wrong cache key" << endl;
+                }
+
+                store_cached_result(cache_fd, key, obj_file, dwo_file, rmsg);
+            }
         }
 
         throw myexception(rmsg.status);
 
-    } catch (myexception e) {
-        delete client;
-        client = 0;
+    } catch (const myexception &e) {
+        exitcode = e.exitcode();
+    }
 
-        if (!obj_file.empty()) {
-            unlink(obj_file.c_str());
-        }
-        if (!dwo_file.empty()) {
-            unlink(dwo_file.c_str());
+    if (out_fd >= 0) {
+        close(out_fd);
+    }
+
+    if (!obj_file.empty()) {
+        unlink(obj_file.c_str());
+    }
+    if (!dwo_file.empty()) {
+        unlink(dwo_file.c_str());
+    }
+    if (!tmp_path.empty()) {
+        rmpath(tmp_path.c_str());
+    }
+
+    return exitcode;
+}
+
+/**
+ * Read a request, run the compiler, and send a response.
+ **/
+int handle_connection(const string &basedir, CompileJob *job,
+                      MsgChannel *client, int &out_fd,
+                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid,
+                      const string &objcachedir, bool tmpfs_outputs)
+{
+    int socket[2];
+
+    if (pipe(socket) == -1) {
+        return -1;
+    }
+
+    flush_debug();
+    pid_t pid = fork();
+    assert(pid >= 0);
+
+    if (pid > 0) {  // parent
+        close(socket[1]);
+        out_fd = socket[0];
+        fcntl(out_fd, F_SETFD, FD_CLOEXEC);
+        return pid;
+    }
+
+    reset_debug(0);
+    close(socket[0]);
+    out_fd = socket[1];
+
+    /* internal communication channel, don't inherit to gcc */
+    fcntl(out_fd, F_SETFD, FD_CLOEXEC);
+
+    errno = 0;
+    int niceval = nice(nice_level);
+    (void) niceval;
+    if (errno != 0) {
+        log_warning() << "failed to set nice value: " << strerror(errno)
+                      << endl;
+    }
+
+    int cache_fd = -1;
+    bool on_tmpfs = false;
+    int ret;
+
+    try {
+        /* The client waits to hear whether we have it before it sends the
+           source, a hit needs neither that nor the compiler.  */
+        if (!job->cacheKey().empty()) {
+            unsigned int job_stat[JobStatistics::num_fields];
+            bool hit;
+
+            if (!send_cached_result(client, objcachedir, job->cacheKey(), &hit)) {
+                throw myexception(EXIT_DISTCC_FAILED);
+            }
+
+            if (hit) {
+                memset(job_stat, 0, sizeof(job_stat));
+                ignore_result(write(out_fd, job_stat, sizeof(job_stat)));
+                close(out_fd);
+                throw myexception(0);
+            }
+
+            cache_fd = open_object_cache(objcachedir);
         }
-        if (!tmp_path.empty()) {
-            rmpath(tmp_path.c_str());
+
+        if (job->environmentVersion().size()) {
+            string dirname = basedir + "/target=" + job->targetPlatform() + "/" + job->environmentVersion();
+
+            if (::access(string(dirname + "/usr/bin/as").c_str(), X_OK)) {
+                error_client(client, dirname + "/usr/bin/as is not executable");
+                log_error() << "I don't have environment " << job->environmentVersion() << "(" << job->targetPlatform() << ") " << job->jobID() << endl;
+                throw myexception(EXIT_DISTCC_FAILED);   // the scheduler didn't listen to us!
+            }
+
+            // with little memory left rather use the disk
+            if (tmpfs_outputs && mem_limit >= TMPFS_MIN_MEM) {
+                on_tmpfs = mount_output_tmpfs(dirname + _PATH_TMP, mem_limit, user_uid, user_gid);
+            }
+
+            chdir_to_environment(client, dirname, user_uid, user_gid);
+        } else {
+            error_client(client, "empty environment");
+            log_error() << "Empty environment (" << job->targetPlatform() << ") " << job->jobID() << endl;
+            throw myexception(EXIT_DISTCC_FAILED);
         }
 
-        delete msg;
+    } catch (const myexception &e) {
+        delete client;
         delete job;
-
         _exit(e.exitcode());
     }
+
+    ret = compile_job(job, client, out_fd, mem_limit, on_tmpfs, cache_fd);
+    delete client;
+    delete job;
+    _exit(ret);
 }
@@ -29,10 +29,18 @@
 class CompileJob;
 class MsgChannel;
 
+// with less memory than this per job (in MB) the outputs go to the disk
+#define TMPFS_MIN_MEM 200
+
 extern int nice_level;
 
+bool mount_output_tmpfs(const std::string &dir, unsigned int size_mb, uid_t user_uid, gid_t user_gid);
+int compile_job(CompileJob *job, MsgChannel *client, int out_fd,
+                unsigned int mem_limit, bool on_tmpfs, int cache_fd);
+
 int handle_connection(const std::string &basedir, CompileJob *job,
                       MsgChannel *serv, int & out_fd,
-                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid);
+                      unsigned int mem_limit, uid_t user_uid, gid_t user_gid,
+                      const std::string &objcachedir, bool tmpfs_outputs);
 
 #endif
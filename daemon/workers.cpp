@@ -0,0 +1,579 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <vector>
+
+#include <comm.h>
+#include <job.h>
+#include "environment.h"
+#include "logging.h"
+#include "poller.h"
+#include "serve.h"
+#include "workit.h"
+#include "workers.h"
+
+#ifndef _PATH_TMP
+#define _PATH_TMP "/tmp"
+#endif
+
+using namespace std;
+
+// how long a worker waits for its next job, in seconds
+#define WORKER_IDLE_TIMEOUT 300
+// a worker exits after this many jobs, so what it leaked doesn't pile up
+#define WORKER_MAX_JOBS 500
+// the largest job message, with what the daemon read from the client already
+#define WORKER_MSG_SIZE (1024 * 1024)
+
+static void put_uint(string &buf, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i) {
+        buf += char(v >> (i * 8));
+    }
+}
+
+static void put_string(string &buf, const string &s)
+{
+    put_uint(buf, s.size());
+    buf += s;
+}
+
+static void put_list(string &buf, const list<string> &l)
+{
+    put_uint(buf, l.size());
+
+    for (list<string>::const_iterator it = l.begin(); it != l.end(); ++it) {
+        put_string(buf, *it);
+    }
+}
+
+// takes a job message apart, ok is false once something didn't fit
+struct JobReader {
+    JobReader(const char *_data, size_t _len) : data(_data), len(_len), pos(0), ok(true) {}
+
+    uint32_t get_uint()
+    {
+        uint32_t v = 0;
+
+        if (len - pos < 4) {
+            ok = false;
+            return 0;
+        }
+
+        for (int i = 0; i < 4; ++i) {
+            v |= uint32_t((unsigned char) data[pos++]) << (i * 8);
+        }
+
+        return v;
+    }
+
+    string get_string()
+    {
+        uint32_t l = get_uint();
+
+        if (len - pos < l) {
+            ok = false;
+            return string();
+        }
+
+        pos += l;
+        return string(data + pos - l, l);
+    }
+
+    void get_list(ArgumentsList &args, Argument_Type type)
+    {
+        for (uint32_t n = get_uint(); ok && n > 0; --n) {
+            args.append(get_string(), type);
+        }
+    }
+
+    const char *data;
+    size_t len;
+    size_t pos;
+    bool ok;
+};
+
+/* Everything handle_connection() gets, but the environment and the
+   object cache, and what was read from the client after the job.  */
+static string job_message(CompileJob *job, MsgChannel *client, unsigned int mem_limit)
+{
+    string buf;
+    put_uint(buf, client->protocol);
+    put_uint(buf, client->peer_compressions());
+    put_uint(buf, mem_limit);
+    put_uint(buf, job->language());
+    put_uint(buf, job->jobID());
+    put_list(buf, job->remoteFlags());
+    put_list(buf, job->restFlags());
+    put_string(buf, job->environmentVersion());
+    put_string(buf, job->targetPlatform());
+    put_string(buf, job->compilerName());
+    put_string(buf, job->inputFile());
+    put_string(buf, job->workingDirectory());
+    put_string(buf, job->outputFile());
+    put_uint(buf, job->dwarfFissionEnabled());
+    put_string(buf, client->buffered_input());
+    return buf;
+}
+
+/* Receives a job message into BUF, with the client's connection and the
+   pipe for the statistics in FDS.  The length, 0 at the end.  */
+static ssize_t receive_job(int sock, vector<char> &buf, int fds[2])
+{
+    fds[0] = fds[1] = -1;
+
+    struct iovec iov;
+    iov.iov_base = &buf[0];
+    iov.iov_len = buf.size();
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    ssize_t len;
+
+    do {
+#ifdef MSG_CMSG_CLOEXEC
+        len = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+#else
+        len = recvmsg(sock, &mh, 0);
+#endif
+    } while (len < 0 && errno == EINTR);
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+                && cmsg->cmsg_len >= CMSG_LEN(2 * sizeof(int)) && fds[0] < 0) {
+            memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+            fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+            fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    if (len < 0) {
+        log_perror("recvmsg()");
+    }
+
+    return len;
+}
+
+static void send_ready(int sock)
+{
+    char ready = 1;
+
+    while (write(sock, &ready, 1) < 0 && errno == EINTR) {}
+}
+
+/* The worker process, set up like a child of handle_connection() once and
+   then running the jobs from SOCK until the daemon closes it.  */
+static void worker_main(int sock, const string &dirname, unsigned int mem_limit,
+                        uid_t user_uid, gid_t user_gid, bool tmpfs_outputs)
+{
+    // the daemon's handler does nothing in its children
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGALRM, SIG_DFL);
+
+    /* Nothing of the daemon may stay open here, least of all its client
+       connections, which this keeps around for much longer than a job.  */
+    close_debug();
+
+    if (sock != STDERR_FILENO + 1) {
+        dup2(sock, STDERR_FILENO + 1);
+        sock = STDERR_FILENO + 1;
+    }
+
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    close_fds_from(sock + 1, getdtablesize());
+    reset_debug(0);
+
+    errno = 0;
+    int niceval = nice(nice_level);
+    (void) niceval;
+    if (errno != 0) {
+        log_warning() << "failed to set nice value: " << strerror(errno)
+                      << endl;
+    }
+
+    bool on_tmpfs = false;
+
+    if (tmpfs_outputs && mem_limit >= TMPFS_MIN_MEM) {
+        on_tmpfs = mount_output_tmpfs(dirname + _PATH_TMP, mem_limit, user_uid, user_gid);
+    }
+
+    chdir_to_environment(0, dirname, user_uid, user_gid);
+    trace() << "worker " << getpid() << " ready in " << dirname << endl;
+
+    vector<char> buf(WORKER_MSG_SIZE);
+
+    for (int jobs = 0; jobs < WORKER_MAX_JOBS; ++jobs) {
+        int fds[2];
+        ssize_t len = receive_job(sock, buf, fds);
+
+        if (len <= 0 || fds[0] < 0) {
+            if (fds[0] >= 0) {
+                close(fds[0]);
+                close(fds[1]);
+            }
+
+            break;
+        }
+
+        JobReader r(&buf[0], len);
+        int protocol = r.get_uint();
+        uint32_t compressions = r.get_uint();
+        unsigned int job_mem_limit = r.get_uint();
+        CompileJob *job = new CompileJob;
+        job->setLanguage((CompileJob::Language) r.get_uint());
+        job->setJobID(r.get_uint());
+        ArgumentsList args;
+        r.get_list(args, Arg_Remote);
+        r.get_list(args, Arg_Rest);
+        job->setFlags(args);
+        job->setEnvironmentVersion(r.get_string());
+        job->setTargetPlatform(r.get_string());
+        job->setCompilerName(r.get_string());
+        job->setInputFile(r.get_string());
+        job->setWorkingDirectory(r.get_string());
+        job->setOutputFile(r.get_string());
+        job->setDwarfFissionEnabled(r.get_uint());
+        string input = r.get_string();
+        MsgChannel *client = 0;
+
+        if (!r.ok) {
+            log_error() << "worker got a broken job" << endl;
+            close(fds[0]);
+        } else {
+            client = Service::adoptChannel(fds[0], protocol, compressions, input);
+        }
+
+        if (client) {
+            trace() << "worker " << getpid() << " compiles job " << job->jobID() << endl;
+            compile_job(job, client, fds[1], job_mem_limit, on_tmpfs, -1);
+            delete client;
+        } else {
+            close(fds[1]);
+        }
+
+        delete job;
+
+        // a compiler that got killed may not have been waited for
+        for (;;) {
+            if (waitpid(-1, 0, 0) < 0 && errno != EINTR) {
+                break;
+            }
+        }
+
+        if (!r.ok) {
+            break;
+        }
+
+        flush_debug();
+        send_ready(sock);
+    }
+
+    flush_debug();
+    _exit(0);
+}
+
+WorkerPool::WorkerPool()
+    : poller(0)
+    , max_workers(0)
+    , user_uid(0)
+    , user_gid(0)
+    , tmpfs_outputs(false)
+{
+}
+
+void WorkerPool::setup(unsigned int _max_workers, uid_t _user_uid, gid_t _user_gid, bool _tmpfs_outputs)
+{
+    max_workers = _max_workers;
+    user_uid = _user_uid;
+    user_gid = _user_gid;
+    tmpfs_outputs = _tmpfs_outputs;
+}
+
+bool WorkerPool::start_worker(const string &env, const string &dirname,
+                              unsigned int mem_limit, int &fd)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        log_perror("socketpair()");
+        return false;
+    }
+
+    int size = 2 * WORKER_MSG_SIZE;
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    flush_debug();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        log_perror("fork()");
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(sv[0]);
+        worker_main(sv[1], dirname, mem_limit, user_uid, user_gid, tmpfs_outputs);
+    }
+
+    close(sv[1]);
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+
+    // the first job waits in the socket until it's set up
+    Worker &w = workers[sv[0]];
+    w.pid = pid;
+    w.env = env;
+    w.busy = false;
+    w.idle_since = time(0);
+    fd = sv[0];
+    trace() << "started worker " << pid << " for " << env << endl;
+    return true;
+}
+
+void WorkerPool::stop_worker(int fd)
+{
+    map<int, Worker>::iterator it = workers.find(fd);
+
+    if (it == workers.end()) {
+        return;
+    }
+
+    // it exits once it's done with what it has, the daemon reaps it
+    trace() << "stopping worker " << it->second.pid << " for " << it->second.env << endl;
+
+    if (poller) {
+        poller->remove(fd);
+    }
+
+    close(fd);
+    workers.erase(it);
+}
+
+bool WorkerPool::start_job(const string &env, const string &dirname, CompileJob *job,
+                           MsgChannel *client, unsigned int mem_limit, int &out_fd, pid_t &pid)
+{
+    if (!max_workers) {
+        return false;
+    }
+
+    // the object cache is outside of the environment, and handle_connection()
+    // also has the error messages for an environment that isn't there
+    if (!job->cacheKey().empty() || ::access(string(dirname + "/usr/bin/as").c_str(), X_OK)) {
+        return false;
+    }
+
+    string msg = job_message(job, client, mem_limit);
+
+    if (msg.size() > WORKER_MSG_SIZE) {
+        return false;
+    }
+
+    int fd = -1;
+    int oldest_idle = -1;
+
+    for (map<int, Worker>::const_iterator it = workers.begin(); it != workers.end(); ++it) {
+        if (it->second.busy) {
+            continue;
+        }
+
+        if (it->second.env == env) {
+            fd = it->first;
+            break;
+        }
+
+        if (oldest_idle < 0 || it->second.idle_since < workers[oldest_idle].idle_since) {
+            oldest_idle = it->first;
+        }
+    }
+
+    if (fd < 0) {
+        // make room by stopping the one of another environment waiting longest
+        if (workers.size() >= max_workers) {
+            if (oldest_idle < 0) {
+                return false;
+            }
+
+            stop_worker(oldest_idle);
+        }
+
+        if (!start_worker(env, dirname, mem_limit, fd)) {
+            return false;
+        }
+    }
+
+    int report[2];
+
+    if (pipe(report) < 0) {
+        log_perror("pipe()");
+        return false;
+    }
+
+    int pass[2] = { client->fd, report[1] };
+    struct iovec iov;
+    iov.iov_base = const_cast<char *>(msg.data());
+    iov.iov_len = msg.size();
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(pass))];
+    } control;
+
+    memset(&control, 0, sizeof(control));
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(pass));
+    memcpy(CMSG_DATA(cmsg), pass, sizeof(pass));
+
+    ssize_t sent;
+
+    while ((sent = sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0 && errno == EINTR) {}
+
+    close(report[1]);
+
+    if (sent != ssize_t(msg.size())) {
+        if (errno != EMSGSIZE) {
+            log_perror("passing job to worker");
+            stop_worker(fd);
+        }
+
+        close(report[0]);
+        return false;
+    }
+
+    fcntl(report[0], F_SETFD, FD_CLOEXEC);
+
+    Worker &w = workers[fd];
+    w.busy = true;
+    out_fd = report[0];
+    pid = w.pid;
+    trace() << "passed job " << job->jobID() << " to worker " << pid << endl;
+    return true;
+}
+
+void WorkerPool::get_fds(set<int> &fds) const
+{
+    for (map<int, Worker>::const_iterator it = workers.begin(); it != workers.end(); ++it) {
+        fds.insert(it->first);
+    }
+}
+
+void WorkerPool::handle_input(int fd)
+{
+    map<int, Worker>::iterator it = workers.find(fd);
+
+    if (it == workers.end()) {
+        return;
+    }
+
+    char ready;
+    ssize_t n;
+
+    while ((n = read(fd, &ready, 1)) < 0 && errno == EINTR) {}
+
+    if (n <= 0) {
+        trace() << "worker " << it->second.pid << " for " << it->second.env << " exited" << endl;
+
+        if (poller) {
+            poller->remove(fd);
+        }
+
+        close(fd);
+        workers.erase(it);
+        return;
+    }
+
+    it->second.busy = false;
+    it->second.idle_since = time(0);
+}
+
+void WorkerPool::expire()
+{
+    time_t now = time(0);
+    vector<int> expired;
+
+    for (map<int, Worker>::const_iterator it = workers.begin(); it != workers.end(); ++it) {
+        if (!it->second.busy && now - it->second.idle_since > WORKER_IDLE_TIMEOUT) {
+            expired.push_back(it->first);
+        }
+    }
+
+    for (vector<int>::const_iterator it = expired.begin(); it != expired.end(); ++it) {
+        stop_worker(*it);
+    }
+}
+
+void WorkerPool::stop(const string &env)
+{
+    vector<int> stopped;
+
+    for (map<int, Worker>::const_iterator it = workers.begin(); it != workers.end(); ++it) {
+        if (env.empty() || it->second.env == env) {
+            stopped.push_back(it->first);
+        }
+    }
+
+    for (vector<int>::const_iterator it = stopped.begin(); it != stopped.end(); ++it) {
+        stop_worker(*it);
+    }
+}
+
+string WorkerPool::dump() const
+{
+    unsigned int busy = 0;
+
+    for (map<int, Worker>::const_iterator it = workers.begin(); it != workers.end(); ++it) {
+        busy += it->second.busy;
+    }
+
+    return toString(workers.size()) + " (busy: " + toString(busy) + ", max: " + toString(max_workers) + ")";
+}
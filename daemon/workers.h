@@ -0,0 +1,95 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_WORKERS_H
+#define ICECREAM_WORKERS_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <sys/types.h>
+#include <time.h>
+
+class CompileJob;
+class MsgChannel;
+class Poller;
+
+/* Processes that wait in an environment for compile jobs, chrooted and
+   running as the user for the jobs already, so that a job needs neither a
+   fork of the daemon nor the setup of the environment.  A job is passed to
+   one over a unix socket, together with the client's connection and a pipe
+   for the statistics, which the worker writes like the child forked by
+   handle_connection().  It answers with a byte when it's ready for the
+   next one and exits when the daemon closes its socket.  */
+class WorkerPool
+{
+public:
+    WorkerPool();
+
+    void setup(unsigned int max_workers, uid_t user_uid, gid_t user_gid, bool tmpfs_outputs);
+
+    /* Passes JOB for the environment ENV (target/version as in the
+       daemon's envs_last_use), which is in DIRNAME, to an idle worker,
+       starting one if needed.  On success PID is the worker's and OUT_FD
+       the pipe where it reports the job done, like handle_connection().
+       False if the job has to be forked for after all.  */
+    bool start_job(const std::string &env, const std::string &dirname, CompileJob *job,
+                   MsgChannel *client, unsigned int mem_limit, int &out_fd, pid_t &pid);
+
+    // the sockets to the workers, to poll for
+    void get_fds(std::set<int> &fds) const;
+    bool handles(int fd) const
+    {
+        return workers.count(fd) > 0;
+    }
+    // reads what the worker at FD said
+    void handle_input(int fd);
+
+    // stops the idle ones not used for too long
+    void expire();
+    // stops the workers of ENV, or all with an empty one
+    void stop(const std::string &env = std::string());
+
+    std::string dump() const;
+
+    // if set, the sockets get removed from it when they are closed
+    Poller *poller;
+
+private:
+    struct Worker {
+        pid_t pid;
+        std::string env;
+        bool busy;
+        time_t idle_since;
+    };
+
+    bool start_worker(const std::string &env, const std::string &dirname,
+                      unsigned int mem_limit, int &fd);
+    void stop_worker(int fd);
+
+    // by the daemon's end of the socket
+    std::map<int, Worker> workers;
+    unsigned int max_workers;
+    uid_t user_uid;
+    gid_t user_gid;
+    bool tmpfs_outputs;
+};
+
+#endif
@@ -46,6 +46,9 @@
 #  include <sys/user.h>
 #endif
 #include <sys/socket.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #if defined(__FreeBSD__) || defined(__DragonFly__) || defined(__APPLE__)
 #ifndef RUSAGE_SELF
@@ -61,12 +64,15 @@
 #include <string>
 
 #include "comm.h"
+#include "hash.h"
 #include "platform.h"
 #include "util.h"
 
 using namespace std;
 
-static int death_pipe[2];
+extern char **environ;
+
+static int death_pipe[2] = { -1, -1 };
 
 extern "C" {
 
@@ -86,15 +92,132 @@ error_client(MsgChannel *client, string error)
     }
 }
 
+/* Closes the pipes of a job that are still open when work_it() returns,
+   which it does from all over the place.  */
+class PipeCloser
+{
+public:
+    PipeCloser() : count(0) {}
+
+    ~PipeCloser() {
+        for (int i = 0; i < count; ++i) {
+            if (*fds[i] >= 0) {
+                close(*fds[i]);
+                *fds[i] = -1;
+            }
+        }
+    }
+
+    void add(int pair[2]) {
+        fds[count++] = &pair[0];
+        fds[count++] = &pair[1];
+    }
+
+private:
+    int *fds[10];
+    int count;
+};
+
+/* Closes all file descriptors from FIRST on, without allocating or
+   logging, so also in a child that shares our memory.  Without a system
+   call for it only the ones below LIMIT.  */
+void close_fds_from(int first, int limit)
+{
+#if defined(__linux__) && defined(SYS_close_range)
+    if (syscall(SYS_close_range, first, ~0U, 0) == 0) {
+        return;
+    }
+#endif
+
+    for (int fd = first; fd < limit; ++fd) {
+        close(fd);
+    }
+}
+
+/* What went wrong in the child before it could exec the compiler.  */
+struct StartErrors {
+    volatile int rlimit_errno;
+    volatile int chdir_errno;
+    volatile int exec_errno;
+};
+
+/* Runs the compiler ARGV in WORK_DIR with the given ends of the pipes.  The
+   child borrows our memory until it has exec'd the compiler, so it only
+   makes system calls, and everything it needs is ready by now.  A function
+   of its own, so that nothing of work_it() has to survive the vfork() in a
+   register.  */
+static pid_t __attribute__((noinline))
+start_compiler(char **argv, char **envp, const char *work_dir, const struct rlimit *rlim,
+               int in_fd, int out_fd, int err_fd, int result_pipe, StartErrors *errors)
+{
+    // no handler of ours may run in the child
+    sigset_t all_signals, old_mask;
+    sigfillset(&all_signals);
+    sigprocmask(SIG_SETMASK, &all_signals, &old_mask);
+
+    flush_debug();
+    pid_t pid = vfork();
+
+    if (pid == 0) {
+        for (int sig = 1; sig < NSIG; ++sig) {
+            struct sigaction sa;
+
+            if (sigaction(sig, 0, &sa) == 0 && sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL) {
+                sa.sa_handler = SIG_DFL;
+                sigaction(sig, &sa, 0);
+            }
+        }
+
+        sigprocmask(SIG_SETMASK, &old_mask, 0);
+
+#ifdef RLIMIT_AS
+        if (setrlimit(RLIMIT_AS, rlim)) {
+            errors->rlimit_errno = errno;
+        }
+#else
+        (void) rlim;
+#endif
+
+        if (chdir(work_dir) != 0) {
+            errors->chdir_errno = errno;
+        }
+
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(err_fd, STDERR_FILENO);
+        dup2(in_fd, STDIN_FILENO);
+
+        // the compiler gets nothing else of ours, like the log file
+        int result_fd = STDERR_FILENO + 1;
+
+        if (result_pipe != result_fd) {
+            dup2(result_pipe, result_fd);
+        }
+
+        fcntl(result_fd, F_SETFD, FD_CLOEXEC);
+        // what is above this was opened with FD_CLOEXEC anyway
+        close_fds_from(result_fd + 1, 4096);
+
+        execve(argv[0], argv, envp);    // no return
+        errors->exec_errno = errno;
+
+        char resultByte = 1;
+        ignore_result(write(result_fd, &resultByte, 1));
+        _exit(-1);
+    }
+
+    sigprocmask(SIG_SETMASK, &old_mask, 0);
+    return pid;
+}
+
 /*
- * This is all happening in a forked child.
- * That means that we can block and be lazy about closing fds
- * (in the error cases which exit quickly).
+ * This is happening in a child of the daemon, forked for the job or
+ * waiting in the environment for jobs.  The error cases close what they
+ * opened only as far as the compiler's fds go.
  */
 
 int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileResultMsg &rmsg,
             const std::string &tmp_root, const std::string &build_path, const std::string &file_name,
-            unsigned long int mem_limit, int client_fd, int /*job_in_fd*/)
+            unsigned long int mem_limit, int client_fd, int /*job_in_fd*/, Sha256 *input_hash)
 {
     rmsg.out.erase(rmsg.out.begin(), rmsg.out.end());
     rmsg.out.erase(rmsg.out.begin(), rmsg.out.end());
@@ -106,11 +229,24 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
         list.push_back("-gsplit-dwarf");
     }
 
-    int sock_err[2];
-    int sock_out[2];
-    int sock_in[2];
-    int main_sock[2];
+    int sock_err[2] = { -1, -1 };
+    int sock_out[2] = { -1, -1 };
+    int sock_in[2] = { -1, -1 };
+    int main_sock[2] = { -1, -1 };
     char buffer[4096];
+    PipeCloser closer;
+
+    closer.add(sock_err);
+    closer.add(sock_out);
+    closer.add(sock_in);
+    closer.add(main_sock);
+    closer.add(death_pipe);
+
+    // Safety check
+    if (getuid() == 0 || getgid() == 0) {
+        error_client(client, "UID is 0 - aborting.");
+        return 142;
+    }
 
     if (pipe(sock_err)) {
         return EXIT_DISTCC_FAILED;
@@ -163,177 +299,169 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
     // Make sure we don't block this signal. gdb tends to do that :-(
     sigprocmask(SIG_UNBLOCK, &act.sa_mask, 0);
 
-    flush_debug();
-    pid_t pid = fork();
-
-    if (pid == -1) {
-        return EXIT_OUT_OF_MEMORY;
-    } else if (pid == 0) {
-
-        setenv("PATH", "/usr/bin", 1);
-
-        // Safety check
-        if (getuid() == 0 || getgid() == 0) {
-            error_client(client, "UID is 0 - aborting.");
-            _exit(142);
-        }
+    struct rlimit rlim;
 
 #ifdef RLIMIT_AS
-        struct rlimit rlim;
-
-        if (getrlimit(RLIMIT_AS, &rlim)) {
-            error_client(client, "getrlimit failed.");
-            log_perror("getrlimit");
-        }
-
-        rlim.rlim_cur = mem_limit * 1024 * 1024;
-        rlim.rlim_max = mem_limit * 1024 * 1024;
-
-        if (setrlimit(RLIMIT_AS, &rlim)) {
-            error_client(client, "setrlimit failed.");
-            log_perror("setrlimit");
-        }
+    if (getrlimit(RLIMIT_AS, &rlim)) {
+        error_client(client, "getrlimit failed.");
+        log_perror("getrlimit");
+    }
 
+    rlim.rlim_cur = mem_limit * 1024 * 1024;
+    rlim.rlim_max = mem_limit * 1024 * 1024;
 #endif
 
-        int argc = list.size();
-        argc++; // the program
-        argc += 6; // -x c - -o file.o -fpreprocessed
-        argc += 4; // gpc parameters
-        argc += 1; // -pipe
-        argc += 9; // clang extra flags
-        char **argv = new char*[argc + 1];
-        int i = 0;
-        bool clang = false;
-
-        if (IS_PROTOCOL_30(client)) {
-            assert(!j.compilerName().empty());
-            clang = (j.compilerName().find("clang") != string::npos);
-            argv[i++] = strdup(("/usr/bin/" + j.compilerName()).c_str());
+    int argc = list.size();
+    argc++; // the program
+    argc += 6; // -x c - -o file.o -fpreprocessed
+    argc += 4; // gpc parameters
+    argc += 1; // -pipe
+    argc += 9; // clang extra flags
+    char **argv = new char*[argc + 1];
+    int i = 0;
+    bool clang = false;
+
+    if (IS_PROTOCOL_30(client)) {
+        assert(!j.compilerName().empty());
+        clang = (j.compilerName().find("clang") != string::npos);
+        argv[i++] = strdup(("/usr/bin/" + j.compilerName()).c_str());
+    } else {
+        if (j.language() == CompileJob::Lang_C) {
+            argv[i++] = strdup("/usr/bin/gcc");
+        } else if (j.language() == CompileJob::Lang_CXX) {
+            argv[i++] = strdup("/usr/bin/g++");
         } else {
-            if (j.language() == CompileJob::Lang_C) {
-                argv[i++] = strdup("/usr/bin/gcc");
-            } else if (j.language() == CompileJob::Lang_CXX) {
-                argv[i++] = strdup("/usr/bin/g++");
-            } else {
-                assert(0);
-            }
+            assert(0);
         }
+    }
 
-        argv[i++] = strdup("-x");
-        argv[i++] = strdup((j.language() == CompileJob::Lang_CXX) ? "c++" : "c");
-
-        if( clang ) {
-            // gcc seems to handle setting main file name and working directory fine
-            // (it gets it from the preprocessed info), but clang needs help
-            if( !j.inputFile().empty()) {
-                argv[i++] = strdup("-Xclang");
-                argv[i++] = strdup("-main-file-name");
-                argv[i++] = strdup("-Xclang");
-                argv[i++] = strdup(j.inputFile().c_str());
-            }
-            if( !j.workingDirectory().empty()) {
-                argv[i++] = strdup("-Xclang");
-                argv[i++] = strdup("-fdebug-compilation-dir");
-                argv[i++] = strdup("-Xclang");
-                argv[i++] = strdup(j.workingDirectory().c_str());
-            }
+    argv[i++] = strdup("-x");
+    argv[i++] = strdup((j.language() == CompileJob::Lang_CXX) ? "c++" : "c");
+
+    if( clang ) {
+        // gcc seems to handle setting main file name and working directory fine
+        // (it gets it from the preprocessed info), but clang needs help
+        if( !j.inputFile().empty()) {
+            argv[i++] = strdup("-Xclang");
+            argv[i++] = strdup("-main-file-name");
+            argv[i++] = strdup("-Xclang");
+            argv[i++] = strdup(j.inputFile().c_str());
+        }
+        if( !j.workingDirectory().empty()) {
+            argv[i++] = strdup("-Xclang");
+            argv[i++] = strdup("-fdebug-compilation-dir");
+            argv[i++] = strdup("-Xclang");
+            argv[i++] = strdup(j.workingDirectory().c_str());
         }
+    }
+
+    bool hasPipe = false;
 
-        // HACK: If in / , Clang records DW_AT_name with / prepended .
-        if (chdir((tmp_root + build_path).c_str()) != 0) {
-            error_client(client, "/tmp dir missing?");
+    for (std::list<string>::const_iterator it = list.begin();
+            it != list.end(); ++it) {
+        if (*it == "-pipe") {
+            hasPipe = true;
         }
 
-        bool hasPipe = false;
+        argv[i++] = strdup(it->c_str());
+    }
 
-        for (std::list<string>::const_iterator it = list.begin();
-                it != list.end(); ++it) {
-            if (*it == "-pipe") {
-                hasPipe = true;
-            }
+    if (!clang) {
+        argv[i++] = strdup("-fpreprocessed");
+    }
 
-            argv[i++] = strdup(it->c_str());
-        }
+    if (!hasPipe) {
+        argv[i++] = strdup("-pipe");
+    }
 
-        if (!clang) {
-            argv[i++] = strdup("-fpreprocessed");
-        }
+    argv[i++] = strdup("-");
+    argv[i++] = strdup("-o");
+    argv[i++] = strdup(file_name.c_str());
+
+    if (!clang) {
+        argv[i++] = strdup("--param");
+        sprintf(buffer, "ggc-min-expand=%d", ggc_min_expand_heuristic(mem_limit));
+        argv[i++] = strdup(buffer);
+        argv[i++] = strdup("--param");
+        sprintf(buffer, "ggc-min-heapsize=%d", ggc_min_heapsize_heuristic(mem_limit));
+        argv[i++] = strdup(buffer);
+    }
 
-        if (!hasPipe) {
-            argv[i++] = strdup("-pipe");
-        }
+    if (clang) {
+        argv[i++] = strdup("-no-canonical-prefixes");    // otherwise clang tries to access /proc/self/exe
+    }
 
-        argv[i++] = strdup("-");
-        argv[i++] = strdup("-o");
-        argv[i++] = strdup(file_name.c_str());
-
-        if (!clang) {
-            argv[i++] = strdup("--param");
-            sprintf(buffer, "ggc-min-expand=%d", ggc_min_expand_heuristic(mem_limit));
-            argv[i++] = strdup(buffer);
-            argv[i++] = strdup("--param");
-            sprintf(buffer, "ggc-min-heapsize=%d", ggc_min_heapsize_heuristic(mem_limit));
-            argv[i++] = strdup(buffer);
-        }
+    if (!clang && j.dwarfFissionEnabled()) {
+        sprintf(buffer, "-fdebug-prefix-map=%s/=/", tmp_root.c_str());
+        argv[i++] = strdup(buffer);
+    }
 
-        if (clang) {
-            argv[i++] = strdup("-no-canonical-prefixes");    // otherwise clang tries to access /proc/self/exe
-        }
+    // before you add new args, check above for argc
+    argv[i] = 0;
+    assert(i <= argc);
 
-        if (!clang && j.dwarfFissionEnabled()) {
-            sprintf(buffer, "-fdebug-prefix-map=%s/=/", tmp_root.c_str());
-            argv[i++] = strdup(buffer);
-        }
+    // our environment, but with the PATH of the environment
+    int envc = 0;
 
-        // before you add new args, check above for argc
-        argv[i] = 0;
-        assert(i <= argc);
+    while (environ[envc]) {
+        envc++;
+    }
 
-        close_debug();
+    char **envp = new char*[envc + 2];
+    int k = 0;
 
-        close(sock_out[0]);
-        dup2(sock_out[1], STDOUT_FILENO);
-        close(sock_out[1]);
+    for (int e = 0; e < envc; ++e) {
+        if (strncmp(environ[e], "PATH=", 5)) {
+            envp[k++] = environ[e];
+        }
+    }
 
-        close(sock_err[0]);
-        dup2(sock_err[1], STDERR_FILENO);
-        close(sock_err[1]);
+    envp[k++] = const_cast<char *>("PATH=/usr/bin");
+    envp[k] = 0;
 
-        close(sock_in[1]);
-        dup2(sock_in[0], STDIN_FILENO);
-        close(sock_in[0]);
+    // HACK: If in / , Clang records DW_AT_name with / prepended .
+    string work_dir = tmp_root + build_path;
 
-        close(main_sock[0]);
-        fcntl(main_sock[1], F_SETFD, FD_CLOEXEC);
+    StartErrors errors;
+    errors.rlimit_errno = errors.chdir_errno = errors.exec_errno = 0;
+    pid_t pid = start_compiler(argv, envp, work_dir.c_str(), &rlim, sock_in[0], sock_out[1],
+                               sock_err[1], main_sock[1], &errors);
 
-        close(death_pipe[0]);
-        close(death_pipe[1]);
+    for (int a = 0; argv[a]; ++a) {
+        free(argv[a]);
+    }
 
-#ifdef ICECC_DEBUG
+    delete[] argv;
+    delete[] envp;
 
-        for (int f = STDERR_FILENO + 1; f < 4096; ++f) {
-            long flags;
-            assert((flags = fcntl(f, F_GETFD, 0)) < 0 || (flags & FD_CLOEXEC));
-        }
+    if (pid == -1) {
+        return EXIT_OUT_OF_MEMORY;
+    }
 
-#endif
+    if (errors.rlimit_errno) {
+        error_client(client, "setrlimit failed.");
+        log_error() << "setrlimit: " << strerror(errors.rlimit_errno) << endl;
+    }
 
-        execv(argv[0], const_cast<char * const*>(argv));    // no return
-        perror("ICECC: execv");
+    if (errors.chdir_errno) {
+        error_client(client, "/tmp dir missing?");
+    }
 
-        char resultByte = 1;
-        ignore_result(write(main_sock[1], &resultByte, 1));
-        _exit(-1);
+    if (errors.exec_errno) {
+        log_error() << "execve " << j.compilerName() << ": " << strerror(errors.exec_errno) << endl;
     }
 
     close(sock_in[0]);
+    sock_in[0] = -1;
     close(sock_out[1]);
+    sock_out[1] = -1;
     close(sock_err[1]);
+    sock_err[1] = -1;
 
     // idea borrowed from kprocess.
     // check whether the compiler could be run at all.
     close(main_sock[1]);
+    main_sock[1] = -1;
 
     for (;;) {
         char resultByte;
@@ -354,6 +482,7 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
     }
 
     close(main_sock[0]);
+    main_sock[0] = -1;
 
     struct timeval starttv;
     gettimeofday(&starttv, 0);
@@ -392,8 +521,17 @@ int work_it(CompileJob &j, unsigned int job_stat[], MsgChannel *client, CompileR
                         fcmsg = static_cast<FileChunkMsg*>(msg);
                         off = 0;
 
+                        if (input_hash) {
+                            input_hash->update(fcmsg->buffer, fcmsg->len);
+                        }
+
                         job_stat[JobStatistics::in_uncompressed] += fcmsg->len;
                         job_stat[JobStatistics::in_compressed] += fcmsg->compressed;
+
+                        // chunks that don't compress are sent uncompressed
+                        if (fcmsg->compression != COMPRESSION_NONE) {
+                            job_stat[JobStatistics::in_compression] = fcmsg->compression;
+                        }
                     } else {
                         log_error() << "protocol error while reading preprocessed file" << endl;
                         return_value = EXIT_IO_ERROR;
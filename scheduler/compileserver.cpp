@@ -132,7 +132,7 @@ string CompileServer::can_install(const Job *job)
         return string();
     }
 
-    Environments environments = job->environments();
+    const Environments &environments = job->environments();
     for (Environments::const_iterator it = environments.begin();
             it != environments.end(); ++it) {
         if (platforms_compatible(it->first) && !blacklisted(job, *it)) {
@@ -176,7 +176,7 @@ void CompileServer::setHostId(unsigned int id)
     m_hostId = id;
 }
 
-string CompileServer::nodeName() const
+const string &CompileServer::nodeName() const
 {
     return m_nodeName;
 }
@@ -201,7 +201,7 @@ void CompileServer::setBusyInstalling(time_t time)
     m_busyInstalling = time;
 }
 
-string CompileServer::hostPlatform() const
+const string &CompileServer::hostPlatform() const
 {
     return m_hostPlatform;
 }
@@ -241,7 +241,7 @@ void CompileServer::setNoRemote(bool value)
     m_noRemote = value;
 }
 
-list<Job *> CompileServer::jobList() const
+const list<Job *> &CompileServer::jobList() const
 {
     return m_jobList;
 }
@@ -301,7 +301,7 @@ void CompileServer::setChrootPossible(const bool possible)
     m_chrootPossible = possible;
 }
 
-Environments CompileServer::compilerVersions() const
+const Environments &CompileServer::compilerVersions() const
 {
     return m_compilerVersions;
 }
@@ -311,7 +311,7 @@ void CompileServer::setCompilerVersions(const Environments &environments)
     m_compilerVersions = environments;
 }
 
-list<JobStat> CompileServer::lastCompiledJobs() const
+const list<JobStat> &CompileServer::lastCompiledJobs() const
 {
     return m_lastCompiledJobs;
 }
@@ -326,7 +326,7 @@ void CompileServer::popCompiledJob()
     m_lastCompiledJobs.pop_front();
 }
 
-list<JobStat> CompileServer::lastRequestedJobs() const
+const list<JobStat> &CompileServer::lastRequestedJobs() const
 {
     return m_lastRequestedJobs;
 }
@@ -376,7 +376,7 @@ void CompileServer::eraseClientJobId(const int localJobId)
     m_clientMap.erase(localJobId);
 }
 
-map<CompileServer *, Environments> CompileServer::blacklist() const
+const map<CompileServer *, Environments> &CompileServer::blacklist() const
 {
     return m_blacklist;
 }
@@ -398,6 +398,12 @@ void CompileServer::eraseCSFromBlacklist(CompileServer *cs)
 
 bool CompileServer::blacklisted(const Job *job, const pair<string, string> &environment)
 {
-    Environments blacklist = job->submitter()->getEnvsForBlacklistedCS(this);
-    return find(blacklist.begin(), blacklist.end(), environment) != blacklist.end();
+    const map<CompileServer *, Environments> &blacklists = job->submitter()->blacklist();
+    map<CompileServer *, Environments>::const_iterator it = blacklists.find(this);
+
+    if (it == blacklists.end()) {
+        return false;
+    }
+
+    return find(it->second.begin(), it->second.end(), environment) != it->second.end();
 }
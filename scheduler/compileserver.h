@@ -66,7 +66,7 @@ public:
     unsigned int hostId() const;
     void setHostId(const unsigned int id);
 
-    string nodeName() const;
+    const string &nodeName() const;
     void setNodeName(const string &name);
 
     bool matches(const string& nm) const;
@@ -74,7 +74,7 @@ public:
     time_t busyInstalling() const;
     void setBusyInstalling(const time_t time);
 
-    string hostPlatform() const;
+    const string &hostPlatform() const;
     void setHostPlatform(const string &platform);
 
     unsigned int load() const;
@@ -86,7 +86,7 @@ public:
     bool noRemote() const;
     void setNoRemote(const bool value);
 
-    list<Job *> jobList() const;
+    const list<Job *> &jobList() const;
     void appendJob(Job *job);
     void removeJob(Job *job);
 
@@ -103,14 +103,14 @@ public:
     bool chrootPossible() const;
     void setChrootPossible(const bool possible);
 
-    Environments compilerVersions() const;
+    const Environments &compilerVersions() const;
     void setCompilerVersions(const Environments &environments);
 
-    list<JobStat> lastCompiledJobs() const;
+    const list<JobStat> &lastCompiledJobs() const;
     void appendCompiledJob(const JobStat &stats);
     void popCompiledJob();
 
-    list<JobStat> lastRequestedJobs() const;
+    const list<JobStat> &lastRequestedJobs() const;
     void appendRequestedJobs(const JobStat &stats);
     void popRequestedJobs();
 
@@ -127,7 +127,7 @@ public:
     void insertClientJobId(const int localJobId, const int newJobId);
     void eraseClientJobId(const int localJobId);
 
-    map<CompileServer *, Environments> blacklist() const;
+    const map<CompileServer *, Environments> &blacklist() const;
     Environments getEnvsForBlacklistedCS(CompileServer *cs);
     void blacklistCompileServer(CompileServer *cs, const std::pair<std::string, std::string> &env);
     void eraseCSFromBlacklist(CompileServer *cs);
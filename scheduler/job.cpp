@@ -41,6 +41,13 @@ Job::Job(const unsigned int _id, CompileServer *subm)
     , m_language()
     , m_preferredHost()
     , m_minimalHostVersion(0)
+    , m_expectedWork(0)
+    , m_requestTime(0)
+    , m_assignTime(0)
+    , m_inputSize(0)
+    , m_leaseExpiry(0)
+    , m_batchIndex(0)
+    , m_cacheKey()
 {
     m_submitter->submittedJobsIncrement();
 }
@@ -103,7 +110,7 @@ void Job::setSubmitter(CompileServer *submitter)
     m_submitter = submitter;
 }
 
-Environments Job::environments() const
+const Environments &Job::environments() const
 {
     return m_environments;
 }
@@ -153,7 +160,7 @@ void Job::setDoneTime(const time_t time)
     m_doneTime = time;
 }
 
-std::string Job::targetPlatform() const
+const std::string &Job::targetPlatform() const
 {
     return m_targetPlatform;
 }
@@ -163,7 +170,7 @@ void Job::setTargetPlatform(const std::string &platform)
     m_targetPlatform = platform;
 }
 
-std::string Job::fileName() const
+const std::string &Job::fileName() const
 {
     return m_fileName;
 }
@@ -173,7 +180,7 @@ void Job::setFileName(const std::string &fileName)
     m_fileName = fileName;
 }
 
-std::list<Job *> Job::masterJobFor() const
+const std::list<Job *> &Job::masterJobFor() const
 {
     return m_masterJobFor;
 }
@@ -193,7 +200,7 @@ void Job::setArgFlags(const unsigned int argFlags)
     m_argFlags = argFlags;
 }
 
-std::string Job::language() const
+const std::string &Job::language() const
 {
     return m_language;
 }
@@ -203,7 +210,7 @@ void Job::setLanguage(const std::string &language)
     m_language = language;
 }
 
-std::string Job::preferredHost() const
+const std::string &Job::preferredHost() const
 {
     return m_preferredHost;
 }
@@ -222,3 +229,73 @@ void Job::setMinimalHostVersion(int version)
 {
     m_minimalHostVersion = version;
 }
+
+unsigned long Job::expectedWork() const
+{
+    return m_expectedWork;
+}
+
+void Job::setExpectedWork(const unsigned long work)
+{
+    m_expectedWork = work;
+}
+
+unsigned long Job::requestTime() const
+{
+    return m_requestTime;
+}
+
+void Job::setRequestTime(const unsigned long msec)
+{
+    m_requestTime = msec;
+}
+
+unsigned long Job::assignTime() const
+{
+    return m_assignTime;
+}
+
+void Job::setAssignTime(const unsigned long msec)
+{
+    m_assignTime = msec;
+}
+
+unsigned int Job::inputSize() const
+{
+    return m_inputSize;
+}
+
+void Job::setInputSize(const unsigned int size)
+{
+    m_inputSize = size;
+}
+
+time_t Job::leaseExpiry() const
+{
+    return m_leaseExpiry;
+}
+
+void Job::setLeaseExpiry(const time_t time)
+{
+    m_leaseExpiry = time;
+}
+
+unsigned int Job::batchIndex() const
+{
+    return m_batchIndex;
+}
+
+void Job::setBatchIndex(const unsigned int index)
+{
+    m_batchIndex = index;
+}
+
+const std::string &Job::cacheKey() const
+{
+    return m_cacheKey;
+}
+
+void Job::setCacheKey(const std::string &key)
+{
+    m_cacheKey = key;
+}
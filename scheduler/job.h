@@ -59,7 +59,7 @@ public:
     CompileServer *submitter() const;
     void setSubmitter(CompileServer *submitter);
 
-    Environments environments() const;
+    const Environments &environments() const;
     void setEnvironments(const Environments &environments);
     void appendEnvironment(const std::pair<std::string, std::string> &env);
     void clearEnvironments();
@@ -73,27 +73,48 @@ public:
     time_t doneTime() const;
     void setDoneTime(const time_t time);
 
-    std::string targetPlatform() const;
+    const std::string &targetPlatform() const;
     void setTargetPlatform(const std::string &platform);
 
-    std::string fileName() const;
+    const std::string &fileName() const;
     void setFileName(const std::string &fileName);
 
-    std::list<Job *> masterJobFor() const;
+    const std::list<Job *> &masterJobFor() const;
     void appendJob(Job *job);
 
     unsigned int argFlags() const;
     void setArgFlags(const unsigned int argFlags);
 
-    std::string language() const;
+    const std::string &language() const;
     void setLanguage(const std::string &language);
 
-    std::string preferredHost() const;
+    const std::string &preferredHost() const;
     void setPreferredHost(const std::string &host);
 
     int minimalHostVersion() const;
     void setMinimalHostVersion( int version );
 
+    unsigned long expectedWork() const;
+    void setExpectedWork(const unsigned long work);
+
+    unsigned long requestTime() const;
+    void setRequestTime(const unsigned long msec);
+
+    unsigned long assignTime() const;
+    void setAssignTime(const unsigned long msec);
+
+    unsigned int inputSize() const;
+    void setInputSize(const unsigned int size);
+
+    time_t leaseExpiry() const;
+    void setLeaseExpiry(const time_t time);
+
+    unsigned int batchIndex() const;
+    void setBatchIndex(const unsigned int index);
+
+    const std::string &cacheKey() const;
+    void setCacheKey(const std::string &key);
+
 private:
     unsigned int m_id;
     unsigned int m_localClientId;
@@ -118,6 +139,13 @@ private:
     std::string m_language; // for debugging
     std::string m_preferredHost; // for debugging daemons
     int m_minimalHostVersion; // minimal version required for the the remote server
+    unsigned long m_expectedWork; // guessed when picking the server, see JobStat::outputSize()
+    unsigned long m_requestTime; // msec after the scheduler started that the job was asked for
+    unsigned long m_assignTime; // same for when it got a server
+    unsigned int m_inputSize; // size of the source file, 0 if the client didn't tell
+    time_t m_leaseExpiry; // while leased to the submitter, but not used yet, else 0
+    unsigned int m_batchIndex; // which source of a batched request this is for
+    std::string m_cacheKey; // see CompileJob::cacheKey(), if the client wants it cached
 };
 
 #endif
@@ -25,6 +25,7 @@
 
 JobStat::JobStat()
     : m_outputSize(0)
+    , m_inputSize(0)
     , m_compileTimeReal(0)
     , m_compileTimeUser(0)
     , m_compileTimeSys(0)
@@ -42,6 +43,16 @@ void JobStat::setOutputSize(unsigned long size)
     m_outputSize = size;
 }
 
+unsigned long JobStat::inputSize() const
+{
+    return m_inputSize;
+}
+
+void JobStat::setInputSize(unsigned long size)
+{
+    m_inputSize = size;
+}
+
 unsigned long JobStat::compileTimeReal() const
 {
     return m_compileTimeReal;
@@ -85,6 +96,7 @@ void JobStat::setJobId(unsigned int id)
 JobStat &JobStat::operator+(const JobStat &st)
 {
     m_outputSize += st.m_outputSize;
+    m_inputSize += st.m_inputSize;
     m_compileTimeReal += st.m_compileTimeReal;
     m_compileTimeUser += st.m_compileTimeUser;
     m_compileTimeSys +=  st.m_compileTimeSys;
@@ -100,6 +112,7 @@ JobStat &JobStat::operator+=(const JobStat &st)
 JobStat &JobStat::operator-(const JobStat &st)
 {
     m_outputSize -= st.m_outputSize;
+    m_inputSize -= st.m_inputSize;
     m_compileTimeReal -= st.m_compileTimeReal;
     m_compileTimeUser -= st.m_compileTimeUser;
     m_compileTimeSys -= st.m_compileTimeSys;
@@ -122,6 +135,7 @@ JobStat JobStat::operator/(int d) const
 JobStat &JobStat::operator/=(int d)
 {
     m_outputSize /= d;
+    m_inputSize /= d;
     m_compileTimeReal /= d;
     m_compileTimeUser /= d;
     m_compileTimeSys /= d;
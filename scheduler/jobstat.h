@@ -31,6 +31,9 @@ public:
     unsigned long outputSize() const;
     void setOutputSize(unsigned long size);
 
+    unsigned long inputSize() const;
+    void setInputSize(unsigned long size);
+
     unsigned long compileTimeReal() const;
     void setCompileTimeReal(unsigned long time);
 
@@ -57,6 +60,7 @@ public:
 
 private:
     unsigned long m_outputSize;  // output size (uncompressed)
+    unsigned long m_inputSize;  // source file size as told by the client, 0 if not known
     unsigned long m_compileTimeReal;  // in milliseconds
     unsigned long m_compileTimeUser;
     unsigned long m_compileTimeSys;
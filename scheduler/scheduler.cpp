@@ -32,6 +32,8 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <sys/signal.h>
 #include <unistd.h>
 #include <errno.h>
@@ -42,16 +44,21 @@
 #include <string>
 #include <list>
 #include <map>
+#include <set>
+#include <vector>
 #include <queue>
 #include <algorithm>
 #include <cassert>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <stdio.h>
+#include <float.h>
 #include <pwd.h>
 #include "../services/comm.h"
 #include "../services/logging.h"
 #include "../services/job.h"
+#include "../services/poller.h"
 #include "config.h"
 
 #include "compileserver.h"
@@ -94,6 +101,9 @@ using namespace std;
 static string pidFilePath;
 
 static map<int, CompileServer *> fd2cs;
+static Poller poller;
+// set when messages may have been read ahead outside of the main loop
+static bool check_buffered_msgs = false;
 static volatile sig_atomic_t exit_main_loop = false;
 
 time_t starttime;
@@ -120,9 +130,176 @@ static list<UnansweredList *> toanswer;
 static list<JobStat> all_job_stats;
 static JobStat cum_job_stats;
 
+/* Input transfer statistics per compression type, as reported by the compile servers.  */
+struct CompressionStats {
+    CompressionStats()
+        : jobs(0), compressed(0), uncompressed(0), decompress_usec(0) {}
+    unsigned int jobs;
+    unsigned long long compressed;
+    unsigned long long uncompressed;
+    unsigned long long decompress_usec;
+};
+static map<uint32_t, CompressionStats> compression_stats;
+
+/* How pick_server() chooses among the servers that could take a job.  */
+enum SchedulingPolicy {
+    // the fastest server, with some rules to spread the environments
+    POLICY_FASTEST,
+    // the one with the earliest predicted completion of the job
+    POLICY_EARLIEST_FINISH
+};
+static SchedulingPolicy scheduling_policy = POLICY_EARLIEST_FINISH;
+
+/* Recent work of the jobs by the flags that influence it, see work_flags().  */
+struct FlagsWork {
+    FlagsWork()
+        : output(0), jobs(0) {}
+    double output; // normalized, see normalized_output()
+    unsigned int jobs;
+};
+static map<unsigned int, FlagsWork> work_by_flags;
+
+// average time it takes a server to install an environment it got sent
+static float env_install_msec = 5000;
+
+// if open, done jobs get written there for --replay
+static ofstream job_record;
+
+/* Average time a remote job takes besides the compile itself: connecting,
+   sending the source over and maybe installing the environment.  */
+static float remote_overhead_msec = 200;
+
+/* Distribution of durations, for telling whether builds wait for the
+   scheduler or for the compile servers.  The buckets grow by a factor of
+   4 from 1 usec to about 18 minutes, the last one takes all longer.  */
+#define HISTOGRAM_BUCKETS 16
+struct Histogram {
+    Histogram()
+        : count(0), sum_usec(0)
+    {
+        memset(buckets, 0, sizeof(buckets));
+    }
+
+    static unsigned long long bucket_limit(int bucket)
+    {
+        return 1ULL << (2 * bucket);
+    }
+
+    void add(unsigned long long usec)
+    {
+        int bucket = 0;
+
+        while (bucket < HISTOGRAM_BUCKETS && usec > bucket_limit(bucket)) {
+            ++bucket;
+        }
+
+        ++buckets[bucket];
+        ++count;
+        sum_usec += usec;
+    }
+
+    // upper limit of the bucket the given fraction of the durations is in
+    unsigned long long quantile(double fraction) const
+    {
+        unsigned long long seen = 0;
+
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+            seen += buckets[bucket];
+
+            if (seen && seen >= fraction * count) {
+                return bucket_limit(bucket);
+            }
+        }
+
+        return bucket_limit(HISTOGRAM_BUCKETS);
+    }
+
+    unsigned long long buckets[HISTOGRAM_BUCKETS + 1];
+    unsigned long long count;
+    unsigned long long sum_usec;
+};
+
+enum HistogramId {
+    HIST_QUEUE_WAIT, // from GetCS to sending UseCS
+    HIST_PICK_SERVER, // one call of pick_server()
+    HIST_JOB_BEGIN, // from sending UseCS to JobBegin from the server
+    HIST_ENV_INSTALL, // from sending an environment to the relogin of the server
+    HIST_COUNT
+};
+static Histogram histograms[HIST_COUNT];
+static const char *const histogram_names[HIST_COUNT] = {
+    "queue_wait", "pick_server", "job_begin", "env_install"
+};
+
+// runs of empty_queue() that found no server for any queued job
+static unsigned long long idle_queue_runs;
+// if set, the metrics get written there for collecting
+static string metrics_file;
+#define METRICS_WRITE_INTERVAL 15
+
+/* Submitters with many jobs going get unused slots of the server picked for
+   one of their jobs leased, as placeholder jobs whose ids their daemon can
+   hand out for the same kind of job for a while without asking us, see
+   LeaseMsg.  That saves the round trip to us for each job of a big build.  */
+// unused leased slots per submitter and server at most
+#define LEASE_SLOTS 2
+// jobs a submitter has to have going to get leases
+#define LEASE_MIN_JOBS 4
+// seconds the daemon may hand out a leased job id
+#define LEASE_TTL 5
+// seconds after which we take back an unused one, for the latency to the daemon
+#define LEASE_GRACE 3
+// ids of the leased jobs not used yet
+static set<unsigned int> leased_jobs;
+
+/* Where the results of recent jobs with a cache key were compiled, their
+   object cache has them, unless it dropped them meanwhile.  */
+#define CACHED_RESULTS 100000
+static map<string, string> cached_results; // key -> node name
+static queue<string> cached_results_order; // oldest first
+
 static float server_speed(CompileServer *cs, Job *job = 0);
+static void rank_server(CompileServer *cs);
 static void broadcast_scheduler_version();
 
+/* The logged in daemons, ordered by how well suited they are for a job
+   that wasn't submitted by themselves: those with a free slot first, each
+   part by descending projected speed.  */
+struct ServerRank {
+    ServerRank()
+        : full(true), speed(0), host_id(0), cs(0) {}
+    bool full; // no free slot, or too much load
+    float speed;
+    unsigned int host_id;
+    CompileServer *cs;
+
+    bool operator<(const ServerRank &other) const
+    {
+        if (full != other.full) {
+            return !full;
+        }
+
+        if (speed != other.speed) {
+            return speed > other.speed;
+        }
+
+        return host_id < other.host_id;
+    }
+};
+typedef set<ServerRank> ServerRanking;
+
+struct IndexedServer {
+    ServerRank rank;
+    Environments envs; // as inserted into env_servers
+};
+
+/* Index for pick_server(), kept up to date by index_server(), rank_server()
+   and unindex_server() whenever something the order depends on changes.  */
+static map<CompileServer *, IndexedServer> indexed_servers;
+static ServerRanking ranked_servers;
+// (target platform, environment name) -> daemons having that installed
+static map<pair<string, string>, ServerRanking> env_servers;
+
 /* Searches the queue for JOB and removes it.
    Returns true if something was deleted.  */
 bool UnansweredList::remove_job(Job *job)
@@ -138,6 +315,77 @@ bool UnansweredList::remove_job(Job *job)
     return false;
 }
 
+static void add_channel(CompileServer *cs)
+{
+    fd2cs[cs->fd] = cs;
+    poller.add(cs->fd);
+}
+
+/* Daemons and monitors often get several small messages while handling
+   one round of events, those are sent together at the end of it.  */
+static set<CompileServer *> corked_channels;
+
+static void remove_channel(CompileServer *cs)
+{
+    fd2cs.erase(cs->fd);
+    poller.remove(cs->fd);
+    corked_channels.erase(cs);
+}
+
+static void cork_channel(CompileServer *cs)
+{
+    if (corked_channels.insert(cs).second) {
+        cs->cork();
+    }
+}
+
+static bool handle_end(CompileServer *cs, Msg *);
+
+static void uncork_channels()
+{
+    while (!corked_channels.empty()) {
+        CompileServer *cs = *corked_channels.begin();
+        corked_channels.erase(corked_channels.begin());
+
+        /* Like for single messages, monitors that can't keep up are
+           simply closed.  */
+        if (!cs->uncork(cs->type() != CompileServer::MONITOR)) {
+            trace() << "failed to send queued messages to " << cs->nodeName() << endl;
+            handle_end(cs, 0);
+        }
+    }
+}
+
+/* The argument flags that make a difference in how much work a job is.  */
+static unsigned int work_flags(unsigned int arg_flags)
+{
+    return arg_flags & (CompileJob::Flag_g | CompileJob::Flag_g3 | CompileJob::Flag_O
+                        | CompileJob::Flag_O2 | CompileJob::Flag_Ol2);
+}
+
+/* The output size of a job, scaled to make jobs with different flags
+   comparable as a measure of the work they were.  */
+static unsigned long normalized_output(unsigned long out_uncompressed, unsigned int arg_flags)
+{
+    unsigned long size = out_uncompressed;
+
+    if (arg_flags & CompileJob::Flag_g) {
+        size = size * 10 / 36;    // average over 1900 jobs: faktor 3.6 in osize
+    } else if (arg_flags & CompileJob::Flag_g3) {
+        size = size * 10 / 45;    // average over way less jobs: factor 1.25 over -g
+    }
+
+    // the difference between the -O flags isn't as big as the one between -O0 and -O>=1
+    // the numbers are actually for gcc 3.3 - but they are _very_ rough heurstics anyway)
+    if (arg_flags & CompileJob::Flag_O
+            || arg_flags & CompileJob::Flag_O2
+            || arg_flags & CompileJob::Flag_Ol2) {
+        size = size * 58 / 35;
+    }
+
+    return size;
+}
+
 static void add_job_stats(Job *job, JobDoneMsg *msg)
 {
     JobStat st;
@@ -154,19 +402,8 @@ static void add_job_stats(Job *job, JobDoneMsg *msg)
     st.setCompileTimeSys(msg->sys_msec);
     st.setJobId(job->id());
 
-    if (job->argFlags() & CompileJob::Flag_g) {
-        st.setOutputSize(st.outputSize() * 10 / 36);    // average over 1900 jobs: faktor 3.6 in osize
-    } else if (job->argFlags() & CompileJob::Flag_g3) {
-        st.setOutputSize(st.outputSize() * 10 / 45);    // average over way less jobs: factor 1.25 over -g
-    }
-
-    // the difference between the -O flags isn't as big as the one between -O0 and -O>=1
-    // the numbers are actually for gcc 3.3 - but they are _very_ rough heurstics anyway)
-    if (job->argFlags() & CompileJob::Flag_O
-            || job->argFlags() & CompileJob::Flag_O2
-            || job->argFlags() & CompileJob::Flag_Ol2) {
-        st.setOutputSize(st.outputSize() * 58 / 35);
-    }
+    st.setOutputSize(normalized_output(msg->out_uncompressed, job->argFlags()));
+    st.setInputSize(job->inputSize());
 
     if (job->server()->lastCompiledJobs().size() >= 7) {
         /* Smooth out spikes by not allowing one job to add more than
@@ -199,9 +436,21 @@ static void add_job_stats(Job *job, JobDoneMsg *msg)
         job->submitter()->popRequestedJobs();
     }
 
+    rank_server(job->server());
+
     all_job_stats.push_back(st);
     cum_job_stats += st;
 
+    FlagsWork &flags_work = work_by_flags[work_flags(job->argFlags())];
+    flags_work.output += st.outputSize();
+    flags_work.jobs++;
+
+    // let old jobs fade out
+    if (flags_work.jobs > 400) {
+        flags_work.output /= 2;
+        flags_work.jobs /= 2;
+    }
+
     if (all_job_stats.size() > 2000) {
         cum_job_stats -= *all_job_stats.begin();
         all_job_stats.pop_front();
@@ -225,7 +474,219 @@ static void add_job_stats(Job *job, JobDoneMsg *msg)
 #endif
 }
 
-static bool handle_end(CompileServer *cs, Msg *);
+/* The speed statistics are kept in a file across restarts of the scheduler,
+   so it doesn't have to learn all servers again.  Only the sums and counts
+   are saved, the jobs are restored as that many average ones.  */
+
+// what a node had learned when it disconnected or the stats were saved
+struct NodeStats {
+    NodeStats()
+        : last_seen(0), compiled_jobs(0), requested_jobs(0) {}
+    time_t last_seen;
+    unsigned int compiled_jobs;
+    JobStat compiled;
+    unsigned int requested_jobs;
+    JobStat requested;
+};
+// by node name and host platform
+static map<pair<string, string>, NodeStats> node_stats;
+static string stats_file;
+
+// save every 5 minutes, and forget nodes not seen for 30 days
+#define STATS_SAVE_INTERVAL 300
+#define STATS_MAX_AGE (30 * 24 * 3600)
+
+static void write_job_stat(ostream &out, const JobStat &st)
+{
+    out << st.outputSize() << " " << st.inputSize() << " " << st.compileTimeReal()
+        << " " << st.compileTimeUser() << " " << st.compileTimeSys();
+}
+
+static bool read_job_stat(istream &in, JobStat &st)
+{
+    unsigned long output, input, real, user, sys;
+
+    if (!(in >> output >> input >> real >> user >> sys)) {
+        return false;
+    }
+
+    st.setOutputSize(output);
+    st.setInputSize(input);
+    st.setCompileTimeReal(real);
+    st.setCompileTimeUser(user);
+    st.setCompileTimeSys(sys);
+    return true;
+}
+
+static void remember_stats(CompileServer *cs)
+{
+    if (cs->nodeName().empty()) {
+        return;
+    }
+
+    NodeStats &stats = node_stats[make_pair(cs->nodeName(), cs->hostPlatform())];
+    stats.last_seen = time(0);
+    stats.compiled_jobs = cs->lastCompiledJobs().size();
+    stats.compiled = cs->cumCompiled();
+    stats.requested_jobs = cs->lastRequestedJobs().size();
+    stats.requested = cs->cumRequested();
+}
+
+static void restore_stats(CompileServer *cs)
+{
+    map<pair<string, string>, NodeStats>::const_iterator it
+        = node_stats.find(make_pair(cs->nodeName(), cs->hostPlatform()));
+
+    if (it == node_stats.end() || !cs->lastCompiledJobs().empty() || !cs->lastRequestedJobs().empty()) {
+        return;
+    }
+
+    const NodeStats &stats = it->second;
+
+    if (stats.compiled_jobs) {
+        JobStat average = stats.compiled / stats.compiled_jobs;
+
+        for (unsigned int i = 0; i < stats.compiled_jobs; ++i) {
+            cs->appendCompiledJob(average);
+            cs->setCumCompiled(cs->cumCompiled() + average);
+        }
+    }
+
+    if (stats.requested_jobs) {
+        JobStat average = stats.requested / stats.requested_jobs;
+
+        for (unsigned int i = 0; i < stats.requested_jobs; ++i) {
+            cs->appendRequestedJobs(average);
+            cs->setCumRequested(cs->cumRequested() + average);
+        }
+    }
+
+    trace() << "restored stats of " << cs->nodeName() << ": " << stats.compiled_jobs
+            << " compiled, " << stats.requested_jobs << " requested" << endl;
+}
+
+static void load_stats()
+{
+    if (stats_file.empty()) {
+        return;
+    }
+
+    ifstream in(stats_file.c_str());
+
+    if (!in) {
+        if (errno != ENOENT) {
+            log_perror("open stats file");
+        }
+
+        return;
+    }
+
+    string line;
+
+    if (!getline(in, line) || line != "icecc-scheduler-stats 1") {
+        log_error() << "unknown format of stats file " << stats_file << endl;
+        return;
+    }
+
+    time_t now = time(0);
+
+    while (getline(in, line)) {
+        istringstream fields(line);
+        string kind;
+        fields >> kind;
+
+        if (kind == "node") {
+            string name, platform;
+            NodeStats stats;
+
+            if (fields >> name >> platform >> stats.last_seen >> stats.compiled_jobs
+                    && read_job_stat(fields, stats.compiled) && fields >> stats.requested_jobs
+                    && read_job_stat(fields, stats.requested)
+                    && stats.last_seen + STATS_MAX_AGE > now) {
+                node_stats[make_pair(name, platform)] = stats;
+            }
+        } else if (kind == "all") {
+            unsigned int count;
+            JobStat sum;
+
+            if (fields >> count && read_job_stat(fields, sum) && count) {
+                JobStat average = sum / count;
+                all_job_stats.clear();
+                cum_job_stats = JobStat();
+
+                for (unsigned int i = 0; i < count; ++i) {
+                    all_job_stats.push_back(average);
+                    cum_job_stats += average;
+                }
+            }
+        } else if (kind == "flags") {
+            unsigned int flags;
+            FlagsWork work;
+
+            if (fields >> flags >> work.output >> work.jobs) {
+                work_by_flags[flags] = work;
+            }
+        } else if (kind == "install") {
+            fields >> env_install_msec;
+        } else if (kind == "overhead") {
+            fields >> remote_overhead_msec;
+        }
+    }
+
+    log_info() << "loaded stats of " << node_stats.size() << " nodes and " << all_job_stats.size()
+               << " jobs from " << stats_file << endl;
+}
+
+static void save_stats()
+{
+    if (stats_file.empty()) {
+        return;
+    }
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+        remember_stats(*it);
+    }
+
+    // write a new file and rename it, so a crash can't leave half of it
+    string tmp_file = stats_file + ".tmp";
+    ofstream out(tmp_file.c_str(), ios::out | ios::trunc);
+
+    if (!out) {
+        log_perror("open stats file");
+        return;
+    }
+
+    out << "icecc-scheduler-stats 1" << endl;
+
+    for (map<pair<string, string>, NodeStats>::const_iterator it = node_stats.begin();
+            it != node_stats.end(); ++it) {
+        const NodeStats &stats = it->second;
+        out << "node " << it->first.first << " " << it->first.second << " "
+            << stats.last_seen << " " << stats.compiled_jobs << " ";
+        write_job_stat(out, stats.compiled);
+        out << " " << stats.requested_jobs << " ";
+        write_job_stat(out, stats.requested);
+        out << endl;
+    }
+
+    out << "all " << all_job_stats.size() << " ";
+    write_job_stat(out, cum_job_stats);
+    out << endl;
+
+    for (map<unsigned int, FlagsWork>::const_iterator it = work_by_flags.begin();
+            it != work_by_flags.end(); ++it) {
+        out << "flags " << it->first << " " << it->second.output << " " << it->second.jobs << endl;
+    }
+
+    out << "install " << env_install_msec << endl;
+    out << "overhead " << remote_overhead_msec << endl;
+    out.close();
+
+    if (!out || rename(tmp_file.c_str(), stats_file.c_str()) != 0) {
+        log_perror("write stats file");
+        unlink(tmp_file.c_str());
+    }
+}
 
 static void notify_monitors(Msg *m)
 {
@@ -234,6 +695,7 @@ static void notify_monitors(Msg *m)
 
     for (it = monitors.begin(); it != monitors.end();) {
         it_old = it++;
+        cork_channel(*it_old);
 
         /* If we can't send it, don't be clever, simply close this monitor.  */
         if (!(*it_old)->send_msg(*m, MsgChannel::SendNonBlocking /*| MsgChannel::SendBulkOnly*/)) {
@@ -282,6 +744,86 @@ static float server_speed(CompileServer *cs, Job *job)
     }
 }
 
+static ServerRank current_rank(CompileServer *cs)
+{
+    ServerRank rank;
+    rank.cs = cs;
+    rank.host_id = cs->hostId();
+    rank.full = (int(cs->jobList().size()) >= cs->maxJobs()) || (cs->load() >= 1000);
+    // what server_speed() gives for a job from some other host
+    rank.speed = cs->load() >= 1000 ? 0 : server_speed(cs) * float(1000 - cs->load()) / 1000;
+    return rank;
+}
+
+static void unindex_server(CompileServer *cs)
+{
+    map<CompileServer *, IndexedServer>::iterator it = indexed_servers.find(cs);
+
+    if (it == indexed_servers.end()) {
+        return;
+    }
+
+    const IndexedServer &entry = it->second;
+    ranked_servers.erase(entry.rank);
+
+    for (Environments::const_iterator env = entry.envs.begin(); env != entry.envs.end(); ++env) {
+        map<pair<string, string>, ServerRanking>::iterator servers = env_servers.find(*env);
+
+        if (servers != env_servers.end()) {
+            servers->second.erase(entry.rank);
+
+            if (servers->second.empty()) {
+                env_servers.erase(servers);
+            }
+        }
+    }
+
+    indexed_servers.erase(it);
+}
+
+/* (Re)adds a logged in daemon with its current environments.  */
+static void index_server(CompileServer *cs)
+{
+    unindex_server(cs);
+
+    IndexedServer &entry = indexed_servers[cs];
+    entry.rank = current_rank(cs);
+    entry.envs = cs->compilerVersions();
+    ranked_servers.insert(entry.rank);
+
+    for (Environments::const_iterator env = entry.envs.begin(); env != entry.envs.end(); ++env) {
+        env_servers[*env].insert(entry.rank);
+    }
+}
+
+/* Moves the daemon to its place after its load, jobs or speed changed.  */
+static void rank_server(CompileServer *cs)
+{
+    map<CompileServer *, IndexedServer>::iterator it = indexed_servers.find(cs);
+
+    if (it == indexed_servers.end()) {
+        return;
+    }
+
+    IndexedServer &entry = it->second;
+    ServerRank rank = current_rank(cs);
+
+    if (!(rank < entry.rank) && !(entry.rank < rank)) {
+        return;
+    }
+
+    ranked_servers.erase(entry.rank);
+    ranked_servers.insert(rank);
+
+    for (Environments::const_iterator env = entry.envs.begin(); env != entry.envs.end(); ++env) {
+        ServerRanking &servers = env_servers[*env];
+        servers.erase(entry.rank);
+        servers.insert(rank);
+    }
+
+    entry.rank = rank;
+}
+
 static void handle_monitor_stats(CompileServer *cs, StatsMsg *m = 0)
 {
     if (monitors.empty()) {
@@ -322,12 +864,25 @@ static void handle_monitor_stats(CompileServer *cs, StatsMsg *m = 0)
     notify_monitors(new MonStatsMsg(cs->hostId(), msg));
 }
 
+static unsigned long long usec_now()
+{
+    struct timeval now;
+    gettimeofday(&now, 0);
+    return now.tv_sec * 1000000ULL + now.tv_usec;
+}
+
+static unsigned long msec_since_start()
+{
+    return usec_now() / 1000 - starttime * 1000ULL;
+}
+
 static Job *create_new_job(CompileServer *submitter)
 {
     ++new_job_id;
     assert(jobs.find(new_job_id) == jobs.end());
 
     Job *job = new Job(new_job_id, submitter);
+    job->setRequestTime(msec_since_start());
     jobs[new_job_id] = job;
     return job;
 }
@@ -374,6 +929,90 @@ static void remove_job_request(void)
 }
 
 static string dump_job(Job *job);
+static unsigned long expected_work(Job *job);
+static bool grant_lease(Job *job, CompileServer *cs);
+static bool assign_job(Job *job, CompileServer *cs);
+static bool place_batch(const vector<Job *> &batch);
+
+/* The daemon gave the request described by M the leased job it names.  */
+static bool handle_leased_job(CompileServer *submitter, GetCSMsg *m)
+{
+    map<unsigned int, Job *>::const_iterator it = jobs.find(m->lease_job_id);
+
+    if (it == jobs.end() || it->second->submitter() != submitter) {
+        // the server will tell about it, and we'll ignore it
+        log_warning() << "leased job " << m->lease_job_id << " of " << submitter->nodeName()
+                      << " unknown" << endl;
+        return true;
+    }
+
+    Job *job = it->second;
+    leased_jobs.erase(job->id());
+    job->setLeaseExpiry(0);
+    job->setArgFlags(m->arg_flags);
+    job->setLanguage((m->lang == CompileJob::Lang_C) ? "C" : "C++");
+    job->setFileName(m->filename);
+    job->setLocalClientId(m->client_id);
+    job->setInputSize(m->input_size);
+    job->setRequestTime(msec_since_start());
+    job->setAssignTime(job->requestTime());
+    job->setExpectedWork(expected_work(job));
+    histograms[HIST_QUEUE_WAIT].add(0);
+
+    log_info() << "NEW " << job->id() << " client=" << submitter->nodeName()
+               << " leased on " << job->server()->nodeName() << " " << m->filename
+               << " " << job->language() << endl;
+    notify_monitors(new MonGetCSMsg(job->id(), submitter->hostId(), m));
+
+    return grant_lease(job, job->server());
+}
+
+static bool more_work(const Job *a, const Job *b)
+{
+    return a->expectedWork() > b->expectedWork();
+}
+
+/* Creates a job for each source of the batched request M, biggest
+   first, and places them together, see place_batch().  */
+static bool handle_cs_batch(CompileServer *submitter, GetCSMsg *m)
+{
+    vector<Job *> batch;
+    unsigned int index = 0;
+
+    for (SourceFiles::const_iterator it = m->batch.begin(); it != m->batch.end(); ++it, ++index) {
+        Job *job = create_new_job(submitter);
+        job->setEnvironments(m->versions);
+        job->setTargetPlatform(m->target);
+        job->setArgFlags(m->arg_flags);
+        job->setLanguage((m->lang == CompileJob::Lang_C) ? "C" : "C++");
+        job->setFileName(it->first);
+        job->setLocalClientId(m->client_id);
+        job->setPreferredHost(m->preferred_host);
+        job->setMinimalHostVersion(m->minimal_host_version);
+        job->setInputSize(it->second);
+        job->setBatchIndex(index);
+        job->setExpectedWork(expected_work(job));
+        batch.push_back(job);
+    }
+
+    stable_sort(batch.begin(), batch.end(), more_work);
+
+    GetCSMsg item(*m);
+    item.batch.clear();
+
+    for (vector<Job *>::const_iterator it = batch.begin(); it != batch.end(); ++it) {
+        Job *job = *it;
+        trace() << "NEW " << job->id() << " batch=" << job->batchIndex()
+                << " " << job->fileName() << " work=" << job->expectedWork() << endl;
+        item.filename = job->fileName();
+        item.input_size = job->inputSize();
+        notify_monitors(new MonGetCSMsg(job->id(), submitter->hostId(), &item));
+    }
+
+    log_info() << "NEW batch of " << batch.size() << " jobs client="
+               << submitter->nodeName() << " " << ((m->lang == CompileJob::Lang_C) ? "C" : "C++") << endl;
+    return place_batch(batch);
+}
 
 static bool handle_cs_request(MsgChannel *cs, Msg *_m)
 {
@@ -385,6 +1024,14 @@ static bool handle_cs_request(MsgChannel *cs, Msg *_m)
 
     CompileServer *submitter = static_cast<CompileServer *>(cs);
 
+    if (m->lease_job_id) {
+        return handle_leased_job(submitter, m);
+    }
+
+    if (!m->batch.empty()) {
+        return handle_cs_batch(submitter, m);
+    }
+
     Job *master_job = 0;
 
     for (unsigned int i = 0; i < m->count; ++i) {
@@ -397,6 +1044,8 @@ static bool handle_cs_request(MsgChannel *cs, Msg *_m)
         job->setLocalClientId(m->client_id);
         job->setPreferredHost(m->preferred_host);
         job->setMinimalHostVersion(m->minimal_host_version);
+        job->setInputSize(m->input_size);
+        job->setCacheKey(m->cache_key);
         enqueue_job_request(job);
         std::ostream &dbg = log_info();
         dbg << "NEW " << job->id() << " client="
@@ -468,7 +1117,7 @@ static string envs_match(CompileServer *cs, const Job *job)
         return cs->hostPlatform();    // it will compile itself
     }
 
-    Environments compilerVersions = cs->compilerVersions();
+    const Environments &compilerVersions = cs->compilerVersions();
 
     /* Check all installed envs on the candidate CS ...  */
     for (Environments::const_iterator it = compilerVersions.begin();
@@ -479,7 +1128,7 @@ static string envs_match(CompileServer *cs, const Job *job)
                could be installed from the client (i.e. those coming with the
                job) if it matches in name and additionally could be run
                by the candidate CS.  */
-            Environments environments = job->environments();
+            const Environments &environments = job->environments();
             for (Environments::const_iterator it2 = environments.begin();
                     it2 != environments.end(); ++it2) {
                 if (it->second == it2->second && cs->platforms_compatible(it2->first)) {
@@ -492,6 +1141,239 @@ static string envs_match(CompileServer *cs, const Job *job)
     return string();
 }
 
+// how many daemons that have an environment CS needs it is told about
+#define MAX_ENV_PEERS 4
+
+/* The daemons other than CS that have the environment JOB needs for
+   PLATFORM installed, as host:port, the least busy ones first.  CS can
+   fetch the environment from them instead of from the client.  */
+static list<string> env_peers(CompileServer *cs, const Job *job, const string &platform)
+{
+    list<string> peers;
+    string name;
+    const Environments &environments = job->environments();
+
+    for (Environments::const_iterator it = environments.begin(); it != environments.end(); ++it) {
+        if (it->first == platform) {
+            name = it->second;
+            break;
+        }
+    }
+
+    if (name.empty()) {
+        return peers;
+    }
+
+    const pair<string, string> env(job->targetPlatform(), name);
+    vector<pair<size_t, CompileServer *> > candidates;
+
+    for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+        CompileServer *peer = *it;
+
+        // the ones with --no-remote don't take connections
+        if (peer == cs || peer->noRemote() || !IS_PROTOCOL_45(peer)) {
+            continue;
+        }
+
+        const Environments &installed = peer->compilerVersions();
+
+        if (find(installed.begin(), installed.end(), env) != installed.end()) {
+            candidates.push_back(make_pair(peer->jobList().size(), peer));
+        }
+    }
+
+    sort(candidates.begin(), candidates.end());
+
+    for (size_t i = 0; i < candidates.size() && i < MAX_ENV_PEERS; ++i) {
+        peers.push_back(candidates[i].second->name + ":"
+                        + toString(candidates[i].second->remotePort()));
+    }
+
+    return peers;
+}
+
+/* Checks what the ranking doesn't tell about CS and JOB.  */
+static bool usable_server(CompileServer *cs, Job *job)
+{
+    /* For now ignore overloaded servers.  */
+    /* Pre-loadable (cs->jobList().size()) == (cs->maxJobs()) is fine.  */
+    if ((int(cs->jobList().size()) > cs->maxJobs()) || (cs->load() >= 1000)) {
+#if DEBUG_SCHEDULER > 1
+        trace() << "overloaded " << cs->nodeName() << " " << cs->jobList().size() << "/"
+                <<  cs->maxJobs() << " jobs, load:" << cs->load() << endl;
+#endif
+        return false;
+    }
+
+    // incompatible architecture or busy installing
+    if (!cs->can_install(job).size()) {
+#if DEBUG_SCHEDULER > 2
+        trace() << cs->nodeName() << " can't install " << job->id() << endl;
+#endif
+        return false;
+    }
+
+    /* Don't use non-chroot-able daemons for remote jobs.  XXX */
+    if (!cs->chrootPossible() && cs != job->submitter()) {
+        trace() << cs->nodeName() << " can't use chroot\n";
+        return false;
+    }
+
+    // Check if remote & if remote allowed
+    if (!cs->check_remote(job)) {
+        trace() << cs->nodeName() << " fails remote job check\n";
+        return false;
+    }
+
+    return true;
+}
+
+/* Guesses how much work JOB is, in normalized output bytes like the
+   server speeds.  If the client told the size of the source file, that
+   scales the earlier jobs of the submitter, else jobs with the same
+   optimization and debug flags are the best hint.  */
+static unsigned long expected_work(Job *job)
+{
+    CompileServer *submitter = job->submitter();
+    JobStat requested = submitter->cumRequested();
+
+    /* How much work the source files of the submitter turned out to be
+       scales best to the one of this job.  */
+    if (job->inputSize() && requested.inputSize()) {
+        return (unsigned long)((double) job->inputSize() * requested.outputSize() / requested.inputSize());
+    }
+
+    map<unsigned int, FlagsWork>::const_iterator it = work_by_flags.find(work_flags(job->argFlags()));
+
+    if (it != work_by_flags.end() && it->second.jobs >= 10) {
+        return (unsigned long)(it->second.output / it->second.jobs);
+    }
+
+    if (submitter->lastRequestedJobs().size() > 0) {
+        return submitter->cumRequested().outputSize() / submitter->lastRequestedJobs().size();
+    }
+
+    if (all_job_stats.size() > 0) {
+        return cum_job_stats.outputSize() / all_job_stats.size();
+    }
+
+    return 0;
+}
+
+/* Predicts how many milliseconds it takes until CS has JOB done.  If all
+   its slots are busy, the job first has to wait for its share of their
+   work, and a server without the environment has to install it first.  */
+static float predicted_finish(CompileServer *cs, Job *job, bool installed)
+{
+    float speed = server_speed(cs, job);
+
+    if (speed <= 0) {
+        return FLT_MAX;
+    }
+
+    float msec = job->expectedWork() / speed;
+
+    if (int(cs->jobList().size()) >= cs->maxJobs()) {
+        unsigned long outstanding = 0;
+
+        for (list<Job *>::const_iterator it = cs->jobList().begin(); it != cs->jobList().end(); ++it) {
+            outstanding += (*it)->expectedWork();
+        }
+
+        msec += outstanding / speed / max(cs->maxJobs(), 1);
+    }
+
+    if (!installed) {
+        msec += env_install_msec;
+    }
+
+    return msec;
+}
+
+/* Walks a ranking for the server that has JOB done first.  INSTALLED says
+   whether the servers in it have an environment of the job, ENV_PLATFORM
+   is then the host platform of that.  Within both the free and the busy
+   part the speed only goes down, so stop once not even the plain compile
+   time could beat the best so far.  */
+static void find_earliest_finish(const ServerRanking &servers, Job *job, bool installed,
+                                 const string &env_platform, CompileServer *&best, float &best_msec)
+{
+    ServerRank busy;
+    busy.speed = FLT_MAX;
+    ServerRanking::const_iterator busy_begin = servers.lower_bound(busy);
+    ServerRanking::const_iterator it = servers.begin();
+
+    for (int part = 0; part < 2; ++part) {
+        ServerRanking::const_iterator part_end = part ? servers.end() : busy_begin;
+
+        for (; it != part_end; ++it) {
+            if (it->speed <= 0) {
+                break;
+            }
+
+            float least_msec = job->expectedWork() / it->speed + (installed ? 0 : env_install_msec);
+
+            if (best && least_msec >= best_msec) {
+                break;
+            }
+
+            CompileServer *cs = it->cs;
+
+            if (cs == job->submitter() || !usable_server(cs, job)) {
+                continue;
+            }
+
+            if (installed ? !cs->platforms_compatible(env_platform) : !envs_match(cs, job).empty()) {
+                continue;
+            }
+
+            float msec = predicted_finish(cs, job, installed);
+
+            if (!best || msec < best_msec) {
+                best = cs;
+                best_msec = msec;
+            }
+        }
+
+        it = busy_begin;
+    }
+}
+
+static CompileServer *pick_earliest_finish(Job *job)
+{
+    CompileServer *best = 0;
+    float best_msec = 0;
+    const Environments &environments = job->environments();
+
+    /* The submitter has everything installed, but it's ranked differently
+       for its own jobs.  */
+    CompileServer *submitter = job->submitter();
+
+    if (indexed_servers.count(submitter) && usable_server(submitter, job)) {
+        best = submitter;
+        best_msec = predicted_finish(submitter, job, true);
+    }
+
+    for (Environments::const_iterator env = environments.begin(); env != environments.end(); ++env) {
+        map<pair<string, string>, ServerRanking>::const_iterator servers
+            = env_servers.find(make_pair(job->targetPlatform(), env->second));
+
+        if (servers != env_servers.end()) {
+            find_earliest_finish(servers->second, job, true, env->first, best, best_msec);
+        }
+    }
+
+    find_earliest_finish(ranked_servers, job, false, string(), best, best_msec);
+
+#if DEBUG_SCHEDULER > 1
+    if (best) {
+        trace() << "taking " << best->nodeName() << ", done in " << best_msec << "ms" << endl;
+    }
+#endif
+
+    return best;
+}
+
 static CompileServer *pick_server(Job *job)
 {
 #if DEBUG_SCHEDULER > 1
@@ -530,8 +1412,21 @@ static CompileServer *pick_server(Job *job)
                 return *it;
             }
         }
-
-        return 0;
+
+        return 0;
+    }
+
+    /* Where it was compiled before, it doesn't even need compiling.  */
+    if (!job->cacheKey().empty()) {
+        map<string, string>::const_iterator cached = cached_results.find(job->cacheKey());
+
+        for (list<CompileServer *>::iterator it = css.begin();
+                cached != cached_results.end() && it != css.end(); ++it) {
+            if ((*it)->nodeName() == cached->second && (*it)->is_eligible(job)) {
+                trace() << "result of " << job->id() << " is cached on " << cached->second << endl;
+                return *it;
+            }
+        }
     }
 
     /* If we have no statistics simply use any server which is usable.  */
@@ -557,117 +1452,113 @@ static CompileServer *pick_server(Job *job)
         return 0;
     }
 
-    /* Now guess about the job.  First see, if this submitter already
-       had other jobs.  Use them as base.  */
-    JobStat guess;
-
-    if (job->submitter()->lastRequestedJobs().size() > 0) {
-        guess = job->submitter()->cumRequested()
-                / job->submitter()->lastRequestedJobs().size();
-    } else {
-        /* Otherwise simply average over all jobs.  */
-        guess = cum_job_stats / all_job_stats.size();
-    }
+    job->setExpectedWork(expected_work(job));
 
     CompileServer *best = 0;
     // best uninstalled
     CompileServer *bestui = 0;
-    // best preloadable host
-    CompileServer *bestpre = 0;
 
-    uint matches = 0;
+    /* Make all servers compile a job at least once, so we'll get an
+       idea about their speed.  Those are among the free ones without
+       a speed yet, i.e. at the end of the free part of the ranking.  */
+    ServerRank no_speed;
+    no_speed.full = false;
 
-    for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it) {
-        CompileServer *cs = *it;
+    for (ServerRanking::const_iterator it = ranked_servers.lower_bound(no_speed);
+            it != ranked_servers.end() && !it->full; ++it) {
+        CompileServer *cs = it->cs;
 
-        /* For now ignore overloaded servers.  */
-        /* Pre-loadable (cs->jobList().size()) == (cs->maxJobs()) is checked later.  */
-        if ((int(cs->jobList().size()) > cs->maxJobs()) || (cs->load() >= 1000)) {
-#if DEBUG_SCHEDULER > 1
-            trace() << "overloaded " << cs->nodeName() << " " << cs->jobList().size() << "/"
-                    <<  cs->maxJobs() << " jobs, load:" << cs->load() << endl;
-#endif
-            continue;
-        }
+        if (cs->lastCompiledJobs().size() == 0 && cs->jobList().size() == 0 && cs->maxJobs()
+                && usable_server(cs, job)) {
+            if (!envs_match(cs, job).empty()) {
+                return cs;
+            }
 
-        // incompatible architecture or busy installing
-        if (!cs->can_install(job).size()) {
-#if DEBUG_SCHEDULER > 2
-            trace() << cs->nodeName() << " can't install " << job->id() << endl;
-#endif
-            continue;
+            // if there is one server that already got the environment and one that
+            // hasn't compiled at all, pick the one with environment first
+            if (!bestui) {
+                bestui = cs;
+            }
         }
+    }
 
-        /* Don't use non-chroot-able daemons for remote jobs.  XXX */
-        if (!cs->chrootPossible() && cs != job->submitter()) {
-            trace() << cs->nodeName() << " can't use chroot\n";
-            continue;
-        }
+    if (scheduling_policy == POLICY_EARLIEST_FINISH) {
+        // without a speed there's nothing to predict, so get one first
+        return bestui ? bestui : pick_earliest_finish(job);
+    }
 
-        // Check if remote & if remote allowed
-        if (!cs->check_remote(job)) {
-            trace() << cs->nodeName() << " fails remote job check\n";
+    /* Look for the server with the earliest projected time to compile
+       the job (XXX currently this is equivalent to the fastest one) among
+       those having one of the environments installed.  A server without
+       a free slot is only taken if all are busy, the job is then preloaded.
+       Also count the matches to decide about the install rule below,
+       but we only need to know whether there are enough.  */
+    CompileServer *submitter = job->submitter();
+    uint enough_matches = min(size_t(11), css.size() / 3);
+    set<CompileServer *> matches;
+    const Environments &environments = job->environments();
+
+    for (Environments::const_iterator env = environments.begin(); env != environments.end(); ++env) {
+        map<pair<string, string>, ServerRanking>::const_iterator servers
+            = env_servers.find(make_pair(job->targetPlatform(), env->second));
+
+        if (servers == env_servers.end()) {
             continue;
         }
 
+        for (ServerRanking::const_iterator it = servers->second.begin(); it != servers->second.end(); ++it) {
+            CompileServer *cs = it->cs;
 
-#if DEBUG_SCHEDULER > 1
-        trace() << cs->nodeName() << " compiled " << cs->lastCompiledJobs().size() << " got now: " <<
-                cs->jobList().size() << " speed: " << server_speed(cs, job) << " compile time " <<
-                cs->cumCompiled().compileTimeUser() << " produced code " << cs->cumCompiled().outputSize() << endl;
-#endif
+            if (cs == submitter || !cs->platforms_compatible(env->first)
+                    || !usable_server(cs, job)) {
+                continue;
+            }
 
-        if ((cs->lastCompiledJobs().size() == 0) && (cs->jobList().size() == 0) && cs->maxJobs()) {
-            /* Make all servers compile a job at least once, so we'll get an
-               idea about their speed.  */
-            if (!envs_match(cs, job).empty()) {
+            if (!best || *it < indexed_servers[best].rank) {
                 best = cs;
-                matches++;
-            } else {
-                // if there is one server that already got the environment and one that
-                // hasn't compiled at all, pick the one with environment first
-                bestui = cs;
             }
 
-            break;
-        }
+            matches.insert(cs);
 
-        if (!envs_match(cs, job).empty()) {
-            if (!best) {
-                best = cs;
-            }
-            /* Search the server with the earliest projected time to compile
-               the job.  (XXX currently this is equivalent to the fastest one)  */
-            else if ((best->lastCompiledJobs().size() != 0)
-                     && (server_speed(best, job) < server_speed(cs, job))) {
-                if (int(cs->jobList().size()) < cs->maxJobs()) {
-                    best = cs;
-                } else {
-                    bestpre = cs;
-                }
+            if (matches.size() >= enough_matches) {
+                break;
             }
+        }
+    }
 
-            matches++;
-        } else {
-            if (!bestui) {
+    /* The submitter has everything installed, but it's ranked differently
+       for its own jobs.  */
+    if (indexed_servers.count(submitter) && usable_server(submitter, job)) {
+        matches.insert(submitter);
+        bool free = int(submitter->jobList().size()) < submitter->maxJobs();
+
+        if (!best) {
+            best = submitter;
+        } else if (free && indexed_servers[best].rank.full) {
+            best = submitter;
+        } else if (free == !indexed_servers[best].rank.full
+                   && server_speed(best, job) < server_speed(submitter, job)) {
+            best = submitter;
+        }
+    }
+
+    bool install_rule = (matches.size() < enough_matches) && ((job->id() % 19) != 0);
+
+    if (!bestui && (!best || install_rule)) {
+        /* The best server that could install one of the environments.  */
+        for (ServerRanking::const_iterator it = ranked_servers.begin(); it != ranked_servers.end(); ++it) {
+            CompileServer *cs = it->cs;
+
+            if (cs != submitter && usable_server(cs, job) && envs_match(cs, job).empty()) {
                 bestui = cs;
-            }
-            /* Search the server with the earliest projected time to compile
-               the job.  (XXX currently this is equivalent to the fastest one)  */
-            else if ((bestui->lastCompiledJobs().size() != 0)
-                     && (server_speed(bestui, job) < server_speed(cs, job))) {
-                if (int(cs->jobList().size()) < cs->maxJobs()) {
-                    bestui = cs;
-                } else {
-                    bestpre = cs;
-                }
+                break;
             }
         }
     }
 
     // to make sure we find the fast computers at least after some time, we overwrite
     // the install rule for every 19th job - if the farm is only filled a bit
-    if (bestui && ((matches < 11) && (matches < (css.size() / 3))) && ((job->id() % 19) != 0)) {
+    if (bestui && install_rule) {
         best = 0;
     }
 
@@ -685,13 +1576,325 @@ static CompileServer *pick_server(Job *job)
         return bestui;
     }
 
-    if (bestpre) {
+    return 0;
+}
+
+/* Small jobs are done sooner by the submitter itself than by shipping
+   them to CS, if it has a free slot.  Only decide that with a size hint
+   from the client, without it the guess is the same for all jobs.  */
+static CompileServer *maybe_keep_local(Job *job, CompileServer *cs)
+{
+    CompileServer *submitter = job->submitter();
+
+    if (cs == submitter || !job->inputSize() || !job->preferredHost().empty()
+            || !indexed_servers.count(submitter)
+            || int(submitter->jobList().size()) >= submitter->maxJobs()
+            || !usable_server(submitter, job)) {
+        return cs;
+    }
+
+    float local_speed = server_speed(submitter, job);
+    float remote_speed = server_speed(cs, job);
+
+    if (local_speed <= 0 || remote_speed <= 0) {
+        return cs;
+    }
+
+    float work = expected_work(job);
+
+    if (work / local_speed > work / remote_speed + remote_overhead_msec) {
+        return cs;
+    }
+
+#if DEBUG_SCHEDULER > 1
+    trace() << "keeping " << job->id() << " local, " << job->inputSize() << " bytes" << endl;
+#endif
+    return submitter;
+}
+
+/* A server as place_batch() sees it: when each of its slots is free, in
+   milliseconds from now, and whether it is free right now.  */
+struct BatchServer {
+    CompileServer *cs;
+    float speed;
+    bool installed;
+    vector<pair<float, bool> > slots;
+};
+
+/* Places the jobs of a batch, sorted biggest first, together: each goes
+   to the slot where it is done first, after what the batch put there
+   before it (LPT).  So the long jobs get the fast servers and the short
+   ones fill up behind them or stay with the submitter, instead of each
+   taking the best server that happens to be free.  Jobs planned for a
+   slot that is free now get it right away, the others are queued, as
+   the plan is only a guess.  A server that has to install the
+   environment gets one job now, like in the queue.  Returns false if the
+   submitter is gone.  */
+static bool place_batch(const vector<Job *> &batch)
+{
+    Job *first = batch.front();
+    vector<BatchServer> servers;
+
+    // without speeds there's nothing to plan with, and a preferred host is no choice
+    if (all_job_stats.size() && first->preferredHost().empty()) {
+        for (list<CompileServer *>::const_iterator it = css.begin(); it != css.end(); ++it) {
+            BatchServer server;
+            server.cs = *it;
+            server.speed = server_speed(server.cs, first);
+
+            if (server.cs->maxJobs() <= 0 || server.speed <= 0 || !usable_server(server.cs, first)) {
+                continue;
+            }
+
+            server.installed = !envs_match(server.cs, first).empty();
+            int busy = min(int(server.cs->jobList().size()), server.cs->maxJobs());
+            unsigned long outstanding = 0;
+
+            for (list<Job *>::const_iterator job = server.cs->jobList().begin();
+                    job != server.cs->jobList().end(); ++job) {
+                outstanding += (*job)->expectedWork();
+            }
+
+            float install = server.installed ? 0 : env_install_msec;
+
+            for (int i = 0; i < server.cs->maxJobs(); ++i) {
+                // the busy ones are free when their share of the outstanding work is done
+                float busy_msec = i < busy ? outstanding / server.speed / busy : 0;
+                server.slots.push_back(make_pair(max(busy_msec, install), i >= busy));
+            }
+
+            servers.push_back(server);
+        }
+    }
+
+    for (vector<Job *>::const_iterator it = batch.begin(); it != batch.end(); ++it) {
+        Job *job = *it;
+        BatchServer *best = 0;
+        size_t best_slot = 0;
+        float best_msec = FLT_MAX;
+
+        for (vector<BatchServer>::iterator server = servers.begin(); server != servers.end(); ++server) {
+            size_t slot = 0;
+
+            for (size_t i = 1; i < server->slots.size(); ++i) {
+                if (server->slots[i].first < server->slots[slot].first) {
+                    slot = i;
+                }
+            }
+
+            float msec = server->slots[slot].first + job->expectedWork() / server->speed;
+
+            if (server->cs != job->submitter()) {
+                msec += remote_overhead_msec;
+            }
+
+            if (msec < best_msec) {
+                best = &*server;
+                best_slot = slot;
+                best_msec = msec;
+            }
+        }
+
+        if (!best || !best->slots[best_slot].second) {
+            enqueue_job_request(job);
+        } else if (!assign_job(job, best->cs)) {
+            return false;
+        }
+
+        if (!best) {
+            continue;
+        }
+
+        best->slots[best_slot] = make_pair(best_msec, false);
+
+        if (!best->installed) {
+            for (size_t i = 0; i < best->slots.size(); ++i) {
+                best->slots[i].second = false;
+            }
+
+            best->installed = true;
+        }
+    }
+
+    return true;
+}
+
+static bool same_lease_kind(const Job *a, const Job *b)
+{
+    return a->submitter() == b->submitter() && a->server() == b->server()
+           && a->environments() == b->environments()
+           && a->targetPlatform() == b->targetPlatform()
+           && a->minimalHostVersion() == b->minimalHostVersion();
+}
+
+/* Tops up the slots on CS leased to the submitter of JOB, which just got
+   CS, for jobs like it.  Returns false if the submitter couldn't be told,
+   it and its jobs are gone then.  */
+static bool grant_lease(Job *job, CompileServer *cs)
+{
+    CompileServer *submitter = job->submitter();
+
+    if (cs == submitter || submitter->is_text_based() || !IS_PROTOCOL_41(submitter)
+            || !job->preferredHost().empty() || !job->masterJobFor().empty()
+            || !toanswer.empty() || cs->load() >= 1000) {
+        return true;
+    }
+
+    string host_platform = envs_match(cs, job);
+
+    if (host_platform.empty()) {
+        return true;
+    }
+
+    int unused = 0;
+    int unused_of_submitter = 0;
+
+    for (set<unsigned int>::const_iterator it = leased_jobs.begin(); it != leased_jobs.end(); ++it) {
+        map<unsigned int, Job *>::const_iterator leased = jobs.find(*it);
+
+        if (leased == jobs.end() || leased->second->submitter() != submitter) {
+            continue;
+        }
+
+        ++unused_of_submitter;
+
+        if (same_lease_kind(leased->second, job)) {
+            ++unused;
+        }
+    }
+
+    if (submitter->submittedJobsCount() - unused_of_submitter < LEASE_MIN_JOBS) {
+        return true;
+    }
+
+    LeaseMsg lease;
+    lease.hostname = cs->name;
+    lease.port = cs->remotePort();
+    lease.host_platform = host_platform;
+    lease.versions = job->environments();
+    lease.target = job->targetPlatform();
+    lease.minimal_host_version = job->minimalHostVersion();
+    lease.ttl = LEASE_TTL;
+
+    time_t expiry = time(0) + LEASE_TTL + LEASE_GRACE;
+
+    for (; unused < LEASE_SLOTS && int(cs->jobList().size()) < cs->maxJobs(); ++unused) {
+        Job *leased = create_new_job(submitter);
+        leased->setEnvironments(job->environments());
+        leased->setTargetPlatform(job->targetPlatform());
+        leased->setMinimalHostVersion(job->minimalHostVersion());
+        leased->setExpectedWork(job->expectedWork());
+        leased->setState(Job::WAITINGFORCS);
+        leased->setServer(cs);
+        leased->setLeaseExpiry(expiry);
+        cs->appendJob(leased);
+        leased_jobs.insert(leased->id());
+        lease.job_ids.push_back(leased->id());
+    }
+
+    if (lease.job_ids.empty()) {
+        return true;
+    }
+
+    trace() << "leasing " << lease.job_ids.size() << " slots of " << cs->nodeName()
+            << " to " << submitter->nodeName() << endl;
+    rank_server(cs);
+    cork_channel(submitter);
+
+    if (!submitter->send_msg(lease)) {
+        trace() << "failed to lease slots to " << submitter->nodeName() << endl;
+        handle_end(submitter, 0);
+        return false;
+    }
+
+    return true;
+}
+
+/* Takes back the unused leases on CS (or all if 0): the daemons get told
+   to not use them anymore, and the slots are free again after the grace
+   period, unless a daemon used one before it got told.  */
+static void revoke_leases(CompileServer *cs)
+{
+    time_t expiry = time(0) + LEASE_GRACE;
+    // by submitter and server
+    map<pair<CompileServer *, CompileServer *>, LeaseMsg> revoked;
+
+    for (set<unsigned int>::const_iterator it = leased_jobs.begin(); it != leased_jobs.end(); ++it) {
+        map<unsigned int, Job *>::const_iterator leased = jobs.find(*it);
+
+        if (leased == jobs.end() || (cs && leased->second->server() != cs)) {
+            continue;
+        }
+
+        Job *job = leased->second;
+
+        if (job->leaseExpiry() <= expiry) {
+            continue;  // revoked already
+        }
+
+        job->setLeaseExpiry(expiry);
+
+        LeaseMsg &msg = revoked[make_pair(job->submitter(), job->server())];
+        msg.hostname = job->server()->name;
+        msg.port = job->server()->remotePort();
+        msg.job_ids.push_back(job->id());
+    }
+
+    for (map<pair<CompileServer *, CompileServer *>, LeaseMsg>::const_iterator it = revoked.begin();
+            it != revoked.end(); ++it) {
+        CompileServer *submitter = it->first.first;
+
+        if (submitter == cs) {
+            continue;
+        }
+
+        trace() << "revoking " << it->second.job_ids.size() << " leased slots of "
+                << it->second.hostname << " from " << submitter->nodeName() << endl;
+        cork_channel(submitter);
+
+        // a failure is noticed in the main loop
+        submitter->send_msg(it->second);
+    }
+}
+
+/* Frees the slots of the leased jobs not used in time and returns when the
+   next one expires, 0 if none.  */
+static time_t expire_leases()
+{
+    time_t now = time(0);
+    time_t next = 0;
+
+    for (set<unsigned int>::iterator it = leased_jobs.begin(); it != leased_jobs.end();) {
+        map<unsigned int, Job *>::iterator leased = jobs.find(*it);
+
+        // gone with its submitter or server
+        if (leased == jobs.end()) {
+            leased_jobs.erase(it++);
+            continue;
+        }
+
+        Job *job = leased->second;
+
+        if (job->leaseExpiry() > now) {
+            if (!next || job->leaseExpiry() < next) {
+                next = job->leaseExpiry();
+            }
+
+            ++it;
+            continue;
+        }
+
 #if DEBUG_SCHEDULER > 1
-        trace() << "taking best preload " << bestui->nodeName() << " " <<  server_speed(bestui, job) << endl;
+        trace() << "leased job " << job->id() << " expired" << endl;
 #endif
+        job->server()->removeJob(job);
+        rank_server(job->server());
+        jobs.erase(leased);
+        delete job;
+        leased_jobs.erase(it++);
     }
 
-    return bestpre;
+    return next;
 }
 
 /* Prunes the list of connected servers by those which haven't
@@ -735,6 +1938,7 @@ static time_t prune_servers()
             if ((*it)->maxJobs() >= 0) {
                 trace() << "send ping " << (*it)->nodeName() << endl;
                 (*it)->setMaxJobs((*it)->maxJobs() * -1);   // better not give it away
+                rank_server(*it);
 
                 if ((*it)->send_msg(PingMsg())) {
                     // give it MAX_SCHEDULER_PONG to answer a ping
@@ -801,9 +2005,12 @@ static bool empty_queue()
     CompileServer *cs = 0;
 
     while (true) {
+        unsigned long long pick_start = usec_now();
         cs = pick_server(job);
+        histograms[HIST_PICK_SERVER].add(usec_now() - pick_start);
 
         if (cs) {
+            cs = maybe_keep_local(job, cs);
             break;
         }
 
@@ -819,6 +2026,13 @@ static bool empty_queue()
 
             if ((job == first_job) || !job) { // no job found in the whole toanswer list
                 trace() << "No suitable host found, delaying" << endl;
+                ++idle_queue_runs;
+
+                // make room for the waiting ones
+                if (!leased_jobs.empty()) {
+                    revoke_leases(0);
+                }
+
                 return false;
             }
         } else {
@@ -827,9 +2041,18 @@ static bool empty_queue()
     }
 
     remove_job_request();
+    assign_job(job, cs);
+    return true;
+}
 
+/* Tells the submitter of JOB to use CS for it.  Returns false if the
+   submitter couldn't be told, it and its jobs are gone then.  */
+static bool assign_job(Job *job, CompileServer *cs)
+{
     job->setState(Job::WAITINGFORCS);
     job->setServer(cs);
+    job->setAssignTime(msec_since_start());
+    histograms[HIST_QUEUE_WAIT].add((job->assignTime() - job->requestTime()) * 1000ULL);
 
     string host_platform = envs_match(cs, job);
     bool gotit = true;
@@ -867,11 +2090,18 @@ static bool empty_queue()
 
     UseCSMsg m2(host_platform, cs->name, cs->remotePort(), job->id(),
                 gotit, job->localClientId(), matched_job_id);
+    m2.batch_index = job->batchIndex();
+
+    if (!gotit) {
+        m2.env_peers = env_peers(cs, job, host_platform);
+    }
+
+    cork_channel(job->submitter());
 
     if (!job->submitter()->send_msg(m2)) {
         trace() << "failed to deliver job " << job->id() << endl;
         handle_end(job->submitter(), 0);   // will care for the rest
-        return true;
+        return false;
     }
 
 #if DEBUG_SCHEDULER >= 0
@@ -882,6 +2112,7 @@ static bool empty_queue()
     }
 #endif
     cs->appendJob(job);
+    rank_server(cs);
 
     /* if it doesn't have the environment, it will get it. */
     if (!gotit) {
@@ -909,6 +2140,10 @@ static bool empty_queue()
         }
     }
 
+    if (gotit) {
+        return grant_lease(job, cs);
+    }
+
     return true;
 }
 
@@ -967,7 +2202,13 @@ static bool handle_login(CompileServer *cs, Msg *_m)
         ++it;
     }
 
+    restore_stats(cs);
     css.push_back(cs);
+    index_server(cs);
+
+    if (job_record.is_open()) {
+        job_record << "server " << cs->nodeName() << " " << cs->maxJobs() << endl;
+    }
 
     /* Configure the daemon */
     if (IS_PROTOCOL_24(cs)) {
@@ -987,7 +2228,17 @@ static bool handle_relogin(MsgChannel *mc, Msg *_m)
 
     CompileServer *cs = static_cast<CompileServer *>(mc);
     cs->setCompilerVersions(m->envs);
+
+    if (cs->busyInstalling()) {
+        /* The daemon logs in again once it has installed the environment,
+           learn how long that takes for predicting finish times.  */
+        float msec = (time(0) - cs->busyInstalling()) * 1000;
+        env_install_msec += (msec - env_install_msec) / 8;
+        histograms[HIST_ENV_INSTALL].add(msec * 1000ULL);
+    }
+
     cs->setBusyInstalling(0);
+    index_server(cs);
 
     std::ostream &dbg = trace();
     dbg << "RELOGIN " << cs->nodeName() << "(" << cs->hostPlatform() << "): [";
@@ -1022,7 +2273,7 @@ static bool handle_mon_login(CompileServer *cs, Msg *_m)
         handle_monitor_stats(*it);
     }
 
-    fd2cs.erase(cs->fd);   // no expected data from them
+    remove_channel(cs);   // no expected data from them
     return true;
 }
 
@@ -1049,6 +2300,14 @@ static bool handle_job_begin(CompileServer *cs, Msg *_m)
     job->setState(Job::COMPILING);
     job->setStartTime(m->stime);
     job->setStartOnScheduler(time(0));
+
+    // may be before the submitter told us about using the leased job
+    leased_jobs.erase(job->id());
+    job->setLeaseExpiry(0);
+
+    if (job->assignTime()) {
+        histograms[HIST_JOB_BEGIN].add((msec_since_start() - job->assignTime()) * 1000ULL);
+    }
     notify_monitors(new MonJobBeginMsg(m->job_id, m->stime, cs->hostId()));
 #if DEBUG_SCHEDULER >= 0
     trace() << "BEGIN: " << m->job_id << " client=" << job->submitter()->nodeName()
@@ -1061,6 +2320,20 @@ static bool handle_job_begin(CompileServer *cs, Msg *_m)
 }
 
 
+static void remember_cached_result(const string &key, CompileServer *cs)
+{
+    if (cached_results.insert(make_pair(key, cs->nodeName())).second) {
+        cached_results_order.push(key);
+    } else {
+        cached_results[key] = cs->nodeName();
+    }
+
+    if (cached_results_order.size() > CACHED_RESULTS) {
+        cached_results.erase(cached_results_order.front());
+        cached_results_order.pop();
+    }
+}
+
 static bool handle_job_done(CompileServer *cs, Msg *_m)
 {
     JobDoneMsg *m = dynamic_cast<JobDoneMsg *>(_m);
@@ -1149,7 +2422,8 @@ static bool handle_job_done(CompileServer *cs, Msg *_m)
 
         if (m->in_uncompressed)
             dbg << " in=" << m->in_uncompressed
-                << "(" << int(m->in_compressed * 100 / m->in_uncompressed) << "%)";
+                << "(" << int(m->in_compressed * 100 / m->in_uncompressed) << "% "
+                << compression_name(m->in_compression) << ")";
         else {
             dbg << " in=0(0%)";
         }
@@ -1174,11 +2448,42 @@ static bool handle_job_done(CompileServer *cs, Msg *_m)
 
     if (j->server()) {
         j->server()->removeJob(j);
+        rank_server(j->server());
+    }
+
+    if (m->is_from_server() && m->in_uncompressed) {
+        CompressionStats &cst = compression_stats[m->in_compression];
+        cst.jobs++;
+        cst.compressed += m->in_compressed;
+        cst.uncompressed += m->in_uncompressed;
+        cst.decompress_usec += m->in_decompress_usec;
+    }
+
+    if (m->is_from_server() && m->exitcode == 0 && j->submitter() != cs && j->assignTime()) {
+        /* What the remote job took in addition to compiling, the output
+           isn't sent back yet, but that's small anyway.  */
+        float msec = float(msec_since_start()) - j->assignTime() - m->real_msec;
+
+        if (msec >= 0) {
+            remote_overhead_msec += (msec - remote_overhead_msec) / 16;
+        }
+    }
+
+    if (job_record.is_open() && m->is_from_server() && m->exitcode == 0 && m->user_msec) {
+        job_record << "job " << j->requestTime() << " "
+                   << j->submitter()->nodeName() << " " << cs->nodeName() << " "
+                   << m->out_uncompressed << " " << m->user_msec << " "
+                   << j->argFlags() << endl;
+    }
+
+    if (m->is_from_server() && m->exitcode == 0 && !j->cacheKey().empty()) {
+        remember_cached_result(j->cacheKey(), cs);
     }
 
     add_job_stats(j, m);
     notify_monitors(new MonJobDoneMsg(*m));
     jobs.erase(m->job_id);
+    leased_jobs.erase(m->job_id);
     delete j;
 
     return true;
@@ -1190,6 +2495,7 @@ static bool handle_ping(CompileServer *cs, Msg * /*_m*/)
 
     if (cs->maxJobs() < 0) {
         cs->setMaxJobs(cs->maxJobs() * -1);
+        rank_server(cs);
     }
 
     return true;
@@ -1210,17 +2516,24 @@ static bool handle_stats(CompileServer *cs, Msg *_m)
 
         if (cs && (cs->maxJobs() < 0)) {
             cs->setMaxJobs(cs->maxJobs() * -1);
+            rank_server(cs);
         }
     }
 
-    for (list<CompileServer *>::iterator it = css.begin(); it != css.end(); ++it)
-        if (*it == cs) {
-            (*it)->setLoad(m->load);
-            handle_monitor_stats(*it, m);
-            return true;
-        }
+    // only logged in daemons are indexed
+    if (!indexed_servers.count(cs)) {
+        return false;
+    }
 
-    return false;
+    cs->setLoad(m->load);
+    rank_server(cs);
+    handle_monitor_stats(cs, m);
+
+    if (cs->load() >= 1000) {
+        revoke_leases(cs);
+    }
+
+    return true;
 }
 
 static bool handle_blacklist_host_env(CompileServer *cs, Msg *_m)
@@ -1305,14 +2618,75 @@ static bool handle_control_login(CompileServer *cs)
     assert(find(controls.begin(), controls.end(), cs) == controls.end());
     controls.push_back(cs);
 
-    std::ostringstream o;
-    o << "200-ICECC " VERSION ": "
-      << time(0) - starttime << "s uptime, "
-      << css.size() << " hosts, "
-      << jobs.size() << " jobs in queue "
-      << "(" << new_job_id << " total)." << endl;
-    o << "200 Use 'help' for help and 'quit' to quit." << endl;
-    return cs->send_msg(TextMsg(o.str()));
+    std::ostringstream o;
+    o << "200-ICECC " VERSION ": "
+      << time(0) - starttime << "s uptime, "
+      << css.size() << " hosts, "
+      << jobs.size() << " jobs in queue "
+      << "(" << new_job_id << " total)." << endl;
+    o << "200 Use 'help' for help and 'quit' to quit." << endl;
+    return cs->send_msg(TextMsg(o.str()));
+}
+
+/* The histograms and some counters in the Prometheus text format.  */
+static void write_metrics(ostream &out)
+{
+    for (int i = 0; i < HIST_COUNT; ++i) {
+        const Histogram &h = histograms[i];
+        string name = string("icecc_scheduler_") + histogram_names[i] + "_seconds";
+        unsigned long long count = 0;
+
+        out << "# TYPE " << name << " histogram\n";
+
+        for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+            count += h.buckets[bucket];
+            out << name << "_bucket{le=\"" << Histogram::bucket_limit(bucket) / 1e6 << "\"} "
+                << count << "\n";
+        }
+
+        out << name << "_bucket{le=\"+Inf\"} " << h.count << "\n"
+            << name << "_sum " << h.sum_usec / 1e6 << "\n"
+            << name << "_count " << h.count << "\n";
+    }
+
+    size_t queued = 0;
+
+    for (list<UnansweredList *>::const_iterator it = toanswer.begin(); it != toanswer.end(); ++it) {
+        queued += (*it)->l.size();
+    }
+
+    out << "# TYPE icecc_scheduler_idle_queue_runs_total counter\n"
+        << "icecc_scheduler_idle_queue_runs_total " << idle_queue_runs << "\n"
+        << "# TYPE icecc_scheduler_queued_jobs gauge\n"
+        << "icecc_scheduler_queued_jobs " << queued << "\n"
+        << "# TYPE icecc_scheduler_jobs gauge\n"
+        << "icecc_scheduler_jobs " << jobs.size() << "\n"
+        << "# TYPE icecc_scheduler_servers gauge\n"
+        << "icecc_scheduler_servers " << css.size() << "\n";
+}
+
+static void write_metrics_file()
+{
+    if (metrics_file.empty()) {
+        return;
+    }
+
+    // collectors may read it any time, so never let them see half of it
+    string tmp_file = metrics_file + ".tmp";
+    ofstream out(tmp_file.c_str(), ios::out | ios::trunc);
+
+    if (!out) {
+        log_perror("open metrics file");
+        return;
+    }
+
+    write_metrics(out);
+    out.close();
+
+    if (!out || rename(tmp_file.c_str(), metrics_file.c_str()) != 0) {
+        log_perror("write metrics file");
+        unlink(tmp_file.c_str());
+    }
 }
 
 static bool handle_line(CompileServer *cs, Msg *_m)
@@ -1376,6 +2750,43 @@ static bool handle_line(CompileServer *cs, Msg *_m)
             if (!cs->send_msg(TextMsg(" " + dump_job(it->second)))) {
                 return false;
             }
+    } else if (cmd == "listcompression") {
+        for (map<uint32_t, CompressionStats>::const_iterator it = compression_stats.begin();
+                it != compression_stats.end(); ++it) {
+            const CompressionStats &cst = it->second;
+            sprintf(buffer, " %s: jobs=%u in=%llu ratio=%.1f%% decompress=%.1f MB/s",
+                    compression_name(it->first), cst.jobs, cst.uncompressed,
+                    cst.uncompressed ? cst.compressed * 100.0 / cst.uncompressed : 0.0,
+                    cst.decompress_usec ? double(cst.uncompressed) / cst.decompress_usec : 0.0);
+
+            if (!cs->send_msg(TextMsg(buffer))) {
+                return false;
+            }
+        }
+    } else if (cmd == "histograms") {
+        for (int i = 0; i < HIST_COUNT; ++i) {
+            const Histogram &h = histograms[i];
+            sprintf(buffer, " %s: count=%llu avg=%.3fms p50<=%.3fms p90<=%.3fms p99<=%.3fms",
+                    histogram_names[i], h.count, h.count ? h.sum_usec / 1000.0 / h.count : 0.0,
+                    h.quantile(0.5) / 1000.0, h.quantile(0.9) / 1000.0, h.quantile(0.99) / 1000.0);
+
+            if (!cs->send_msg(TextMsg(buffer))) {
+                return false;
+            }
+        }
+
+        sprintf(buffer, " idle queue runs: %llu", idle_queue_runs);
+
+        if (!cs->send_msg(TextMsg(buffer))) {
+            return false;
+        }
+    } else if (cmd == "metrics") {
+        ostringstream out;
+        write_metrics(out);
+
+        if (!cs->send_msg(TextMsg(out.str()))) {
+            return false;
+        }
     } else if (cmd == "quit" || cmd == "exit") {
         handle_end(cs, 0);
         return false;
@@ -1434,6 +2845,7 @@ static bool handle_line(CompileServer *cs, Msg *_m)
 
             if ((*it)->send_msg(GetInternalStatus())) {
                 msg = (*it)->get_msg();
+                check_buffered_msgs = true;
             }
 
             if (msg && msg->type == M_STATUS_TEXT) {
@@ -1450,7 +2862,7 @@ static bool handle_line(CompileServer *cs, Msg *_m)
         }
     } else if (cmd == "help") {
         if (!cs->send_msg(TextMsg(
-                             "listcs\nlistblocks\nlistjobs\nremovecs\nblockcs\nunblockcs\ninternals\nhelp\nquit"))) {
+                             "listcs\nlistblocks\nlistjobs\nlistcompression\nhistograms\nmetrics\nremovecs\nblockcs\nunblockcs\ninternals\nhelp\nquit"))) {
             return false;
         }
     } else {
@@ -1523,6 +2935,9 @@ static bool handle_end(CompileServer *toremove, Msg *m)
          the daemon died.  We expect that the daemon dying makes the client
          disconnect soon too.  */
         css.remove(toremove);
+        unindex_server(toremove);
+        remember_stats(toremove);
+        revoke_leases(toremove);
 
         /* Unfortunately the toanswer queues are also tagged based on the daemon,
            so we need to clean them up also.  */
@@ -1562,6 +2977,7 @@ static bool handle_end(CompileServer *toremove, Msg *m)
                 also remove the job from the servers joblist.  */
                 if (job->server() && job->server() != toremove) {
                     job->server()->removeJob(job);
+                    rank_server(job->server());
                 }
 
                 if (job->server()) {
@@ -1590,7 +3006,7 @@ static bool handle_end(CompileServer *toremove, Msg *m)
         break;
     }
 
-    fd2cs.erase(toremove->fd);
+    remove_channel(toremove);
     delete toremove;
     return true;
 }
@@ -1766,6 +3182,285 @@ static void broadcast_scheduler_version()
     DiscoverSched::broadcastData(scheduler_port, buf, sizeof(buf));
 }
 
+/* Offline replay of a trace written with --record, to compare the
+   scheduling policies on the same load.  Every job gets asked for again at
+   its recorded time and takes as long as its work takes at the speed its
+   recorded server really had.  All servers are assumed to have the
+   environment already.  */
+
+struct ReplayJob {
+    unsigned long request_msec;
+    string submitter;
+    string server;
+    unsigned long out_uncompressed;
+    unsigned long user_msec;
+    unsigned int arg_flags;
+};
+
+struct ReplayRunning {
+    Job *job;
+    const ReplayJob *trace;
+    double start_msec;
+};
+
+static bool read_replay_trace(const string &file, map<string, int> &max_jobs, vector<ReplayJob> &trace)
+{
+    ifstream in(file.c_str());
+
+    if (!in) {
+        log_perror("open replay trace");
+        return false;
+    }
+
+    string line;
+
+    while (getline(in, line)) {
+        istringstream fields(line);
+        string kind;
+        fields >> kind;
+
+        if (kind == "server") {
+            string name;
+            int jobs = 0;
+
+            if (fields >> name >> jobs) {
+                max_jobs[name] = jobs;
+            }
+        } else if (kind == "job") {
+            ReplayJob job;
+
+            if (fields >> job.request_msec >> job.submitter >> job.server
+                    >> job.out_uncompressed >> job.user_msec >> job.arg_flags) {
+                trace.push_back(job);
+            }
+        }
+    }
+
+    for (vector<ReplayJob>::const_iterator it = trace.begin(); it != trace.end(); ++it) {
+        // submitters that weren't compile servers still get to ask for jobs
+        if (!max_jobs.count(it->submitter)) {
+            max_jobs[it->submitter] = 0;
+        }
+
+        if (!max_jobs.count(it->server)) {
+            max_jobs[it->server] = 1;
+        }
+    }
+
+    return true;
+}
+
+static bool earlier_request(const ReplayJob &a, const ReplayJob &b)
+{
+    return a.request_msec < b.request_msec;
+}
+
+/* The other ends of the channels of the replayed servers, what the
+   scheduler sends them just gets thrown away.  */
+static vector<int> replay_peers;
+
+static void drain_replay_peers()
+{
+    char buf[4096];
+
+    for (vector<int>::const_iterator it = replay_peers.begin(); it != replay_peers.end(); ++it) {
+        while (read(*it, buf, sizeof(buf)) > 0) {
+            continue;
+        }
+    }
+}
+
+static CompileServer *add_replay_server(const string &name, int max_jobs)
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        log_perror("socketpair");
+        exit(1);
+    }
+
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    replay_peers.push_back(fds[1]);
+
+    CompileServer *cs = new CompileServer(fds[0], 0, 0, true);
+    cs->setNodeName(name);
+    cs->setMaxJobs(max_jobs);
+    cs->setLoad(0);
+    cs->setHostPlatform("replay");
+    cs->setChrootPossible(true);
+    cs->setCompilerVersions(Environments(1, make_pair(string("replay"), string("replay"))));
+    cs->pick_new_id();
+    css.push_back(cs);
+    index_server(cs);
+    return cs;
+}
+
+static void replay_policy(const map<string, int> &max_jobs, const vector<ReplayJob> &trace,
+                          const map<string, float> &real_speed, float average_speed)
+{
+    map<string, CompileServer *> servers;
+    map<CompileServer *, vector<double> > free_slots; // when each slot is free again
+
+    for (map<string, int>::const_iterator it = max_jobs.begin(); it != max_jobs.end(); ++it) {
+        CompileServer *cs = add_replay_server(it->first, it->second);
+        servers[it->first] = cs;
+        free_slots[cs].resize(max(it->second, 1), 0);
+    }
+
+    map<unsigned int, const ReplayJob *> waiting; // asked for, but no server yet
+    multimap<double, ReplayRunning> running; // by the time they are done
+    size_t next = 0;
+    double last_done = 0, latency = 0, wait = 0;
+    unsigned int done = 0;
+
+    while (true) {
+        double now = DBL_MAX;
+
+        if (next < trace.size()) {
+            now = trace[next].request_msec;
+        }
+
+        if (!running.empty()) {
+            now = min(now, running.begin()->first);
+        }
+
+        if (now == DBL_MAX) {
+            break;
+        }
+
+        while (!running.empty() && running.begin()->first <= now) {
+            ReplayRunning &r = running.begin()->second;
+            Job *job = r.job;
+            JobDoneMsg m(job->id(), 0, JobDoneMsg::FROM_SERVER);
+            m.out_uncompressed = r.trace->out_uncompressed;
+            m.user_msec = m.real_msec = (uint32_t)(running.begin()->first - r.start_msec);
+
+            job->server()->removeJob(job);
+            rank_server(job->server());
+            add_job_stats(job, &m);
+
+            latency += running.begin()->first - r.trace->request_msec;
+            last_done = running.begin()->first;
+            ++done;
+
+            jobs.erase(job->id());
+            delete job;
+            running.erase(running.begin());
+        }
+
+        while (next < trace.size() && trace[next].request_msec <= now) {
+            Job *job = create_new_job(servers[trace[next].submitter]);
+            job->setRequestTime(trace[next].request_msec);
+            job->setEnvironments(Environments(1, make_pair(string("replay"), string("replay"))));
+            job->setTargetPlatform("replay");
+            job->setArgFlags(trace[next].arg_flags);
+            enqueue_job_request(job);
+            waiting[job->id()] = &trace[next];
+            ++next;
+        }
+
+        while (empty_queue()) {
+            uncork_channels();
+            drain_replay_peers();
+        }
+
+        for (map<unsigned int, const ReplayJob *>::iterator it = waiting.begin(); it != waiting.end();) {
+            Job *job = jobs[it->first];
+            CompileServer *cs = job->server();
+
+            if (!cs) {
+                ++it;
+                continue;
+            }
+
+            vector<double> &slots = free_slots[cs];
+            vector<double>::iterator slot = min_element(slots.begin(), slots.end());
+            ReplayRunning r;
+            r.job = job;
+            r.trace = it->second;
+            r.start_msec = max(now, *slot);
+
+            map<string, float>::const_iterator speed = real_speed.find(cs->nodeName());
+            float msec = normalized_output(r.trace->out_uncompressed, r.trace->arg_flags)
+                         / (speed != real_speed.end() ? speed->second : average_speed);
+
+            *slot = r.start_msec + max(msec, 1.0f);
+            job->setState(Job::COMPILING);
+            running.insert(make_pair(*slot, r));
+            wait += r.start_msec - r.trace->request_msec;
+            waiting.erase(it++);
+        }
+    }
+
+    printf("%s: %u jobs, %lu never started, makespan %.1fs, average latency %.1fs, average wait %.1fs\n",
+           scheduling_policy == POLICY_FASTEST ? "fastest" : "eft",
+           done, (unsigned long) waiting.size(),
+           (last_done - (trace.empty() ? 0 : trace.front().request_msec)) / 1000,
+           done ? latency / done / 1000 : 0, done ? wait / done / 1000 : 0);
+}
+
+static int replay_trace(const string &file)
+{
+    map<string, int> max_jobs;
+    vector<ReplayJob> trace;
+
+    if (!read_replay_trace(file, max_jobs, trace)) {
+        return 1;
+    }
+
+    stable_sort(trace.begin(), trace.end(), earlier_request);
+
+    // how fast the servers really were, in the units of server_speed()
+    map<string, pair<double, double> > work;
+    double all_output = 0, all_msec = 0;
+
+    for (vector<ReplayJob>::const_iterator it = trace.begin(); it != trace.end(); ++it) {
+        double output = normalized_output(it->out_uncompressed, it->arg_flags);
+        work[it->server].first += output;
+        work[it->server].second += it->user_msec;
+        all_output += output;
+        all_msec += it->user_msec;
+    }
+
+    map<string, float> real_speed;
+
+    for (map<string, pair<double, double> >::const_iterator it = work.begin(); it != work.end(); ++it) {
+        if (it->second.second > 0) {
+            real_speed[it->first] = it->second.first / it->second.second;
+        }
+    }
+
+    float average_speed = all_msec > 0 ? all_output / all_msec : 1;
+    const SchedulingPolicy policies[] = { POLICY_FASTEST, POLICY_EARLIEST_FINISH };
+
+    fflush(stdout);
+
+    /* Each policy runs in a child of its own, so that they all start out
+       with an empty scheduler.  */
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            log_perror("fork");
+            return 1;
+        }
+
+        if (pid == 0) {
+            scheduling_policy = policies[i];
+            replay_policy(max_jobs, trace, real_speed, average_speed);
+            fflush(stdout);
+            _exit(0);
+        }
+
+        int status;
+
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+    }
+
+    return 0;
+}
+
 static void usage(const char *reason = 0)
 {
     if (reason) {
@@ -1782,6 +3477,11 @@ static void usage(const char *reason = 0)
          << "  -d, --daemonize\n"
          << "  -u, --user-uid\n"
          << "  -v[v[v]]]\n"
+         << "  --policy <eft|fastest>\n"
+         << "  --record <file>\n"
+         << "  --replay <file>\n"
+         << "  --stats-file <file>\n"
+         << "  --metrics-file <file>\n"
          << endl;
 
     exit(1);
@@ -1802,6 +3502,23 @@ static void trigger_exit(int signum)
     signal(signum, trigger_exit);
 }
 
+/* PATH of the OPTION as an absolute one, the files are opened after
+   daemon() changed to /.  */
+static string absolute_path(const char *path, const char *option)
+{
+    if (path[0] == '/') {
+        return path;
+    }
+
+    char buf[FILENAME_MAX];
+
+    if (!getcwd(buf, sizeof(buf))) {
+        usage((string("Error: can't tell the path of the ") + option).c_str());
+    }
+
+    return string(buf) + "/" + path;
+}
+
 int main(int argc, char *argv[])
 {
     int listen_fd, remote_fd, broad_fd, text_fd;
@@ -1811,6 +3528,8 @@ int main(int argc, char *argv[])
     bool detach = false;
     int debug_level = Error;
     string logfile;
+    string record_file;
+    string replay_file;
     uid_t user_uid;
     gid_t user_gid;
     int warn_icecc_user_errno = 0;
@@ -1840,6 +3559,11 @@ int main(int argc, char *argv[])
             { "daemonize", 0, NULL, 'd'},
             { "log-file", 1, NULL, 'l'},
             { "user-uid", 1, NULL, 'u'},
+            { "policy", 1, NULL, 'P'},
+            { "record", 1, NULL, 'R'},
+            { "replay", 1, NULL, 'Y'},
+            { "stats-file", 1, NULL, 'S'},
+            { "metrics-file", 1, NULL, 'M'},
             { 0, 0, 0, 0 }
         };
 
@@ -1919,6 +3643,53 @@ int main(int argc, char *argv[])
                 usage("Error: -u requires a valid username");
             }
 
+            break;
+        case 'P':
+
+            if (optarg && !strcmp(optarg, "eft")) {
+                scheduling_policy = POLICY_EARLIEST_FINISH;
+            } else if (optarg && !strcmp(optarg, "fastest")) {
+                scheduling_policy = POLICY_FASTEST;
+            } else {
+                usage("Error: --policy requires eft or fastest");
+            }
+
+            break;
+        case 'R':
+
+            if (optarg && *optarg) {
+                record_file = absolute_path(optarg, "--record");
+            } else {
+                usage("Error: --record requires argument");
+            }
+
+            break;
+        case 'Y':
+
+            if (optarg && *optarg) {
+                replay_file = optarg;
+            } else {
+                usage("Error: --replay requires argument");
+            }
+
+            break;
+        case 'S':
+
+            if (optarg && *optarg) {
+                stats_file = absolute_path(optarg, "--stats-file");
+            } else {
+                usage("Error: --stats-file requires argument");
+            }
+
+            break;
+        case 'M':
+
+            if (optarg && *optarg) {
+                metrics_file = absolute_path(optarg, "--metrics-file");
+            } else {
+                usage("Error: --metrics-file requires argument");
+            }
+
             break;
 
         default:
@@ -1926,6 +3697,12 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (!replay_file.empty()) {
+        setup_debug(debug_level, logfile);
+        signal(SIGPIPE, SIG_IGN);
+        return replay_trace(replay_file);
+    }
+
     if (warn_icecc_user_errno != 0) {
         log_errno("Error: no icecc user on system. Falling back to nobody.", errno);
     }
@@ -1990,6 +3767,16 @@ int main(int argc, char *argv[])
     }
 
     starttime = time(0);
+    load_stats();
+
+    if (!record_file.empty()) {
+        job_record.open(record_file.c_str(), ios::out | ios::app);
+
+        if (!job_record) {
+            log_perror("open job record");
+            return 1;
+        }
+    }
 
     ofstream pidFile;
     string progName = argv[0];
@@ -2004,14 +3791,37 @@ int main(int argc, char *argv[])
     signal(SIGALRM, trigger_exit);
 
     time_t next_listen = 0;
+    time_t next_prune = 0;
+    time_t next_stats_save = starttime + STATS_SAVE_INTERVAL;
+    // 0 without a metrics file
+    time_t next_metrics_write = metrics_file.empty() ? 0 : starttime;
+    bool listening = true;
+
+    poller.add(listen_fd);
+    poller.add(text_fd);
+    poller.add(broad_fd);
 
     broadcast_scheduler_version();
     last_announce = starttime;
 
     while (!exit_main_loop) {
-        struct timeval tv;
-        tv.tv_usec = 0;
-        tv.tv_sec = prune_servers();
+        time_t now = time(0);
+
+        if (now >= next_prune) {
+            next_prune = now + prune_servers();
+        }
+
+        if (now >= next_stats_save) {
+            save_stats();
+            next_stats_save = now + STATS_SAVE_INTERVAL;
+        }
+
+        if (next_metrics_write && now >= next_metrics_write) {
+            write_metrics_file();
+            next_metrics_write = now + METRICS_WRITE_INTERVAL;
+        }
+
+        time_t next_lease_expiry = expire_leases();
 
         while (empty_queue()) {
             continue;
@@ -2025,211 +3835,206 @@ int main(int argc, char *argv[])
             last_announce = time(NULL);
         }
 
-        fd_set read_set;
-        int max_fd = 0;
-        FD_ZERO(&read_set);
-
-        if (time(0) >= next_listen) {
-            max_fd = listen_fd;
-            FD_SET(listen_fd, &read_set);
-
-            if (text_fd > max_fd) {
-                max_fd = text_fd;
-            }
-
-            FD_SET(text_fd, &read_set);
-        }
-
-        if (broad_fd > max_fd) {
-            max_fd = broad_fd;
+        if (!listening && time(0) >= next_listen) {
+            poller.modify(listen_fd, Poller::Read);
+            poller.modify(text_fd, Poller::Read);
+            listening = true;
         }
 
-        FD_SET(broad_fd, &read_set);
+        /* Handling a message may have read further messages of other
+           channels into their buffers (e.g. the internals command),
+           those won't wake up the poller, so handle them now.  */
+        if (check_buffered_msgs) {
+            check_buffered_msgs = false;
 
-        for (map<int, CompileServer *>::const_iterator it = fd2cs.begin(); it != fd2cs.end();) {
-            int i = it->first;
-            CompileServer *cs = it->second;
-            bool ok = true;
-            ++it;
+            for (map<int, CompileServer *>::const_iterator it = fd2cs.begin(); it != fd2cs.end();) {
+                CompileServer *cs = it->second;
+                /* handle_activity() can delete c and make the iterator
+                   invalid.  */
+                ++it;
 
-            /* handle_activity() can delete c and make the iterator
-               invalid.  */
-            while (ok && cs->has_msg()) {
-                if (!handle_activity(cs)) {
-                    ok = false;
+                while (cs->has_msg()) {
+                    if (!handle_activity(cs)) {
+                        break;
+                    }
                 }
             }
+        }
 
-            if (ok) {
-                if (i > max_fd) {
-                    max_fd = i;
-                }
+        time_t wakeup = min(next_prune, next_stats_save);
 
-                FD_SET(i, &read_set);
-            }
+        if (next_metrics_write) {
+            wakeup = min(wakeup, next_metrics_write);
+        }
+
+        if (next_lease_expiry) {
+            wakeup = min(wakeup, next_lease_expiry);
         }
 
-        max_fd = select(max_fd + 1, &read_set, NULL, NULL, &tv);
+        if (!listening) {
+            wakeup = min(wakeup, next_listen);
+        }
+
+        uncork_channels();
+        now = time(0);
+        int ready = poller.wait(wakeup > now ? (wakeup - now) * 1000 : 0);
 
-        if (max_fd < 0 && errno == EINTR) {
+        if (ready < 0 && errno == EINTR) {
             continue;
         }
 
-        if (max_fd < 0) {
-            log_perror("select()");
+        if (ready < 0) {
+            log_perror("poll");
             return 1;
         }
 
-        if (FD_ISSET(listen_fd, &read_set)) {
-            max_fd--;
-            bool pending_connections = true;
-
-            while (pending_connections) {
-                remote_len = sizeof(remote_addr);
-                remote_fd = accept(listen_fd,
-                                   (struct sockaddr *) &remote_addr,
-                                   &remote_len);
+        for (int r = 0; r < ready; ++r) {
+            int fd = poller.ready_fd(r);
 
-                if (remote_fd < 0) {
-                    pending_connections = false;
-                }
+            if (fd == listen_fd) {
+                bool pending_connections = true;
 
-                if (remote_fd < 0 && errno != EAGAIN && errno != EINTR
-                        && errno != EWOULDBLOCK) {
-                    log_perror("accept()");
-                    /* don't quit because of ECONNABORTED, this can happen during
-                     * floods  */
-                }
+                while (pending_connections) {
+                    remote_len = sizeof(remote_addr);
+                    remote_fd = accept(listen_fd,
+                                       (struct sockaddr *) &remote_addr,
+                                       &remote_len);
 
-                if (remote_fd >= 0) {
-                    CompileServer *cs = new CompileServer(remote_fd, (struct sockaddr *) &remote_addr, remote_len, false);
-                    trace() << "accepted " << cs->name << endl;
-                    cs->last_talk = time(0);
+                    if (remote_fd < 0) {
+                        pending_connections = false;
+                    }
 
-                    if (!cs->protocol) { // protocol mismatch
-                        delete cs;
-                        continue;
+                    if (remote_fd < 0 && errno != EAGAIN && errno != EINTR
+                            && errno != EWOULDBLOCK) {
+                        log_perror("accept()");
+                        /* don't quit because of ECONNABORTED, this can happen during
+                         * floods  */
                     }
 
-                    fd2cs[cs->fd] = cs;
+                    if (remote_fd >= 0) {
+                        CompileServer *cs = new CompileServer(remote_fd, (struct sockaddr *) &remote_addr, remote_len, false);
+                        trace() << "accepted " << cs->name << endl;
+                        cs->last_talk = time(0);
 
-                    while (!cs->read_a_bit() || cs->has_msg()) {
-                        if (! handle_activity(cs)) {
-                            break;
+                        if (!cs->protocol) { // protocol mismatch
+                            delete cs;
+                            continue;
                         }
-                    }
-                }
-            }
 
-            next_listen = time(0) + 1;
-        }
-
-        if (max_fd && FD_ISSET(text_fd, &read_set)) {
-            max_fd--;
-            remote_len = sizeof(remote_addr);
-            remote_fd = accept(text_fd,
-                               (struct sockaddr *) &remote_addr,
-                               &remote_len);
+                        add_channel(cs);
 
-            if (remote_fd < 0 && errno != EAGAIN && errno != EINTR) {
-                log_perror("accept()");
-                /* Don't quit the scheduler just because a debugger couldn't
-                   connect.  */
-            }
+                        while (!cs->read_a_bit() || cs->has_msg()) {
+                            if (! handle_activity(cs)) {
+                                break;
+                            }
+                        }
+                    }
+                }
 
-            if (remote_fd >= 0) {
-                CompileServer *cs = new CompileServer(remote_fd, (struct sockaddr *) &remote_addr, remote_len, true);
-                fd2cs[cs->fd] = cs;
+                next_listen = time(0) + 1;
+                poller.modify(listen_fd, 0);
+                poller.modify(text_fd, 0);
+                listening = false;
+            } else if (fd == text_fd) {
+                remote_len = sizeof(remote_addr);
+                remote_fd = accept(text_fd,
+                                   (struct sockaddr *) &remote_addr,
+                                   &remote_len);
 
-                if (!handle_control_login(cs)) {
-                    handle_end(cs, 0);
-                    continue;
+                if (remote_fd < 0 && errno != EAGAIN && errno != EINTR) {
+                    log_perror("accept()");
+                    /* Don't quit the scheduler just because a debugger couldn't
+                       connect.  */
                 }
 
-                while (!cs->read_a_bit() || cs->has_msg())
-                    if (!handle_activity(cs)) {
-                        break;
+                if (remote_fd >= 0) {
+                    CompileServer *cs = new CompileServer(remote_fd, (struct sockaddr *) &remote_addr, remote_len, true);
+                    add_channel(cs);
+
+                    if (!handle_control_login(cs)) {
+                        handle_end(cs, 0);
+                        continue;
                     }
-            }
-        }
 
-        if (max_fd && FD_ISSET(broad_fd, &read_set)) {
-            max_fd--;
-            char buf[BROAD_BUFLEN];
-            struct sockaddr_in broad_addr;
-            socklen_t broad_len = sizeof(broad_addr);
-            /* We can get either a daemon request for a scheduler (1 byte) or another scheduler
-               announcing itself (4 bytes + time). */
-            const int schedbuflen = 4 + sizeof(uint64_t);
-
-            int buflen = recvfrom(broad_fd, buf, max( 1, schedbuflen), 0, (struct sockaddr *) &broad_addr,
-                                  &broad_len);
-            if (buflen != 1 && buflen != schedbuflen) {
-                int err = errno;
-                log_perror("recvfrom()");
-
-                /* Some linux 2.6 kernels can return from select with
-                   data available, and then return from read() with EAGAIN
-                even on a blocking socket (breaking POSIX).  Happens
-                 when the arriving packet has a wrong checksum.  So
-                 we ignore EAGAIN here, but still abort for all other errors. */
-                if (err != EAGAIN) {
-                    return -1;
+                    while (!cs->read_a_bit() || cs->has_msg())
+                        if (!handle_activity(cs)) {
+                            break;
+                        }
                 }
-            }
-            /* Daemon is searching for a scheduler, only answer if daemon would be able to talk to us. */
-            else if (buflen == 1 && buf[0] >= MIN_PROTOCOL_VERSION) {
-                log_info() << "broadcast from " << inet_ntoa(broad_addr.sin_addr)
-                           << ":" << ntohs(broad_addr.sin_port)
-                           << " (version " << int(buf[0]) << ")\n";
-                int reply_len = prepare_broadcast_reply(buf, netname);
-                if (sendto(broad_fd, buf, reply_len, 0,
-                           (struct sockaddr *) &broad_addr, broad_len) != reply_len) {
-                    log_perror("sendto()");
+            } else if (fd == broad_fd) {
+                char buf[BROAD_BUFLEN];
+                struct sockaddr_in broad_addr;
+                socklen_t broad_len = sizeof(broad_addr);
+                /* We can get either a daemon request for a scheduler (1 byte) or another scheduler
+                   announcing itself (4 bytes + time). */
+                const int schedbuflen = 4 + sizeof(uint64_t);
+
+                int buflen = recvfrom(broad_fd, buf, max( 1, schedbuflen), 0, (struct sockaddr *) &broad_addr,
+                                      &broad_len);
+                if (buflen != 1 && buflen != schedbuflen) {
+                    int err = errno;
+                    log_perror("recvfrom()");
+
+                    /* Some linux 2.6 kernels can return from select with
+                       data available, and then return from read() with EAGAIN
+                    even on a blocking socket (breaking POSIX).  Happens
+                     when the arriving packet has a wrong checksum.  So
+                     we ignore EAGAIN here, but still abort for all other errors. */
+                    if (err != EAGAIN) {
+                        return -1;
+                    }
                 }
-            }
-            else if (buflen == schedbuflen && buf[0] == 'I' && buf[1] == 'C' && buf[2] == 'E') {
-                /* Another scheduler is announcing it's running, disconnect daemons if it has a better version
-                   or the same version but was started earlier. */
-                uint64_t tmp_time;
-                memcpy(&tmp_time, buf + 4, sizeof(uint64_t));
-                time_t other_time = tmp_time;
-                if (buf[3] > PROTOCOL_VERSION || other_time < starttime) {
-                    if (!css.empty() || !monitors.empty()) {
-                        log_info() << "Scheduler from " << inet_ntoa(broad_addr.sin_addr)
+                /* Daemon is searching for a scheduler, only answer if daemon would be able to talk to us. */
+                else if (buflen == 1 && buf[0] >= MIN_PROTOCOL_VERSION) {
+                    log_info() << "broadcast from " << inet_ntoa(broad_addr.sin_addr)
                                << ":" << ntohs(broad_addr.sin_port)
-                               << " (version " << int(buf[3]) << ") has announced itself as a preferred"
-                            " scheduler, disconnecting all connections." << endl;
-                        while (!css.empty())
-                            handle_end(css.front(), NULL);
-                        while (!monitors.empty())
-                            handle_end(monitors.front(), NULL);
+                               << " (version " << int(buf[0]) << ")\n";
+                    int reply_len = prepare_broadcast_reply(buf, netname);
+                    if (sendto(broad_fd, buf, reply_len, 0,
+                               (struct sockaddr *) &broad_addr, broad_len) != reply_len) {
+                        log_perror("sendto()");
                     }
                 }
-            }
-        }
+                else if (buflen == schedbuflen && buf[0] == 'I' && buf[1] == 'C' && buf[2] == 'E') {
+                    /* Another scheduler is announcing it's running, disconnect daemons if it has a better version
+                       or the same version but was started earlier. */
+                    uint64_t tmp_time;
+                    memcpy(&tmp_time, buf + 4, sizeof(uint64_t));
+                    time_t other_time = tmp_time;
+                    if (buf[3] > PROTOCOL_VERSION || other_time < starttime) {
+                        if (!css.empty() || !monitors.empty()) {
+                            log_info() << "Scheduler from " << inet_ntoa(broad_addr.sin_addr)
+                                   << ":" << ntohs(broad_addr.sin_port)
+                                   << " (version " << int(buf[3]) << ") has announced itself as a preferred"
+                                " scheduler, disconnecting all connections." << endl;
+                            while (!css.empty())
+                                handle_end(css.front(), NULL);
+                            while (!monitors.empty())
+                                handle_end(monitors.front(), NULL);
+                        }
+                    }
+                }
+            } else {
+                /* An earlier fd of this round may have ended the channel,
+                   and a new connection may even have reused the fd.  */
+                map<int, CompileServer *>::const_iterator it = fd2cs.find(fd);
 
-        for (map<int, CompileServer *>::const_iterator it = fd2cs.begin();
-                max_fd && it != fd2cs.end();) {
-            int i = it->first;
-            CompileServer *cs = it->second;
-            /* handle_activity can delete the channel from the fd2cs list,
-               hence advance the iterator right now, so it doesn't become
-               invalid.  */
-            ++it;
+                if (it == fd2cs.end()) {
+                    continue;
+                }
+
+                CompileServer *cs = it->second;
 
-            if (FD_ISSET(i, &read_set)) {
                 while (!cs->read_a_bit() || cs->has_msg()) {
                     if (!handle_activity(cs)) {
                         break;
                     }
                 }
-
-                max_fd--;
             }
         }
     }
 
+    save_stats();
     shutdown(broad_fd, SHUT_RDWR);
     close(broad_fd);
     unlink(pidFilePath.c_str());
@@ -31,6 +31,7 @@
 #include <sys/un.h>
 #include <arpa/inet.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #if HAVE_NETINET_TCP_VAR_H
@@ -40,13 +41,24 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string>
 #include <iostream>
 #include <assert.h>
 #include <lzo/lzo1x.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
 #include <stdio.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #ifdef HAVE_LIBCAP_NG
 #include <cap-ng.h>
 #endif
@@ -66,6 +78,57 @@ using namespace std;
 
 #define MAX_MSG_SIZE 1 * 1024 * 1024
 
+#define DEFAULT_ZSTD_LEVEL 1
+
+/* The input buffer has room for at least this much with every read, and
+   what doesn't fit goes to a spill buffer of INPUT_SPILL_SIZE on the stack.
+   A buffer that grew beyond INPUT_SHRINK_SIZE for a big message is given
+   back once it's empty.  */
+#define MIN_INPUT_READ 4096
+#define INPUT_SPILL_SIZE 65536
+#define INPUT_SHRINK_SIZE (256 * 1024)
+
+/* A corked channel sends its output anyway once it has this much.  */
+#define MAX_CORKED_OUTPUT 65536
+
+/* Per-channel state of the compressors, so that it's not necessary
+   to allocate it for every single FileChunkMsg.  */
+struct CompressionContext {
+    CompressionContext()
+        : lzo_wrkmem(0)
+#ifdef HAVE_LZ4
+        , lz4_state(0)
+#endif
+#ifdef HAVE_ZSTD
+        , zstd_cctx(0)
+        , zstd_dctx(0)
+#endif
+    {}
+
+    ~CompressionContext()
+    {
+        free(lzo_wrkmem);
+#ifdef HAVE_LZ4
+        free(lz4_state);
+#endif
+#ifdef HAVE_ZSTD
+        ZSTD_freeCCtx(zstd_cctx);
+        ZSTD_freeDCtx(zstd_dctx);
+#endif
+    }
+
+    lzo_voidp lzo_wrkmem;
+#ifdef HAVE_LZ4
+    void *lz4_state;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd_cctx;
+    ZSTD_DCtx *zstd_dctx;
+#endif
+};
+
+static uint32_t supported_compressions();
+
 /* TODO
  * buffered in/output per MsgChannel
     + move read* into MsgChannel, create buffer-fill function
@@ -78,31 +141,65 @@ using namespace std;
     of the whole data packet?)
  */
 
-/* Tries to fill the inbuf completely.  */
+/* Makes room for COUNT more bytes at the end of inbuf, by moving the
+   unread data to the front if that is enough, or else growing it to at
+   least twice the size.  */
+void MsgChannel::reserve_input(size_t count)
+{
+    if (inbuflen - inofs >= count) {
+        return;
+    }
+
+    if (intogo && inbuflen - (inofs - intogo) >= count) {
+        memmove(inbuf, inbuf + intogo, inofs - intogo);
+        inofs -= intogo;
+        intogo = 0;
+        return;
+    }
+
+    size_t len = max(inbuflen * 2, inofs + count);
+    inbuflen = (len + MIN_INPUT_READ - 1) & ~(size_t)(MIN_INPUT_READ - 1);
+    inbuf = (char *) realloc(inbuf, inbuflen);
+}
+
+/* Reads what is available, with room for at least the rest of the
+   message being received.  More than fits goes to a spill buffer in
+   the same readv(), so a whole message usually arrives in one call
+   without growing the buffer for it in advance.  */
 bool MsgChannel::read_a_bit()
 {
     chop_input();
-    size_t count = inbuflen - inofs;
 
-    if (count < 128) {
-        inbuflen = (inbuflen + 128 + 127) & ~(size_t) 127;
-        inbuf = (char *) realloc(inbuf, inbuflen);
-        count = inbuflen - inofs;
+    size_t count = MIN_INPUT_READ;
+
+    if (instate == FILL_BUF && intogo + inmsglen > inofs) {
+        count = max(count, intogo + inmsglen - inofs);
     }
 
-    char *buf = inbuf + inofs;
-    bool error = false;
+    reserve_input(count);
 
-    while (count) {
-        if (eof) {
-            break;
-        }
+    char spill[INPUT_SPILL_SIZE];
+    struct iovec iov[2];
+    iov[0].iov_base = inbuf + inofs;
+    iov[0].iov_len = inbuflen - inofs;
+    iov[1].iov_base = spill;
+    iov[1].iov_len = sizeof(spill);
+    bool error = false;
 
-        ssize_t ret = read(fd, buf, count);
+    while (!eof) {
+        ssize_t ret = readv(fd, iov, 2);
 
         if (ret > 0) {
-            count -= ret;
-            buf += ret;
+            size_t room = inbuflen - inofs;
+
+            if (size_t(ret) <= room) {
+                inofs += ret;
+            } else {
+                inofs = inbuflen;
+                reserve_input(ret - room);
+                memcpy(inbuf + inofs, spill, ret - room);
+                inofs += ret - room;
+            }
         } else if (ret < 0 && errno == EINTR) {
             continue;
         } else if (ret < 0) {
@@ -117,8 +214,6 @@ bool MsgChannel::read_a_bit()
         break;
     }
 
-    inofs = buf - inbuf;
-
     if (!update_state()) {
         error = true;
     }
@@ -165,6 +260,18 @@ bool MsgChannel::update_state(void)
 
                 writefull(vers, 4);
 
+                /* Since protocol 36 the version is followed by the bitmask
+                   of compressions we support.  */
+                if (remote_prot >= 36) {
+                    uint32_t compressions = supported_compressions();
+
+                    for (int i = 0; i < 4; ++i) {
+                        vers[i] = compressions >> (i * 8);
+                    }
+
+                    writefull(vers, 4);
+                }
+
                 if (!flush_writebuf(true)) {
                     return false;
                 }
@@ -179,9 +286,19 @@ bool MsgChannel::update_state(void)
                     return false;
                 }
 
+                if (IS_PROTOCOL_36(this)) {
+                    /* The remote's compressions follow.  */
+                    continue;
+                }
+
                 instate = NEED_LEN;
                 /* Don't consume bytes from messages.  */
                 break;
+            } else if (IS_PROTOCOL_36(this)) {
+                /* This is not the protocol but the compressions the remote supports.  */
+                negotiate_compression(remote_prot);
+                instate = NEED_LEN;
+                break;
             } else {
                 trace() << "NEED_PROTO but protocol > 0" << endl;
             }
@@ -217,11 +334,6 @@ bool MsgChannel::update_state(void)
                 return false;
             }
 
-            if (inbuflen - intogo < inmsglen) {
-                inbuflen = (inmsglen + intogo + 127) & ~(size_t)127;
-                inbuf = (char *) realloc(inbuf, inbuflen);
-            }
-
             instate = FILL_BUF;
             /* FALLTHROUGH */
         } else {
@@ -241,6 +353,10 @@ bool MsgChannel::update_state(void)
     case HAS_MSG:
         /* handled elsewere */
         break;
+
+    case RAW_DATA:
+        /* handled by read_raw() */
+        break;
     }
 
     return true;
@@ -248,16 +364,47 @@ bool MsgChannel::update_state(void)
 
 void MsgChannel::chop_input()
 {
-    /* Make buffer smaller, if there's much already read in front
-       of it, or it is cheap to do.  */
-    if (intogo > 8192 || inofs - intogo <= 16) {
+    /* Move the unread data to the front if it's cheap to do, otherwise
+       reserve_input() does it only when the space is needed.  */
+    if (inofs - intogo <= 16) {
         if (inofs - intogo != 0) {
             memmove(inbuf, inbuf + intogo, inofs - intogo);
         }
 
         inofs -= intogo;
         intogo = 0;
+
+        if (inofs == 0 && inbuflen > INPUT_SHRINK_SIZE) {
+            inbuflen = MIN_INPUT_READ;
+            inbuf = (char *) realloc(inbuf, inbuflen);
+        }
+    }
+}
+
+std::string MsgChannel::buffered_input() const
+{
+    std::string input;
+
+    /* update_state() may have taken the length of the next message
+       already, which the new reader has to see as well.  */
+    if (!text_based && (instate == FILL_BUF || instate == HAS_MSG)) {
+        uint32_t len = htonl(inmsglen);
+        input.assign((const char *) &len, 4);
     }
+
+    return input.append(inbuf + intogo, inofs - intogo);
+}
+
+void MsgChannel::drop_input()
+{
+    if (instate == NEED_PROTO) {
+        return;
+    }
+
+    inofs = intogo = 0;
+    rawtogo = 0;
+    instate = NEED_LEN;
+    chop_input();
 }
 
 void MsgChannel::chop_output()
@@ -283,7 +430,7 @@ void MsgChannel::writefull(const void *_buf, size_t count)
     msgtogo += count;
 }
 
-bool MsgChannel::flush_writebuf(bool blocking)
+bool MsgChannel::flush_writebuf(bool blocking, bool queued)
 {
     const char *buf = msgbuf + msgofs;
     bool error = false;
@@ -304,6 +451,11 @@ bool MsgChannel::flush_writebuf(bool blocking)
                 continue;
             }
 
+            /* What can't be sent now stays queued for flush_queued().  */
+            if (queued && errno == EAGAIN) {
+                break;
+            }
+
             /* If we want to write blocking, but couldn't write anything,
                select on the fd.  */
             if (blocking && errno == EAGAIN) {
@@ -460,11 +612,247 @@ void MsgChannel::read_environments(Environments &envs)
     }
 }
 
-void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen, size_t &_clen)
+const char *compression_name(uint32_t type)
+{
+    switch (type) {
+    case COMPRESSION_NONE:
+        return "none";
+    case COMPRESSION_LZO:
+        return "lzo";
+    case COMPRESSION_LZ4:
+        return "lz4";
+    case COMPRESSION_ZSTD:
+        return "zstd";
+    }
+
+    return "unknown";
+}
+
+/* Bitmask of the compressions we can decompress, sent to the other side
+   during the protocol setup.  */
+static uint32_t supported_compressions()
+{
+    uint32_t mask = (1 << COMPRESSION_NONE) | (1 << COMPRESSION_LZO);
+#ifdef HAVE_LZ4
+    mask |= 1 << COMPRESSION_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+    mask |= 1 << COMPRESSION_ZSTD;
+#endif
+    return mask;
+}
+
+/* The compression we'd like to use for sending, can be set
+   using ICECC_COMPRESSION=<none|lzo|lz4|zstd>[:<level>].  */
+static void preferred_compression(CompressionType &type, int &level)
+{
+    static bool initialized = false;
+    static CompressionType preferred_type = COMPRESSION_ZSTD;
+    static int preferred_level = DEFAULT_ZSTD_LEVEL;
+
+    if (!initialized) {
+        initialized = true;
+        const char *env = getenv("ICECC_COMPRESSION");
+
+        if (env && *env) {
+            string name = env;
+            string::size_type colon = name.find(':');
+
+            if (colon != string::npos) {
+                preferred_level = atoi(name.c_str() + colon + 1);
+                name = name.substr(0, colon);
+            }
+
+            if (name == "none") {
+                preferred_type = COMPRESSION_NONE;
+            } else if (name == "lzo") {
+                preferred_type = COMPRESSION_LZO;
+            } else if (name == "lz4") {
+                preferred_type = COMPRESSION_LZ4;
+            } else if (name == "zstd") {
+                preferred_type = COMPRESSION_ZSTD;
+
+                if (colon == string::npos) {
+                    preferred_level = DEFAULT_ZSTD_LEVEL;
+                }
+            } else {
+                log_warning() << "unknown ICECC_COMPRESSION value: " << env << endl;
+                preferred_level = DEFAULT_ZSTD_LEVEL;
+            }
+        }
+    }
+
+    type = preferred_type;
+    level = preferred_level;
+}
+
+void MsgChannel::negotiate_compression(uint32_t _remote_compressions)
+{
+    remote_compressions = _remote_compressions;
+    uint32_t common = supported_compressions() & remote_compressions;
+    CompressionType type;
+    int level;
+    preferred_compression(type, level);
+
+    if (!(common & (1 << type))) {
+        /* Fall back to the best one both sides can handle.  */
+        if (common & (1 << COMPRESSION_ZSTD)) {
+            type = COMPRESSION_ZSTD;
+            level = DEFAULT_ZSTD_LEVEL;
+        } else if (common & (1 << COMPRESSION_LZ4)) {
+            type = COMPRESSION_LZ4;
+        } else {
+            type = COMPRESSION_LZO;
+        }
+    }
+
+    out_compression = type;
+    out_compression_level = level;
+}
+
+static size_t compress_bound(CompressionType type, size_t in_len)
+{
+    switch (type) {
+    case COMPRESSION_LZO:
+        return in_len + in_len / 64 + 16 + 3;
+#ifdef HAVE_LZ4
+    case COMPRESSION_LZ4:
+        return LZ4_compressBound(in_len);
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESSION_ZSTD:
+        return ZSTD_compressBound(in_len);
+#endif
+    default:
+        return in_len;
+    }
+}
+
+static bool compress_data(CompressionContext *ctx, CompressionType type, int level,
+                          const unsigned char *in_buf, size_t in_len,
+                          unsigned char *out_buf, size_t &out_len)
 {
-    lzo_uint uncompressed_len;
-    lzo_uint compressed_len;
+    switch (type) {
+    case COMPRESSION_NONE:
+        memcpy(out_buf, in_buf, in_len);
+        out_len = in_len;
+        return true;
+    case COMPRESSION_LZO: {
+        if (!ctx->lzo_wrkmem) {
+            ctx->lzo_wrkmem = (lzo_voidp) malloc(LZO1X_MEM_COMPRESS);
+        }
+
+        lzo_uint lzo_out_len = out_len;
+        int ret = lzo1x_1_compress(in_buf, in_len, out_buf, &lzo_out_len, ctx->lzo_wrkmem);
+        out_len = lzo_out_len;
+        return ret == LZO_E_OK;
+    }
+#ifdef HAVE_LZ4
+    case COMPRESSION_LZ4: {
+        if (!ctx->lz4_state) {
+            ctx->lz4_state = malloc(LZ4_sizeofState());
+        }
+
+        int ret = LZ4_compress_fast_extState(ctx->lz4_state, (const char *) in_buf,
+                                             (char *) out_buf, in_len, out_len, 1);
+        out_len = ret > 0 ? ret : 0;
+        return ret > 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESSION_ZSTD: {
+        if (!ctx->zstd_cctx) {
+            ctx->zstd_cctx = ZSTD_createCCtx();
+        }
+
+        size_t ret = ZSTD_compressCCtx(ctx->zstd_cctx, out_buf, out_len, in_buf, in_len, level);
+
+        if (ZSTD_isError(ret)) {
+            return false;
+        }
+
+        out_len = ret;
+        return true;
+    }
+#endif
+    default:
+        (void) level;
+        return false;
+    }
+}
+
+static bool decompress_data(CompressionContext *ctx, uint32_t type,
+                            const unsigned char *in_buf, size_t in_len,
+                            unsigned char *out_buf, size_t &out_len)
+{
+    switch (type) {
+    case COMPRESSION_NONE:
+        if (in_len > out_len) {
+            return false;
+        }
+
+        memcpy(out_buf, in_buf, in_len);
+        out_len = in_len;
+        return true;
+    case COMPRESSION_LZO: {
+        lzo_uint lzo_out_len = out_len;
+        int ret = lzo1x_decompress_safe(in_buf, in_len, out_buf, &lzo_out_len, 0);
+        out_len = lzo_out_len;
+        return ret == LZO_E_OK;
+    }
+#ifdef HAVE_LZ4
+    case COMPRESSION_LZ4: {
+        int ret = LZ4_decompress_safe((const char *) in_buf, (char *) out_buf, in_len, out_len);
+        out_len = ret > 0 ? ret : 0;
+        return ret >= 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    case COMPRESSION_ZSTD: {
+        if (!ctx->zstd_dctx) {
+            ctx->zstd_dctx = ZSTD_createDCtx();
+        }
+
+        size_t ret = ZSTD_decompressDCtx(ctx->zstd_dctx, out_buf, out_len, in_buf, in_len);
+
+        if (ZSTD_isError(ret)) {
+            return false;
+        }
+
+        out_len = ret;
+        return true;
+    }
+#endif
+    default:
+        (void) ctx;
+        return false;
+    }
+}
+
+static uint64_t usec_since(const struct timeval &start)
+{
+    struct timeval now;
+    gettimeofday(&now, 0);
+
+    if (now.tv_sec < start.tv_sec) {
+        return 0;
+    }
+
+    return (now.tv_sec - start.tv_sec) * (uint64_t) 1000000 + now.tv_usec - start.tv_usec;
+}
+
+void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen, size_t &_clen,
+                                uint32_t &_compression)
+{
+    size_t uncompressed_len;
+    size_t compressed_len;
+    uint32_t compression = COMPRESSION_LZO;
     uint32_t tmp;
+
+    if (IS_PROTOCOL_36(this)) {
+        *this >> compression;
+    }
+
     *this >> tmp;
     uncompressed_len = tmp;
     *this >> tmp;
@@ -482,25 +870,32 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
         uncompressed_len = 0;
         _uclen = uncompressed_len;
         _clen = compressed_len;
+        _compression = compression;
         return;
     }
 
     *uncompressed_buf = new unsigned char[uncompressed_len];
 
     if (uncompressed_len && compressed_len) {
-        const lzo_byte *compressed_buf = (lzo_byte *)(inbuf + intogo);
-        lzo_voidp wrkmem = (lzo_voidp) malloc(LZO1X_MEM_COMPRESS);
-        int ret = lzo1x_decompress(compressed_buf, compressed_len,
-                                   *uncompressed_buf, &uncompressed_len, wrkmem);
-        free(wrkmem);
+        const unsigned char *compressed_buf = (unsigned char *)(inbuf + intogo);
+
+        if (!compression_ctx) {
+            compression_ctx = new CompressionContext;
+        }
+
+        struct timeval starttv;
+        gettimeofday(&starttv, 0);
+        bool ok = decompress_data(compression_ctx, compression, compressed_buf, compressed_len,
+                                  *uncompressed_buf, uncompressed_len);
+        decompress_usec += usec_since(starttv);
 
-        if (ret != LZO_E_OK) {
+        if (!ok) {
             /* This should NEVER happen.
             Remove the buffer, and indicate there is nothing in it,
             but don't reset the compressed_len, so our caller know,
             that there actually was something read in.  */
-            log_error() << "internal error - decompression of data from " << dump().c_str()
-                        << " failed: " << ret << endl;
+            log_error() << "internal error - decompression (" << compression_name(compression)
+                        << ") of data from " << dump().c_str() << " failed" << endl;
             delete [] *uncompressed_buf;
             *uncompressed_buf = 0;
             uncompressed_len = 0;
@@ -513,14 +908,22 @@ void MsgChannel::readcompressed(unsigned char **uncompressed_buf, size_t &_uclen
     intogo += compressed_len;
     _uclen = uncompressed_len;
     _clen = compressed_len;
+    _compression = compression;
 }
 
-void MsgChannel::writecompressed(const unsigned char *in_buf, size_t _in_len, size_t &_out_len)
+void MsgChannel::writecompressed(const unsigned char *in_buf, size_t _in_len, size_t &_out_len,
+                                 uint32_t &_compression)
 {
-    lzo_uint in_len = _in_len;
-    lzo_uint out_len = _out_len;
-    out_len = in_len + in_len / 64 + 16 + 3;
-    *this << in_len;
+    CompressionType compression = IS_PROTOCOL_36(this) ? out_compression : COMPRESSION_LZO;
+    size_t in_len = _in_len;
+    size_t out_len = compress_bound(compression, in_len);
+    size_t msgtogo_compression = msgtogo;
+
+    if (IS_PROTOCOL_36(this)) {
+        *this << (uint32_t) compression;
+    }
+
+    *this << (uint32_t) in_len;
     size_t msgtogo_old = msgtogo;
     *this << (uint32_t) 0;
 
@@ -530,21 +933,39 @@ void MsgChannel::writecompressed(const unsigned char *in_buf, size_t _in_len, si
         msgbuf = (char *) realloc(msgbuf, msgbuflen);
     }
 
-    lzo_byte *out_buf = (lzo_byte *)(msgbuf + msgtogo);
-    lzo_voidp wrkmem = (lzo_voidp) malloc(LZO1X_MEM_COMPRESS);
-    int ret = lzo1x_1_compress(in_buf, in_len, out_buf, &out_len, wrkmem);
-    free(wrkmem);
+    if (!compression_ctx) {
+        compression_ctx = new CompressionContext;
+    }
+
+    unsigned char *out_buf = (unsigned char *)(msgbuf + msgtogo);
+    struct timeval starttv;
+    gettimeofday(&starttv, 0);
 
-    if (ret != LZO_E_OK) {
+    if (!compress_data(compression_ctx, compression, out_compression_level,
+                       in_buf, in_len, out_buf, out_len)) {
         /* this should NEVER happen */
-        log_error() << "internal error - compression failed: " << ret << endl;
+        log_error() << "internal error - compression (" << compression_name(compression)
+                    << ") failed" << endl;
         out_len = 0;
     }
 
+    compress_usec += usec_since(starttv);
+
+    /* Data that doesn't compress is better sent as it is.  */
+    if (IS_PROTOCOL_36(this) && compression != COMPRESSION_NONE
+            && (out_len == 0 || out_len >= in_len)) {
+        compression = COMPRESSION_NONE;
+        memcpy(out_buf, in_buf, in_len);
+        out_len = in_len;
+        uint32_t _compression_net = htonl(compression);
+        memcpy(msgbuf + msgtogo_compression, &_compression_net, 4);
+    }
+
     uint32_t _olen = htonl(out_len);
     memcpy(msgbuf + msgtogo_old, &_olen, 4);
     msgtogo += out_len;
     _out_len = out_len;
+    _compression = compression;
 }
 
 void MsgChannel::read_line(string &line)
@@ -719,6 +1140,271 @@ MsgChannel *Service::createChannel(const string &socket_path)
     return createChannel(remote_fd, (struct sockaddr *)&remote_addr, sizeof(remote_addr));
 }
 
+int Service::startConnect(const string &hostname, unsigned short p)
+{
+    int remote_fd;
+    struct sockaddr_in remote_addr;
+
+    if ((remote_fd = prepare_connect(hostname, p, remote_addr)) < 0) {
+        return -1;
+    }
+
+    fcntl(remote_fd, F_SETFL, O_NONBLOCK);
+    fcntl(remote_fd, F_SETFD, FD_CLOEXEC);
+
+    if (connect(remote_fd, (struct sockaddr *) &remote_addr, sizeof(remote_addr)) < 0
+            && errno != EINPROGRESS && errno != EINTR) {
+        trace() << "connect failed on " << hostname << endl;
+        close(remote_fd);
+        return -1;
+    }
+
+    return remote_fd;
+}
+
+MsgChannel *Service::finishConnect(int remote_fd)
+{
+    int error = 0;
+    socklen_t error_len = sizeof(error);
+    struct sockaddr_in remote_addr;
+    socklen_t remote_len = sizeof(remote_addr);
+
+    if (getsockopt(remote_fd, SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 || error
+            || getpeername(remote_fd, (struct sockaddr *) &remote_addr, &remote_len) < 0) {
+        trace() << "connect failed: " << strerror(error ? error : errno) << endl;
+        close(remote_fd);
+        return 0;
+    }
+
+    MsgChannel *c = new MsgChannel(remote_fd, (struct sockaddr *) &remote_addr, remote_len, false);
+
+    if (c->protocol == 0) {
+        delete c;
+        return 0;
+    }
+
+    return c;
+}
+
+/* A passed connection comes as three little endian uint32: whether there
+   is one, its protocol and the compressions the remote supports.  The fd
+   rides along with the first byte.  */
+static const size_t CHANNEL_RECORD_SIZE = 12;
+
+bool MsgChannel::send_channel(const MsgChannel *c)
+{
+    /* The record must not get mixed up with queued messages.  */
+    if (msgtogo && !flush_writebuf(true)) {
+        return false;
+    }
+
+    uint32_t fields[3] = { c ? 1U : 0U, c ? uint32_t(c->protocol) : 0, c ? c->remote_compressions : 0 };
+    unsigned char record[CHANNEL_RECORD_SIZE];
+
+    for (int f = 0; f < 3; ++f) {
+        for (int i = 0; i < 4; ++i) {
+            record[f * 4 + i] = fields[f] >> (i * 8);
+        }
+    }
+
+    struct iovec iov;
+    iov.iov_base = record;
+    iov.iov_len = sizeof(record);
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    if (c) {
+        memset(&control, 0, sizeof(control));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &c->fd, sizeof(int));
+    }
+
+    for (;;) {
+#ifdef MSG_NOSIGNAL
+        ssize_t ret = sendmsg(fd, &mh, MSG_NOSIGNAL);
+#else
+        ssize_t ret = sendmsg(fd, &mh, 0);
+#endif
+
+        if (ret >= 0) {
+            if (size_t(ret) < sizeof(record)) {
+                // the fd went with the first part already
+                writefull(record + ret, sizeof(record) - ret);
+                return flush_writebuf(true);
+            }
+
+            return true;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_perror("sendmsg()");
+            return false;
+        }
+
+        fd_set write_set;
+        FD_ZERO(&write_set);
+        FD_SET(fd, &write_set);
+        struct timeval tv;
+        tv.tv_sec = 20;
+        tv.tv_usec = 0;
+
+        if (select(fd + 1, NULL, &write_set, NULL, &tv) <= 0 && errno != EINTR) {
+            log_error() << "can't pass connection to " << name << endl;
+            return false;
+        }
+    }
+}
+
+MsgChannel *Service::receiveChannel(MsgChannel *via, int timeout)
+{
+    /* The record is read directly from the socket, as the fd would get
+       lost when reading it into the buffer with the messages.  */
+    if (via->inofs != via->intogo) {
+        log_error() << "unexpected data before passed connection" << endl;
+        return 0;
+    }
+
+    unsigned char record[CHANNEL_RECORD_SIZE];
+    size_t got = 0;
+    int remote_fd = -1;
+
+    while (got < sizeof(record)) {
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        FD_SET(via->fd, &read_set);
+        struct timeval tv;
+        tv.tv_sec = timeout;
+        tv.tv_usec = 0;
+        int ret = select(via->fd + 1, &read_set, NULL, NULL, &tv);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret <= 0) {
+            log_error() << "no connection passed within timeout" << endl;
+            break;
+        }
+
+        struct iovec iov;
+        iov.iov_base = record + got;
+        iov.iov_len = sizeof(record) - got;
+
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+
+        struct msghdr mh;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+
+#ifdef MSG_CMSG_CLOEXEC
+        ssize_t len = recvmsg(via->fd, &mh, MSG_CMSG_CLOEXEC);
+#else
+        ssize_t len = recvmsg(via->fd, &mh, 0);
+#endif
+
+        if (len < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            continue;
+        }
+
+        if (len <= 0) {
+            if (len < 0) {
+                log_perror("recvmsg()");
+            }
+
+            break;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+                    && cmsg->cmsg_len >= CMSG_LEN(sizeof(int)) && remote_fd < 0) {
+                memcpy(&remote_fd, CMSG_DATA(cmsg), sizeof(int));
+            }
+        }
+
+        got += len;
+    }
+
+    uint32_t fields[3] = { 0, 0, 0 };
+
+    if (got == sizeof(record)) {
+        for (int f = 0; f < 3; ++f) {
+            for (int i = 0; i < 4; ++i) {
+                fields[f] |= record[f * 4 + i] << (i * 8);
+            }
+        }
+    } else {
+        via->eof = true;
+    }
+
+    if (!fields[0] || remote_fd < 0 || fields[1] < MIN_PROTOCOL_VERSION) {
+        if (remote_fd >= 0) {
+            close(remote_fd);
+        }
+
+        return 0;
+    }
+
+    return adoptChannel(remote_fd, fields[1], fields[2]);
+}
+
+MsgChannel *Service::adoptChannel(int remote_fd, int protocol, uint32_t remote_compressions,
+                                  const std::string &input)
+{
+    struct sockaddr_storage remote_addr;
+    socklen_t remote_len = sizeof(remote_addr);
+
+    if (getpeername(remote_fd, (struct sockaddr *) &remote_addr, &remote_len) < 0) {
+        log_perror("getpeername()");
+        close(remote_fd);
+        return 0;
+    }
+
+    // the versions were exchanged by the one who connected
+    MsgChannel *c = new MsgChannel(remote_fd, (struct sockaddr *) &remote_addr, remote_len,
+                                   false, protocol);
+
+    if (IS_PROTOCOL_36(c)) {
+        c->negotiate_compression(remote_compressions);
+    }
+
+    if (!input.empty()) {
+        c->reserve_input(input.size());
+        memcpy(c->inbuf + c->inofs, input.data(), input.size());
+        c->inofs += input.size();
+
+        if (!c->update_state()) {
+            delete c;
+            return 0;
+        }
+    }
+
+    trace() << "got connection to " << c->name << endl;
+    return c;
+}
+
 static std::string shorten_filename(const std::string &str)
 {
     std::string::size_type ofs = str.rfind('/');
@@ -753,7 +1439,7 @@ MsgChannel *Service::createChannel(int fd, struct sockaddr *_a, socklen_t _l)
     return c;
 }
 
-MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
+MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text, int agreed_protocol)
     : fd(_fd)
 {
     addr_len = _l;
@@ -762,9 +1448,13 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
         addr = (struct sockaddr *)malloc(addr_len);
         memcpy(addr, _a, addr_len);
         char buf[16384] = "";
-        if(addr->sa_family == AF_UNIX)
-            name = reinterpret_cast<sockaddr_un*>(addr)->sun_path;
-        else {
+        if(addr->sa_family == AF_UNIX) {
+            // unnamed ones, like those of socketpairs, come without the path
+            size_t path_offset = offsetof(struct sockaddr_un, sun_path);
+            const char *path = reinterpret_cast<sockaddr_un*>(addr)->sun_path;
+            if(addr_len > path_offset)
+                name = string(path, strnlen(path, addr_len - path_offset));
+        } else {
             if(int error = getnameinfo(addr, addr_len, buf, sizeof(buf), NULL, 0, NI_NUMERICHOST))
                 log_error() << "getnameinfo(): " << error << endl;
             name = buf;
@@ -779,12 +1469,20 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
     msgbuflen = 128;
     msgofs = 0;
     msgtogo = 0;
-    inbuf = (char *) malloc(128);
-    inbuflen = 128;
+    inbuf = (char *) malloc(MIN_INPUT_READ);
+    inbuflen = MIN_INPUT_READ;
     inofs = 0;
     intogo = 0;
     eof = false;
     text_based = text;
+    corked = false;
+    rawtogo = 0;
+    out_compression = COMPRESSION_LZO;
+    out_compression_level = 0;
+    compression_ctx = 0;
+    remote_compressions = 0;
+    compress_usec = 0;
+    decompress_usec = 0;
 
     int on = 1;
 
@@ -825,6 +1523,9 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
     if (text_based) {
         instate = NEED_LEN;
         protocol = PROTOCOL_VERSION;
+    } else if (agreed_protocol > 0) {
+        instate = NEED_LEN;
+        protocol = min(agreed_protocol, PROTOCOL_VERSION);
     } else {
         instate = NEED_PROTO;
         protocol = -1;
@@ -842,6 +1543,12 @@ MsgChannel::MsgChannel(int _fd, struct sockaddr *_a, socklen_t _l, bool text)
 
 MsgChannel::~MsgChannel()
 {
+    /* Don't lose the last messages of a corked channel, as far as they
+       can be sent without waiting.  */
+    if (fd >= 0 && corked && msgtogo) {
+        flush_writebuf(false, true);
+    }
+
     if (fd >= 0) {
         close(fd);
     }
@@ -859,6 +1566,8 @@ MsgChannel::~MsgChannel()
     if (addr) {
         free(addr);
     }
+
+    delete compression_ctx;
 }
 
 string MsgChannel::dump() const
@@ -932,6 +1641,11 @@ bool MsgChannel::wait_for_msg(int timeout)
         return true;
     }
 
+    /* The other side may need what is still queued for answering.  */
+    if (corked && msgtogo && !flush_writebuf(true)) {
+        return false;
+    }
+
     if (!read_a_bit()) {
         trace() << "!read_a_bit\n";
         return false;
@@ -975,6 +1689,11 @@ Msg *MsgChannel::get_msg(int timeout)
     enum MsgType type;
     uint32_t t;
 
+    if (instate == RAW_DATA) {
+        log_error() << "get_msg() while raw data is pending" << endl;
+        return 0;
+    }
+
     if (!wait_for_msg(timeout)) {
         trace() << "!wait_for_msg()\n";
         return 0;
@@ -1090,45 +1809,345 @@ Msg *MsgChannel::get_msg(int timeout)
     case M_BLACKLIST_HOST_ENV:
         m = new BlacklistHostEnvMsg;
         break;
+    case M_FILE_BULK:
+        m = new FileBulkMsg;
+        break;
+    case M_GET_CONNECTION:
+        m = new GetConnectionMsg;
+        break;
+    case M_RETURN_CONNECTION:
+        m = new ReturnConnectionMsg;
+        break;
+    case M_LEASE:
+        m = new LeaseMsg;
+        break;
+    case M_CACHE_LOOKUP:
+        m = new CacheLookupMsg;
+        break;
+    case M_CACHE_RESULT:
+        m = new CacheResultMsg;
+        break;
+    case M_ENV_MANIFEST:
+        m = new EnvManifestMsg;
+        break;
+    case M_ENV_MISSING:
+        m = new EnvMissingMsg;
+        break;
+    case M_ENV_FETCH:
+        m = new EnvFetchMsg;
+        break;
+    case M_GET_ENV_MANIFEST:
+        m = new GetEnvManifestMsg;
+        break;
+    case M_GET_ENV_BLOBS:
+        m = new GetEnvBlobsMsg;
+        break;
+    case M_MUX:
+        m = new MuxMsg;
+        break;
     case M_TIMEOUT:
         break;
     }
 
-    if (!m) {
-        trace() << "no message type" << endl;
-        return 0;
-    }
+    if (!m) {
+        trace() << "no message type" << endl;
+        return 0;
+    }
+
+    m->fill_from_channel(this);
+
+    if (m->type == M_FILE_BULK) {
+        /* The data follows raw and must be fetched with read_raw().  */
+        rawtogo = static_cast<FileBulkMsg *>(m)->len;
+        instate = RAW_DATA;
+    } else {
+        instate = NEED_LEN;
+    }
+
+    update_state();
+
+    return m;
+}
+
+bool MsgChannel::send_msg(const Msg &m, int flags)
+{
+    if (instate == NEED_PROTO && !wait_for_protocol()) {
+        return false;
+    }
+
+    chop_output();
+
+    /* The message gets appended at msgtogo, so queued output must start at msgbuf.  */
+    if (msgofs && msgtogo) {
+        memmove(msgbuf, msgbuf + msgofs, msgtogo);
+        msgofs = 0;
+    }
+
+    size_t msgtogo_old = msgtogo;
+
+    if (text_based) {
+        m.send_to_channel(this);
+    } else {
+        *this << (uint32_t) 0;
+        m.send_to_channel(this);
+        uint32_t len = htonl(msgtogo - msgtogo_old - 4);
+        memcpy(msgbuf + msgtogo_old, &len, 4);
+    }
+
+    if ((flags & SendBulkOnly) && msgtogo < 4096) {
+        return true;
+    }
+
+    if (corked && msgtogo < MAX_CORKED_OUTPUT) {
+        return true;
+    }
+
+    if (flags & SendQueued) {
+        return flush_writebuf(false, true);
+    }
+
+    return flush_writebuf((flags & SendBlocking));
+}
+
+bool MsgChannel::flush_queued()
+{
+    return flush_writebuf(false, true);
+}
+
+bool MsgChannel::uncork(bool blocking)
+{
+    corked = false;
+    return flush_writebuf(blocking);
+}
+
+/* Waits until FD is readable (or writable), false on timeout or error.  */
+static bool wait_for_fd(int fd, bool for_write, int timeout)
+{
+    for (;;) {
+        fd_set set;
+        FD_ZERO(&set);
+        FD_SET(fd, &set);
+        struct timeval tv;
+        tv.tv_sec = timeout;
+        tv.tv_usec = 0;
+        int ret = select(fd + 1, for_write ? NULL : &set, for_write ? &set : NULL, NULL, &tv);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        return ret > 0;
+    }
+}
+
+static bool write_all(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t ret = write(fd, buf, len);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret <= 0) {
+            return false;
+        }
+
+        buf += ret;
+        len -= ret;
+    }
+
+    return true;
+}
+
+/* Sends LEN bytes from IN_FD as they are, after a FileBulkMsg announced them.
+   On Linux the data goes from the file to the socket without being copied
+   through our buffers.  */
+bool MsgChannel::write_raw(int in_fd, size_t len)
+{
+    if (!flush_writebuf(true)) {
+        return false;
+    }
+
+#ifdef __linux__
+    bool use_sendfile = true;
+#endif
+
+    while (len) {
+#ifdef __linux__
+        if (use_sendfile) {
+            ssize_t ret = sendfile(fd, in_fd, NULL, len);
+
+            if (ret > 0) {
+                len -= ret;
+                continue;
+            }
+
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (ret < 0 && errno == EAGAIN) {
+                if (!wait_for_fd(fd, true, 20)) {
+                    log_error() << "timeout in write_raw()" << endl;
+                    return false;
+                }
+
+                continue;
+            }
+
+            if (ret < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                use_sendfile = false;
+                continue;
+            }
+
+            log_perror("sendfile() in write_raw()");
+            return false;
+        }
+#endif
 
-    m->fill_from_channel(this);
-    instate = NEED_LEN;
-    update_state();
+        char buf[65536];
+        ssize_t bytes = read(in_fd, buf, min(len, sizeof(buf)));
 
-    return m;
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (bytes <= 0) {
+            log_perror("read() in write_raw()");
+            return false;
+        }
+
+        writefull(buf, bytes);
+
+        if (!flush_writebuf(true)) {
+            return false;
+        }
+
+        len -= bytes;
+    }
+
+    return true;
 }
 
-bool MsgChannel::send_msg(const Msg &m, int flags)
+/* Writes the raw data announced by the last FileBulkMsg to OUT_FD.  On Linux
+   it's spliced from the socket into the file without a copy in userspace.  */
+bool MsgChannel::read_raw(int out_fd, int timeout)
 {
-    if (instate == NEED_PROTO && !wait_for_protocol()) {
+    if (instate != RAW_DATA) {
         return false;
     }
 
-    chop_output();
-    size_t msgtogo_old = msgtogo;
+    /* Some of the data may have been read in together with the message.  */
+    size_t buffered = min(inofs - intogo, rawtogo);
 
-    if (text_based) {
-        m.send_to_channel(this);
-    } else {
-        *this << (uint32_t) 0;
-        m.send_to_channel(this);
-        uint32_t len = htonl(msgtogo - msgtogo_old - 4);
-        memcpy(msgbuf + msgtogo_old, &len, 4);
+    if (buffered) {
+        if (!write_all(out_fd, inbuf + intogo, buffered)) {
+            return false;
+        }
+
+        intogo += buffered;
+        rawtogo -= buffered;
     }
 
-    if ((flags & SendBulkOnly) && msgtogo < 4096) {
-        return true;
+    bool error = false;
+
+#ifdef __linux__
+    int pipefd[2] = { -1, -1 };
+
+    if (rawtogo && pipe(pipefd) < 0) {
+        pipefd[0] = pipefd[1] = -1;
     }
+#endif
 
-    return flush_writebuf((flags & SendBlocking));
+    while (rawtogo && !error) {
+        ssize_t ret;
+
+#ifdef __linux__
+        if (pipefd[0] >= 0) {
+            ret = splice(fd, NULL, pipefd[1], NULL, rawtogo, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+            if (ret > 0) {
+                size_t inpipe = ret;
+                rawtogo -= ret;
+
+                while (inpipe) {
+                    ssize_t written = splice(pipefd[0], NULL, out_fd, NULL, inpipe, SPLICE_F_MOVE);
+
+                    if (written < 0 && errno == EINTR) {
+                        continue;
+                    }
+
+                    if (written <= 0) {
+                        /* E.g. the filesystem doesn't support splice, copy what's
+                           in the pipe and go on without it.  */
+                        char buf[65536];
+                        ssize_t bytes = read(pipefd[0], buf, min(inpipe, sizeof(buf)));
+
+                        if (bytes <= 0 || !write_all(out_fd, buf, bytes)) {
+                            error = true;
+                            break;
+                        }
+
+                        written = bytes;
+                    }
+
+                    inpipe -= written;
+                }
+
+                continue;
+            }
+
+            if (ret < 0 && errno == EINVAL) {
+                close(pipefd[0]);
+                close(pipefd[1]);
+                pipefd[0] = pipefd[1] = -1;
+                continue;
+            }
+        } else
+#endif
+        {
+            char buf[65536];
+            ret = read(fd, buf, min(rawtogo, sizeof(buf)));
+
+            if (ret > 0) {
+                if (!write_all(out_fd, buf, ret)) {
+                    error = true;
+                }
+
+                rawtogo -= ret;
+                continue;
+            }
+        }
+
+        if (ret == 0) {
+            eof = true;
+            error = true;
+        } else if (errno == EAGAIN) {
+            if (!wait_for_fd(fd, false, timeout)) {
+                log_error() << "timeout in read_raw()" << endl;
+                error = true;
+            }
+        } else if (errno != EINTR) {
+            log_perror("read_raw()");
+            error = true;
+        }
+    }
+
+#ifdef __linux__
+    if (pipefd[0] >= 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+#endif
+
+    if (error) {
+        return false;
+    }
+
+    instate = NEED_LEN;
+    update_state();
+    return true;
 }
 
 #include "getifaddrs.h"
@@ -1517,6 +2536,46 @@ void GetCSMsg::fill_from_channel(MsgChannel *c)
         *c >> version;
         minimal_host_version = max( minimal_host_version, int( version ));
     }
+
+    input_size = 0;
+    if (IS_PROTOCOL_38(c)) {
+        *c >> input_size;
+    }
+
+    lease_job_id = 0;
+    if (IS_PROTOCOL_41(c)) {
+        *c >> lease_job_id;
+    }
+
+    batch.clear();
+    if (IS_PROTOCOL_42(c)) {
+        uint32_t sources;
+        *c >> sources;
+
+        /* All have to be read to get to the fields after them, but a
+           bigger batch than allowed fails as a whole.  */
+        for (uint32_t i = 0; i < sources; ++i) {
+            string file;
+            uint32_t size;
+            *c >> file;
+            *c >> size;
+
+            if (i < MAX_GET_CS_BATCH) {
+                batch.push_back(make_pair(file, size));
+            }
+        }
+
+        if (sources > MAX_GET_CS_BATCH) {
+            log_error() << "batch of " << sources << " sources is too big" << endl;
+            batch.clear();
+            count = 0;
+        }
+    }
+
+    cache_key.clear();
+    if (IS_PROTOCOL_43(c)) {
+        *c >> cache_key;
+    }
 }
 
 void GetCSMsg::send_to_channel(MsgChannel *c) const
@@ -1540,6 +2599,26 @@ void GetCSMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_34(c)) {
         *c << minimal_host_version;
     }
+    if (IS_PROTOCOL_38(c)) {
+        *c << input_size;
+    }
+    if (IS_PROTOCOL_41(c)) {
+        *c << lease_job_id;
+    }
+    if (IS_PROTOCOL_42(c)) {
+        uint32_t sources = min(batch.size(), size_t(MAX_GET_CS_BATCH));
+        *c << sources;
+
+        SourceFiles::const_iterator it = batch.begin();
+
+        for (uint32_t i = 0; i < sources; ++i, ++it) {
+            *c << shorten_filename(it->first);
+            *c << it->second;
+        }
+    }
+    if (IS_PROTOCOL_43(c)) {
+        *c << cache_key;
+    }
 }
 
 void UseCSMsg::fill_from_channel(MsgChannel *c)
@@ -1557,6 +2636,16 @@ void UseCSMsg::fill_from_channel(MsgChannel *c)
     } else {
         matched_job_id = 0;
     }
+
+    batch_index = 0;
+    if (IS_PROTOCOL_42(c)) {
+        *c >> batch_index;
+    }
+
+    env_peers.clear();
+    if (IS_PROTOCOL_45(c)) {
+        *c >> env_peers;
+    }
 }
 
 void UseCSMsg::send_to_channel(MsgChannel *c) const
@@ -1572,6 +2661,12 @@ void UseCSMsg::send_to_channel(MsgChannel *c) const
     if (IS_PROTOCOL_28(c)) {
         *c << matched_job_id;
     }
+    if (IS_PROTOCOL_42(c)) {
+        *c << batch_index;
+    }
+    if (IS_PROTOCOL_45(c)) {
+        *c << env_peers;
+    }
 }
 
 void CompileFileMsg::fill_from_channel(MsgChannel *c)
@@ -1625,6 +2720,11 @@ void CompileFileMsg::fill_from_channel(MsgChannel *c)
         job->setOutputFile(outputFile);
         job->setDwarfFissionEnabled(dwarfFissionEnabled);
     }
+    if (IS_PROTOCOL_43(c)) {
+        string cacheKey;
+        *c >> cacheKey;
+        job->setCacheKey(cacheKey);
+    }
 }
 
 void CompileFileMsg::send_to_channel(MsgChannel *c) const
@@ -1661,6 +2761,9 @@ void CompileFileMsg::send_to_channel(MsgChannel *c) const
         *c << job->outputFile();
         *c << (uint32_t) job->dwarfFissionEnabled();
     }
+    if (IS_PROTOCOL_43(c)) {
+        *c << job->cacheKey();
+    }
 }
 
 // Environments created by icecc-create-env always use the same binary name
@@ -1693,13 +2796,13 @@ void FileChunkMsg::fill_from_channel(MsgChannel *c)
     del_buf = true;
 
     Msg::fill_from_channel(c);
-    c->readcompressed(&buffer, len, compressed);
+    c->readcompressed(&buffer, len, compressed, compression);
 }
 
 void FileChunkMsg::send_to_channel(MsgChannel *c) const
 {
     Msg::send_to_channel(c);
-    c->writecompressed(buffer, len, compressed);
+    c->writecompressed(buffer, len, compressed, compression);
 }
 
 FileChunkMsg::~FileChunkMsg()
@@ -1709,6 +2812,18 @@ FileChunkMsg::~FileChunkMsg()
     }
 }
 
+void FileBulkMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> len;
+}
+
+void FileBulkMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << len;
+}
+
 void CompileResultMsg::fill_from_channel(MsgChannel *c)
 {
     Msg::fill_from_channel(c);
@@ -1795,6 +2910,8 @@ JobDoneMsg::JobDoneMsg(int id, int exit, unsigned int _flags)
     in_uncompressed = 0;
     out_compressed = 0;
     out_uncompressed = 0;
+    in_compression = COMPRESSION_LZO;
+    in_decompress_usec = 0;
 }
 
 void JobDoneMsg::fill_from_channel(MsgChannel *c)
@@ -1813,6 +2930,11 @@ void JobDoneMsg::fill_from_channel(MsgChannel *c)
     *c >> out_uncompressed;
     *c >> flags;
     exitcode = (int) _exitcode;
+
+    if (IS_PROTOCOL_36(c)) {
+        *c >> in_compression;
+        *c >> in_decompress_usec;
+    }
 }
 
 void JobDoneMsg::send_to_channel(MsgChannel *c) const
@@ -1829,6 +2951,11 @@ void JobDoneMsg::send_to_channel(MsgChannel *c) const
     *c << out_compressed;
     *c << out_uncompressed;
     *c << flags;
+
+    if (IS_PROTOCOL_36(c)) {
+        *c << in_compression;
+        *c << in_decompress_usec;
+    }
 }
 
 LoginMsg::LoginMsg(unsigned int myport, const std::string &_nodename, const std::string _host_platform)
@@ -2111,6 +3238,196 @@ void BlacklistHostEnvMsg::send_to_channel(MsgChannel *c) const
     *c << hostname;
 }
 
+void GetConnectionMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> hostname;
+    *c >> port;
+}
+
+void GetConnectionMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << hostname;
+    *c << port;
+}
+
+void ReturnConnectionMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> reusable;
+}
+
+void ReturnConnectionMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << reusable;
+}
+
+void LeaseMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    uint32_t count;
+    *c >> count;
+    job_ids.clear();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t id;
+        *c >> id;
+        job_ids.push_back(id);
+    }
+
+    *c >> hostname;
+    *c >> port;
+    *c >> host_platform;
+    c->read_environments(versions);
+    *c >> target;
+    *c >> minimal_host_version;
+    *c >> ttl;
+}
+
+void LeaseMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << (uint32_t) job_ids.size();
+
+    for (std::list<uint32_t>::const_iterator it = job_ids.begin(); it != job_ids.end(); ++it) {
+        *c << *it;
+    }
+
+    *c << hostname;
+    *c << port;
+    *c << host_platform;
+    c->write_environments(versions);
+    *c << target;
+    *c << minimal_host_version;
+    *c << ttl;
+}
+
+void CacheLookupMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> key;
+}
+
+void CacheLookupMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << key;
+}
+
+void CacheResultMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> hit;
+}
+
+void CacheResultMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << hit;
+}
+
+void EnvManifestMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> name;
+    *c >> target;
+    *c >> paths;
+    *c >> blobs;
+    sizes.clear();
+    links.clear();
+
+    if (IS_PROTOCOL_45(c)) {
+        uint32_t count;
+        *c >> count;
+
+        // one per path, and no more
+        for (uint32_t i = 0; i < count && i < paths.size(); ++i) {
+            uint32_t size;
+            *c >> size;
+            sizes.push_back(size);
+        }
+
+        *c >> links;
+    }
+}
+
+void EnvManifestMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << name;
+    *c << target;
+    *c << paths;
+    *c << blobs;
+
+    if (IS_PROTOCOL_45(c)) {
+        *c << (uint32_t) sizes.size();
+
+        for (std::list<uint32_t>::const_iterator it = sizes.begin(); it != sizes.end(); ++it) {
+            *c << *it;
+        }
+
+        *c << links;
+    }
+}
+
+void EnvMissingMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> ok;
+    *c >> blobs;
+}
+
+void EnvMissingMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << ok;
+    *c << blobs;
+}
+
+void EnvFetchMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> name;
+    *c >> target;
+    *c >> peers;
+}
+
+void EnvFetchMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << name;
+    *c << target;
+    *c << peers;
+}
+
+void GetEnvManifestMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> name;
+    *c >> target;
+}
+
+void GetEnvManifestMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << name;
+    *c << target;
+}
+
+void GetEnvBlobsMsg::fill_from_channel(MsgChannel *c)
+{
+    Msg::fill_from_channel(c);
+    *c >> blobs;
+}
+
+void GetEnvBlobsMsg::send_to_channel(MsgChannel *c) const
+{
+    Msg::send_to_channel(c);
+    *c << blobs;
+}
+
 /*
 vim:cinoptions={.5s,g0,p5,t0,(0,^-0.5s,n-0.5s:tw=78:cindent:sw=4:
 */
@@ -36,7 +36,7 @@
 #include "job.h"
 
 // if you increase the PROTOCOL_VERSION, add a macro below and use that
-#define PROTOCOL_VERSION 35
+#define PROTOCOL_VERSION 46
 // if you increase the MIN_PROTOCOL_VERSION, comment out macros below and clean up the code
 #define MIN_PROTOCOL_VERSION 21
 
@@ -60,6 +60,17 @@
 #define IS_PROTOCOL_33(c) ((c)->protocol >= 33)
 #define IS_PROTOCOL_34(c) ((c)->protocol >= 34)
 #define IS_PROTOCOL_35(c) ((c)->protocol >= 35)
+#define IS_PROTOCOL_36(c) ((c)->protocol >= 36)
+#define IS_PROTOCOL_37(c) ((c)->protocol >= 37)
+#define IS_PROTOCOL_38(c) ((c)->protocol >= 38)
+#define IS_PROTOCOL_39(c) ((c)->protocol >= 39)
+#define IS_PROTOCOL_40(c) ((c)->protocol >= 40)
+#define IS_PROTOCOL_41(c) ((c)->protocol >= 41)
+#define IS_PROTOCOL_42(c) ((c)->protocol >= 42)
+#define IS_PROTOCOL_43(c) ((c)->protocol >= 43)
+#define IS_PROTOCOL_44(c) ((c)->protocol >= 44)
+#define IS_PROTOCOL_45(c) ((c)->protocol >= 45)
+#define IS_PROTOCOL_46(c) ((c)->protocol >= 46)
 
 enum MsgType {
     // so far unknown
@@ -126,14 +137,61 @@ enum MsgType {
     M_VERIFY_ENV,
     M_VERIFY_ENV_RESULT,
     // C --> CS, CS --> S (forwarded from C), to not use given host for given environment
-    M_BLACKLIST_HOST_ENV
+    M_BLACKLIST_HOST_ENV,
+
+    // generic file transfer, the uncompressed data follows the message raw
+    M_FILE_BULK,
+
+    // C --> CS, asks for a connection to the given CS, answered by MsgChannel::send_channel()
+    M_GET_CONNECTION,
+    // C --> CS, when done with the connection from M_GET_CONNECTION
+    M_RETURN_CONNECTION,
+
+    // S --> CS, job ids on a CS the daemon may hand out itself for a while
+    M_LEASE,
+
+    // C --> CS, asks for a result in the object cache
+    M_CACHE_LOOKUP,
+    // CS --> C, answers M_CACHE_LOOKUP or a M_COMPILE_FILE with a cache key
+    M_CACHE_RESULT,
+
+    // C --> CS, the files of an environment about to be transferred
+    M_ENV_MANIFEST,
+    // CS --> C, answers M_ENV_MANIFEST with the files it needs
+    M_ENV_MISSING,
+
+    // C --> CS, fetch the environment from other daemons, answered by M_VERIFY_ENV_RESULT
+    M_ENV_FETCH,
+    // CS --> CS, answered by M_ENV_MANIFEST, without files if it doesn't have it
+    M_GET_ENV_MANIFEST,
+    // CS --> CS, answered by the blobs as M_FILE_CHUNKs, each followed by an M_END
+    M_GET_ENV_BLOBS,
+
+    // CS --> CS, the rest of the connection carries the connections of several jobs, see daemon/mux.h
+    M_MUX
 };
 
 class MsgChannel;
+struct CompressionContext;
+
+// codecs used for compressing FileChunkMsg data; before protocol 36 it's always LZO
+enum CompressionType {
+    COMPRESSION_NONE = 0,
+    COMPRESSION_LZO = 1,
+    COMPRESSION_LZ4 = 2,
+    COMPRESSION_ZSTD = 3
+};
+
+const char *compression_name(uint32_t type);
 
 // a list of pairs of host platform, filename
 typedef std::list<std::pair<std::string, std::string> > Environments;
 
+// source files with their size (0 if not known), see GetCSMsg::batch
+typedef std::list<std::pair<std::string, uint32_t> > SourceFiles;
+// the most sources asked for in one GetCSMsg, to stay below the message size limit
+#define MAX_GET_CS_BATCH 4096
+
 class Msg
 {
 public:
@@ -153,7 +211,10 @@ public:
     enum SendFlags {
         SendBlocking = 1 << 0,
         SendNonBlocking = 1 << 1,
-        SendBulkOnly = 1 << 2
+        SendBulkOnly = 1 << 2,
+        // send what is possible without blocking and keep the rest queued,
+        // see has_queued_output() and flush_queued()
+        SendQueued = 1 << 3
     };
 
     virtual ~MsgChannel();
@@ -167,11 +228,51 @@ public:
     // false <--> error (msg not send)
     bool send_msg(const Msg &, int SendFlags = SendBlocking);
 
+    bool has_queued_output() const
+    {
+        return msgtogo != 0;
+    }
+
+    // false <--> error, sends as much of the queued output as possible without blocking
+    bool flush_queued();
+
+    // while corked, send_msg() just queues the messages, unless there are
+    // many, so that those of one round of the event loop go out together
+    void cork()
+    {
+        corked = true;
+    }
+
+    // false <--> error, sends what was queued while corked
+    bool uncork(bool blocking = true);
+
+    // the raw data following a FileBulkMsg, false <--> error
+    bool write_raw(int in_fd, size_t len);
+    bool read_raw(int out_fd, int timeout = 10);
+
     bool has_msg(void) const
     {
         return eof || instate == HAS_MSG;
     }
 
+    // forgets the buffered input, when someone else read what followed it
+    void drop_input();
+
+    // what was read already but not handled yet, see Service::adoptChannel()
+    std::string buffered_input() const;
+
+    // the compressions the remote told us it supports
+    uint32_t peer_compressions() const
+    {
+        return remote_compressions;
+    }
+
+    // nothing buffered in either direction, at a message boundary
+    bool is_idle() const
+    {
+        return instate == NEED_LEN && inofs == intogo && !msgtogo && !eof;
+    }
+
     bool read_a_bit(void);
 
     bool at_eof(void) const
@@ -184,9 +285,10 @@ public:
         return text_based;
     }
 
-    void readcompressed(unsigned char **buf, size_t &_uclen, size_t &_clen);
+    void readcompressed(unsigned char **buf, size_t &_uclen, size_t &_clen,
+                        uint32_t &_compression);
     void writecompressed(const unsigned char *in_buf,
-                         size_t _in_len, size_t &_out_len);
+                         size_t _in_len, size_t &_out_len, uint32_t &_compression);
     void write_environments(const Environments &envs);
     void read_environments(Environments &envs);
     void read_line(std::string &line);
@@ -194,6 +296,23 @@ public:
 
     bool eq_ip(const MsgChannel &s) const;
 
+    // the codec used for compressing data sent by us
+    CompressionType compression() const
+    {
+        return out_compression;
+    }
+
+    // false while the protocol versions are still being exchanged
+    bool is_set_up() const
+    {
+        return instate != NEED_PROTO;
+    }
+
+    /* Passes the connection of the set up channel C (or none if 0) over
+       this unix socket, to be picked up by Service::receiveChannel().
+       C stays ours, false <--> error.  */
+    bool send_channel(const MsgChannel *c);
+
     MsgChannel &operator>>(uint32_t &);
     MsgChannel &operator>>(std::string &);
     MsgChannel &operator>>(std::list<std::string> &);
@@ -211,18 +330,26 @@ public:
     std::string name;
     time_t last_talk;
 
+    // time spent in writecompressed() and readcompressed()
+    uint64_t compress_usec;
+    uint64_t decompress_usec;
+
 protected:
-    MsgChannel(int _fd, struct sockaddr *, socklen_t, bool text = false);
+    /* AGREED_PROTOCOL is for a connection whose protocol versions were
+       exchanged by another process already, see Service::adoptChannel().  */
+    MsgChannel(int _fd, struct sockaddr *, socklen_t, bool text = false, int agreed_protocol = 0);
 
     bool wait_for_protocol();
     // returns false if there was an error sending something
-    bool flush_writebuf(bool blocking);
+    bool flush_writebuf(bool blocking, bool queued = false);
     void writefull(const void *_buf, size_t count);
     // returns false if there was an error in the protocol setup
     bool update_state(void);
     void chop_input(void);
+    void reserve_input(size_t count);
     void chop_output(void);
     bool wait_for_msg(int timeout);
+    void negotiate_compression(uint32_t remote_compressions);
 
     char *msgbuf;
     size_t msgbuflen;
@@ -237,12 +364,22 @@ protected:
         NEED_PROTO,
         NEED_LEN,
         FILL_BUF,
-        HAS_MSG
+        HAS_MSG,
+        RAW_DATA
     } instate;
 
     uint32_t inmsglen;
+    // raw data still to be read by read_raw()
+    size_t rawtogo;
     bool eof;
     bool text_based;
+    bool corked;
+
+    CompressionType out_compression;
+    int out_compression_level;
+    CompressionContext *compression_ctx;
+    // what the remote told us it supports
+    uint32_t remote_compressions;
 
 private:
     friend class Service;
@@ -259,6 +396,22 @@ public:
     static MsgChannel *createChannel(const std::string &host, unsigned short p, int timeout);
     static MsgChannel *createChannel(const std::string &domain_socket);
     static MsgChannel *createChannel(int remote_fd, struct sockaddr *, socklen_t);
+
+    /* Starts connecting without waiting for it, returns the fd, which gets
+       writable when the connect is done, or -1.  finishConnect() creates the
+       channel then, whose protocol setup completes in read_a_bit(), see
+       MsgChannel::is_set_up().  */
+    static int startConnect(const std::string &host, unsigned short p);
+    static MsgChannel *finishConnect(int remote_fd);
+
+    // the connection sent by MsgChannel::send_channel() over VIA, 0 if none
+    static MsgChannel *receiveChannel(MsgChannel *via, int timeout);
+
+    /* A channel for the connection REMOTE_FD that was set up by another
+       process, with what was agreed on there and the INPUT it had read
+       already but not handled.  0 if the connection is gone.  */
+    static MsgChannel *adoptChannel(int remote_fd, int protocol, uint32_t remote_compressions,
+                                    const std::string &input = std::string());
 };
 
 // --------------------------------------------------------------------------
@@ -357,7 +510,9 @@ public:
         : Msg(M_GET_CS)
         , count(1)
         , arg_flags(0)
-        , client_id(0) {}
+        , client_id(0)
+        , input_size(0)
+        , lease_job_id(0) {}
 
     GetCSMsg(const Environments &envs, const std::string &f,
              CompileJob::Language _lang, unsigned int _count,
@@ -372,7 +527,9 @@ public:
         , arg_flags(_arg_flags)
         , client_id(0)
         , preferred_host(host)
-        , minimal_host_version(_minimal_host_version) {}
+        , minimal_host_version(_minimal_host_version)
+        , input_size(0)
+        , lease_job_id(0) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -380,19 +537,30 @@ public:
     Environments versions;
     std::string filename;
     CompileJob::Language lang;
-    uint32_t count; // the number of UseCS messages to answer with - usually 1
+    // the number of UseCS messages to answer with - usually 1, 0 if the message was invalid
+    uint32_t count;
     std::string target;
     uint32_t arg_flags;
     uint32_t client_id;
     std::string preferred_host;
     int minimal_host_version;
+    uint32_t input_size; // size of the source file, 0 if not known
+    // CS --> S: the daemon answered the request itself with this leased job id
+    uint32_t lease_job_id;
+    // see CompileJob::cacheKey(), the scheduler knows where it was compiled last
+    std::string cache_key;
+    /* Since protocol 42 a build driver can ask for servers for many jobs at
+       once, filename and input_size are ignored then and count is 1 for
+       each.  The answers come in any order, with UseCSMsg::batch_index.  */
+    SourceFiles batch;
 };
 
 class UseCSMsg : public Msg
 {
 public:
     UseCSMsg()
-        : Msg(M_USE_CS) {}
+        : Msg(M_USE_CS)
+        , batch_index(0) {}
     UseCSMsg(std::string platform, std::string host, unsigned int p, unsigned int id, bool gotit,
              unsigned int _client_id, unsigned int matched_host_jobs)
         : Msg(M_USE_CS),
@@ -402,7 +570,8 @@ public:
           host_platform(platform),
           got_env(gotit),
           client_id(_client_id),
-          matched_job_id(matched_host_jobs) {}
+          matched_job_id(matched_host_jobs),
+          batch_index(0) {}
 
     virtual void fill_from_channel(MsgChannel *c);
     virtual void send_to_channel(MsgChannel *c) const;
@@ -414,6 +583,10 @@ public:
     uint32_t got_env;
     uint32_t client_id;
     uint32_t matched_job_id;
+    // which one of GetCSMsg::batch this is for
+    uint32_t batch_index;
+    // without got_env, daemons (host:port) that have the environment
+    std::list<std::string> env_peers;
 };
 
 class GetNativeEnvMsg : public Msg
@@ -483,12 +656,16 @@ public:
         : Msg(M_FILE_CHUNK)
         , buffer(_buffer)
         , len(_len)
+        , compressed(0)
+        , compression(COMPRESSION_NONE)
         , del_buf(false) {}
 
     FileChunkMsg()
         : Msg(M_FILE_CHUNK)
         , buffer(0)
         , len(0)
+        , compressed(0)
+        , compression(COMPRESSION_NONE)
         , del_buf(true) {}
 
     ~FileChunkMsg();
@@ -499,6 +676,7 @@ public:
     unsigned char *buffer;
     size_t len;
     mutable size_t compressed;
+    mutable uint32_t compression;
     bool del_buf;
 
 private:
@@ -506,6 +684,20 @@ private:
     FileChunkMsg &operator=(const FileChunkMsg &);
 };
 
+// announces len bytes of raw file data, see MsgChannel::write_raw() and read_raw()
+class FileBulkMsg : public Msg
+{
+public:
+    FileBulkMsg(uint32_t _len = 0)
+        : Msg(M_FILE_BULK)
+        , len(_len) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t len;
+};
+
 class CompileResultMsg : public Msg
 {
 public:
@@ -589,6 +781,9 @@ public:
     uint32_t out_uncompressed;
 
     uint32_t job_id;
+
+    uint32_t in_compression; /* CompressionType used for the input */
+    uint32_t in_decompress_usec; /* time spent decompressing the input */
 };
 
 class JobLocalBeginMsg : public Msg
@@ -914,4 +1109,200 @@ public:
     std::string hostname;
 };
 
+class GetConnectionMsg : public Msg
+{
+public:
+    GetConnectionMsg()
+        : Msg(M_GET_CONNECTION)
+        , port(0) {}
+
+    GetConnectionMsg(const std::string &_hostname, uint32_t _port)
+        : Msg(M_GET_CONNECTION)
+        , hostname(_hostname)
+        , port(_port) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string hostname;
+    uint32_t port;
+};
+
+class ReturnConnectionMsg : public Msg
+{
+public:
+    ReturnConnectionMsg(bool _reusable = false)
+        : Msg(M_RETURN_CONNECTION)
+        , reusable(_reusable) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // whether the job ended cleanly, so that the connection can take another one
+    uint32_t reusable;
+};
+
+/* Job ids the scheduler reserved on a compile server for the daemon, which
+   may answer GetCSMsg requests for the same environments, target and minimal
+   host version with them itself during the next TTL seconds, and tells the
+   scheduler with GetCSMsg::lease_job_id then.  A TTL of 0 takes back the
+   given ids.  */
+class LeaseMsg : public Msg
+{
+public:
+    LeaseMsg()
+        : Msg(M_LEASE)
+        , port(0)
+        , minimal_host_version(0)
+        , ttl(0) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::list<uint32_t> job_ids;
+    std::string hostname;
+    uint32_t port;
+    std::string host_platform;
+    Environments versions;
+    std::string target;
+    uint32_t minimal_host_version;
+    uint32_t ttl;
+};
+
+// see CompileJob::cacheKey()
+class CacheLookupMsg : public Msg
+{
+public:
+    CacheLookupMsg(const std::string &_key = std::string())
+        : Msg(M_CACHE_LOOKUP)
+        , key(_key) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string key;
+};
+
+/* On a hit the result follows like after compiling it, a CompileResultMsg
+   and the output files.  */
+class CacheResultMsg : public Msg
+{
+public:
+    CacheResultMsg(bool _hit = false)
+        : Msg(M_CACHE_RESULT)
+        , hit(_hit) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    uint32_t hit;
+};
+
+/* Before an M_TRANFER_ENV the client may list the regular files of the
+   environment, by path and by what they are in the store of the daemon
+   (content hash and mode).  The daemon takes what it has from its store
+   and answers with the blobs it still needs, only those have to be in the
+   tarball then.  Big environments are listed in several messages.  */
+class EnvManifestMsg : public Msg
+{
+public:
+    EnvManifestMsg()
+        : Msg(M_ENV_MANIFEST) {}
+
+    EnvManifestMsg(const std::string &_target, const std::string &_name)
+        : Msg(M_ENV_MANIFEST)
+        , name(_name)
+        , target(_target) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string name;
+    std::string target;
+    std::list<std::string> paths;
+    // in the order of paths
+    std::list<std::string> blobs;
+    // from daemons only, also in the order of paths
+    std::list<uint32_t> sizes;
+    // from daemons only, the symlinks, each path followed by its target
+    std::list<std::string> links;
+};
+
+class EnvMissingMsg : public Msg
+{
+public:
+    EnvMissingMsg()
+        : Msg(M_ENV_MISSING)
+        , ok(0) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    // false if the environment can't be installed from a manifest
+    uint32_t ok;
+    std::list<std::string> blobs;
+};
+
+/* The daemon asked to install an environment gets it from the PEERS, daemons
+   that have it installed already, instead of from the client.  It takes the
+   manifest from one of them, and the blobs that aren't in its own store from
+   as many of them as it may use at once.  */
+class EnvFetchMsg : public Msg
+{
+public:
+    EnvFetchMsg()
+        : Msg(M_ENV_FETCH) {}
+
+    EnvFetchMsg(const std::string &_target, const std::string &_name,
+                const std::list<std::string> &_peers)
+        : Msg(M_ENV_FETCH)
+        , name(_name)
+        , target(_target)
+        , peers(_peers) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string name;
+    std::string target;
+    std::list<std::string> peers;
+};
+
+class GetEnvManifestMsg : public Msg
+{
+public:
+    GetEnvManifestMsg()
+        : Msg(M_GET_ENV_MANIFEST) {}
+
+    GetEnvManifestMsg(const std::string &_target, const std::string &_name)
+        : Msg(M_GET_ENV_MANIFEST)
+        , name(_name)
+        , target(_target) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::string name;
+    std::string target;
+};
+
+class GetEnvBlobsMsg : public Msg
+{
+public:
+    GetEnvBlobsMsg()
+        : Msg(M_GET_ENV_BLOBS) {}
+
+    virtual void fill_from_channel(MsgChannel *c);
+    virtual void send_to_channel(MsgChannel *c) const;
+
+    std::list<std::string> blobs;
+};
+
+class MuxMsg : public Msg
+{
+public:
+    MuxMsg()
+        : Msg(M_MUX) {}
+};
+
 #endif
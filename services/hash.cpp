@@ -0,0 +1,357 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+
+using namespace std;
+
+static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+static const uint64_t seeds[2] = { 0, PRIME5 };
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static inline uint64_t merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= round64(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+Hash::Hash()
+    : m_buffered(0)
+    , m_length(0)
+{
+    for (int i = 0; i < 2; ++i) {
+        m_lanes[i][0] = seeds[i] + PRIME1 + PRIME2;
+        m_lanes[i][1] = seeds[i] + PRIME2;
+        m_lanes[i][2] = seeds[i];
+        m_lanes[i][3] = seeds[i] - PRIME1;
+    }
+}
+
+void Hash::stripe(const unsigned char *p)
+{
+    for (int lane = 0; lane < 4; ++lane) {
+        uint64_t input = read64(p + lane * 8);
+        m_lanes[0][lane] = round64(m_lanes[0][lane], input);
+        m_lanes[1][lane] = round64(m_lanes[1][lane], input);
+    }
+}
+
+void Hash::update(const void *data, size_t len)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    m_length += len;
+
+    if (m_buffered) {
+        size_t fill = min(len, sizeof(m_buffer) - m_buffered);
+        memcpy(m_buffer + m_buffered, p, fill);
+        m_buffered += fill;
+        p += fill;
+        len -= fill;
+
+        if (m_buffered < sizeof(m_buffer)) {
+            return;
+        }
+
+        stripe(m_buffer);
+        m_buffered = 0;
+    }
+
+    for (; len >= 32; p += 32, len -= 32) {
+        stripe(p);
+    }
+
+    memcpy(m_buffer, p, len);
+    m_buffered = len;
+}
+
+string Hash::digest() const
+{
+    char hex[33];
+
+    for (int i = 0; i < 2; ++i) {
+        const uint64_t *v = m_lanes[i];
+        uint64_t h;
+
+        if (m_length >= 32) {
+            h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+
+            for (int lane = 0; lane < 4; ++lane) {
+                h = merge_round(h, v[lane]);
+            }
+        } else {
+            h = seeds[i] + PRIME5;
+        }
+
+        h += m_length;
+
+        const unsigned char *p = m_buffer;
+        size_t left = m_buffered;
+
+        for (; left >= 8; p += 8, left -= 8) {
+            h ^= round64(0, read64(p));
+            h = rotl(h, 27) * PRIME1 + PRIME4;
+        }
+
+        if (left >= 4) {
+            h ^= uint64_t(read32(p)) * PRIME1;
+            h = rotl(h, 23) * PRIME2 + PRIME3;
+            p += 4;
+            left -= 4;
+        }
+
+        for (; left; ++p, --left) {
+            h ^= *p * PRIME5;
+            h = rotl(h, 11) * PRIME1;
+        }
+
+        h ^= h >> 33;
+        h *= PRIME2;
+        h ^= h >> 29;
+        h *= PRIME3;
+        h ^= h >> 32;
+
+        sprintf(hex + i * 16, "%016llx", (unsigned long long) h);
+    }
+
+    return hex;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, int r)
+{
+    return (x >> r) | (x << (32 - r));
+}
+
+Sha256::Sha256()
+    : m_buffered(0)
+    , m_length(0)
+{
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(m_state, init, sizeof(m_state));
+}
+
+void Sha256::block(const unsigned char *p)
+{
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; ++i, p += 4) {
+        w[i] = uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+    }
+
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+    uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+
+    for (int i = 0; i < 64; ++i) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g))
+                      + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    m_state[0] += a;
+    m_state[1] += b;
+    m_state[2] += c;
+    m_state[3] += d;
+    m_state[4] += e;
+    m_state[5] += f;
+    m_state[6] += g;
+    m_state[7] += h;
+}
+
+void Sha256::update(const void *data, size_t len)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    m_length += len;
+
+    if (m_buffered) {
+        size_t fill = min(len, sizeof(m_buffer) - m_buffered);
+        memcpy(m_buffer + m_buffered, p, fill);
+        m_buffered += fill;
+        p += fill;
+        len -= fill;
+
+        if (m_buffered < sizeof(m_buffer)) {
+            return;
+        }
+
+        block(m_buffer);
+        m_buffered = 0;
+    }
+
+    for (; len >= 64; p += 64, len -= 64) {
+        block(p);
+    }
+
+    memcpy(m_buffer, p, len);
+    m_buffered = len;
+}
+
+string Sha256::digest() const
+{
+    // the padding goes into a copy, so that more can be added to this one
+    Sha256 last(*this);
+    unsigned char pad[72];
+    size_t padlen = (m_buffered < 56 ? 56 : 120) - m_buffered;
+    uint64_t bits = m_length * 8;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+
+    for (int i = 0; i < 8; ++i) {
+        pad[padlen + i] = bits >> (56 - i * 8);
+    }
+
+    last.update(pad, padlen + 8);
+
+    char hex[65];
+
+    for (int i = 0; i < 8; ++i) {
+        sprintf(hex + i * 8, "%08x", last.m_state[i]);
+    }
+
+    return hex;
+}
+
+template <class H>
+static string digest_file(const string &file)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+
+    if (fd < 0) {
+        return string();
+    }
+
+    H hash;
+    struct stat st;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            hash.update(map, st.st_size);
+            munmap(map, st.st_size);
+            close(fd);
+            return hash.digest();
+        }
+    }
+
+    // pipes and the like
+    unsigned char buffer[65536];
+    ssize_t bytes;
+
+    while ((bytes = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            close(fd);
+            return string();
+        }
+
+        hash.update(buffer, bytes);
+    }
+
+    close(fd);
+    return hash.digest();
+}
+
+string hash_file(const string &file)
+{
+    return digest_file<Hash>(file);
+}
+
+string sha256_file(const string &file)
+{
+    return digest_file<Sha256>(file);
+}
@@ -0,0 +1,83 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_HASH_H
+#define ICECREAM_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/* A fast non-cryptographic 128 bit hash for naming and comparing files,
+   environments and cache entries: two XXH64 of the data with different
+   seeds, computed in one pass.  The four lanes of each keep the CPU busy
+   enough that reading the data is what limits it, not the hashing.  Good
+   against accidental collisions, not against made up ones.  */
+class Hash
+{
+public:
+    Hash();
+
+    void update(const void *data, size_t len);
+    void update(const std::string &s) {
+        update(s.data(), s.size());
+    }
+
+    // in hex, 32 characters
+    std::string digest() const;
+
+private:
+    void stripe(const unsigned char *p);
+
+    uint64_t m_lanes[2][4];
+    unsigned char m_buffer[32];
+    size_t m_buffered;
+    uint64_t m_length;
+};
+
+/* SHA-256, for where a made up collision does harm: the keys of the
+   object cache, which the daemons compute again from what they compiled.  */
+class Sha256
+{
+public:
+    Sha256();
+
+    void update(const void *data, size_t len);
+    void update(const std::string &s) {
+        update(s.data(), s.size());
+    }
+
+    // in hex, 64 characters
+    std::string digest() const;
+
+private:
+    void block(const unsigned char *p);
+
+    uint32_t m_state[8];
+    unsigned char m_buffer[64];
+    size_t m_buffered;
+    uint64_t m_length;
+};
+
+// reads the file through mmap, returns an empty string on failure
+std::string hash_file(const std::string &file);
+std::string sha256_file(const std::string &file);
+
+#endif
@@ -24,6 +24,7 @@
 #include "logging.h"
 #include "exitcode.h"
 #include "platform.h"
+#include "hash.h"
 #include <stdio.h>
 
 using namespace std;
@@ -114,3 +115,35 @@ unsigned int CompileJob::argumentFlags() const
 
     return result;
 }
+
+string object_cache_key(const CompileJob &job, const string &source_digest)
+{
+    list<string> parts = job.remoteFlags();
+    appendList(parts, job.restFlags());
+    // the daemon only gets this much of the name, see CompileFileMsg::remote_compiler_name()
+    parts.push_back(job.compilerName().find("clang") != string::npos ? "clang" : "gcc");
+
+    char language[16];
+    sprintf(language, "%d", int(job.language()));
+    parts.push_back(language);
+    parts.push_back(job.targetPlatform());
+    parts.push_back(job.environmentVersion());
+
+    if (job.argumentFlags() & (CompileJob::Flag_g | CompileJob::Flag_g3)) {
+        parts.push_back(job.workingDirectory());
+    }
+
+    if (job.dwarfFissionEnabled()) {
+        parts.push_back(job.outputFile());
+    }
+
+    parts.push_back(source_digest);
+    Sha256 hash;
+
+    for (list<string>::const_iterator it = parts.begin(); it != parts.end(); ++it) {
+        // with the terminating 0, so that the parts can't run into each other
+        hash.update(it->c_str(), it->size() + 1);
+    }
+
+    return hash.digest();
+}
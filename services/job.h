@@ -160,6 +160,17 @@ public:
         return m_working_directory;
     }
 
+    // see object_cache_key(), if the client wants the result cached
+    void setCacheKey(const std::string &key)
+    {
+        m_cache_key = key;
+    }
+
+    std::string cacheKey() const
+    {
+        return m_cache_key;
+    }
+
     void setJobID(unsigned int id)
     {
         m_id = id;
@@ -198,9 +209,19 @@ private:
     std::string m_input_file, m_output_file;
     std::string m_working_directory;
     std::string m_target_platform;
+    std::string m_cache_key;
     bool m_dwarf_fission;
 };
 
+/* A SHA-256 of everything the output of JOB depends on: the flags, the
+   compiler, the environment it is compiled in and SOURCE_DIGEST, the
+   sha256_file() of the preprocessed source.  With debug info the working
+   directory ends up in the object file, with split DWARF also the name of
+   the .dwo file.  The daemon computes it again from what it compiled and
+   stores the result under that, so a client can't put anything under the
+   key of something else.  */
+std::string object_cache_key(const CompileJob &job, const std::string &source_digest);
+
 inline void appendList(std::list<std::string> &list, const std::list<std::string> &toadd)
 {
     // Cannot splice since toadd is a reference-to-const
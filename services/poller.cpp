@@ -0,0 +1,218 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/select.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "logging.h"
+#include "poller.h"
+
+using namespace std;
+
+#ifdef HAVE_SYS_EPOLL_H
+static uint32_t to_epoll(int events)
+{
+    uint32_t ret = 0;
+
+    if (events & Poller::Read) {
+        ret |= EPOLLIN;
+    }
+
+    if (events & Poller::Write) {
+        ret |= EPOLLOUT;
+    }
+
+    return ret;
+}
+#endif
+
+Poller::Poller()
+    : epoll_fd(-1)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    epoll_fd = epoll_create(64);
+
+    if (epoll_fd < 0) {
+        log_perror("epoll_create()");
+    } else if (fcntl(epoll_fd, F_SETFD, FD_CLOEXEC) < 0) {
+        log_perror("Poller fcntl()");
+    }
+#endif
+}
+
+Poller::~Poller()
+{
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+    }
+}
+
+void Poller::add(int fd, int events)
+{
+    /* The fd may have been closed and reused since it was added, in which
+       case the kernel has forgotten about it, so register it anew.  */
+    if (contains(fd)) {
+        remove(fd);
+    }
+
+    fds[fd] = events;
+#ifdef HAVE_SYS_EPOLL_H
+    if (epoll_fd >= 0) {
+        struct epoll_event ev;
+        ev.events = to_epoll(events);
+        ev.data.fd = fd;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            log_perror("epoll_ctl(EPOLL_CTL_ADD)");
+        }
+    }
+#endif
+}
+
+void Poller::modify(int fd, int events)
+{
+    map<int, int>::iterator it = fds.find(fd);
+
+    if (it == fds.end()) {
+        add(fd, events);
+        return;
+    }
+
+    if (it->second == events) {
+        return;
+    }
+
+    it->second = events;
+#ifdef HAVE_SYS_EPOLL_H
+    if (epoll_fd >= 0) {
+        struct epoll_event ev;
+        ev.events = to_epoll(events);
+        ev.data.fd = fd;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+            log_perror("epoll_ctl(EPOLL_CTL_MOD)");
+        }
+    }
+#endif
+}
+
+void Poller::remove(int fd)
+{
+    if (fds.erase(fd) == 0) {
+        return;
+    }
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (epoll_fd >= 0) {
+        struct epoll_event ev; // ignored, but must not be NULL for old kernels
+        ev.events = 0;
+        ev.data.fd = fd;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev) < 0 && errno != EBADF && errno != ENOENT) {
+            log_perror("epoll_ctl(EPOLL_CTL_DEL)");
+        }
+    }
+#endif
+}
+
+int Poller::wait(int timeout)
+{
+    ready.clear();
+
+#ifdef HAVE_SYS_EPOLL_H
+    if (epoll_fd >= 0) {
+        struct epoll_event events[256];
+        int ret = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout);
+
+        for (int i = 0; i < ret; ++i) {
+            int revents = 0;
+
+            // errors and hangups are reported as readable, the read then tells what happened
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                revents |= Read;
+            }
+
+            if (events[i].events & EPOLLOUT) {
+                revents |= Write;
+            }
+
+            int fd = events[i].data.fd;
+            ready.push_back(make_pair(fd, revents));
+        }
+
+        return ret;
+    }
+#endif
+
+    fd_set read_set;
+    fd_set write_set;
+    FD_ZERO(&read_set);
+    FD_ZERO(&write_set);
+    int max_fd = -1;
+
+    for (map<int, int>::const_iterator it = fds.begin(); it != fds.end(); ++it) {
+        if (it->second & Read) {
+            FD_SET(it->first, &read_set);
+        }
+
+        if (it->second & Write) {
+            FD_SET(it->first, &write_set);
+        }
+
+        if (it->second && it->first > max_fd) {
+            max_fd = it->first;
+        }
+    }
+
+    struct timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    int ret = select(max_fd + 1, &read_set, &write_set, NULL, timeout < 0 ? NULL : &tv);
+
+    if (ret <= 0) {
+        return ret;
+    }
+
+    for (map<int, int>::const_iterator it = fds.begin(); it != fds.end(); ++it) {
+        int revents = 0;
+
+        if (FD_ISSET(it->first, &read_set)) {
+            revents |= Read;
+        }
+
+        if (FD_ISSET(it->first, &write_set)) {
+            revents |= Write;
+        }
+
+        if (revents) {
+            ready.push_back(make_pair(it->first, revents));
+        }
+    }
+
+    return ready.size();
+}
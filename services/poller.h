@@ -0,0 +1,78 @@
+/* -*- mode: C++; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 99; -*- */
+/* vim: set ts=4 sw=4 et tw=99:  */
+/*
+    This file is part of Icecream.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef ICECREAM_POLLER_H
+#define ICECREAM_POLLER_H
+
+#include <map>
+#include <vector>
+
+/* Waits for activity on a set of file descriptors. Uses epoll where
+   available, so the cost of a wakeup doesn't depend on the number of
+   registered fds, and falls back to select() elsewhere.  */
+class Poller
+{
+public:
+    enum Events {
+        Read = 1 << 0,
+        Write = 1 << 1
+    };
+
+    Poller();
+    ~Poller();
+
+    /* Events 0 keeps the fd registered, but epoll still reports errors and
+       hangups for it, remove() it to not hear of it at all.  Adding an fd
+       again registers it anew (e.g. after it got reused).  */
+    void add(int fd, int events = Read);
+    void modify(int fd, int events);
+    // unknown fds are ignored
+    void remove(int fd);
+
+    bool contains(int fd) const
+    {
+        return fds.find(fd) != fds.end();
+    }
+
+    /* Waits at most timeout milliseconds (-1 for no limit), returns the number
+       of ready fds, or -1 on error (with errno set).  */
+    int wait(int timeout);
+
+    int ready_fd(int i) const
+    {
+        return ready[i].first;
+    }
+
+    int ready_events(int i) const
+    {
+        return ready[i].second;
+    }
+
+private:
+    Poller(const Poller &);
+    Poller &operator=(const Poller &);
+
+    int epoll_fd;
+    // fd -> events
+    std::map<int, int> fds;
+    std::vector<std::pair<int, int> > ready;
+};
+
+#endif
@@ -0,0 +1,173 @@
+#include "objcache.h"
+#include "file_util.h"
+#include <comm.h>
+#include <job.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+static void check(bool ok, const string &what) {
+  if (!ok) {
+    cerr << what << " failed\n";
+    exit(1);
+  }
+}
+
+static CompileJob make_job() {
+  CompileJob job;
+  job.setLanguage(CompileJob::Lang_CXX);
+  job.setCompilerName("g++");
+  job.setTargetPlatform("x86_64");
+  job.setEnvironmentVersion("env.tar.gz");
+  job.setWorkingDirectory("/src");
+  job.setOutputFile("main.o");
+  job.appendFlag("-c", Arg_Remote);
+  job.appendFlag("-O2", Arg_Rest);
+  return job;
+}
+
+static void test_key() {
+  CompileJob job = make_job();
+  string key = object_cache_key(job, "source");
+
+  check(key.size() == 64 && key.find_first_not_of("0123456789abcdef") == string::npos, "key format");
+  check(object_cache_key(make_job(), "source") == key, "same job same key");
+  check(object_cache_key(job, "other") != key, "source in key");
+
+  CompileJob other = make_job();
+  other.setEnvironmentVersion("other.tar.gz");
+  check(object_cache_key(other, "source") != key, "environment in key");
+
+  other = make_job();
+  other.appendFlag("-O0", Arg_Rest);
+  check(object_cache_key(other, "source") != key, "flags in key");
+
+  // the daemon gets g++ for c++, which has to come out the same
+  other = make_job();
+  other.setCompilerName("c++");
+  check(object_cache_key(other, "source") == key, "remote compiler name");
+
+  // the working directory only matters with debug info
+  other = make_job();
+  other.setWorkingDirectory("/elsewhere");
+  check(object_cache_key(other, "source") == key, "working directory without -g");
+
+  CompileJob debug = make_job();
+  debug.appendFlag("-g", Arg_Remote);
+  other = debug;
+  other.setWorkingDirectory("/elsewhere");
+  check(object_cache_key(other, "source") != object_cache_key(debug, "source"), "working directory with -g");
+}
+
+static void write_file(const string &file, const string &contents) {
+  FILE *f = fopen(file.c_str(), "w");
+  check(f && fwrite(contents.data(), 1, contents.size(), f) == contents.size() && fclose(f) == 0,
+        "writing " + file);
+}
+
+static void store(const string &dir, const string &key, const string &obj, const string &out) {
+  string file = dir + "/obj.o";
+  write_file(file, obj);
+  CompileResultMsg rmsg;
+  rmsg.status = 0;
+  rmsg.out = out;
+  int fd = open_object_cache(dir);
+  check(fd >= 0, "open_object_cache");
+  store_cached_result(fd, key, file, "", rmsg);
+  close(fd);
+  unlink(file.c_str());
+}
+
+// what send_cached_result() gives to the other end, the object if it's a hit
+static bool lookup(const string &dir, const string &key, string &obj, string &out) {
+  int fds[2];
+  check(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair");
+  MsgChannel *daemon = Service::adoptChannel(fds[0], PROTOCOL_VERSION, 0);
+  MsgChannel *client = Service::adoptChannel(fds[1], PROTOCOL_VERSION, 0);
+  check(daemon && client, "adoptChannel");
+
+  bool hit;
+  check(send_cached_result(daemon, dir, key, &hit), "send_cached_result");
+
+  Msg *msg = client->get_msg(5);
+  check(msg && msg->type == M_CACHE_RESULT, "answer");
+  check(static_cast<CacheResultMsg *>(msg)->hit == hit, "hit in answer");
+  delete msg;
+
+  if (hit) {
+    msg = client->get_msg(5);
+    check(msg && msg->type == M_COMPILE_RESULT, "compile result");
+    out = static_cast<CompileResultMsg *>(msg)->out;
+    delete msg;
+
+    obj.clear();
+    while ((msg = client->get_msg(5)) && msg->type == M_FILE_CHUNK) {
+      FileChunkMsg *chunk = static_cast<FileChunkMsg *>(msg);
+      obj.append((const char *) chunk->buffer, chunk->len);
+      delete msg;
+    }
+    check(msg && msg->type == M_END, "end of object");
+    delete msg;
+  }
+
+  delete daemon;
+  delete client;
+  return hit;
+}
+
+static void test_hit_miss(const string &dir) {
+  string key = object_cache_key(make_job(), "hit");
+  string obj, out;
+
+  check(!lookup(dir, key, obj, out), "miss before storing");
+  store(dir, key, "object", "warning");
+  check(lookup(dir, key, obj, out), "hit after storing");
+  check(obj == "object" && out == "warning", "stored result");
+  check(!lookup(dir, object_cache_key(make_job(), "miss"), obj, out), "miss of another key");
+  check(!lookup(dir, "../../../../etc/passwd", obj, out), "key outside of the cache");
+}
+
+static void test_trim(const string &dir) {
+  string old_key = object_cache_key(make_job(), "old");
+  string new_key = object_cache_key(make_job(), "new");
+  store(dir, old_key, string(10000, 'o'), "");
+  store(dir, new_key, string(10000, 'n'), "");
+
+  // an hour ago, as if it wasn't used since
+  struct timeval times[2];
+  gettimeofday(&times[0], 0);
+  times[0].tv_sec -= 3600;
+  times[1] = times[0];
+  check(utimes((dir + "/" + old_key.substr(0, 2) + "/" + old_key).c_str(), times) == 0, "utimes");
+
+  size_t left = trim_object_cache(dir, 15000);
+  check(left <= 15000, "size after trimming");
+
+  string obj, out;
+  check(!lookup(dir, old_key, obj, out), "oldest one dropped");
+  check(lookup(dir, new_key, obj, out), "newest one kept");
+  check(trim_object_cache(dir, 1000000) == left, "nothing to trim");
+}
+
+int main() {
+  char dir[] = "/tmp/icecc-cache-test-XXXXXX";
+  check(mkdtemp(dir), "mkdtemp");
+  check(setup_object_cache(dir, getuid(), getgid()), "setup_object_cache");
+
+  test_key();
+  test_hit_miss(dir);
+  test_trim(dir);
+
+  rmpath(dir);
+  exit(0);
+}
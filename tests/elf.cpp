@@ -0,0 +1,79 @@
+#include "config.h"
+#include "client.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <list>
+#include <set>
+#include <string>
+
+using namespace std;
+
+static string basename_of(const string &path) {
+  return path.substr(path.find_last_of('/') + 1);
+}
+
+// the libraries as ldd lists them, by their names, false if there's no ldd
+static bool ldd(const string &binary, set<string> &libs) {
+  FILE *f = popen(("ldd " + binary + " 2>/dev/null").c_str(), "r");
+  if (!f) {
+    return false;
+  }
+  char line[4096];
+  while (fgets(line, sizeof(line), f)) {
+    // "libc.so.6 => /lib/libc.so.6 (0x...)" or "/lib64/ld-linux-x86-64.so.2 (0x...)"
+    const char *path = strstr(line, "=> ");
+    path = path ? path + 3 : line + strspn(line, " \t");
+    if (*path != '/') {
+      continue; // linux-vdso.so.1 isn't a file
+    }
+    libs.insert(basename_of(string(path, strcspn(path, " \n"))));
+  }
+  return pclose(f) == 0 && !libs.empty();
+}
+
+static void test_binary(const string &binary) {
+  set<string> expected;
+  if (!ldd(binary, expected)) {
+    cerr << "no ldd for " << binary << ", skipped\n";
+    exit(77);
+  }
+
+  list<string> libs;
+  if (!elf_dependencies(binary, libs)) {
+    cerr << binary << " failed: not parsed as ELF\n";
+    exit(1);
+  }
+
+  set<string> got;
+  for (list<string>::const_iterator it = libs.begin(); it != libs.end(); ++it) {
+    got.insert(basename_of(*it));
+  }
+
+  if (got != expected) {
+    cerr << binary << " failed\n     got:";
+    for (set<string>::const_iterator it = got.begin(); it != got.end(); ++it) {
+      cerr << " " << *it;
+    }
+    cerr << "\nexpected:";
+    for (set<string>::const_iterator it = expected.begin(); it != expected.end(); ++it) {
+      cerr << " " << *it;
+    }
+    cerr << "\n";
+    exit(1);
+  }
+}
+
+int main(int, char **argv) {
+  list<string> libs;
+  if (elf_dependencies("/etc/passwd", libs)) {
+    cerr << "a text file parsed as ELF\n";
+    exit(1);
+  }
+
+  // this one links against libz and the C++ runtime, /bin/sh usually not
+  test_binary(argv[0]);
+  test_binary("/bin/sh");
+  exit(0);
+}
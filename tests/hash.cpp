@@ -0,0 +1,67 @@
+#include "hash.h"
+#include <stdlib.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+/* The two halves of the digest are XXH64 with the seeds 0 and PRIME64_5,
+   the expected values are from the reference implementation.  */
+struct Vector {
+  string input;
+  const char *digest;
+};
+
+static void check(const string &what, const string &got, const string &expected) {
+  if (got != expected) {
+    cerr << what << " failed\n";
+    cerr << "     got: \"" << got << "\"\nexpected: \"" << expected << "\"\n";
+    exit(1);
+  }
+}
+
+static string bytes_0_to_255(int times) {
+  string s;
+  for (int i = 0; i < times; ++i) {
+    for (int c = 0; c < 256; ++c) {
+      s += char(c);
+    }
+  }
+  return s;
+}
+
+int main() {
+  const Vector vectors[] = {
+    { "", "ef46db3751d8e9999aadff3ee38d8e67" },
+    { "a", "d24ec4f1a98c6e5b0fc27a7ec0aae600" },
+    { "abc", "44bc2cf5ad77099996a5e06f5ba066ea" },
+    { "Nobody inspects the spammish repetition", "fbcea83c8a378bf10af5e91cd035543f" },
+    { bytes_0_to_255(4), "6f3914f18fe4df573a56879c40026281" },
+  };
+
+  for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i) {
+    Hash hash;
+    hash.update(vectors[i].input);
+    check("vector " + vectors[i].input.substr(0, 10), hash.digest(), vectors[i].digest);
+  }
+
+  // the same in pieces that don't line up with the 32 byte stripes
+  const string &input = vectors[4].input;
+  Hash hash;
+  size_t pos = 0;
+  for (size_t len = 1; pos < input.size(); len = len * 3 % 67 + 1) {
+    hash.update(input.data() + pos, min(len, input.size() - pos));
+    pos += len;
+  }
+  check("chunked update", hash.digest(), vectors[4].digest);
+
+  // the digest doesn't end the hash
+  Hash twice;
+  twice.update("ab", 2);
+  twice.digest();
+  twice.update("c", 1);
+  check("digest in between", twice.digest(), vectors[2].digest);
+
+  exit(0);
+}
@@ -0,0 +1,100 @@
+#include "environment.h"
+#include "file_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <iostream>
+#include <list>
+#include <string>
+
+using namespace std;
+
+static void check(bool ok, const string &what) {
+  if (!ok) {
+    cerr << what << " failed\n";
+    exit(1);
+  }
+}
+
+static void test_manifest_paths() {
+  check(valid_manifest_path("usr/bin/as"), "plain path");
+  check(valid_manifest_path("usr/lib/..so"), "dots in a name");
+  check(!valid_manifest_path(""), "empty path");
+  check(!valid_manifest_path("/etc/passwd"), "absolute path");
+  check(!valid_manifest_path(".."), "parent");
+  check(!valid_manifest_path("../etc/passwd"), "leading parent");
+  check(!valid_manifest_path("usr/../../etc/passwd"), "parent in between");
+  check(!valid_manifest_path("usr/lib/.."), "trailing parent");
+  check(!valid_manifest_path("./usr/bin/as"), "current directory");
+  check(!valid_manifest_path("usr//bin/as"), "empty part");
+  check(!valid_manifest_path("usr/bin/"), "trailing slash");
+}
+
+// puts a blob of HASH with MODE into STORE, returns its name
+static string add_blob(const string &store, const string &hash, mode_t mode) {
+  char suffix[16];
+  snprintf(suffix, sizeof(suffix), "-%04o", (unsigned int) (mode & 0555));
+  string blob = hash + suffix;
+  mkdir((store + "/" + hash.substr(0, 2)).c_str(), 0700);
+  string file = store_blob(store, blob);
+  FILE *f = fopen(file.c_str(), "w");
+  check(f && fputs(blob.c_str(), f) >= 0 && fclose(f) == 0, "writing " + file);
+  check(chmod(file.c_str(), mode) == 0, "chmod " + file);
+  return blob;
+}
+
+static void test_missing_blobs(const string &basedir) {
+  string store = store_dir(basedir);
+  check(mkdir(store.c_str(), 0700) == 0, "mkdir store");
+
+  string as = add_blob(store, string(64, '0'), 0555);
+  string libc = add_blob(store, string(64, '1'), 0444);
+  string writable = add_blob(store, string(64, '2'), 0644);
+  string absent = string(64, '3') + "-0444";
+
+  list<string> paths, blobs, missing;
+  // the assembler comes with the tarball always
+  paths.push_back("usr/bin/as");
+  blobs.push_back(as);
+  paths.push_back("lib/libc.so.6");
+  blobs.push_back(libc);
+  // reported once for both paths
+  paths.push_back("lib/liba.so");
+  blobs.push_back(absent);
+  paths.push_back("lib/liba.so.1");
+  blobs.push_back(absent);
+  paths.push_back("lib/libw.so");
+  blobs.push_back(writable);
+  paths.push_back("../escaped");
+  blobs.push_back(libc);
+
+  check(prepare_install_environment(basedir, "x86_64", "env", true, paths, blobs, missing,
+                                    getuid(), getgid()), "prepare_install_environment");
+
+  list<string> expected;
+  expected.push_back(as);
+  expected.push_back(absent);
+  expected.push_back(writable);
+  expected.push_back(libc);
+  check(missing == expected, "missing blobs");
+
+  string envdir = basedir + "/target=x86_64/env";
+  struct stat st, bst;
+  check(stat((envdir + "/lib/libc.so.6").c_str(), &st) == 0
+        && stat(store_blob(store, libc).c_str(), &bst) == 0 && st.st_ino == bst.st_ino,
+        "linked from the store");
+  check(access((envdir + "/usr/bin/as").c_str(), F_OK) != 0, "assembler not linked");
+  check(access((envdir + "/lib/libw.so").c_str(), F_OK) != 0, "writable blob not linked");
+  check(access((basedir + "/target=x86_64/escaped").c_str(), F_OK) != 0, "path outside");
+}
+
+int main() {
+  test_manifest_paths();
+
+  char dir[] = "/tmp/icecc-store-test-XXXXXX";
+  check(mkdtemp(dir), "mkdtemp");
+  test_missing_blobs(dir);
+  rmpath(dir);
+  exit(0);
+}
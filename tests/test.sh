@@ -438,6 +438,35 @@ make_test()
     make -f Makefile.test OUTDIR="$testdir" clean -s
 }
 
+batch_test()
+{
+    # the sources of the make test as one batch, the scheduler places all of them at once
+    echo Running batch test.
+    reset_logs remote "batch test"
+    make -f Makefile.test OUTDIR="$testdir" clean -s
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        echo "$GXX -Wall -Werror -c make$i.cpp -o '$testdir/make$i.o'"
+    done | ICECC_TEST_SOCKET="$testdir"/socket-localice ICECC_DEBUG=debug ICECC_LOGFILE="$testdir"/icecc.log $valgrind "$prefix"/bin/icecc --batch 2>>"$testdir"/stderr.log
+    if test $? -ne 0; then
+        echo Batch test failed.
+        stop_ice 0
+        exit 2
+    fi
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        if test ! -f "$testdir"/make$i.o; then
+            echo Batch test failed, "$testdir"/make$i.o missing.
+            stop_ice 0
+            exit 2
+        fi
+    done
+    flush_logs
+    check_logs_for_generic_errors
+    check_log_message scheduler "NEW batch of 10 jobs"
+    echo Batch test successful.
+    echo
+    make -f Makefile.test OUTDIR="$testdir" clean -s
+}
+
 # 1st argument, if set, means we run without scheduler
 icerun_test()
 {
@@ -539,7 +568,15 @@ buildnativetest()
         echo icecc --build-native test failed.
         exit 2
     fi
-    rm -f $tgz
+    # the same files have to give the same archive, byte for byte
+    mkdir -p "$testdir"/buildnative
+    local tgz2=$(cd "$testdir"/buildnative && PATH="$prefix"/bin:/bin:/usr/bin icecc --build-native 2>&1 | \
+        grep "^creating .*\.tar\.gz$" | sed -e "s/^creating //")
+    if test "$tgz2" != "$tgz" || ! cmp -s "$tgz" "$testdir"/buildnative/"$tgz2"; then
+        echo icecc --build-native test failed, the archives differ.
+        exit 2
+    fi
+    rm -rf $tgz "$testdir"/buildnative
     echo icecc --build-native test successful.
     echo
 }
@@ -797,6 +834,7 @@ run_ice "$testdir/plain.o" "remote" 0 $GXX -Wall -Werror -c plain.cpp -o "$testd
 if test -z "$chroot_disabled"; then
     make_test 1
     make_test 2
+    batch_test
 fi
 
 run_ice "$testdir/plain.o" "remote" 0 "split_dwarf" $GCC -Wall -Werror -gsplit-dwarf -c plain.c -o "$testdir/"plain.o